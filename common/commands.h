@@ -0,0 +1,88 @@
+//MegaFlash Command Specification
+//This file is shared with Pico and CPanel project.
+//
+//Each command is listed once here. defines.h expands the list to the
+//CMD_xxx command codes. cmdhandler.c expands it to the dispatch table.
+//The codes in defines.inc for assembly code are generated by gendefines.py.
+//
+//  MFCOMMAND(name, code, handler, flags, keyIndex)
+//    name     - Command code constant
+//    code     - Command code
+//    handler  - Handler function in cmdhandler.c (NULL = not implemented)
+//    flags    - CF_xxx attributes defined in cmdhandler.c
+//    keyIndex - Location of Write Enable Key in parameter buffer (CF_WRITEKEY)
+//
+//There is no include guard. MFCOMMAND must be defined before this file is
+//included.
+
+//        name                     code  handler                  flags                                               keyIndex
+MFCOMMAND(CMD_RESETBOTHPTRS,       0x00, DoNothing,               CF_RESETDATA|CF_RESETPARAM,                           0)
+MFCOMMAND(CMD_RESETDATAPTR,        0x01, DoNothing,               CF_RESETDATA,                                         0)
+MFCOMMAND(CMD_RESETPARAMPTR,       0x02, DoNothing,               CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_MODELINEAR,          0x03, DoNothing,               CF_LINEAR|CF_RESETDATA,                               0)
+MFCOMMAND(CMD_MODEINTERLEAVED,     0x04, DoModeInterleaved,       CF_RESETDATA,                                         0)
+MFCOMMAND(CMD_COLDSTART,           0x05, DoAppleColdStart,        CF_WRITEKEY|CF_LINEAR|CF_RESETPARAM,                  0)
+MFCOMMAND(CMD_ENABLEROMDISK,       0x06, DoEnableRomdisk,         0,                                                    0)
+MFCOMMAND(CMD_DISABLEROMDISK,      0x07, DoDisableRomdisk,        0,                                                    0)
+MFCOMMAND(CMD_LOAD_CPANEL,         0x08, DoLoadCPanel,            CF_LINEAR|CF_RESETDATA|CF_RESETPARAM,                 0)
+MFCOMMAND(CMD_TESTWIFI,            0x09, DoTestWifi,              CF_PICOW|CF_WRITEKEY|CF_LINEAR|CF_RESETDATA|CF_RESETPARAM, 0)
+MFCOMMAND(CMD_GETINFOSTR,          0x0a, DoGetInfoString,         CF_LINEAR|CF_RESETDATA,                               0)
+
+MFCOMMAND(CMD_GETDEVINFO,          0x10, DoGetDeviceInfo,         CF_RESETDATA|CF_RESETPARAM,                           0)
+MFCOMMAND(CMD_GETDEVSTATUS,        0x11, DoGetDeviceStatus,       CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETUNITSTATUS,       0x12, DoGetUnitStatus,         CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETDIB,              0x13, DoGetDIB,                CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETVOLINFO,          0x14, DoGetVolumeInfo,         CF_RESETDATA|CF_RESETPARAM|CF_LONG,                   0)
+MFCOMMAND(CMD_READBLOCK,           0x15, DoReadBlock,             CF_RESETDATA|CF_RESETPARAM,                           0)
+MFCOMMAND(CMD_WRITEBLOCK,          0x16, DoWriteBlock,            CF_WRITEKEY|CF_SPRESULT|CF_RESETDATA|CF_RESETPARAM|CF_LONGFLASH, 4)
+MFCOMMAND(CMD_GETPRODOSTIME,       0x17, DoGetProdosTime,         CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETPRODOS25TIME,     0x18, DoGetProdos25Time,       CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETTIMESTR,          0x19, DoGetTimeString,         CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_SETRTC_PRODOS,       0x1a, DoSetRTC_Prodos,         CF_WRITEKEY,                                          4)
+MFCOMMAND(CMD_SETRTC_PRODOS25,     0x1b, DoSetRTC_Prodos25,       CF_WRITEKEY,                                          6)
+MFCOMMAND(CMD_WRITEBLOCKSIZETOVDH, 0x1c, DoWriteBlockSizeToVDH,   CF_WRITEKEY|CF_SPRESULT|CF_RESETPARAM,                1)
+MFCOMMAND(CMD_FORMATDISK,          0x1d, DoFormatDisk,            CF_WRITEKEY|CF_SPRESULT|CF_RESETDATA|CF_RESETPARAM|CF_LONG, 4)
+MFCOMMAND(CMD_ERASEDISK,           0x1e, DoEraseDisk,             CF_WRITEKEY|CF_SPRESULT|CF_RESETDATA|CF_RESETPARAM|CF_LONG, 1)
+MFCOMMAND(CMD_GETREADAHEADSTAT,    0x1f, DoGetReadAheadStat,      CF_RESETPARAM,                                        0)
+
+MFCOMMAND(CMD_SAVEUSERSETTINGS,    0x20, DoSaveUserSettings,      CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_GETUSERSETTINGS,     0x21, DoGetUserSettings,       CF_LINEAR|CF_RESETDATA,                               0)
+MFCOMMAND(CMD_SAVEWIFISETTINGS,    0x22, DoSaveWifiSettings,      CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_GETCONFIGBYTES,      0x23, DoGetConfigBytes,        CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_ERASEUSERSETTINGS,   0x24, DoEraseUserSettings,     CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_ERASEWIFISETTINGS,   0x25, DoEraseWifiSettings,     CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_ERASEADVSETTINGS,    0x26, DoEraseAdvancedSettings, CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_ERASEALLSETTINGS,    0x27, DoEraseAllSettings,      CF_WRITEKEY,                                          0)
+MFCOMMAND(CMD_DRIVEMAPPING,        0x28, DoDriveMapping,          CF_WRITEKEY,                                          1)
+
+MFCOMMAND(CMD_FADD,                0x30, DoFAdd,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FMUL,                0x31, DoFMul,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FDIV,                0x32, DoFDiv,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FSIN,                0x33, DoFSin,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FCOS,                0x34, DoFCos,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FTAN,                0x35, DoFTan,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FATN,                0x36, DoFAtn,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FLOG,                0x37, DoFLog,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FEXP,                0x38, DoFExp,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FSQR,                0x39, DoFSqr,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FOUT,                0x3a, DoFOut,                  CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_FMUL10,              0x3b, NULL,                    0,                                                    0)
+MFCOMMAND(CMD_FDIV10,              0x3c, NULL,                    0,                                                    0)
+
+MFCOMMAND(CMD_RESETTIMER_US,       0x40, DoResetTimer_us,         0,                                                    0)
+MFCOMMAND(CMD_GETTIMER_US,         0x41, DoGetTimer_us,           CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_RESETTIMER_MS,       0x42, DoResetTimer_ms,         0,                                                    0)
+MFCOMMAND(CMD_GETTIMER_MS,         0x43, DoGetTimer_ms,           CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_RESETTIMER_S,        0x44, DoResetTimer_s,          0,                                                    0)
+MFCOMMAND(CMD_GETTIMER_S,          0x45, DoGetTimer_s,            CF_RESETPARAM,                                        0)
+
+MFCOMMAND(CMD_TFTPRUN,             0x50, DoTFTPRun,               CF_PICOW|CF_WRITEKEY,                                 3)
+MFCOMMAND(CMD_TFTPSTATUS,          0x51, DoTFTPStatus,            CF_LINEAR|CF_RESETDATA|CF_RESETPARAM,                 0)
+MFCOMMAND(CMD_TFTPGETLASTSERVER,   0x52, DoTFTPGetLastServer,     CF_LINEAR|CF_RESETDATA,                               0)
+MFCOMMAND(CMD_TFTPSAVELASTSERVER,  0x53, DoTFTPSaveLastServer,    0,                                                    0)
+
+MFCOMMAND(CMD_READBLOCKS,          0x60, DoReadBlocks,            CF_RESETDATA|CF_RESETPARAM,                           0)
+MFCOMMAND(CMD_WRITEBLOCKS,         0x61, DoWriteBlocks,           CF_WRITEKEY|CF_SPRESULT|CF_RESETDATA|CF_RESETPARAM,   5)
+MFCOMMAND(CMD_GETTRIMSTAT,         0x62, DoGetTrimStat,           CF_RESETPARAM,                                        0)
+MFCOMMAND(CMD_GETFLASHSTAT,        0x63, DoGetFlashStat,          CF_LINEAR|CF_RESETDATA,                               0)
+MFCOMMAND(CMD_SETTRIM,             0x64, DoSetTrim,               CF_WRITEKEY|CF_RESETPARAM,                            1)
@@ -7,69 +7,12 @@
 
 //************** MegaFlash ********************/
 //MegaFlash Commands
-#define CMD_RESETBOTHPTRS       0x00
-#define CMD_RESETDATAPTR        0x01
-#define CMD_RESETPARAMPTR       0x02
-#define CMD_MODELINEAR          0x03
-#define CMD_MODEINTERLEAVED     0x04
-#define CMD_COLDSTART           0x05
-#define CMD_ENABLEROMDISK       0x06
-#define CMD_DISABLEROMDISK      0x07
-#define CMD_LOAD_CPANEL         0x08
-#define CMD_TESTWIFI            0x09
-#define CMD_GETINFOSTR          0x0a
-
-#define CMD_GETDEVINFO          0x10
-#define CMD_GETDEVSTATUS        0x11
-#define CMD_GETUNITSTATUS       0x12
-#define CMD_GETDIB              0x13
-#define CMD_GETVOLINFO          0x14
-#define CMD_READBLOCK           0x15
-#define CMD_WRITEBLOCK          0x16
-#define CMD_GETPRODOSTIME       0x17
-#define CMD_GETPRODS25TIME      0x18  
-#define CMD_GETTIMESTR          0x19
-#define CMD_SETRTC_PRODOS       0x1a
-#define CMD_SETRTC_PRODOS25     0x1b
-#define CMD_WRITEBLOCKSIZETOVDH 0x1c
-#define CMD_FORMATDISK          0x1d
-#define CMD_ERASEDISK           0x1e
-
-#define CMD_SAVEUSERSETTINGS    0x20
-#define CMD_GETUSERSETTINGS     0x21
-#define CMD_SAVEWIFISETTINGS    0x22
-#define CMD_GETCONFIGBYTES      0x23
-#define CMD_ERASEUSERSETTINGS   0x24
-#define CMD_ERASEWIFISETTINGS   0x25
-#define CMD_ERASEADVSETTINGS    0x26
-#define CMD_ERASEALLSETTINGS    0x27
-#define CMD_DRIVEMAPPING        0x28
-
-#define CMD_FADD                0x30
-#define CMD_FMUL                0x31
-#define CMD_FDIV                0x32
-#define CMD_FSIN                0x33
-#define CMD_FCOS                0x34
-#define CMD_FTAN                0x35
-#define CMD_FATN                0x36
-#define CMD_FLOG                0x37
-#define CMD_FEXP                0x38
-#define CMD_FSQR                0x39
-#define CMD_FOUT                0x3a
-#define CMD_FMUL10              0x3b
-#define CMD_FDIV10              0x3c
-
-#define CMD_RESETTIMER_US       0x40
-#define CMD_GETTIMER_US         0x41
-#define CMD_RESETTIMER_MS       0x42
-#define CMD_GETTIMER_MS         0x43
-#define CMD_RESETTIMER_S        0x44
-#define CMD_GETTIMER_S          0x45
-
-#define CMD_TFTPRUN             0x50
-#define CMD_TFTPSTATUS          0x51
-#define CMD_TFTPGETLASTSERVER   0x52
-#define CMD_TFTPSAVELASTSERVER  0x53
+//The commands are listed in commands.h
+enum {
+#define MFCOMMAND(name,code,handler,flags,keyIndex) name = code,
+#include "../common/commands.h"
+#undef MFCOMMAND
+};
 
 //MegaFlash Error Code
 #define MFERR_NONE         0x00  /* No Error*/
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+#
+# gendefines.py - Generate the command codes of defines.inc from commands.h
+#
+# commands.h is the list of MegaFlash commands. C code expands it with the MFCOMMAND
+# macro. ca65 cannot include a C header. So, this script writes the CMD_xxx constants
+# between the markers of defines.inc. The rest of defines.inc is maintained by hand.
+# The firmware and cpanel Makefiles run it when commands.h is changed.
+#
+# Usage:
+#   gendefines.py           Update defines.inc
+#   gendefines.py --check   Exit code is 1 if defines.inc is not up to date
+#
+
+import os
+import re
+import sys
+
+DIR = os.path.dirname(os.path.abspath(__file__))
+COMMANDS_H = os.path.join(DIR, 'commands.h')
+DEFINES_INC = os.path.join(DIR, 'defines.inc')
+
+BEGIN = ';Generated from commands.h by gendefines.py. Do not edit.'
+END = ';End of generated commands'
+
+MFCOMMAND = re.compile(r'^MFCOMMAND\(\s*(\w+)\s*,\s*(0x[0-9a-fA-F]+)\s*,')
+
+
+def generate():
+  lines = []
+  with open(COMMANDS_H, newline='') as f:
+    for line in f.read().splitlines():
+      match = MFCOMMAND.match(line)
+      if match:
+        name, code = match.groups()
+        lines.append('%-23s =       $%02X' % (name, int(code, 16)))
+      elif lines and line.strip()=='' and lines[-1]!='':
+        lines.append('')    # Keep the groups of commands.h
+  while lines and lines[-1]=='': lines.pop()
+  return lines
+
+
+def main():
+  check = sys.argv[1:]==['--check']
+  if sys.argv[1:] and not check:
+    print('Usage: %s [--check]' % sys.argv[0])
+    return 2
+
+  with open(DEFINES_INC, newline='') as f: text = f.read()
+  lines = text.split('\r\n')
+  try:
+    begin = lines.index(BEGIN)
+    end = lines.index(END)
+  except ValueError:
+    print('%s: markers not found' % DEFINES_INC)
+    return 1
+
+  newText = '\r\n'.join(lines[:begin+1]+generate()+lines[end:])
+  if newText==text: return 0
+  if check:
+    print('%s is not up to date. Run %s' % (DEFINES_INC, os.path.basename(sys.argv[0])))
+    return 1
+  with open(DEFINES_INC, 'w', newline='') as f: f.write(newText)
+  return 0
+
+
+if __name__=='__main__':
+  sys.exit(main())
@@ -87,7 +87,7 @@
                 .import toshowbootmenu
 
                 ;From smartport.s
-                .importzp spCommand,spUnitNum,spBlockNum24,spIOPointer,spStatusListPtr,errorno
+                .importzp spCommand,spUnitNum,spBlockNum24,spIOPointer,spStatusListPtr,spBlockCount,errorno
                 .import putstatus,printayspc,printa
                 .importzp zpscratch
 
@@ -110,6 +110,7 @@
                 ;exports
                 ;
                 .export isonline,getdevstatus,getunitstatus,readblock,writeblock,coldstartinit,writeblocksizetovdh
+                .export readblocks,writeblocks
                 .export getdsb,getdib
                 .export clockdriver,clockdriverimpl,loadcpanel
                 
@@ -866,6 +867,151 @@ WRRAMCODELEN    = (* - wrramcode)
 ;----------------------------------------------------------------------             
 
 
+;*****************************************************************
+;
+;readblocks / writeblocks - Multi-block Transfer
+;
+;CMD_READBLOCKS and CMD_WRITEBLOCKS transfer consecutive blocks with
+;one command. Pico reads the next block or writes the previous block
+;while the 6502 is transferring the current one.
+;
+;Any command written to cmdreg ends the transfer. readoneblock and
+;writeoneblock cannot be used because they reset the buffer pointer
+;by cmdreg. The zero page is saved to stack instead of parameter
+;buffer. The same data transfer routines (rdramcode/wrramcode) are
+;used.
+;
+;*****************************************************************
+
+;--------------------------------------------------------------------
+; Read/Write consecutive blocks from/to storage
+;
+; Input spUnitNum, spBlockNum24, spIOPointer, spBlockCount (1-127)
+;
+; Output: 1)Setup errorno
+;           possible result:
+;             SP_NOERR / SP_IOERR / SP_NODRVERR (No Device Connected)
+;             SP_NOWRITEERR (Write Protected)
+;             SP_BADBLKERR (The last block is out of range)
+;          2) Carry Flag =0 if no error, =1 if error
+;
+; Assume the caller has validated the unit number and the first block
+; number, and checked the unit status before calling.
+;
+                .segment "ROM4"
+                .reloc
+readblocks:     ldx #CMD_READBLOCKS
+                skip2                   ;skip ldx #CMD_WRITEBLOCKS
+writeblocks:    ldx #CMD_WRITEBLOCKS
+
+                ;CMD_READBLOCKS and CMD_WRITEBLOCKS keep the transfer mode
+                lda #CMD_MODEINTERLEAVED
+                jsr execute
+
+                ;Setup Parameters
+                jsr rwparam
+                lda spBlockCount
+                sta paramreg
+                lda #WE_KEY                     ;Write Enable Key, ignored by CMD_READBLOCKS
+                sta paramreg
+
+                ;Execute the command in X. execute does not change X.
+                txa
+                jsr execute
+                lda paramreg                    ;error code
+                bne rwbexit                     ;If error, skip data transfer
+
+                ;Save the original content of zero page to stack
+                ldy #RDRAMCODELEN
+:               lda ramcodeloc-1,y
+                pha
+                dey
+                bne :-
+
+                ;Read spBlockCount and spIOPointer before the data transfer
+                ;routine is copied to zero page
+                lda spBlockCount
+                pha                             ;stack = block count
+                lda spIOPointer+1
+                pha                             ;stack = spIOPointer+1
+                ldy spIOPointer                 ;y = spIOPointer
+
+                cpx #CMD_WRITEBLOCKS
+                beq @wrcode
+
+                ;copy rdramcode and update the operands of sta instructions
+                ldx #RDRAMCODELEN
+:               lda rdramcode-1,x
+                sta ramcodeloc-1,x
+                dex
+                bne :-
+                sty ramcodeloc+4
+                sty ramcodeloc+10
+                ldx #5                          ;x = offset of high byte of lower page operand
+                bra @setpage
+
+@wrcode:        ;copy wrramcode and update the operands of lda instructions
+                ldx #WRRAMCODELEN
+:               lda wrramcode-1,x
+                sta ramcodeloc-1,x
+                dex
+                bne :-
+                sty ramcodeloc+1
+                sty ramcodeloc+7
+                ldx #2                          ;x = offset of high byte of lower page operand
+
+@setpage:       pla                             ;pull spIOPointer+1 from stack
+                sta ramcodeloc,x                ;lower page
+                inc a
+                sta ramcodeloc+6,x              ;upper page
+                phx                             ;stack = operand offset
+
+@loop:          ldy #0                          ;ramcodeexec expects y=0
+                jsr ramcodeexec                 ;Transfer one block
+
+                ;Wait until Pico has swapped the buffers
+:               bit statusreg
+                bmi :-
+                bvs @done                       ;Error flag is set. Transfer is ended by Pico
+
+                ;Next block is 512 bytes above
+                tsx
+                ldy $101,x                      ;y = operand offset
+                lda ramcodeloc,y
+                inc a
+                inc a
+                sta ramcodeloc,y                ;lower page
+                inc a
+                sta ramcodeloc+6,y              ;upper page
+
+                dec $102,x                      ;block count
+                bne @loop
+
+@done:          pla                             ;discard operand offset
+                pla                             ;discard block count
+
+                ;restore the original content of zero page
+                ldx #0
+:               pla
+                sta ramcodeloc,x
+                inx
+                cpx #RDRAMCODELEN
+                blt :-
+
+                ;Pico has reset the parameter buffer at the end of transfer
+                ;except for CMD_READBLOCKS of one block. Reset it here.
+                lda #CMD_RESETPARAMPTR
+                jsr execute
+                lda paramreg                    ;error code
+
+rwbexit:        sta errorno
+                lda #CMD_MODELINEAR             ;Restore to linear mode
+                sta cmdreg
+                lda errorno
+                cmp #01                         ;Setup Error Flag
+                rts
+
+
 ;*****************************************************************
 ;
 ;readoneblock / writeoneblock - ROM Only Implementation
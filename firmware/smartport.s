@@ -18,6 +18,7 @@
 
                 ;From Device Driver
                 .import isonline,getdevstatus,getunitstatus,readblock,writeblock,writeblocksizetovdh
+                .import readblocks,writeblocks
                 .import getdsb,getdib
                 .if DEBUG
                 .import print
@@ -32,7 +33,7 @@
                 ;
                 ; Exports
                 ;
-                .exportzp spUnitNum,spBlockNum24,spIOPointer,spStatusListPtr,errorno
+                .exportzp spUnitNum,spBlockNum24,spIOPointer,spStatusListPtr,spBlockCount,errorno
                 .exportzp zpscratch,zpstart     ;Zero Page segment address
                 .export putstatus
                 .export p8spentry
@@ -45,15 +46,18 @@
 ; Constants
 ;
 SPPARAMLEN      EQU     7       ;Length of Smartport Parameter List.
-                                ;Since we don't handle Read/Write Call. The len is 7 bytes.
+                                ;Read/Write Call has 9 bytes. The last 2 bytes
+                                ;are copied to spAddressHigh16 by spdriver.
 
 ;-------------------------------------------------------------------------
 ;
 ; Zero Page Allocation
 ;
-; This Smartport module requires 7 bytes in zeropage as working area.
+; This Smartport module requires 9 bytes in zeropage as working area.
 ; 6 bytes for Smartport Parameter and Working Area.
 ; 1 byte for storing errorcode
+; 2 bytes for the parameters of Read/Write Call which do not fit in
+; Smartport Parameter area
 ;
 ; The memory is saved in stack and restored. It can be at any memory locations
 ; unless the locations are used by interrupt service routine. Test program
@@ -100,6 +104,7 @@ ZPSCRATCHSIZE = (*-zpscratch)
                 .reloc
 zpstart:                
 errorno:        .res 1                  ;Result Code
+spAddressHigh16: .res 2                 ;Address Mid and High Bytes (Read/Write Call)
 ZPSIZE = (*-zpstart)
 
 
@@ -122,6 +127,11 @@ spStatusCode    := spParamList+3        ;1 Byte Status Code
 spControlCode   := spParamList+3        ;1 Byte Control Code
 spBlockNum24    := spParamList+3        ;3 Bytes Block Number
 spIOPointer     := spParamList+1        ;2 Bytes IO Buffer Pointer
+spByteCount     := spParamList+3        ;2 Bytes Byte Count (Read/Write Call)
+spAddressLow    := spParamList+5        ;1 Byte Address Low Byte (Read/Write Call)
+spBlockCount    := spAddressHigh16      ;1 Byte Number of Blocks. Set by sp_rw
+                                        ;Share with spAddressHigh16 after the
+                                        ;Address is moved to spBlockNum24
 
 
 
@@ -419,6 +429,21 @@ spdriver:       ;errorno is the value returned in Acc
                 pla                     ;Restore low byte from stack
                 sta spParamListPtr      ;Store low byte
                 ;Now spParamListPtr point to actual parameters
+
+                ;Read/Write Call has 9 bytes of parameters. Parameter offset 7-8
+                ;(Mid and High Bytes of Address) don't fit in spParamList.
+                ;Copy them to spAddressHigh16 before spParamListPtr is destroyed.
+                lda spCommand
+                and #$FE                ;SP_READ or SP_WRITE?
+                cmp #SP_READ
+                bne :+
+                ldy #7
+                jsr getparam            ;A=Address Mid Byte
+                sta spAddressHigh16
+                iny                     ;y=8
+                jsr getparam            ;A=Address High Byte
+                sta spAddressHigh16+1
+:
                         
                 ;Copy Parameter List to spParamList. spParamListPtr is destroyed.
                 ;Return Parameter Count in A
@@ -443,8 +468,8 @@ known_rts:      rts
 ;Smartport Parameter Count OK           
 pcountok:
                 ;Validate spCommand in x
-                ;Only Command $00-$05 is implemented
-                cpx #06
+                ;Only Command $00-$09 is dispatched
+                cpx #10
                 bge not_implemented
 
                 ;
@@ -466,6 +491,10 @@ sp_dispatch_table:
                 .addr sp_format
                 .addr sp_control
                 .addr sp_init
+                .addr not_implemented   ;Open, for char device only
+                .addr not_implemented   ;Close, for char device only
+                .addr sp_rw
+                .addr sp_rw
                         
                         
 sp_pcount_table:
@@ -803,10 +832,83 @@ sp_writeblock:
                 jsr sp_chkblocknum      ;No return if error
 
                 jmp writeblock
+
+;*********************************************************
+; Smartport Read/Write Command handler
+;
+; For block device, Byte Count must be a multiple of 512 and
+; Address is the block number. The blocks are transferred with
+; one CMD_READBLOCKS/CMD_WRITEBLOCKS command. See blockstream.c
+; of Pico firmware.
+;
+; ProDOS 8 does not make Read/Write Call. Block I/O of ProDOS 8 is
+; done by the ProDOS driver entry (p8driver) or Smartport ReadBlock/
+; WriteBlock Call ($01/$02). So, the rule applies to other programs
+; calling the Smartport entry directly. Apple does not define the
+; result of a partial block. SP_IOERR is returned.
+;
+                .segment "ROM4"
+                .reloc
+sp_rw:          ;validate unit number
+                jsr sp_chkunitnum       ;No return if error
+
+                ;Byte Count should be 512-$FE00 and a multiple of 512
+                ;i.e. Low Byte = 0, High Byte is even and non-zero
+                lda spByteCount
+                bne @badcount
+                lda spByteCount+1
+                lsr a                   ;A = Number of Blocks
+                bcs @badcount           ;Branch if odd
+                bne @countok            ;Branch if non-zero
+@badcount:      lda #SP_IOERR
+                sta errorno
+                rts
+
+@countok:       ;Move Address to spBlockNum24. Byte Count is overwritten.
+                ;Then, store Number of Blocks to spBlockCount.
+                ldx spAddressLow
+                stx spBlockNum24
+                ldx spAddressHigh16
+                stx spBlockNum24+1
+                ldx spAddressHigh16+1
+                stx spBlockNum24+2
+                sta spBlockCount
+
+                ;Check Unit status
+                ;Return block size in AXY
+                jsr sp_getunitstatus    ;No return if error
+
+                ;validate the first block number
+                ;Pico reports an error if the last block is invalid
+                jsr sp_chkblocknum      ;No return if error
+
+                ;Read or Write the blocks
+                lda spCommand
+                cmp #SP_WRITE
+                beq @write
+                jsr readblocks
+                bra @setxy
+@write:         jsr writeblocks
+
+@setxy:         ;On return X(Low Byte) and Y(High Byte) registers indicate the Number
+                ;of bytes transfered.
+                
+                ;Assume error. set XY to $0
+                stz xval
+                stz yval
+                bcs :+                  ;Branch if error
+                
+                ;No error, set return value of XY to Byte Count
+                lda spBlockCount
+                asl a
+                sta yval
+:               rts
                         
 ;*********************************************************
 ; Smartport Control Command Handler
 ;
+                .segment "ROM1"
+                .reloc
 sp_control:     ;X = Control Code
                 ldx spControlCode
                 
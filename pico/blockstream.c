@@ -0,0 +1,374 @@
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "pico/sync.h"
+#include "hardware/sync.h"
+#include "defines.h"
+#include "debug.h"
+#include "mediaaccess.h"
+#include "ipc.h"
+#include "cmdhandler.h"
+#include "blockstream.h"
+
+/****************************************************************************************
+Multi-block Transfer (CMD_READBLOCKS / CMD_WRITEBLOCKS)
+
+CMD_READBLOCK and CMD_WRITEBLOCK transfer one block per command. The 6502 has to write
+the parameters, execute the command and wait for the busy flag for every block.
+CMD_READBLOCKS and CMD_WRITEBLOCKS transfer up to 255 consecutive blocks with one command.
+
+Two data buffers are used. The 6502 accesses the active buffer (dataBuffer) via DATAREG.
+At the same time, core 0 reads the next block into the other buffer or writes the
+previous block from the other buffer. When dataBufferIndex loops around to zero (i.e.
+512 bytes are transferred), BusLoop() calls BlockStreamNextBuffer() to swap the buffers.
+Only the pointer is swapped. So, core 1 can serve the next DATAREG access in time.
+
+If core 0 has not finished the other buffer yet, the busy flag is set until it is done.
+So, the 6502 must wait for the busy flag after every 512 bytes:
+
+  Read:  CMD_READBLOCKS, wait busy flag, check error
+         repeat count times: read 512 bytes from DATAREG, wait busy flag, check error
+  Write: CMD_WRITEBLOCKS, wait busy flag, check error
+         repeat count times: write 512 bytes to DATAREG, wait busy flag, check error
+
+Normally, the busy flag is already clear. If an error occurs, the transfer is aborted.
+The error flag and parameter buffer are set in the same way as CMD_READBLOCK and
+CMD_WRITEBLOCK.
+
+Ownership of the other buffer:
+Core 1 owns it except when job.state is JOB_PENDING. Core 0 owns it when job.state is
+JOB_PENDING. The ownership is passed by job.state with memory barriers. No lock is needed.
+
+Core 0 is not always available. For example, it may be syncing the network time. Core 0
+sets workerReady only while it polls for jobs. Otherwise, the job is marked JOB_INLINE and
+core 1 reads/writes the other buffer itself when the 6502 waits for it. It is the same
+as CMD_READBLOCK and CMD_WRITEBLOCK: the busy flag has been sent to PIO before core 1
+accesses the medium.
+
+Any command written to CMDREG ends the transfer. If core 0 still owns the other buffer,
+core 1 does not wait for it. The command is deferred and the busy flag is kept set.
+The command is executed by BlockStreamNextBuffer() when the 6502 polls the status
+register after core 0 has finished the job.
+*****************************************************************************************/
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in a2bus.c
+extern union {
+  uint8_t  r[16];     //Individual 8-bit registers
+  uint32_t i32[4];    //Chunks of 4 32-bit registers
+} registers;
+//--------------------------------------------------------------
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in busloop.c
+extern uint8_t parameterBuffer[];
+extern uint8_t dataBufferPool[2][DATABUFFERSIZE];
+extern uint8_t* dataBuffer;
+extern uint parameterBufferIndex;
+//--------------------------------------------------------------
+
+//Job States
+typedef enum {
+  JOB_NONE,
+  JOB_PENDING,  //Core 0 is reading/writing the other buffer
+  JOB_INLINE,   //Core 0 is not polling. Core 1 reads/writes the other buffer when the 6502 waits for it
+  JOB_DONE
+} jobstate_t;
+
+static struct {
+  volatile jobstate_t state;
+  streammode_t op;
+  uint unitNum;
+  uint blockNum;
+  uint8_t* buffer;
+  uint error;         //MegaFlash Error Code
+  uint8_t spError;    //Smartport/ProDOS Error Code
+} job;
+
+//Accessed by BusLoop()
+streammode_t blockStreamMode = STREAM_NONE;
+bool blockStreamWaiting = false;  //Busy flag is set by BlockStreamNextBuffer()
+
+static uint streamUnitNum;
+static uint nextBlockNum;     //Read: Block in the other buffer. Write: Block in the active buffer
+static uint blocksRemaining;  //Blocks not yet transferred to/from the active buffer
+static uint32_t deferredCommand;  //Command written to CMDREG while core 0 owns the other buffer
+
+static bool workerReady = false;
+static critical_section_t workerCS;   //Protect workerReady and posting a job
+
+//Message to wake up core 0
+static struct IpcMsg wakeupMsg = {IPCCMD_BLOCKSTREAM, 0};
+
+
+////////////////////////////////////////////////////////////////////
+// Initialize Multi-block Transfer
+// It must be called before core 1 is launched.
+//
+void InitBlockStream() {
+  critical_section_init(&workerCS);
+  job.state = JOB_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// Get the buffer which is not accessed by the 6502
+//
+static inline uint8_t* GetOtherBuffer() {
+  return (dataBuffer==dataBufferPool[0]) ? dataBufferPool[1] : dataBufferPool[0];
+}
+
+////////////////////////////////////////////////////////////////////
+// Read/Write the block of the job
+// Executed by core 0, or by core 1 if the job is JOB_INLINE.
+//
+static void __no_inline_not_in_flash_func(RunJob)() {
+  uint8_t spError;
+  if (job.op==STREAM_READ) job.error = ReadBlock(job.unitNum, job.blockNum, job.buffer, &spError);
+  else job.error = WriteBlock(job.unitNum, job.blockNum, job.buffer, &spError);
+  job.spError = spError;
+}
+
+////////////////////////////////////////////////////////////////////
+// Request core 0 to read/write a block with the other buffer
+// If core 0 is not polling, the job is left to core 1.
+//
+static void __no_inline_not_in_flash_func(PostJob)(const streammode_t op, const uint blockNum) {
+  job.op = op;
+  job.unitNum = streamUnitNum;
+  job.blockNum = blockNum;
+  job.buffer = GetOtherBuffer();
+
+  bool posted = false;
+  critical_section_enter_blocking(&workerCS);
+  if (workerReady) {
+    __dmb();
+    job.state = JOB_PENDING;
+    posted = true;
+  } else {
+    job.state = JOB_INLINE;
+  }
+  critical_section_exit(&workerCS);
+
+  //Wake up core 0. If fifo is full, core 0 finds the job at next poll.
+  if (posted && multicore_fifo_wready()) multicore_fifo_push_blocking((uint32_t)&wakeupMsg);
+}
+
+////////////////////////////////////////////////////////////////////
+// Set Busy Flag until the other buffer is ready
+//
+static inline void SetWaiting() {
+  registers.r[STATUSREG] |= BUSYFLAG;
+  blockStreamWaiting = true;
+}
+
+static inline void ClearWaiting() {
+  registers.r[STATUSREG] &= ~BUSYFLAG;
+  blockStreamWaiting = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// End the transfer and report the result to the 6502
+// Core 0 must not own the other buffer.
+//
+// Input: error   - MegaFlash Error Code
+//        spError - Smartport/ProDOS Error Code
+//
+static void __no_inline_not_in_flash_func(FinishStream)(const uint error, const uint8_t spError) {
+  registers.r[STATUSREG] &= ~(ERRORFLAG|ERRORCODEFIELD);
+  if (error) registers.r[STATUSREG] |= ERRORFLAG | error;
+
+  parameterBuffer[0] = spError;
+  parameterBufferIndex = 0;
+  registers.r[PARAMREG] = parameterBuffer[0];
+
+  job.state = JOB_NONE;
+  blockStreamMode = STREAM_NONE;
+  ClearWaiting();
+}
+
+////////////////////////////////////////////////////////////////////
+// Execute the command deferred by EndBlockStream()
+// Core 0 must not own the other buffer.
+//
+static void __no_inline_not_in_flash_func(ExecuteDeferredCommand)() {
+  job.state = JOB_NONE;
+  blockStreamMode = STREAM_NONE;
+  blockStreamWaiting = false;
+  DoCommand(deferredCommand);
+  if (!asyncCommandWaiting) registers.r[STATUSREG] &= ~BUSYFLAG;
+}
+
+////////////////////////////////////////////////////////////////////
+// Start Multi-block Read
+// The first block should have been read into dataBuffer already.
+//
+// Input: unitNum  - Unit Number (1-N)
+//        blockNum - Block Number of the second block
+//        count    - Number of blocks after the first block (>0)
+//
+void StartReadStream(const uint unitNum, const uint blockNum, const uint count) {
+  assert(count>0);
+  streamUnitNum = unitNum;
+  nextBlockNum = blockNum;
+  blocksRemaining = count;
+  blockStreamMode = STREAM_READ;
+  PostJob(STREAM_READ, nextBlockNum);
+}
+
+////////////////////////////////////////////////////////////////////
+// Start Multi-block Write
+//
+// Input: unitNum  - Unit Number (1-N)
+//        blockNum - Block Number of the first block
+//        count    - Number of blocks (>0)
+//
+void StartWriteStream(const uint unitNum, const uint blockNum, const uint count) {
+  assert(count>0);
+  streamUnitNum = unitNum;
+  nextBlockNum = blockNum;
+  blocksRemaining = count;
+  blockStreamMode = STREAM_WRITE;
+  job.state = JOB_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by BusLoop() when dataBufferIndex loops around to zero
+// during a multi-block transfer. It is also called when the 6502
+// reads status register while blockStreamWaiting is true.
+//
+// Time critical. It must not wait for core 0.
+//
+void __no_inline_not_in_flash_func(BlockStreamNextBuffer)() {
+  if (job.state==JOB_PENDING) {
+    SetWaiting();   //Core 0 is still working on the other buffer
+    return;
+  }
+  __dmb();
+
+  if (job.state==JOB_INLINE) {
+    //Set the busy flag first. The block is read/written at the next
+    //status register read, when the busy flag has been sent to PIO.
+    if (!blockStreamWaiting) {
+      SetWaiting();
+      return;
+    }
+    RunJob();
+    job.state = JOB_DONE;
+  }
+
+  if (blockStreamMode==STREAM_ENDING) {
+    //Core 0 has finished
+    ExecuteDeferredCommand();
+    return;
+  }
+
+  if (job.state==JOB_DONE && job.error!=MFERR_NONE) {
+    FinishStream(job.error, job.spError);
+    return;
+  }
+
+  if (blockStreamMode==STREAM_READ) {
+    if (blocksRemaining==0) {
+      //The 6502 has read the last block
+      FinishStream(MFERR_NONE, SP_NOERR);
+      return;
+    }
+    //The next block is in the other buffer
+    dataBuffer = GetOtherBuffer();
+    registers.r[DATAREG] = dataBuffer[0];
+    job.state = JOB_NONE;
+    ++nextBlockNum;
+    if (--blocksRemaining) PostJob(STREAM_READ, nextBlockNum);
+    ClearWaiting();
+  } else {
+    if (blocksRemaining==0) {
+      //Last block has been written
+      FinishStream(MFERR_NONE, SP_NOERR);
+      return;
+    }
+    //The active buffer is full. Swap and let core 0 write it.
+    dataBuffer = GetOtherBuffer();
+    registers.r[DATAREG] = dataBuffer[0];
+    PostJob(STREAM_WRITE, nextBlockNum++);
+    if (--blocksRemaining) ClearWaiting();
+    else SetWaiting();  //Wait until last block is written
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// End the transfer.
+// Called by BusLoop() before a command is executed. The busy flag
+// has been sent to PIO. It does not wait for core 0.
+//
+// Input: command - Command written to CMDREG
+//
+// Output: true if the command can be executed now.
+//         false if core 0 still owns the other buffer. The command is
+//         executed by BlockStreamNextBuffer() later.
+//
+bool __no_inline_not_in_flash_func(EndBlockStream)(const uint32_t command) {
+  if (blockStreamMode==STREAM_ENDING) {
+    //The 6502 has not waited for the busy flag. Keep the order of commands.
+    CompleteBlockStream();
+    return true;
+  }
+
+  if (job.state==JOB_PENDING) {
+    deferredCommand = command;
+    blockStreamMode = STREAM_ENDING;
+    blockStreamWaiting = true;
+    return false;
+  }
+  __dmb();
+
+  //The block written by the 6502 must reach the medium before the command
+  if (job.state==JOB_INLINE && job.op==STREAM_WRITE) RunJob();
+
+  job.state = JOB_NONE;
+  blockStreamMode = STREAM_NONE;
+  blockStreamWaiting = false;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Execute the deferred command now.
+// Called by BusLoop() when the 6502 writes to DATAREG or PARAMREG
+// without waiting for the busy flag after the command, e.g.
+// stz cmdreg followed by sta paramreg. The deferred command must be
+// executed first. Wait until core 0 finishes the job. It is rare
+// because the transfer is normally finished before the next command.
+//
+void __no_inline_not_in_flash_func(CompleteBlockStream)() {
+  while (job.state==JOB_PENDING) {
+    tight_loop_contents();
+  }
+  __dmb();
+  ExecuteDeferredCommand();
+}
+
+////////////////////////////////////////////////////////////////////
+// Read/Write the pending block
+// This function should be called periodically by core 0.
+//
+void BlockStreamTask() {
+  if (job.state!=JOB_PENDING) return;
+  __dmb();
+
+  RunJob();
+
+  __dmb();
+  job.state = JOB_DONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// Tell core 1 if core 0 polls for jobs.
+// Called by SetAsyncWorkerReady(). The job posted before is executed here.
+//
+// Input: ready - true if core 0 polls for jobs
+//
+void SetBlockStreamWorkerReady(const bool ready) {
+  critical_section_enter_blocking(&workerCS);
+  workerReady = ready;
+  critical_section_exit(&workerCS);
+
+  if (!ready) BlockStreamTask();
+}
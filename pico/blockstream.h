@@ -0,0 +1,34 @@
+#ifndef _BLOCKSTREAM_H
+#define _BLOCKSTREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Multi-block Transfer Mode
+typedef enum {
+  STREAM_NONE,
+  STREAM_READ,
+  STREAM_WRITE,
+  STREAM_ENDING   //A command is deferred until core 0 finishes the job
+} streammode_t;
+
+extern streammode_t blockStreamMode;
+extern bool blockStreamWaiting;
+
+void InitBlockStream();
+void StartReadStream(const uint unitNum, const uint blockNum, const uint count);
+void StartWriteStream(const uint unitNum, const uint blockNum, const uint count);
+void BlockStreamNextBuffer();
+bool EndBlockStream(const uint32_t command);
+void CompleteBlockStream();
+void BlockStreamTask();
+void SetBlockStreamWorkerReady(const bool ready);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
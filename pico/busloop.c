@@ -8,6 +8,8 @@
 #include "cmdhandler.h"
 #include "dmamemops.h"
 #include "uthernet2.h"
+#include "blockstream.h"
+#include "bustrace.h"
 
 //--------------------------------------------------------------------
 //Accessing buffers from Apple IIc
@@ -42,6 +44,12 @@
 //Important:
 // Switching to interleaved mode should be temporary. The mode should be restored
 // to linear after data transfer.
+//
+//Double Buffering
+//================
+//There are two data buffers in dataBufferPool. dataBuffer points to the one
+//accessed by the 6502. The other one is used by multi-block transfer only.
+//See blockstream.c
 //-----
 
 //--------------------------------------------------------------
@@ -58,7 +66,8 @@ extern union {
 uint parameterBufferIndex;
 uint dataBufferIndex;
 uint8_t __attribute__((aligned(4))) parameterBuffer[PARAMBUFFERSIZE]; 
-uint8_t __attribute__((aligned(4))) dataBuffer[DATABUFFERSIZE];
+uint8_t __attribute__((aligned(4))) dataBufferPool[2][DATABUFFERSIZE];
+uint8_t* dataBuffer = dataBufferPool[0];  //Active data buffer
 transfermode_t dataBufferTransferMode;  //Linear or Interleaved mode
 //---------------------------------------------------------------------
 
@@ -92,13 +101,14 @@ void __no_inline_not_in_flash_func(BusLoopDataInit)() {
 }
 
 void __no_inline_not_in_flash_func(BusLoop)() {
-  const uint SM0 = 0;   //State Machine 0 for $C0C0-$C0C3 registers 
   const uint READFLAG = (1<<4); //Read flag is at bit 4
-  uint u2_poll_counter = 0;
 
   while(true) {
+    BusTraceEnd();  //Debug Build only. See bustrace.c
+    
     //8-bit data from Apple + RnW Flag + 4-bit address from Apple
     uint32_t busdata = GetAppleBusBlocking();
+    BusTraceBegin(busdata);
     uint32_t addr = busdata & 0b1111;     //Lower nibble of Apple Address
 
     /* Address decode: C0x4–C0x7 = Uthernet II ($C0C4–$C0C7); C0x0–C0x3 = MegaFlash ($C0C0–$C0C3). No GPIO slot select. */
@@ -111,10 +121,6 @@ void __no_inline_not_in_flash_func(BusLoop)() {
         merged |= (uint32_t)u2_read_byte << (u2_addr * 8);
         UpdateMegaFlashRegisters(0, merged);
       }
-      if (++u2_poll_counter >= 500) {
-        u2_poll_counter = 0;
-        U2_Poll();
-      }
       continue;
     }
 
@@ -126,6 +132,9 @@ void __no_inline_not_in_flash_func(BusLoop)() {
           if (dataBufferTransferMode==MODE_LINEAR) dataBufferIndex = (dataBufferIndex + 1) & DATABUFFERINDEXMASK; //loop around if end of buffer is reached
           else dataBufferIndex = (dataBufferIndex&0x100)?(dataBufferIndex+1)&0xff:dataBufferIndex|0x100;
           
+          //Swap buffers if a block of multi-block transfer is done
+          if (dataBufferIndex==0 && blockStreamMode!=STREAM_NONE) BlockStreamNextBuffer();
+          
           registers.r[DATAREG] = dataBuffer[dataBufferIndex];
           break;
         case PARAMREG:
@@ -134,7 +143,14 @@ void __no_inline_not_in_flash_func(BusLoop)() {
           break;        
         case IDREG: 
           registers.r[IDREG] = ~registers.r[IDREG];  //Bitwise NOT
-          break;          
+          break;
+        case STATUSREG:
+          //6502 is waiting for the other buffer of multi-block transfer
+          //or a long command executed by core 0
+          if (blockStreamWaiting) BlockStreamNextBuffer();
+          else if (asyncCommandWaiting) AsyncCommandPoll();
+          else continue;
+          break;
         default:
           continue; //No need to update MegaFlash Registers if reading other addresses
       }
@@ -151,22 +167,39 @@ void __no_inline_not_in_flash_func(BusLoop)() {
             //Send Busy Flag to PIO State Machine
             UpdateMegaFlashRegisters(0, registers.i32[0]);
 
+            //Any command ends multi-block transfer
+            //If core 0 is still working on the other buffer, the command is
+            //deferred and executed by BlockStreamNextBuffer(). Busy flag is kept set.
+            if (blockStreamMode!=STREAM_NONE && !EndBlockStream(data)) break;
+            
+            //The previous command may be still executed by core 0.
+            //If so, the command is deferred and executed by AsyncCommandPoll().
+            //Busy flag is kept set.
+            if (asyncCommandWaiting && !EndAsyncCommand(data)) break;
+
             //Execute the command
             DoCommand(data);
             
-            //Clear Busy Flag
-            registers.r[STATUSREG] &= ~BUSYFLAG;
+            //Clear Busy Flag unless the command is executed by core 0
+            if (!asyncCommandWaiting) registers.r[STATUSREG] &= ~BUSYFLAG;
             break;
           case DATAREG:
+            //A command deferred by EndBlockStream() must be executed first
+            if (blockStreamMode==STREAM_ENDING) CompleteBlockStream();
+            
             dataBuffer[dataBufferIndex] = data;
             
             //advance dataBufferIndex
             if (dataBufferTransferMode==MODE_LINEAR) dataBufferIndex = (dataBufferIndex + 1) & DATABUFFERINDEXMASK; //loop around if end of buffer is reached
             else dataBufferIndex = (dataBufferIndex&0x100)?(dataBufferIndex+1)&0xff:dataBufferIndex|0x100;
             
+            //Swap buffers if a block of multi-block transfer is done
+            if (dataBufferIndex==0 && blockStreamMode!=STREAM_NONE) BlockStreamNextBuffer();
+            
             registers.r[DATAREG] = dataBuffer[dataBufferIndex];
             break;
           case PARAMREG:
+            if (blockStreamMode==STREAM_ENDING) CompleteBlockStream();
             parameterBuffer[parameterBufferIndex] = data;
             parameterBufferIndex = (parameterBufferIndex + 1) & PARAMBUFFERINDEXMASK;
             registers.r[PARAMREG] = parameterBuffer[parameterBufferIndex];
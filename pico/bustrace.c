@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/systick.h"
+#include "defines.h"
+#include "bustrace.h"
+
+#if BUSTRACE
+
+/****************************************************************************************
+Bus Trace Capture
+
+BusLoop() and BusLoopSlinky() have to react to a listener FIFO word before the next bus
+cycle of the 6502. This module measures how many CPU cycles each path of the loop takes.
+
+When BUSTRACE is defined to be 1 (Debug Build only), the bus loops call BusTraceBegin()
+after a word is received and BusTraceEnd() before waiting for the next word. The raw
+word, the SysTick timestamp and the number of cycles spent are recorded in a RAM ring
+of BUSTRACE_COUNT entries. The worst case of each path (Read Flag + 4-bit address) is
+also kept.
+
+SysTick of core 1 counts CPU cycles down from 0xffffff. So, timestamps wrap around
+every 112ms at 150MHz. The measured cycles include the overhead of BusTraceEnd().
+Commands ($C0C0 write) include DoCommand() which runs while the busy flag is set.
+
+Press 't' on USB serial to dump the ring and the worst case table. The key is read by
+TerminalKeyTask() (Apple connected) or the Main Menu of User Terminal. So, no character
+meant for the User Terminal or a file transfer is taken here. Capture is paused during
+the dump and the worst case table is reset after it.
+*****************************************************************************************/
+
+bustraceentry_t busTrace[BUSTRACE_COUNT];
+uint busTraceIndex = 0;
+uint32_t busTraceWorst[BUSTRACE_PATHCOUNT];
+volatile bool busTraceFrozen = false;
+uint32_t busTraceWord = 0;
+uint32_t busTraceStart;
+
+//Apple IIc bus clock
+#define APPLE_CLOCK_HZ 1020484
+
+
+////////////////////////////////////////////////////////////////////
+// Initialize USB serial for the dump. Called by core 0
+// The ring is in bss and is cleared at start-up.
+//
+void BusTraceInit() {
+  stdio_usb_init();
+}
+
+////////////////////////////////////////////////////////////////////
+// Start SysTick of core 1 as cycle counter. Called by core 1
+//
+void BusTraceInitCore1() {
+  systick_hw->csr = 0;
+  systick_hw->rvr = 0xffffff;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0b101;  //Enable, Processor Clock, No Interrupt
+}
+
+////////////////////////////////////////////////////////////////////
+// Print the recorded bus accesses, oldest first
+//
+static void DumpRing() {
+  printf("\n#Bus Trace: index word start cycles\n");
+  uint index = busTraceIndex;
+  for(uint i=0;i<BUSTRACE_COUNT;++i) {
+    const bustraceentry_t* entry = &busTrace[index];
+    index = (index+1) & (BUSTRACE_COUNT-1);
+    if (entry->word==0 && entry->start==0) continue;  //Unused entry
+    printf("%u %04X %06X %u\n", i, entry->word & 0xffff, entry->start, entry->word>>16);
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Print worst case cycles of each path
+//
+static void DumpWorstCase() {
+  printf("#Budget = %u cycles per bus cycle\n", clock_get_hz(clk_sys)/APPLE_CLOCK_HZ);
+  printf("#Path          Worst\n");
+  for(uint path=0;path<BUSTRACE_PATHCOUNT;++path) {
+    if (busTraceWorst[path]==0) continue;
+    printf("#%s $C0C%X  %5u\n", (path & 0x10)?"Read ":"Write", path & 0x0f, busTraceWorst[path]);
+  }
+  memset(busTraceWorst,0,sizeof(busTraceWorst));
+}
+
+////////////////////////////////////////////////////////////////////
+// Dump the trace. Called by core 0 when 't' is pressed on USB serial
+// See terminal.c
+//
+void BusTraceDump() {
+  busTraceFrozen = true;
+  sleep_us(10);   //Let core 1 finish the current entry
+  DumpRing();
+  DumpWorstCase();
+  busTraceFrozen = false;
+}
+
+#endif
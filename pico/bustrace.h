@@ -0,0 +1,76 @@
+#ifndef _BUSTRACE_H
+#define _BUSTRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "pico/stdlib.h"
+#include "hardware/structs/systick.h"
+#include "defines.h"
+
+#if BUSTRACE
+
+#ifdef NDEBUG
+#error "BUSTRACE is for Debug Build only"
+#endif
+
+//One bus access
+typedef struct {
+  uint32_t word;    //Bit 0-12: Listener FIFO word, Bit 16-31: Cycles spent in Bus Loop
+  uint32_t start;   //SysTick value when the word is received (24-bit, counting down)
+} bustraceentry_t;
+
+#define BUSTRACE_PATHCOUNT 32   //Read Flag + 4-bit address
+
+//--------------------------------------------------------------
+//The definitions below are accessed by the inline functions only
+extern bustraceentry_t busTrace[BUSTRACE_COUNT];
+extern uint busTraceIndex;
+extern uint32_t busTraceWorst[BUSTRACE_PATHCOUNT];
+extern volatile bool busTraceFrozen;
+extern uint32_t busTraceWord;
+extern uint32_t busTraceStart;
+//--------------------------------------------------------------
+
+void BusTraceInit();
+void BusTraceInitCore1();
+void BusTraceDump();
+
+////////////////////////////////////////////////////////////////////
+// Called by the bus loop when a word is received from the listener
+//
+static inline void BusTraceBegin(const uint32_t busdata) {
+  busTraceStart = systick_hw->cvr;
+  busTraceWord = busdata | 0x80000000;  //Bit 31: An access is being measured
+}
+
+////////////////////////////////////////////////////////////////////
+// Called by the bus loop before it waits for the next word.
+// Record the access and the number of cycles spent on it.
+//
+static inline void BusTraceEnd() {
+  if (!(busTraceWord & 0x80000000) || busTraceFrozen) return;
+  
+  //SysTick counts down
+  const uint32_t cycles = MIN((busTraceStart - systick_hw->cvr) & 0xffffff, 0xffff);
+  const uint path = busTraceWord & (BUSTRACE_PATHCOUNT-1);
+  if (cycles>busTraceWorst[path]) busTraceWorst[path] = cycles;
+  
+  bustraceentry_t* entry = &busTrace[busTraceIndex];
+  entry->word = (busTraceWord & 0x1fff) | (cycles<<16);
+  entry->start = busTraceStart;
+  busTraceIndex = (busTraceIndex+1) & (BUSTRACE_COUNT-1);
+  busTraceWord = 0;
+}
+
+#else
+static inline void BusTraceBegin(const uint32_t busdata) {}
+static inline void BusTraceEnd() {}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,9 +2,11 @@
 #include <string.h>
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
+#include "pico/sync.h"
 #include "pico/aon_timer.h"
 #include "defines.h"
 #include "busloop.h"
+#include "cmdhandler.h"
 #include "mediaaccess.h"
 #include "flash.h"
 #include "flashunitmapper.h"
@@ -20,6 +22,10 @@
 #include "ipc.h"
 #include "network.h"
 #include "tftpstate.h"
+#include "readahead.h"
+#include "blockstream.h"
+#include "trim.h"
+#include "flashstats.h"
 
 //--------------------------------------------------------------
 //The definitions below must be the same as the ones in a2bus.c
@@ -32,7 +38,7 @@ extern union {
 //--------------------------------------------------------------
 //The definitions below must be the same as the ones in busloop.c
 extern uint8_t parameterBuffer[]; 
-extern uint8_t dataBuffer[];
+extern uint8_t* dataBuffer;
 extern uint parameterBufferIndex;
 extern uint dataBufferIndex;
 extern transfermode_t dataBufferTransferMode;
@@ -50,21 +56,36 @@ extern volatile bool updateNTPNow;
 void CommandHandlerInit() {
 }
 
+//Error Code of the command being executed. A command may be executed
+//by core 0. So, the handlers do not write the status register directly.
+//The error code is applied to status register by core 1.
+static uint8_t commandError;
+
 /////////////////////////////////////////////////////////////
-// Clear Error Flag and Error Code in status register
+// Clear Error Code of the command
 //
 static inline void ClearError() {
-  registers.r[STATUSREG] &= ~(ERRORFLAG|ERRORCODEFIELD);
+  commandError = MFERR_NONE;
 }
 
 /////////////////////////////////////////////////////////////
-// Set Error Flag and Error Code in status register
+// Set Error Code of the command
 //
 // Input: error code
 //
 static inline void SetError(const uint8_t errorCode) {
   assert(errorCode < 32);
-  ClearError();
+  commandError = errorCode;
+}
+
+/////////////////////////////////////////////////////////////
+// Set Error Flag and Error Code in status register
+// Called by core 1 only
+//
+// Input: error code
+//
+static inline void ApplyError(const uint8_t errorCode) {
+  registers.r[STATUSREG] &= ~(ERRORFLAG|ERRORCODEFIELD);
   if (errorCode) registers.r[STATUSREG] |= ERRORFLAG | errorCode;
 }
 
@@ -182,10 +203,6 @@ static void DoGetDeviceInfo() {
   
   //Reserved for future use
   parameterBuffer[11] = 0;
-    
-  ResetParamPointer();
-  ResetDataPointer();
-  ClearError();
 }
 
 /////////////////////////////////////////////////////////////
@@ -206,10 +223,6 @@ static void DoGetInfoString(){
     SetError(MFERR_INVALIDARG);
     return;
   }
-
-  dataBufferTransferMode = MODE_LINEAR; 
-  ResetDataPointer();
-  ClearError();
 }
 
 /////////////////////////////////////////////////////////////
@@ -226,13 +239,7 @@ static void DoGetDeviceStatus() {
   uint numOfUnit = GetTotalUnitCount();
   
   parameterBuffer[0] = numOfUnit; 
-  if (numOfUnit == 0) {
-    SetError(MFERR_NOFLASH);
-  } else {
-    ClearError();
-  }
-  
-  ResetParamPointer();
+  if (numOfUnit == 0) SetError(MFERR_NOFLASH);
 }
 
 /////////////////////////////////////////////////////////////
@@ -259,17 +266,13 @@ static void __no_inline_not_in_flash_func(DoGetUnitStatus)() {
     parameterBuffer[1]=0;
     parameterBuffer[2]=0;    
     SetError(MFERR_INVALIDUNIT);
-    goto exit;
+    return;
   }
   
   uint32_t blockCount = GetBlockCount(unitNum);
   parameterBuffer[0]= (uint8_t)blockCount;  blockCount>>=8;
   parameterBuffer[1]= (uint8_t)blockCount;  blockCount>>=8;
   parameterBuffer[2]= (uint8_t)blockCount;
-  ClearError();
-
-exit:  
-  ResetParamPointer();
 }
      
 /////////////////////////////////////////////////////////////
@@ -291,13 +294,10 @@ static void DoGetDIB(){
   //validate unitNum
   if (!IsValidUnitNum(unitNum)) {
     SetError(MFERR_INVALIDUNIT);
-    goto exit;
+    return;
   }
 
   GetDIB(unitNum,parameterBuffer);
-
-exit:
-  ResetParamPointer();
 }
 
 
@@ -326,15 +326,8 @@ static void __no_inline_not_in_flash_func(DoReadBlock)() {
   uint unitNum = parameterBuffer[0];
   const uint blockNum = parameterBuffer[1] | parameterBuffer[2]<<8 | parameterBuffer[3]<<16;
   
-  //Assume no error
-  ClearError();   
-
   uint error = ReadBlock(unitNum, blockNum, dataBuffer,&parameterBuffer[0]);
   SetError(error);
-  
-exit:
-  ResetDataPointer();
-  ResetParamPointer();  
 }
 
 /////////////////////////////////////////////////////////////
@@ -360,19 +353,89 @@ static void __no_inline_not_in_flash_func(DoWriteBlock)() {
   uint unitNum = parameterBuffer[0];
   const uint blockNum = parameterBuffer[1] | parameterBuffer[2]<<8 | parameterBuffer[3]<<16;
   
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(4)) {
-    parameterBuffer[0] = SP_IOERR;  //Return I/O Error code
-    SetError(MFERR_INVALIDWEKEY);
-    goto exit;
-  }  
-
   uint error = WriteBlock(unitNum, blockNum, dataBuffer, &parameterBuffer[0]);
   SetError(error);
+}
 
-exit: 
-  ResetDataPointer();
-  ResetParamPointer();    
+/////////////////////////////////////////////////////////////
+// Read consecutive ProDOS blocks
+// The first block is read to dataBuffer. Then, the 6502 reads
+// the blocks from DATAREG continuously. After each block, the 6502
+// must wait for busy flag and check error flag.
+// See blockstream.c for details.
+//
+// Parameter Input:
+//   unit number (1-N)
+//   block number (low byte)
+//   block number (mid byte)
+//   block number (high byte)
+//   number of blocks (1-255)
+//
+// Parameter Output:
+//   Smartport/ProDOS error code
+//
+// Possible Errors:
+//   MFERR_INVALIDARG
+//   MFERR_INVALIDUNIT
+//   MFERR_INVALIDBLK
+//   MFERR_RWERROR
+//
+static void __no_inline_not_in_flash_func(DoReadBlocks)() {
+  uint unitNum = parameterBuffer[0];
+  const uint blockNum = parameterBuffer[1] | parameterBuffer[2]<<8 | parameterBuffer[3]<<16;
+  const uint count = parameterBuffer[4];
+  
+  if (count==0) {
+    parameterBuffer[0] = SP_IOERR;
+    SetError(MFERR_INVALIDARG);
+    return;
+  }
+  
+  uint error = ReadBlock(unitNum, blockNum, dataBuffer, &parameterBuffer[0]);
+  SetError(error);
+  
+  //Core 0 reads the remaining blocks to the other buffer
+  if (error==MFERR_NONE && count>1) StartReadStream(unitNum, blockNum+1, count-1);
+}
+
+/////////////////////////////////////////////////////////////
+// Write consecutive ProDOS blocks
+// After this command, the 6502 writes the blocks to DATAREG
+// continuously. After each block, the 6502 must wait for busy flag
+// and check error flag. The result is available after the last block.
+// See blockstream.c for details.
+//
+// Parameter Input:
+//   unit number (1-N)
+//   block number (low byte)
+//   block number (mid byte)
+//   block number (high byte)
+//   number of blocks (1-255)
+//   Write Enable Key
+//
+// Parameter Output:
+//   Smartport/ProDOS error code (SP_NOERR, SP_IOERR, SP_NODRVERR, SP_NOWRITEERR)
+//
+// Possible Errors:
+//   MFERR_INVALIDARG
+//   MFERR_INVALIDUNIT
+//   MFERR_INVALIDBLK
+//   MFERR_INVALIDWEKEY
+//   MFERR_RWERROR
+//
+static void __no_inline_not_in_flash_func(DoWriteBlocks)() {
+  uint unitNum = parameterBuffer[0];
+  const uint blockNum = parameterBuffer[1] | parameterBuffer[2]<<8 | parameterBuffer[3]<<16;
+  const uint count = parameterBuffer[4];
+  
+  if (count==0) {
+    parameterBuffer[0] = SP_IOERR;
+    SetError(MFERR_INVALIDARG);
+    return;
+  }
+  
+  parameterBuffer[0] = SP_NOERR;
+  StartWriteStream(unitNum, blockNum, count);
 }
 
 //////////////////////////////////////////////////////
@@ -389,9 +452,6 @@ exit:
 //
 static void DoGetProdosTime(){
   GetProdosTimestamp(parameterBuffer);
-  
-  ResetParamPointer();
-  ClearError(); 
 }
 
 //////////////////////////////////////////////////////
@@ -410,9 +470,6 @@ static void DoGetProdosTime(){
 //
 static void DoGetProdos25Time(){
   GetProdos25Timestamp(parameterBuffer);
-  
-  ResetParamPointer();
-  ClearError();
 }
 
 //////////////////////////////////////////////////////
@@ -470,9 +527,6 @@ static void DoGetTimeString(){
   
   //Null-terminate the string
   parameterBuffer[STRLEN] ='\0';
-  
-  ClearError();
-  ResetParamPointer();
 }
 
 //////////////////////////////////////////////////////
@@ -490,19 +544,8 @@ static void DoGetTimeString(){
 // Note: Currently, this command is not used by Apple firmware.
 // But it makes a clock setting application program possible.
 static void DoSetRTC_Prodos(){
-  //Assume no error
-  ClearError();   
-
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(4)) {
-    goto exit;
-  }
-
   //Set the RTC!
   SetRTCFromProdosTimestamp(parameterBuffer);
-
-exit:
-  return;  
 }
 
 //////////////////////////////////////////////////////
@@ -522,19 +565,8 @@ exit:
 // Note: Currently, this command is not used by Apple firmware.
 // But it makes a clock setting application program possible.
 static void DoSetRTC_Prodos25(){
-  //Assume no error
-  ClearError();   
-
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(6)) {
-    goto exit;
-  }
-
   //Set the RTC!
   SetRTCFromProdos25Timestamp(parameterBuffer);
-
-exit:
-  return;  
 }
 
 /////////////////////////////////////////////////////////////
@@ -560,20 +592,11 @@ static void DoWriteBlockSizeToVDH() {
   uint unitNum = parameterBuffer[0];
   uint error;
   
-  //Assume no error
-  ClearError();    
-  
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(1)) {
-    parameterBuffer[0] = SP_IOERR;  //Return I/O Error code
-    goto exit;
-  }
-  
   //Read Volume Directory Header (Block 2)
   error = ReadBlock(unitNum, VDHBLOCK, buffer, &parameterBuffer[0]);
   if (error != MFERR_NONE) {
     SetError(error);
-    goto exit;
+    return;
   }
 
   //Write Block Count to offset 0x29-2a
@@ -590,9 +613,6 @@ static void DoWriteBlockSizeToVDH() {
   if (error != MFERR_NONE) {
     SetError(error);
   }
-
-exit: 
-  ResetParamPointer();     
 }
 
 
@@ -621,15 +641,10 @@ static void DoLoadCPanel() {
   if (page<pageCount) {
     //Copy Control Panel Program code to Data Buffer
     CopyMemoryAligned(dataBuffer, cpanelData+page*256, 256);
-    ClearError();
   } else {
     //invalid page number
     SetError(MFERR_INVALIDPAGE);
   }
-
-  dataBufferTransferMode = MODE_LINEAR; 
-  ResetDataPointer();
-  ResetParamPointer();
 }
 
 /////////////////////////////////////////////////////////////
@@ -645,23 +660,12 @@ static void DoLoadCPanel() {
 // Possible Errors:
 //   MFERR_INVALIDWEKEY
 static void DoSaveWifiSettings() { 
-  //Assume no error
-  ClearError();   
-  
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(0)) {
-    goto exit;
-  }
-
   bool success = SaveWifiSettings(dataBuffer);
   if (success) {
     Reconfig();  //User Config changed.
   } else {
     SetError(MFERR_USERCONFIG);
   }
-
-exit:
-  return;
 }
 
 /////////////////////////////////////////////////////////////
@@ -676,23 +680,12 @@ exit:
 //   MFERR_INVALIDWEKEY
 //   MFERR_USERCONFIG
 static void DoSaveUserSettings() {
-  //Assume no error
-  ClearError();   
-  
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(0)) {
-    goto exit;
-  }
-
   bool success = SaveUserSettings(dataBuffer);
   if (success) {
     Reconfig();  //User Config changed.
   } else {
     SetError(MFERR_USERCONFIG);
   }
-
-exit:
-  return;   
 }
 
 
@@ -703,9 +696,6 @@ exit:
 //
 static void DoGetUserSettings(){
   GetUserSettings(dataBuffer);
-  ClearError();
-  dataBufferTransferMode = MODE_LINEAR;   
-  ResetDataPointer();
 } 
 
 /////////////////////////////////////////////////////////////
@@ -718,9 +708,6 @@ static void DoGetUserSettings(){
 static void DoGetConfigBytes() {
   parameterBuffer[0]=GetConfigByte1();
   parameterBuffer[1]=GetConfigByte2();
-  
-  ClearError();
-  ResetParamPointer();
 }
 
 /////////////////////////////////////////////////////////////
@@ -731,15 +718,8 @@ static void DoGetConfigBytes() {
 //   Write Enable Key
 //
 static void DoEraseUserSettings() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    return;
-  }
-  
   EraseUserSettingsFromFlash();
   Reconfig();  //User Config changed.
-  
-  ClearError();
 }
 
 /////////////////////////////////////////////////////////////
@@ -750,15 +730,8 @@ static void DoEraseUserSettings() {
 //   Write Enable Key
 //
 static void DoEraseWifiSettings() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    return;
-  }
-  
   EraseWifiSettingsFromFlash();
   Reconfig();  //User Config changed.  
-  
-  ClearError();
 }
 
 /////////////////////////////////////////////////////////////
@@ -769,15 +742,8 @@ static void DoEraseWifiSettings() {
 //   Write Enable Key
 //
 static void DoEraseAdvancedSettings() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    return;
-  }
-  
   EraseAdvancedSettingsFromFlash();
   Reconfig();  //User Config changed.  
-  
-  ClearError();  
 }
 
 /////////////////////////////////////////////////////////////
@@ -788,15 +754,8 @@ static void DoEraseAdvancedSettings() {
 //   Write Enable Key
 //
 static void DoEraseAllSettings() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    return;
-  }
-  
   EraseAllSettingsFromFlash();
   Reconfig();  //User Config changed.
-  
-  ClearError();
 }
 
 ///////////////////////////////////////////////////////////////
@@ -812,11 +771,6 @@ static void DoEraseAllSettings() {
 //  Write Enable Key
 //
 static void DoDriveMapping() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(1)) {
-    return;
-  }
-  
   if (parameterBuffer[0]) {
     //Enable Flash Drive Mapping
     EnableFlashUnitMapping();
@@ -844,13 +798,8 @@ static void DoDriveMapping() {
 //   configbyte2
 //
 static void DoAppleColdStart() {
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    return;
-  }
-  
-  //Reset data transfer mode in case the computer is reset during data transfer
-  dataBufferTransferMode = MODE_LINEAR;   
+  //Write dirty sectors in cache back to flash
+  tsFlushSectorCache();
   
   //ROM Disk: always available at last unit unless user chose "Boot to ROM Disk"
   EnableRomdisk();
@@ -919,17 +868,6 @@ static char* FormatIPAddr(char* dest, ip_addr_t ipaddr) {
 static void DoTestWifi() {
   const uint32_t TIMEOUT_MS = 90*1000; //90 Seconds. Also update control panel text message if this value is changed.
 
-  //Running on Pico W?
-  if (!CheckPicoW()) {
-    parameterBuffer[0] = NETERR_NOTPICOW;
-    goto exit;
-  }
-  
-  //Validate Write Enable Key
-  if (!CheckWriteEnableKey(0)) {
-    goto exit;
-  }
-  
   //testResult and msg need to be static because
   //their addresses are passed to another core.
   //They need to be always present in memory. If they are
@@ -942,11 +880,11 @@ static void DoTestWifi() {
   
   static struct IpcMsg msg;
   msg.command = IPCCMD_WIFITEST;
-  msg.data = (uint32_t)&testResult;
+  msg.data = (uint32_t)(uintptr_t)&testResult;
   
   //Ask another core to do the test
   UDPTask_RequestAbortIfRunning();      //Abort if another network is running
-  multicore_fifo_push_timeout_us((uint32_t)&msg,10);
+  multicore_fifo_push_timeout_us((uint32_t)(uintptr_t)&msg,10);
 
   //wait until test completed or timeout
   absolute_time_t until = make_timeout_time_ms(TIMEOUT_MS);
@@ -960,10 +898,9 @@ static void DoTestWifi() {
     DEBUG_PRINTF("Timeout\n");
     UDPTask_RequestAbortIfRunning(); //try to stop the task
     parameterBuffer[0] = NETERR_TIMEOUT;
-    goto exit;
+    return;
   }
 
-  ClearError();
   parameterBuffer[0] = (uint8_t)testResult.error;
   memcpy(parameterBuffer+1, &testResult, sizeof(ip4_addr_t)*4);
   
@@ -972,11 +909,6 @@ static void DoTestWifi() {
   dest = FormatIPAddr(dest, testResult.netmask);
   dest = FormatIPAddr(dest, testResult.gateway);
   dest = FormatIPAddr(dest, testResult.dnsserver);
-
-exit:
-  dataBufferTransferMode = MODE_LINEAR;   
-  ResetDataPointer();
-  ResetParamPointer();
 }
 
 /////////////////////////////////////////////////////////////
@@ -1003,34 +935,25 @@ static void DoFormatDisk() {
   const uint32_t blockCount = parameterBuffer[1] | parameterBuffer[2]<<8 | parameterBuffer[3]<<16;
   char* volName = parameterBuffer + 5;
   
-  //Assume no error
-  ClearError();   
-  
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(4)) {
-    parameterBuffer[0] = SP_IOERR;  //Return I/O Error code
-    goto exit;
-  }
-
   //Validate unitNum
   if (!IsValidUnitNum(unitNum)) {
     parameterBuffer[0] = SP_IOERR;  //Return I/O Error code    
     SetError(MFERR_INVALIDUNIT);
-    goto exit;
+    return;
   }  
 
   //Check if the unit is writable
   if (!IsUnitWritable(unitNum)) {
     parameterBuffer[0] = SP_NOWRITEERR;   //Write Protected Error
     SetError(MFERR_RWERROR);
-    goto exit; 
+    return; 
   }
   
   //Validate blockNum
   if (blockCount <  FMT_MINBLOCKCOUNT || blockCount>FMT_MAXBLOCKCOUNT || blockCount>GetBlockCount(unitNum)) {
     parameterBuffer[0] = SP_IOERR;
     SetError(MFERR_INVALIDBLK);
-    goto exit;
+    return;
   }
   
   //Sanitize Volume Name
@@ -1046,10 +969,6 @@ static void DoFormatDisk() {
     parameterBuffer[0] = SP_IOERR;
     SetError(MFERR_RWERROR);
   }
-  
-exit: 
-  ResetDataPointer();
-  ResetParamPointer();  
 }
 
 /////////////////////////////////////////////////////////////
@@ -1069,27 +988,18 @@ exit:
 static void DoEraseDisk() {
   uint unitNum = parameterBuffer[0];
   
-  //Assume no error
-  ClearError();   
-  
-  //Validate Write Enable Key, to avoid unintented Write
-  if (!CheckWriteEnableKey(1)) {
-    parameterBuffer[0] = SP_IOERR;  //Return I/O Error code
-    goto exit;
-  }
-
   //Validate unitNum
   if (!IsValidUnitNum(unitNum)) {
     parameterBuffer[0] = SP_IOERR;  //Return I/O Error code    
     SetError(MFERR_INVALIDUNIT);
-    goto exit;
+    return;
   }  
 
   //Check if the unit is writable
   if (!IsUnitWritable(unitNum)) {
     parameterBuffer[0] = SP_NOWRITEERR;   //Write Protected Error
     SetError(MFERR_RWERROR);
-    goto exit; 
+    return; 
   }
   
   //Erase the unit
@@ -1099,10 +1009,6 @@ static void DoEraseDisk() {
     parameterBuffer[0] = SP_IOERR;
     SetError(MFERR_RWERROR);
   }
-  
-exit: 
-  ResetDataPointer();
-  ResetParamPointer();  
 }
 
 
@@ -1123,19 +1029,16 @@ exit:
 static void DoGetVolumeInfo() {
   VolumeInfo info;
   uint unitNum = parameterBuffer[0];
-
-  //Assume no error
-  ClearError();   
   
   if (!IsValidUnitNum(unitNum)) {
     SetError(MFERR_INVALIDUNIT);
-    goto exit;
+    return;
   }  
 
   bool success = GetVolumeInfo(unitNum,&info);
   if (!success) {
     SetError(MFERR_RWERROR);    
-    goto exit;
+    return;
   }
   
   //Don't want random data in parameter buffer
@@ -1151,11 +1054,81 @@ static void DoGetVolumeInfo() {
   
   parameterBuffer[4] = info.volNameLen;         //Volume Name Length
   strncpy(parameterBuffer+5, info.volName, VOLNAMELENMAX+1); //Volume Name
+}
 
+/////////////////////////////////////////////////////////////
+// Get Read-ahead statistics of flash units
+//
+// Parameter Input:
+//   Flag - Bit0: Reset the counters after reading
+//
+// Parameter Output:
+//   offset 0-3 : Number of hits   (32-bit, Little-Endian)
+//   offset 4-7 : Number of misses
+//   offset 8-11: Number of blocks prefetched by core 0
+//
+static void DoGetReadAheadStat() {
+  readaheadstats_t stats;
+  GetReadAheadStats(&stats, parameterBuffer[0]&0x01);
+  
+  uint32_t* dest = (uint32_t*)parameterBuffer;
+  dest[0] = stats.hits;
+  dest[1] = stats.misses;
+  dest[2] = stats.prefetched;
+}
 
-exit: 
-  ResetDataPointer();
-  ResetParamPointer();   
+/////////////////////////////////////////////////////////////
+// Get statistics of background pre-erase (TRIM) of flash units
+//
+// Parameter Input:
+//   Flag - Bit0: Reset the counters after reading
+//
+// Parameter Output:
+//   offset 0-3  : Number of free sectors erased (32-bit, Little-Endian)
+//   offset 4-7  : Number of free sectors already erased
+//   offset 8-11 : Number of scans aborted by Apple commands or block writes
+//   offset 12-15: Number of completed scans of all flash units
+//
+static void DoGetTrimStat() {
+  trimstats_t stats;
+  GetTrimStats(&stats, parameterBuffer[0]&0x01);
+  
+  uint32_t* dest = (uint32_t*)parameterBuffer;
+  dest[0] = stats.reclaimed;
+  dest[1] = stats.skipped;
+  dest[2] = stats.aborted;
+  dest[3] = stats.passes;
+}
+
+/////////////////////////////////////////////////////////////
+// Enable or disable background pre-erase (TRIM) of flash units
+// The setting is saved in user config. TRIM is disabled by default.
+//
+// Parameter Input:
+//   offset 0: Bit0: 1=Enable, 0=Disable
+//   offset 1: Write Enable Key
+//
+static void DoSetTrim() {
+  SaveTrimEnabled(parameterBuffer[0]&0x01);
+}
+
+/////////////////////////////////////////////////////////////
+// Get statistics of flash operations and ReadBlock/WriteBlock
+// latency of flash units (flashstats_t structure)
+// The data structure is copied to dataBuffer
+// Transfer mode is set to linear
+//
+// Parameter Input:
+//   Flag - Bit0: Reset the counters after reading
+//
+// Data Buffer Output: (32-bit, Little-Endian)
+//   offset 0-23  : blocks read, blocks written, pages programmed,
+//                  4kB erases, 64kB erases, suspends
+//   offset 24-71 : ReadBlock latency histogram (FLASHSTATS_BUCKETS)
+//   offset 72-119: WriteBlock latency histogram (FLASHSTATS_BUCKETS)
+//
+static void DoGetFlashStat() {
+  GetFlashStats((flashstats_t*)dataBuffer, parameterBuffer[0]&0x01);
 }
 
 /********************************************************************
@@ -1178,7 +1151,6 @@ static void DoResetTimer_us() {
 static void DoGetTimer_us() {
   uint32_t elapsed = time_us_32() - startTime_us;
   *(uint32_t*)parameterBuffer = elapsed;
-  ResetParamPointer();
 }
 
 ////////////////////////////////////////////////////////////
@@ -1196,7 +1168,6 @@ static void DoResetTimer_ms() {
 static void DoGetTimer_ms() {
   uint64_t elapsed = (time_us_64() - startTime_ms)/1000ull;
   *(uint32_t*)parameterBuffer = (uint32_t)elapsed;
-  ResetParamPointer();
 }
 
 /////////////////////////////////////////////////////////////
@@ -1214,7 +1185,6 @@ static void DoResetTimer_s() {
 static void DoGetTimer_s() {
   uint64_t elapsed = (time_us_64() - startTime_s)/1000000ull;
   *(uint32_t*)parameterBuffer = (uint32_t)elapsed;
-  ResetParamPointer();
 }
 
 /********************************************************************
@@ -1231,34 +1201,21 @@ extern volatile tftp_state_t tftp_state;
 //
 // Parameter Input: 
 //   Unit Number
-//   Direction  - 0=Download from server, 1=Upload to server
+//   Direction  - 0=Download from server, 1=Upload to server, 2=Server Mode
 //   Flag       - Bit0:To save hostname to userConfig
+//                Bit1:Server Mode: Accept WRQ. Clients can overwrite units
 //   WE Key
 //
 // Data Buffer Input:
 //   hostname   - hostname string
 //   filename   - filename string
+//   (Both are not used in Server Mode. They can be empty strings)
 //
 void DoTFTPRun() {
   const uint32_t TIMEOUT_MS = 30*1000; //30 Seconds. 
   
-  //Assume no error
-  ClearError();     
-  
-  //Running on Pico W?
-  if (!CheckPicoW()) {
-    parameterBuffer[0] = NETERR_NOTPICOW;
-    goto exit;
-  }  
-  
-  //
-  //Step 1: Validate Write Enable Key, to avoid unintended command
-  if (!CheckWriteEnableKey(3)) {
-    goto exit;
-  }
-  
   //
-  //Step 2: Validate hostname and filename len
+  //Step 1: Validate hostname and filename len
   char *hostname = (char*)dataBuffer;
   char *filename = (char*)(dataBuffer+strlen(hostname)+1);  
   hostname = strtrim(hostname); 
@@ -1267,12 +1224,16 @@ void DoTFTPRun() {
 
   if (strlen(hostname)>TFTP_HOSTNAME_MAXLEN) {
     SetError(MFERR_INVALIDARG);
-    goto exit;
+    return;
   }
   if (strlen(filename)>TFTP_FILENAME_MAXLEN) {
     SetError(MFERR_INVALIDARG);    
-    goto exit;
+    return;
   }  
+  if (parameterBuffer[1]>2) {   //Direction
+    SetError(MFERR_INVALIDARG);    
+    return;
+  }
   
   //Save hostname
   uint32_t flag = parameterBuffer[2];
@@ -1281,16 +1242,17 @@ void DoTFTPRun() {
   }
   
   //
-  //Step 3: Abort running task
+  //Step 2: Abort running task
   if (!UDPTask_AbortTimeout_ms(TIMEOUT_MS)) {
     SetError(MFERR_TIMEOUT);
-    goto exit;
+    return;
   }
   
   //
-  //Step 4: Copy Parameters to tftp_state
+  //Step 3: Copy Parameters to tftp_state
   tftp_state.unitNum = parameterBuffer[0];
-  tftp_state.dir = parameterBuffer[1];    //0=Download from server, 1=Upload to server
+  tftp_state.dir = parameterBuffer[1];    //0=Download from server, 1=Upload to server, 2=Server Mode
+  tftp_state.serverWriteEnabled = (flag&0x02)!=0;
   TFTPCopyHostname(hostname); 
   TFTPCopyFilename(filename);
   
@@ -1300,14 +1262,14 @@ void DoTFTPRun() {
   DEBUG_PRINTF("Hostname = %s\n",hostname);
   DEBUG_PRINTF("filename = %s\n",filename);
   
-  //Step 5: Send IPC command to another core
+  //Step 4: Send IPC command to another core
   ++tftpCurrentTaskID;    //Get a new Task ID
   static struct IpcMsg msg; //must be static since &msg is passed to another core
   msg.command = IPCCMD_TFTP;
   msg.data = tftpCurrentTaskID;
-  multicore_fifo_push_timeout_us((uint32_t)&msg,10);
+  multicore_fifo_push_timeout_us((uint32_t)(uintptr_t)&msg,10);
   
-  //Step 6: Wait until TFTP Task is running
+  //Step 5: Wait until TFTP Task is running
   absolute_time_t until = make_timeout_time_ms(TIMEOUT_MS);
   bool taskStarted = false;
   do {
@@ -1318,9 +1280,6 @@ void DoTFTPRun() {
     }
   }while (!time_reached(until));
   if (!taskStarted) SetError(MFERR_TIMEOUT);
-  
-exit:
-  return;
 }
 
 
@@ -1359,18 +1318,16 @@ exit:
 //
 // Note: Block Transferred can be 65536. So, it is a 32-bit integer
 void DoTFTPStatus() {
-  ClearError(); //Assume no error
-  
   //Only PicoW has network function
   if (!CheckPicoW()) {
     SetError(MFERR_NOTPICOW);
-    goto exit;
+    return;
   }
   
   //Check Version Byte ==0
   if (parameterBuffer[0]!=0) {
     SetError(MFERR_INVALIDARG);
-    goto exit;
+    return;
   }
 
   uint32_t pbMaxValue = parameterBuffer[2];
@@ -1386,6 +1343,7 @@ void DoTFTPStatus() {
   uint32_t retries;           //Number of Retries
   int32_t error;              //error code
   uint8_t status;             //status code
+  uint8_t dnsCache;           //DNS Cache result
 
   //Take a snapshot of current TFTP State  
   tftp_critical_section_enter_blocking();
@@ -1394,6 +1352,7 @@ void DoTFTPStatus() {
   retries = tftp_state.retries;
   error = tftp_state.error;
   status = tftp_state.status;
+  dnsCache = tftp_state.dnsCache;
   tftp_critical_section_exit();
   elapsedTime = (get_absolute_time()-tftp_state.startTime)/1000000ull;
   
@@ -1417,16 +1376,11 @@ void DoTFTPStatus() {
   
   //Write text string message to data buffer
   char* dest = dataBuffer;
-  dest = TFTPFormatStatusMessage(dest,status,error); 
+  dest = TFTPFormatStatusMessage(dest,status,error,dnsCache); 
   dest = TFTPFormatBlocksMessage(dest,blockTransferred,tsize);
   dest = TFTPFormatRetransmit(dest,retries);
   dest = TFTPFormatElapsedTime(dest,elapsedTime);
   dest = TFTPFormatErrorMessage(dest,error);
-  
-exit:  
-  dataBufferTransferMode = MODE_LINEAR; 
-  ResetDataPointer();
-  ResetParamPointer();  
 }
 
 
@@ -1439,8 +1393,6 @@ exit:
 //
 static void DoTFTPGetLastServer() {
   strcpy((char*)dataBuffer,GetTFTPLastServer());  
-  dataBufferTransferMode = MODE_LINEAR; 
-  ResetDataPointer();
 }
 
 /////////////////////////////////////////////////////////////
@@ -1452,7 +1404,6 @@ static void DoTFTPGetLastServer() {
 static void DoTFTPSaveLastServer() {
   char* hostname = dataBuffer;
   SaveTFTPLastServer(strtrim(hostname));  
-  ClearError();
 }
 
 
@@ -1460,218 +1411,336 @@ static void DoTFTPSaveLastServer() {
 
 
 
+//Number of commands executed. Used by core 0 to detect Apple activity
+static volatile uint32_t commandCount = 0;
+
+//////////////////////////////////////////////////////
+// Get the number of commands executed
+//
+uint32_t GetCommandCount() {
+  return commandCount;
+}
+
+/********************************************************************
+
+        Command Dispatch Table
+        
+********************************************************************/
+//
+// The commands are listed in common/commands.h. The list is expanded
+// to a 256-entry table indexed by command code. The table is placed in
+// RAM so that a command is dispatched with one load and one indirect
+// branch, without XIP cache misses.
+//
+// The common steps of the handlers are done by ExecuteCommand()
+// according to the flags:
+//   Before the handler: Clear error. Check Pico W. Check Write Enable Key.
+//   After the handler : Set linear mode. Reset data/parameter pointer.
+//
+// If it is not a Pico W or the Write Enable Key is invalid, the handler
+// is not called. The steps after the handler are still done.
+//
+
+//Command Flags
+#define CF_WRITEKEY   0x01  //Write Enable Key is required at keyIndex
+#define CF_SPRESULT   0x02  //Parameter output is Smartport/ProDOS error code. SP_IOERR if key is invalid.
+#define CF_RESETPARAM 0x04  //Reset parameter pointer after the handler
+#define CF_RESETDATA  0x08  //Reset data pointer after the handler
+#define CF_LINEAR     0x10  //Set transfer mode to linear after the handler
+#define CF_LONG       0x20  //Long command. Executed by core 0 if possible.
+#define CF_LONGFLASH  0x40  //Long command if parameterBuffer[0] is a flash unit
+#define CF_PICOW      0x80  //Pico W is required. NETERR_NOTPICOW is returned before the key is checked.
+
+typedef void (*cmdhandler_t)();
+
+typedef struct {
+  cmdhandler_t handler; //NULL = unknown command
+  uint8_t flags;        //CF_xxx
+  uint8_t keyIndex;     //Location of Write Enable Key in parameter buffer
+} cmdentry_t;
+
+/////////////////////////////////////////////////////////////
+// Small handlers
+// DoNothing() is for the commands done by the flags only.
+//
+static void __not_in_flash_func(DoNothing)() {
+}
+
+static void DoModeInterleaved() {
+  dataBufferTransferMode = MODE_INTERLEAVED;
+}
+
+static void DoEnableRomdisk() {
+  EnableRomdisk();
+  SetRomdiskFirst(parameterBuffer[0] != 0);  /* 1 = first (boot), 0 = last */
+}
+
+static void DoDisableRomdisk() {
+  DisableRomdisk();
+}
+
+/////////////////////////////////////////////////////////////
+// FPU Commands
+// The result is returned in parameter buffer
+//
+static void __not_in_flash_func(DoFAdd)() { fadd(parameterBuffer); }
+static void __not_in_flash_func(DoFMul)() { fmul(parameterBuffer); }
+static void __not_in_flash_func(DoFDiv)() { fdiv(parameterBuffer); }
+static void __not_in_flash_func(DoFSin)() { fsin(parameterBuffer); }
+static void __not_in_flash_func(DoFCos)() { fcos(parameterBuffer); }
+static void __not_in_flash_func(DoFTan)() { ftan(parameterBuffer); }
+static void __not_in_flash_func(DoFAtn)() { fatn(parameterBuffer); }
+static void __not_in_flash_func(DoFLog)() { flog(parameterBuffer); }
+static void __not_in_flash_func(DoFExp)() { fexp(parameterBuffer); }
+static void __not_in_flash_func(DoFSqr)() { fsqr(parameterBuffer); }
+static void __not_in_flash_func(DoFOut)() { fout(parameterBuffer); }
+
+//Dispatch Table. Unlisted command codes are zero (unknown command).
+static const cmdentry_t __not_in_flash("cmdtable") commandTable[256] = {
+#define MFCOMMAND(name,code,handler,flags,keyIndex) [name] = {handler, flags, keyIndex},
+#include "../common/commands.h"
+#undef MFCOMMAND
+};
+
+//////////////////////////////////////////////////////
+// Execute command
+// Called by DoCommand() on core 1 or AsyncCommandTask() on core 0
+//
+// Input: command code
+//
+// Output: MegaFlash Error Code
+//
+static uint8_t __no_inline_not_in_flash_func(ExecuteCommand)(const uint32_t command) {
+  const cmdentry_t* entry = &commandTable[command&0xff];
+  const uint32_t flags = entry->flags;
+  
+  if (entry->handler==NULL) return MFERR_UNKNOWNCMD;
+  
+  //Assume no error
+  ClearError();
+  
+  //Running on Pico W?
+  if ((flags&CF_PICOW) && !CheckPicoW()) {
+    parameterBuffer[0] = NETERR_NOTPICOW;
+  }
+  //Validate Write Enable Key, to avoid unintented Write
+  else if (!(flags&CF_WRITEKEY) || CheckWriteEnableKey(entry->keyIndex)) {
+    entry->handler();
+  } else if (flags&CF_SPRESULT) {
+    parameterBuffer[0] = SP_IOERR;  //Return I/O Error code
+  }
+  
+  if (flags&CF_LINEAR) dataBufferTransferMode = MODE_LINEAR;
+  if (flags&CF_RESETDATA) ResetDataPointer();
+  if (flags&CF_RESETPARAM) ResetParamPointer();
+  return commandError;
+}
+
+/********************************************************************
+
+        Asynchronous Command Execution
+        
+********************************************************************/
+//
+// DoCommand() runs on core 1 inside BusLoop(). While a command is
+// executed, core 1 does not serve the listener FIFO. So, Uthernet II
+// accesses and U2_Poll() stall until the command returns.
+//
+// Long commands (CF_LONG: CMD_FORMATDISK, CMD_ERASEDISK, CMD_GETVOLINFO,
+// CF_LONGFLASH: CMD_WRITEBLOCK of flash units) are handed to core 0 instead. The
+// busy flag is kept set. Core 1 returns to BusLoop() and keeps serving
+// the bus. When the 6502 reads the status register, BusLoop() calls
+// AsyncCommandPoll(). If core 0 has finished, the error code returned
+// in asyncJob is set, the busy flag is cleared and the registers are
+// sent to PIO. Core 0 never writes status register. Core 1 clears the
+// busy flag because it is the only core which sends the registers to PIO.
+// The 6502 sees the flag cleared at the next read of status register.
+//
+// The handoff has one entry instead of a queue. A command works in place
+// on parameterBuffer and dataBuffer, which are shared by all commands.
+// The 6502 waits for the busy flag before it writes the parameters of the
+// next command. So, there is never a second command to be queued. The
+// ownership of the entry is passed by asyncJob.state with memory barriers,
+// in the same way as blockstream.c.
+//
+// If the 6502 writes CMDREG while core 0 is still executing the previous
+// command (e.g. after /RESET), core 1 does not wait for core 0. The command
+// is deferred and the busy flag is kept set. It is executed by
+// AsyncCommandPoll() when the 6502 polls the status register after core 0
+// has finished. Only the last deferred command is kept. Writing CMDREG
+// twice without waiting for the busy flag is not supported by the protocol.
+//
+// Core 0 is not always available. For example, it may be syncing the
+// network time. Core 0 sets asyncWorkerReady only while it polls for
+// jobs. Otherwise, the command is executed by core 1 as before.
+//
+
+//Job States
+typedef enum {
+  ASYNC_NONE,
+  ASYNC_PENDING,  //Core 0 is executing the command
+  ASYNC_DONE
+} asyncstate_t;
+
+static struct {
+  volatile asyncstate_t state;
+  uint32_t command;
+  uint8_t error;      //MegaFlash Error Code. Applied by AsyncCommandPoll()
+} asyncJob;
+
+//Accessed by BusLoop()
+bool asyncCommandWaiting = false;  //Busy flag is kept set until the job is done
+
+static uint32_t deferredCommand;      //Command written to CMDREG while core 0 executes the previous one
+static bool commandDeferred = false;
+
+static bool asyncWorkerReady = false;
+static critical_section_t asyncCS;    //Protect asyncWorkerReady and posting a job
+
+//Message to wake up core 0
+static struct IpcMsg asyncWakeupMsg = {IPCCMD_ASYNCCMD, 0};
+
+//////////////////////////////////////////////////////
+// Initialize Asynchronous Command Execution
+// It must be called before core 1 is launched.
+//
+void InitAsyncCommand() {
+  critical_section_init(&asyncCS);
+  asyncJob.state = ASYNC_NONE;
+}
+
+//////////////////////////////////////////////////////
+// Check if a command should be executed by core 0
+//
+static bool __no_inline_not_in_flash_func(IsLongCommand)(const uint32_t command) {
+  const uint32_t flags = commandTable[command&0xff].flags;
+  if (flags&CF_LONG) return true;
+  
+  //RAM Disk write is fast
+  if (flags&CF_LONGFLASH) return IsValidUnitNum(parameterBuffer[0]) && GetMediumType(parameterBuffer[0])==TYPE_FLASH;
+  return false;
+}
+
+//////////////////////////////////////////////////////
+// Hand a long command to core 0
+//
+// Input: command code
+//
+// Output: true if the command is posted
+//
+static bool __no_inline_not_in_flash_func(PostAsyncCommand)(const uint32_t command) {
+  if (!IsLongCommand(command)) return false;
+  
+  bool posted = false;
+  critical_section_enter_blocking(&asyncCS);
+  if (asyncWorkerReady) {
+    asyncJob.command = command;
+    __dmb();
+    asyncJob.state = ASYNC_PENDING;
+    asyncCommandWaiting = true;
+    posted = true;
+  }
+  critical_section_exit(&asyncCS);
+  
+  //Wake up core 0. If fifo is full, core 0 finds the job at next poll.
+  if (posted && multicore_fifo_wready()) multicore_fifo_push_blocking((uint32_t)(uintptr_t)&asyncWakeupMsg);
+  return posted;
+}
+
+//////////////////////////////////////////////////////
+// Release the job finished by core 0 and execute the
+// deferred command, if any.
+// The deferred command may be posted to core 0 again.
+//
+static void __no_inline_not_in_flash_func(FinishAsyncCommand)() {
+  __dmb();
+  asyncJob.state = ASYNC_NONE;
+  asyncCommandWaiting = false;
+
+  if (commandDeferred) {
+    commandDeferred = false;
+    DoCommand(deferredCommand);
+  }
+}
+
+//////////////////////////////////////////////////////
+// Called by BusLoop() when the 6502 reads status register
+// while asyncCommandWaiting is true.
+// If core 0 has finished the command, its error code is applied
+// to status register and the busy flag is cleared.
+//
+void __no_inline_not_in_flash_func(AsyncCommandPoll)() {
+  if (asyncJob.state!=ASYNC_DONE) return;
+  ApplyError(asyncJob.error);
+  FinishAsyncCommand();
+  if (!asyncCommandWaiting) registers.r[STATUSREG] &= ~BUSYFLAG;
+}
+
+//////////////////////////////////////////////////////
+// End the command executed by core 0.
+// Called by BusLoop() before the next command is executed. The busy
+// flag has been sent to PIO. It does not wait for core 0.
+//
+// Input: command - Command written to CMDREG
+//
+// Output: true if the command can be executed now.
+//         false if core 0 is still executing the previous command. The
+//         command is executed by AsyncCommandPoll() later.
+//
+bool __no_inline_not_in_flash_func(EndAsyncCommand)(const uint32_t command) {
+  if (asyncJob.state!=ASYNC_PENDING) FinishAsyncCommand();
+  if (!asyncCommandWaiting) return true;
+
+  deferredCommand = command;
+  commandDeferred = true;
+  return false;
+}
+
+//////////////////////////////////////////////////////
+// Execute the pending command
+// This function should be called periodically by core 0.
+//
+void AsyncCommandTask() {
+  if (asyncJob.state!=ASYNC_PENDING) return;
+  __dmb();
+  
+  asyncJob.error = ExecuteCommand(asyncJob.command);
+  TurnOffActLed();
+  
+  __dmb();
+  asyncJob.state = ASYNC_DONE;
+}
+
+//////////////////////////////////////////////////////
+// Tell core 1 if core 0 polls for jobs.
+// Before core 0 starts a long task, it should call this function
+// with false. The job posted before is executed here.
+// The worker state of multi-block transfer is updated as well.
+//
+// Input: ready - true if core 0 polls for jobs
+//
+void SetAsyncWorkerReady(const bool ready) {
+  critical_section_enter_blocking(&asyncCS);
+  asyncWorkerReady = ready;
+  critical_section_exit(&asyncCS);
+  
+  SetBlockStreamWorkerReady(ready);
+  if (!ready) AsyncCommandTask();
+}
+
 //////////////////////////////////////////////////////
 // Execute command from Apple
 //
 // Input: command code
 //
 void __no_inline_not_in_flash_func(DoCommand)(const uint32_t command) {
+  ++commandCount;
   TurnOnActLed();
-  switch(command) {
-    case CMD_RESETBOTHPTRS:
-      ResetDataPointer();
-      ResetParamPointer();
-      ClearError();
-      break;
-    case CMD_RESETDATAPTR:
-      ResetDataPointer();
-      ClearError();
-      break;
-    case CMD_RESETPARAMPTR:
-      ResetDataPointer();
-      ClearError();
-      break;
-    case CMD_MODELINEAR:
-      dataBufferTransferMode = MODE_LINEAR;
-      ResetDataPointer();
-      ClearError();
-      break;
-    case CMD_MODEINTERLEAVED:
-      dataBufferTransferMode = MODE_INTERLEAVED;
-      ResetDataPointer();
-      ClearError();
-      break;    
-    case CMD_COLDSTART:
-      DoAppleColdStart();
-      break;
-    case CMD_ENABLEROMDISK:
-      EnableRomdisk();
-      SetRomdiskFirst(parameterBuffer[0] != 0);  /* 1 = first (boot), 0 = last */
-      ClearError();
-      break;
-    case CMD_DISABLEROMDISK:
-      DisableRomdisk();
-      ClearError();
-      break;
-    case CMD_LOAD_CPANEL:
-      DoLoadCPanel();
-      break;
-    case CMD_TESTWIFI:
-      DoTestWifi();
-      break;      
-    case CMD_GETINFOSTR:
-      DoGetInfoString();
-      break;
-    case CMD_GETDEVINFO:
-      DoGetDeviceInfo();
-      break;
-    case CMD_GETDEVSTATUS:
-      DoGetDeviceStatus();
-      break;
-    case CMD_GETUNITSTATUS:
-      DoGetUnitStatus();
-      break;
-    case CMD_GETDIB:
-      DoGetDIB();
-      break;
-    case CMD_GETVOLINFO:
-      DoGetVolumeInfo();
-      break;
-    case CMD_READBLOCK:
-      DoReadBlock();
-      break;
-    case CMD_WRITEBLOCK:
-      DoWriteBlock();
-      break;
-    case CMD_GETPRODOSTIME:
-      DoGetProdosTime();
-      break;
-    case CMD_GETPRODS25TIME:
-      DoGetProdos25Time();
-      break;
-    case CMD_GETTIMESTR:
-      DoGetTimeString();
-      break;
-    case CMD_SETRTC_PRODOS:
-      DoSetRTC_Prodos();
-      break;
-    case CMD_SETRTC_PRODOS25:  
-      DoSetRTC_Prodos25();
-      break;
-    case CMD_WRITEBLOCKSIZETOVDH:
-      DoWriteBlockSizeToVDH();
-      break;
-    case CMD_FORMATDISK:
-      DoFormatDisk();
-      break;
-    case CMD_ERASEDISK:
-      DoEraseDisk();
-      break;
-    case CMD_SAVEUSERSETTINGS:  
-      DoSaveUserSettings();    
-      break;
-    case CMD_GETUSERSETTINGS:
-      DoGetUserSettings();
-      break;
-    case CMD_SAVEWIFISETTINGS:
-      DoSaveWifiSettings();
-      break;
-    case CMD_GETCONFIGBYTES:
-      DoGetConfigBytes();
-      break;
-    case CMD_ERASEUSERSETTINGS:
-      DoEraseUserSettings();
-      break;
-    case CMD_ERASEWIFISETTINGS:
-      DoEraseWifiSettings();
-      break;
-    case CMD_ERASEADVSETTINGS:  
-      DoEraseAdvancedSettings();
-      break;
-    case CMD_ERASEALLSETTINGS:
-      DoEraseAllSettings();
-      break;
-    case CMD_DRIVEMAPPING:
-      DoDriveMapping();
-      break;
-    case CMD_FADD:
-      fadd(parameterBuffer);
-      ResetParamPointer();
-      ClearError();      
-      break;
-    case CMD_FMUL:
-      fmul(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break; 
-    case CMD_FDIV:
-      fdiv(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break;
-    case CMD_FSIN:
-      fsin(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break;
-    case CMD_FCOS:
-      fcos(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break;   
-    case CMD_FTAN:
-      ftan(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break;    
-    case CMD_FATN:
-      fatn(parameterBuffer);
-      ResetParamPointer();
-      ClearError();
-      break;
-    case CMD_FLOG:
-      flog(parameterBuffer);
-      ResetParamPointer();
-      ClearError();    
-      break;
-    case CMD_FEXP:
-      fexp(parameterBuffer);
-      ResetParamPointer();
-      ClearError();    
-      break;
-    case CMD_FSQR:
-      fsqr(parameterBuffer);
-      ResetParamPointer();
-      ClearError();    
-      break;
-    case CMD_FOUT:
-      fout(parameterBuffer);
-      ResetParamPointer();
-      ClearError();    
-      break;      
-    case CMD_RESETTIMER_US:
-      DoResetTimer_us();
-      break;
-    case CMD_GETTIMER_US:
-      DoGetTimer_us();
-      break;
-    case CMD_RESETTIMER_MS:
-      DoResetTimer_ms();
-      break;
-    case CMD_GETTIMER_MS:
-      DoGetTimer_ms();
-      break;    
-    case CMD_RESETTIMER_S:
-      DoResetTimer_s();
-      break;
-    case CMD_GETTIMER_S:
-      DoGetTimer_s();
-      break;            
-    case CMD_TFTPRUN:
-      DoTFTPRun();
-      break;
-    case CMD_TFTPSTATUS:
-      DoTFTPStatus();
-      break;
-    case CMD_TFTPGETLASTSERVER:
-      DoTFTPGetLastServer();
-      break;
-    case CMD_TFTPSAVELASTSERVER:
-      DoTFTPSaveLastServer();
-      break;
-    default:
-      SetError(MFERR_UNKNOWNCMD);
-  }
+  
+  //Long command is executed by core 0. Busy flag is cleared later.
+  if (PostAsyncCommand(command)) return;
+  
+  ApplyError(ExecuteCommand(command));
   TurnOffActLed();
 }
 
@@ -1,8 +1,20 @@
 #ifndef _CMDHANDLER_H
 #define _CMDHANDLER_H
 
+#include "pico/stdlib.h"
+
 void CommandHandlerInit();
 void DoCommand(const uint32_t command);
+uint32_t GetCommandCount();
+
+//Asynchronous Command Execution
+extern bool asyncCommandWaiting;
+
+void InitAsyncCommand();
+void AsyncCommandPoll();
+bool EndAsyncCommand(const uint32_t command);
+void AsyncCommandTask();
+void SetAsyncWorkerReady(const bool ready);
 
 
 
@@ -53,6 +53,28 @@
 #define SLINKY_SIZE (256*1024)
 #endif
 
+//Number of 4kB sectors in Flash Write-back Sector Cache
+#ifdef PICO_RP2040
+#define SECTORCACHE_COUNT 2
+#else
+#define SECTORCACHE_COUNT 4   /* 16kB */
+#endif
+
+//Number of blocks in Flash Read-ahead ring
+#ifdef PICO_RP2040
+#define READAHEAD_COUNT 8
+#else
+#define READAHEAD_COUNT 16  /* 8kB */
+#endif
+
+//Bus Trace Capture (Debug Build only). See bustrace.c
+#define BUSTRACE 0
+#ifdef PICO_RP2040
+#define BUSTRACE_COUNT 1024
+#else
+#define BUSTRACE_COUNT 4096   /* 32kB */
+#endif
+
 //Buffer Size
 #define PARAMBUFFERSIZE  32 //Note: Smartport DIB requires 25 bytes
 #define PARAMBUFFERINDEXMASK 0b11111
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "defines.h"
+#include "debug.h"
+#include "dnscache.h"
+
+/****************************************************************************************
+DNS Result Cache
+
+Every NTP sync and TFTP transfer looks up the server hostname. The table of lwIP resolver
+cannot be relied on across a restart of the CYW43 library. Its TTL does not count down
+while the library is not running. So, the results are cached here. The cache survives
+across CUDPTask objects and WIFI sessions.
+
+- CUDPTask::DNSLookup() checks the cache first. The lookup completes immediately
+  on a hit.
+- A result from lwIP resolver is added to the cache. The least recently used entry is
+  replaced if the cache is full.
+- An entry expires DNSCACHE_TTL_MS after it is added. lwIP does not pass the TTL of the
+  DNS record to the callback. So, a fixed TTL is used.
+- If the server does not respond, the task removes the hostname from the cache. The
+  next task looks it up again.
+
+The cache is only accessed by core 0.
+*****************************************************************************************/
+
+typedef struct {
+  bool valid;
+  char hostname[TFTP_HOSTNAME_MAXLEN+1];
+  ip_addr_t addr;
+  absolute_time_t expiry;
+  absolute_time_t lastUsed;
+} dnscache_entry_t;
+
+static dnscache_entry_t cache[DNSCACHE_SIZE];
+
+
+////////////////////////////////////////////////////////////////////
+// Find the entry of hostname
+//
+// Output: Pointer to the entry. NULL if not found or expired.
+//
+static dnscache_entry_t* FindEntry(const char* hostname) {
+  for(uint i=0;i<DNSCACHE_SIZE;++i) {
+    dnscache_entry_t* entry = &cache[i];
+    if (!entry->valid || strcmp(entry->hostname,hostname)!=0) continue;
+
+    if (time_reached(entry->expiry)) {
+      entry->valid = false;
+      return NULL;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+// Lookup hostname in the cache
+//
+// Input: hostname - Hostname to be resolved
+//        addrOut  - Pointer to receive the IP address
+//
+// Output: true if hostname is found
+//
+bool DNSCache_Lookup(const char* hostname, ip_addr_t* addrOut) {
+  dnscache_entry_t* entry = FindEntry(hostname);
+  if (!entry) return false;
+
+  entry->lastUsed = get_absolute_time();
+  *addrOut = entry->addr;
+  DEBUG_PRINTF("DNS Cache hit: %s=%s\n",hostname,ipaddr_ntoa(addrOut));
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Add the IP address of hostname to the cache
+//
+// Input: hostname - Hostname
+//        addr     - IP address of hostname
+//
+void DNSCache_Add(const char* hostname, const ip_addr_t* addr) {
+  if (strlen(hostname)>TFTP_HOSTNAME_MAXLEN) return;
+
+  dnscache_entry_t* entry = FindEntry(hostname);
+  if (!entry) {
+    //Use an empty entry or replace the least recently used one
+    entry = &cache[0];
+    for(uint i=0;i<DNSCACHE_SIZE;++i) {
+      if (!cache[i].valid) {
+        entry = &cache[i];
+        break;
+      }
+      if (absolute_time_diff_us(cache[i].lastUsed,entry->lastUsed)>0) entry = &cache[i];
+    }
+    strcpy(entry->hostname,hostname);
+  }
+
+  entry->addr = *addr;
+  entry->expiry = make_timeout_time_ms(DNSCACHE_TTL_MS);
+  entry->lastUsed = get_absolute_time();
+  entry->valid = true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Remove hostname from the cache
+//
+void DNSCache_Remove(const char* hostname) {
+  dnscache_entry_t* entry = FindEntry(hostname);
+  if (entry) entry->valid = false;
+}
@@ -0,0 +1,29 @@
+#ifndef _DNSCACHE_H
+#define _DNSCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+#include "lwip/ip_addr.h"
+
+#define DNSCACHE_SIZE         4             //Number of hostnames in the cache
+#define DNSCACHE_TTL_MS       (10*60*1000)  //Time to live of a cached IP address in msec
+
+//Result of the last DNS lookup of a task
+typedef enum {
+  DNSCACHE_NOTUSED = 0,   //No lookup or the hostname is an IP address
+  DNSCACHE_HIT,
+  DNSCACHE_MISS
+} dnscache_result_t;
+
+bool DNSCache_Lookup(const char* hostname, ip_addr_t* addrOut);
+void DNSCache_Add(const char* hostname, const ip_addr_t* addr);
+void DNSCache_Remove(const char* hostname);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
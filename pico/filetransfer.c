@@ -15,7 +15,7 @@
 //--------------------------------------------------------------
 //The definitions below must be the same as the ones in busloop.c
 
-extern uint8_t dataBuffer[];
+extern uint8_t* dataBuffer;
 //--------------------------------------------------------------
 
 
@@ -83,8 +83,10 @@ uint32_t verificationErrorCount;
 // The packet order byte and CRC checksum are validated.
 // Then, payload data is copied to dataBuffer. Once we got
 // 512 Bytes of data, the data is written to flash.
+//
+// ACK is not sent if sendAck is false (YMODEM-G).
 bool  PacketReceived(const uint8_t *packetData,const uint32_t packetNumber,const uint32_t payloadLength,
-                     const uint32_t unitNum,uint8_t packetOrderByte){
+                     const uint32_t unitNum,uint8_t packetOrderByte,const bool sendAck){
   static uint32_t blockNum;
   static uint32_t partsAlreadyInBuffer;
   
@@ -109,7 +111,7 @@ bool  PacketReceived(const uint8_t *packetData,const uint32_t packetNumber,const
   //Valid Packet!
   //Send ACK immediately so that host can send next packet
   //while we are processing the previous one.
-  usb_putchar(ACK);
+  if (sendAck) usb_putchar(ACK);
 
   uint32_t partsRemaining = payloadLength/128;  //Number of 128 Bytes chunk to be processed
   do {
@@ -225,7 +227,7 @@ int xmodemrx(const uint32_t unitNum) {
         
         const uint32_t payloadLength = packetSize - OVERHEAD;
         assert(payloadLength%128==0); //should be multiple of 128
-        bool isValid=PacketReceived(packet+PADDING,packetNumber,payloadLength,unitNum,packetOrderByte);
+        bool isValid=PacketReceived(packet+PADDING,packetNumber,payloadLength,unitNum,packetOrderByte,true);
         if (isValid) {
           state=STATE_ACK;
           errorCount = 0;
@@ -550,5 +552,310 @@ void Download(const uint32_t unitNum,enum TxProtocol protocol) {
 
 
 
+////////////////////////////////////////////////////////////////////////////////////////
+//
+// YMODEM-G
+//
+// Streaming variant of YMODEM. The receiver sends 'G' instead of 'C'. Then, the
+// sender sends all packets without waiting for ACK. There is no error recovery. A bad
+// packet aborts the transfer. USB has its own error checking and retransmission.
+// So, it is safe over USB serial.
+//
+// Block 0 contains the file name and size. Only one file is transferred.
+//
+////////////////////////////////////////////////////////////////////////////////////////
+
+#define GCHAR 'G'
+
+//////////////////////////////////////////////////////
+// Cancel the transfer. Send CAN and discard input.
+//
+static void CancelTransfer() {
+  for(int i=0;i<5;++i) usb_putchar(CAN);
+  sleep_ms(100);
+  usb_discard();
+}
 
+//////////////////////////////////////////////////////
+// Read the rest of a packet after SOH/STX
+//
+// Input: packet    - Buffer to receive packet order bytes, payload and CRC
+//        startChar - SOH or STX
+//
+// Output: Payload length. 0 if timeout.
+//
+static uint32_t ReadPacket(uint8_t* packet, const int startChar) {
+  const uint32_t payloadLength = (startChar==STX)?1024:128;
+  const uint32_t packetSize = payloadLength+4;  //2 Packet Order Bytes and 2-Bytes CRC
+  
+  if (usb_getraw_timeout((char*)packet,packetSize,onesecond)!=packetSize) return 0;
+  return payloadLength;
+}
 
+//////////////////////////////////////////////////////
+// Validate block 0 and get the file size
+// Block 0: file name, NUL, file size in decimal, ...
+//
+// Input: packet        - Packet read by ReadPacket()
+//        payloadLength - Payload length
+//        fileSizeOut   - Pointer to receive file size. 0 if not present.
+//
+// Output: true if valid. 
+//
+static bool ParseBlock0(const uint8_t* packet, const uint32_t payloadLength, uint32_t* fileSizeOut) {
+  if (packet[0]!=0 || packet[1]!=255) return false;
+  
+  const uint8_t* payload = packet+2;
+  const uint32_t crc = packet[payloadLength+2]*256+packet[payloadLength+3];
+  if (CRC16Aligned(payload,payloadLength)!=crc) return false;
+
+  *fileSizeOut = 0;
+  const uint32_t nameLen = strnlen((const char*)payload,payloadLength);
+  if (nameLen+1<payloadLength) *fileSizeOut = strtoul((const char*)payload+nameLen+1,NULL,10);
+  return true;
+}
+
+//////////////////////////////////////////////////////
+// YModem-G Receive (PC to MegaFlash)
+//
+// Input: unitNum     - ProDOS Drive to be written.
+//        fileSizeOut - Pointer to receive file size in block 0
+//
+// Output: int - Number of 128-bytes packets received
+//               -1 if aborted
+//
+int ymodemgrx(const uint32_t unitNum, uint32_t* fileSizeOut) {
+  const uint MAXSTARTRETRY = 30; //Retry every 3 seconds. 90 seconds for user to start transfer
+  const uint PADDING = 2;        //To make sure packet payload is 32-bit aligned
+  const uint BUFFERSIZE = PADDING + 1024 + 4;
+  
+  int ch;
+  uint32_t payloadLength;
+  uint32_t packetNumber = 0;  //1k payload is counted as 8 packets
+  uint8_t packetOrderByte = 0;
+  bool success = false;
+  verificationErrorCount = 0;
+  
+  //allocate buffer
+  #ifdef PICO_RP2040
+  //Stack Size of RP2040 is 2kB only.
+  //So, allocate from heap instead.
+  uint8_t* packet = malloc(BUFFERSIZE);
+  assert(packet);
+  #else
+  uint8_t __attribute__((aligned(4))) packet[BUFFERSIZE];
+  #endif
+  
+  do {
+    //Send 'G' every 3 seconds until block 0 is received
+    uint retry = 0;
+    do {
+      usb_putchar(GCHAR);
+      ch=usb_getchar_timeout_us(3*onesecond);
+      if (ch==CTRLC || ch==CAN) break;
+    } while (ch!=SOH && ch!=STX && ++retry<=MAXSTARTRETRY);
+    if (ch!=SOH && ch!=STX) break;
+    
+    //Block 0
+    payloadLength = ReadPacket(packet+PADDING,ch);
+    if (!payloadLength || !ParseBlock0(packet+PADDING,payloadLength,fileSizeOut)) break;
+    if (packet[PADDING+2]=='\0') {   //Empty batch
+      usb_putchar(ACK);
+      break;
+    }
+    usb_putchar(ACK);
+    usb_putchar(GCHAR);  //Start streaming
+    
+    //Data packets are streamed until EOT
+    while(1) {
+      ch=usb_getchar_timeout_us(3*onesecond);
+      if (ch!=SOH && ch!=STX) break;
+      
+      payloadLength = ReadPacket(packet+PADDING,ch);
+      if (!payloadLength) break;
+      ++packetOrderByte;
+      if (!PacketReceived(packet+PADDING,packetNumber,payloadLength,unitNum,packetOrderByte,false)) break;
+      packetNumber += payloadLength/128;
+    }
+    if (ch!=EOT) break;
+    usb_putchar(ACK);
+    success = true;
+    
+    //End of batch. Only one file is accepted.
+    usb_putchar(GCHAR);
+    ch=usb_getchar_timeout_us(3*onesecond);
+    if (ch==SOH || ch==STX) {
+      uint32_t nextFileSize;
+      payloadLength = ReadPacket(packet+PADDING,ch);
+      if (payloadLength && ParseBlock0(packet+PADDING,payloadLength,&nextFileSize) && packet[PADDING+2]=='\0') {
+        usb_putchar(ACK);
+      } else {
+        CancelTransfer();
+      }
+    }
+  } while(0);
+  
+  if (!success) CancelTransfer();
+  
+  #ifdef PICO_RP2040
+  free(packet); //free packet buffer
+  #endif
+  return success?packetNumber:-1;
+}
+
+//PC -> MegaFlash
+void UploadYModemG(const uint32_t unitNum) {
+  printf("\nYou are ready to upload ProDOS image file to drive %d.\n",unitNum);
+  printf("Please start upload using YModem-G protocol\n");
+  printf("within 90 seconds. Type Ctrl-C to abort.\n");
+  
+  uint32_t fileSize;
+  int packetCount = ymodemgrx(unitNum,&fileSize);
+  if (packetCount<0) printf("\nAborted.\n");
+  else {
+    printf("\n\n");
+    if (fileSize%BLOCKSIZE!=0) printf("Warning:Last block is incomplete.\n");
+    if (fileSize>0x2000000) printf("Warning:The file is larger than 32MB\n");
+    printf("%d blocks received.\n",(fileSize!=0)?fileSize/BLOCKSIZE:packetCount/4);
+    printf("Verification Error:%d\n",verificationErrorCount);
+  }
+}
+
+//////////////////////////////////////////////////////
+// Send block 0
+//
+// Input: packetBuffer - Buffer of TXBUFFERSIZE bytes
+//        unitNum      - Unit number for file name. 0 for end of batch.
+//        blockCount   - Number of blocks of the file
+//
+static void SendBlock0(uint8_t* packetBuffer, const uint32_t unitNum, const uint32_t blockCount) {
+  uint8_t *payload = packetBuffer+(TXPADDING+3);
+  
+  packetBuffer[TXPADDING+0] = SOH;
+  packetBuffer[TXPADDING+1] = 0;
+  packetBuffer[TXPADDING+2] = 255;
+  memset(payload,0,128);
+  if (unitNum!=0) {
+    //File name, NUL, file size
+    int len = sprintf((char*)payload,"drive%u.po",(uint)unitNum);
+    sprintf((char*)payload+len+1,"%u",(uint)(blockCount*BLOCKSIZE));
+  }
+  
+  uint32_t crc=CRC16Aligned(payload,128);
+  packetBuffer[TXPADDING+132] = (uint8_t) crc; crc>>=8; //Low Byte 
+  packetBuffer[TXPADDING+131] = (uint8_t) crc;          //High Byte
+  usb_putraw(packetBuffer+TXPADDING,TXPACKETSIZE128);
+}
+
+//////////////////////////////////////////////////////
+// Wait for 'G' from receiver. ACK is ignored.
+//
+// Input: timeout_us - timeout period in us
+//
+// Output: true if 'G' is received
+//
+static bool WaitForG(const uint32_t timeout_us) {
+  int ch;
+  do {
+    ch = usb_getchar_timeout_us(timeout_us);
+  } while (ch==ACK);
+  return ch==GCHAR;
+}
+
+//////////////////////////////////////////////////////
+// YModem-G Transmit (MegaFlash to PC)
+//
+// Input: unitNum    - ProDOS Drive to be read.
+//        blockCount - Number of blocks to be sent
+//
+// Output: int - Number of 128-bytes packets sent
+//               -1 if aborted
+//
+int ymodemgtx(const uint32_t unitNum, const uint32_t blockCount) {
+  assert(blockCount != 0);
+  const uint32_t MAXNAK = 10;
+  
+  int ch;
+  uint32_t packetNumber = 0;                //To count number of 128 bytes chunk sent
+  uint32_t packetRemaining = blockCount*4;  //Number of 128 bytes chunk to be sent
+  uint8_t  packetOrderByte = 1;
+  bool success = false;
+  
+  //allocate buffer
+  #ifdef PICO_RP2040
+  //Stack Size of RP2040 is 2kB only.
+  //So, allocate from heap instead.
+  uint8_t* packetBuffer = malloc(TXBUFFERSIZE);
+  assert(packetBuffer);
+  #else
+  uint8_t __attribute__((aligned(4))) packetBuffer[TXBUFFERSIZE];
+  #endif 
+  
+  //Reset static variable
+  SendPacket128(NULL,0,0,0,false); //NULL means reset static variable
+  
+  do {
+    //Wait for 'G'. 'C' (YMODEM with ACK) is not supported.
+    do {
+      ch = usb_getchar_timeout_us(90*onesecond);
+    } while (ch!=GCHAR && ch!=CTRLC && ch!=CAN && ch!=-1);
+    if (ch!=GCHAR) break;
+    
+    //Block 0
+    SendBlock0(packetBuffer,unitNum,blockCount);
+    if (!WaitForG(3*onesecond)) break;
+    
+    //Stream data packets
+    while (packetRemaining!=0) {
+      if (packetRemaining>=8) {
+        SendPacket1k(packetBuffer,unitNum,packetNumber,packetOrderByte);
+        packetNumber += 8;
+        packetRemaining -= 8;
+      } else {
+        SendPacket128(packetBuffer,unitNum,packetNumber,packetOrderByte,true);
+        packetNumber += 1;
+        packetRemaining -= 1;
+      }
+      ++packetOrderByte;
+      
+      //Receiver may cancel the transfer
+      if (usb_getchar_timeout_us(0)==CAN) break;
+    }
+    if (packetRemaining!=0) break;
+    
+    //Send EOT, wait for ACK
+    uint32_t nakCount = 0;
+    do {
+      usb_putchar(EOT);
+      ch = usb_getchar_timeout_us(3*onesecond);
+    } while (ch==NAK && ++nakCount<=MAXNAK);
+    if (ch!=ACK) break;
+    success = true;
+    
+    //End of batch
+    if (WaitForG(3*onesecond)) SendBlock0(packetBuffer,0,0);
+  } while(0);
+  
+  if (!success) usb_discard();
+  
+  #ifdef PICO_RP2040
+  free(packetBuffer); //free packet buffer
+  #endif  
+  return success?packetNumber:-1;
+}
+
+//MegaFlash -> PC
+void DownloadYModemG(const uint32_t unitNum) { 
+  printf("\nYou are ready to download ProDOS image file (.po) from drive %d.\n",unitNum);
+  printf("Please start download using YModem-G protocol within 90 seconds.\n");
+  printf("Type Ctrl-C to abort.\n");
+  
+  uint32_t blockCount = GetBlockCountForImageTransfer(unitNum);
+
+  int packetCount = ymodemgtx(unitNum, blockCount);
+  if (packetCount<0) printf("\nAborted.\n");
+  else {
+    printf("\n\nDownload Completed.\n");
+    printf("%d blocks sent.\n",packetCount/4);
+  }
+}
@@ -12,6 +12,8 @@ enum TxProtocol {
 
 void Upload(const uint32_t unitnum);
 void Download(const uint32_t unitNum, enum TxProtocol protocol);
+void UploadYModemG(const uint32_t unitNum);
+void DownloadYModemG(const uint32_t unitNum);
 
 #ifdef __cplusplus
 }
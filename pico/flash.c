@@ -11,6 +11,7 @@
 #include "flash.h"
 #include "userconfig.h"
 #include "misc.h"
+#include "flashstats.h"
 
 
 /////////////////////////////////////////////////////////////////////
@@ -42,9 +43,110 @@
 // Thread-safe is needed because both cores may access to flash at the same
 // time if TFTP is running.
 //
+// There are two levels of locks:
+// 1) Device Lock - One for each flash chip (DEVICE0 and DEVICE1). It is held
+//    for a complete operation on the chip, including the wait for an erase or
+//    program operation to complete. It also protects the sector cache entries
+//    and the scratch buffers of the chip.
+// 2) Bus Lock - It is held for one SPI transaction only (from /CS low to /CS high)
+//    by enable_spi0() and disable_spi0(). Memory DMA and the CRC sniffer are also
+//    protected by Bus Lock because they are not thread-safe.
+//
+// So, a ProDOS block on one chip can be read while the other chip is erasing.
+// The Bus Lock is never held while waiting for the busy flag of a chip.
+//
+// Lock Order: Device Lock before Bus Lock. DEVICE0 before DEVICE1.
+//
 // Note: All functions which are thread-safe and access flash are prefix with ts
 #define USEMUTEX 1
 
+
+/////////////////////////////////////////////////////////////////////
+// Write-back Sector Cache
+//
+// If SECTORCACHE is defined to be 1, a ProDOS block write which needs
+// an erase operation does not erase the 4kB sector immediately. Instead,
+// the sector is loaded into a RAM cache entry, the block is merged into
+// it and the entry is marked dirty. Further writes to the same sector
+// are merged into the cache entry. So, N writes into one sector cost
+// one erase. Reads of a cached sector are served from the cache.
+//
+// Dirty sectors are written back to flash when
+// 1) No flash write has happened for SECTORCACHE_IDLE_MS (flush-on-idle)
+// 2) A sector has been dirty for SECTORCACHE_DIRTY_MS (dirty timeout)
+// 3) All entries are dirty (background LRU eviction)
+// 4) Apple is cold-started (CMD_COLDSTART) or reset (/RESET interrupt)
+// 5) A cache entry is needed for another sector and no entry is free
+//    (inline LRU eviction)
+//
+// 1) to 4) are executed on core 0 by FlushSectorCacheIfIdle(). 5) is
+// executed by the block write itself. That write waits for the erase of
+// the evicted sector, as if there were no cache. 3) frees an entry before
+// the next write needs it. So, 5) only happens if the writes come faster
+// than core 0 polls.
+//
+// Note: Because of the block layout (see GetBlockLoc), the 8 blocks in
+// a 4kB sector are 8192 blocks apart. The cache mainly absorbs repeated
+// writes to the same blocks (Volume Bitmap, Directory and Index blocks).
+//
+// Note: A write to a cached sector always reports success to ProDOS.
+// If the sector cannot be verified when it is written back, the error
+// is logged and the sector is kept dirty for another attempt.
+//
+#define SECTORCACHE 1
+#define SECTORCACHE_IDLE_MS   200
+#define SECTORCACHE_DIRTY_MS  2000
+
+
+/////////////////////////////////////////////////////////////////////
+// Erase/Program Suspend
+//
+// A 64kB sector erase takes up to 2s and a 4kB sector erase takes
+// about 60ms. The Device Lock is held during the operation. Without
+// ERASESUSPEND, a ProDOS block read from the same flash chip has to
+// wait until the operation is completed.
+//
+// If ERASESUSPEND is defined to be 1, tsReadBlockFlash_Public() does
+// not wait for the Device Lock when it is held by the other core.
+// It posts a read request instead. The owner of the Device Lock checks
+// the request while it is waiting for the busy flag of an erase or
+// program operation. It suspends the operation (0x75), reads the block,
+// and resumes the operation (0x7A). So, the read latency is about 20us
+// (suspend time) plus the time to read one block.
+//
+// The blocks in the region being erased or programmed cannot be read
+// while the operation is suspended. Such request is not served and the
+// reader waits for the Device Lock as usual. A block in the sector cache
+// is always served from the cache.
+//
+// The operation needs some time to make progress between suspends.
+// Otherwise, an erase may never complete if the blocks are read back to
+// back. So, a suspend is issued at most once every SUSPEND_INTERVAL_US.
+//
+#define ERASESUSPEND 1
+#define SUSPEND_INTERVAL_US  200
+
+
+/////////////////////////////////////////////////////////////////////
+// Lazy Unit Erase
+//
+// Erasing a 32MB unit takes about 2 minutes. If LAZYERASE is defined to
+// be 1, tsEraseFlashDisk() does not erase the unit. It marks every 64kB
+// region of the unit which is not known to be erased as stale, erases the
+// guard region (see tsCheckGuardRegions()) and writes the checkpoint of
+// region maps. It completes in about 300ms.
+//
+// The stale regions hold the data of the previous generation of the unit.
+// The blocks in a stale region are read as erased blocks (i.e. zeros after
+// bit inversion). A stale region is erased before a block in it is written.
+// LazyEraseTask() on core 0 erases the stale regions in background when
+// no ProDOS block has been read or written for LAZYERASE_IDLE_MS.
+//
+// See the note at Erased Region Map and Stale Region Map.
+//
+#define LAZYERASE 1
+#define LAZYERASE_IDLE_MS  500
+
 //SPI pins
 const uint CS0_PIN  = 5;  //Chip #0 /CS
 const uint CS1_PIN  = 28; //Chip #1 /CS
@@ -65,14 +167,82 @@ const uint MISO_PIN = 4;  //rx
 
 static const uint8_t REPEATED_TX_DATA = 0;
 static const uint FLASH_BUSYFLAG = 0b00000001;  //Busy Flash in Flash Status Register
+static const uint FLASH_SUSFLAG  = 0b10000000;  //Suspend Status in Flash Status Register-2
 
 //Flash Chip Device Number
 #define DEVICE0 0
 #define DEVICE1 1
 
-//Data Buffers
-static uint8_t __attribute__((aligned(4))) sectorBuffer[SECTORSIZE];
-static uint8_t __attribute__((aligned(4))) blockBuffer[BLOCKSIZE]; 
+//Data Buffers, one set for each flash chip
+static uint8_t __attribute__((aligned(4))) sectorBuffer[2][SECTORSIZE];
+static uint8_t __attribute__((aligned(4))) blockBuffer[2][BLOCKSIZE]; 
+
+//Sector Cache
+#if SECTORCACHE
+typedef struct {
+  bool valid;                 //Entry holds a dirty sector
+  uint deviceNum;             //Flash Chip device number
+  uint32_t sectorAddress;     //Address of the sector (4kB aligned)
+  uint32_t lastUsed;          //For LRU eviction
+  absolute_time_t dirtySince; //Time when the entry becomes dirty
+} sectorcache_t;
+
+static sectorcache_t sectorCache[SECTORCACHE_COUNT];
+static uint8_t __attribute__((aligned(4))) sectorCacheData[SECTORCACHE_COUNT][SECTORSIZE];
+static uint32_t sectorCacheUseCounter = 0;
+static absolute_time_t lastFlashWriteTime;
+static volatile bool sectorCacheFlushRequested = false;
+
+static void DiscardSectorCacheRange(const uint deviceNum, const uint32_t address, const uint32_t len);
+static bool IsSectorCachedInRange(const uint deviceNum, const uint32_t address, const uint32_t len);
+#endif
+
+//Read Request for Erase/Program Suspend
+#if ERASESUSPEND
+typedef enum {
+  REQ_NONE,
+  REQ_PENDING,  //Posted by the reader
+  REQ_DONE      //Block has been read by the owner of Device Lock
+} readreqstate_t;
+
+typedef struct {
+  volatile readreqstate_t state;
+  blockloc_t blockLoc;
+  uint8_t* dest;
+} readrequest_t;
+
+static readrequest_t readRequest[2];        //One for each flash chip
+static absolute_time_t nextSuspendTime[2];  //Earliest time of next suspend
+
+static void ServeReadRequest(const uint deviceNum, const uint32_t address, const uint32_t len);
+#endif
+
+//Erased Region Map and Stale Region Map
+#define MAXREGIONCOUNT        4096        //Number of 64kB regions of 256MB flash chip
+#define ERASEDMAP_CP_REGIONS  8           //Number of regions per bit of erased map in checkpoint
+#define STALEMAP_CP_REGIONS   4           //Number of regions per bit of stale map in checkpoint
+#define STALEMAP_CP_LIVE      24          //Max. number of live regions covered by stale bits in checkpoint
+#define REGIONMAP_REGNUM      3           //Security Register to store checkpoint
+#define REGIONMAP_MAGIC       0x6a3e19d6
+#define REGIONMAP_VERSION     3           //Increase it when the layout or the meaning of the bits is changed
+
+static uint32_t erasedMap[2][MAXREGIONCOUNT/32];   //One for each flash chip
+static uint32_t staleMap[2][MAXREGIONCOUNT/32];
+static uint staleRegionCount[2];
+static bool regionMapCheckpointed[2];              //Checkpoint in flash is valid
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;     //REGIONMAP_VERSION. Version 1 had no version field.
+  uint32_t flashSize;   //Flash Capacity in MB
+  uint32_t erasedBits[MAXREGIONCOUNT/ERASEDMAP_CP_REGIONS/32];
+  uint32_t staleBits[MAXREGIONCOUNT/STALEMAP_CP_REGIONS/32];
+  uint16_t liveRegions[STALEMAP_CP_LIVE];   //Regions not stale although their bit of staleBits is set. 0xffff=unused
+} regionmapcp_t;
+static_assert(sizeof(regionmapcp_t)<=256, "Checkpoint must fit into one security register");
+
+static regionmapcp_t checkpoint[2];   //Last checkpoint written to or read from flash
+static volatile uint32_t lastFlashAccessTime;  //time_us_32() of last ProDOS block read/write
 
 //Number of units (ProDOS drives) on Flash chip
 static uint32_t unitCountFlash0 = 0;
@@ -83,15 +253,23 @@ static uint32_t flashSize0 = 0;
 static uint32_t flashSize1 = 0;
 
 //Mutex
-//Recursive Mutex is used because the functions are calling one another
-//Recursive Mutex avoid dead lock
+//Recursive Mutex is used for Device Lock because the functions are calling one another
+//Recursive Mutex avoid dead lock. Bus Lock is never nested.
 #if USEMUTEX
-  auto_init_recursive_mutex(flashMutex);
-  #define MUTEXLOCK()   recursive_mutex_enter_blocking(&flashMutex)
-  #define MUTEXUNLOCK() recursive_mutex_exit(&flashMutex)
+  auto_init_recursive_mutex(flashDevice0Mutex);
+  auto_init_recursive_mutex(flashDevice1Mutex);
+  auto_init_mutex(flashBusMutex);
+  #define DEVICELOCK(d)   recursive_mutex_enter_blocking((d)==DEVICE0?&flashDevice0Mutex:&flashDevice1Mutex)
+  #define DEVICEUNLOCK(d) recursive_mutex_exit((d)==DEVICE0?&flashDevice0Mutex:&flashDevice1Mutex)
+  #define DEVICETRYLOCK(d) recursive_mutex_try_enter((d)==DEVICE0?&flashDevice0Mutex:&flashDevice1Mutex,NULL)
+  #define BUSLOCK()       mutex_enter_blocking(&flashBusMutex)
+  #define BUSUNLOCK()     mutex_exit(&flashBusMutex)
 #else
-  #define MUTEXLOCK()   do{}while(0)
-  #define MUTEXUNLOCK() do{}while(0)
+  #define DEVICELOCK(d)   do{}while(0)
+  #define DEVICEUNLOCK(d) do{}while(0)
+  #define DEVICETRYLOCK(d) true
+  #define BUSLOCK()       do{}while(0)
+  #define BUSUNLOCK()     do{}while(0)
 #endif
 
 ////////////////////////////////////////////////////////////////////
@@ -120,6 +298,7 @@ uint32_t GetFlashSize() {
 
 ////////////////////////////////////////////////////////////////////
 // Enable SPI CS line
+// Bus Lock is held until disable_spi0() is called.
 //
 // Input: Device Number
 //
@@ -129,6 +308,7 @@ uint32_t GetFlashSize() {
 static inline void enable_spi0(const uint deviceNum) {
   assert(deviceNum <= 1);
   
+  BUSLOCK();
   asm volatile("nop");
   gpio_clr_mask(deviceNum==0?1ul<<CS0_PIN:1ul<<CS1_PIN); 
   asm volatile("nop");
@@ -145,6 +325,7 @@ static inline void disable_spi0() {
   asm volatile("nop");
   gpio_set_mask(1ul<<CS0_PIN|1ul<<CS1_PIN);
   asm volatile("nop");
+  BUSUNLOCK();
 }
 
 
@@ -264,6 +445,25 @@ static uint8_t __no_inline_not_in_flash_func(ReadStatus1)(const uint deviceNum)
   return rxbuffer[1];
 }
 
+////////////////////////////////////////////////////////////////////
+// Read Status Register-2 from Flash Chip
+//
+// Input: Device Number
+//
+// Output: Status Register-2
+//
+static uint8_t __no_inline_not_in_flash_func(ReadStatus2)(const uint deviceNum) {
+  //Read Status Register-2 Command + 1 Byte Result
+  uint8_t txbuffer[2]={0x35};  
+  uint8_t rxbuffer[2];
+  
+  enable_spi0(deviceNum);
+  spi_write_read_blocking(spi0, txbuffer, rxbuffer, 2); 
+  disable_spi0();
+  
+  return rxbuffer[1];
+}
+
 ////////////////////////////////////////////////////////////////////
 // Read Status Register-3 from Flash Chip
 //
@@ -307,21 +507,71 @@ static uint8_t WriteStatus3Volatile(const uint deviceNum, const uint8_t value) {
 //
 // Input: Device Number
 //
+// Each polling is a separate SPI transaction. So, the other
+// flash chip can be accessed between pollings.
+//
 static void WaitUntilBusyClear(const uint deviceNum) {
-  uint8_t buffer[1] = {0x05}; //Read Status Register-1 Command
-
-  enable_spi0(deviceNum);
-  spi_write_blocking(spi0,buffer,1);  //Send Read Status Register-1 command
-  
   //keep reading status register 1 until busy flag is cleared
   do{
     busy_wait_us_32(2);  //wait 2us before next polling    
-    spi_read_blocking(spi0, REPEATED_TX_DATA, buffer, 1);
-  }while(buffer[0] & FLASH_BUSYFLAG);
+  }while(ReadStatus1(deviceNum) & FLASH_BUSYFLAG);
+}
+
+////////////////////////////////////////////////////////////////////
+// Wait until busy flag of an erase or program operation is cleared
+// Read requests from the other core are served during the wait.
+// See the note at ERASESUSPEND definition.
+//
+// Input: deviceNum - Device Number
+//        address   - Start address of the region being erased/programmed
+//        len       - Length of the region
+//        delayUs   - Time before the first polling of busy flag
+//
+static void __no_inline_not_in_flash_func(WaitUntilBusyClearWithSuspend)(const uint deviceNum, const uint32_t address, const uint32_t len, const uint32_t delayUs) {
+#if ERASESUSPEND
+  absolute_time_t pollTime = make_timeout_time_us(delayUs);
+  while(true) {
+    if (readRequest[deviceNum].state==REQ_PENDING) ServeReadRequest(deviceNum, address, len);
+    if (time_reached(pollTime)) {
+      if (!(ReadStatus1(deviceNum) & FLASH_BUSYFLAG)) break;
+      pollTime = make_timeout_time_us(2);  //wait 2us before next polling
+    }
+  }
+#else
+  sleep_us(delayUs);
+  WaitUntilBusyClear(deviceNum);
+#endif
+}
+
+#if ERASESUSPEND
+////////////////////////////////////////////////////////////////////
+// Send Erase/Program Suspend command
+// Valid only when an erase or program operation is in progress.
+//
+// Input: Device Number
+//
+static void __no_inline_not_in_flash_func(SuspendOperation)(const uint deviceNum) {
+  const uint8_t msg[]={0x75};  //Erase/Program Suspend command
   
+  enable_spi0(deviceNum);
+  spi_write_blocking(spi0, msg, 1);
   disable_spi0();
 }
 
+////////////////////////////////////////////////////////////////////
+// Send Erase/Program Resume command
+//
+// Input: Device Number
+//
+static void __no_inline_not_in_flash_func(ResumeOperation)(const uint deviceNum) {
+  const uint8_t msg[]={0x7A};  //Erase/Program Resume command
+  
+  enable_spi0(deviceNum);
+  spi_write_blocking(spi0, msg, 1);
+  disable_spi0();
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////
 // Set Flash Drive Strength to 75%
 //
@@ -339,12 +589,12 @@ static void SetFlashDriveStrength(const uint deviceNum) {
 // Assume 4 Bytes addressing is being used.
 // Assume the security register has been erased
 //
-// Input: Security Registers Number (1-3),
+// Input: Device Number,
+//        Security Registers Number (1-3),
 //        Pointer to Source Data
 //        Length of data
 //
-// Note: Always write to Flash Chip #0
-static void tsProgramSecurityRegister(const uint32_t regnum,const uint8_t* src,const size_t len) {
+static void tsProgramSecurityRegister(const uint deviceNum,const uint32_t regnum,const uint8_t* src,const size_t len) {
   if (regnum==0 || regnum >3) {
     assert(0);
     return;
@@ -359,9 +609,9 @@ static void tsProgramSecurityRegister(const uint32_t regnum,const uint8_t* src,c
   msg[2] = (uint8_t)(address);  address>>=8;
   msg[1] = (uint8_t)(address);
   
-  MUTEXLOCK();
-  WriteEnable(DEVICE0);
-  enable_spi0(DEVICE0);
+  DEVICELOCK(deviceNum);
+  WriteEnable(deviceNum);
+  enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 5);
   spi_write_blocking(spi0,src, len); //Write actual data
   disable_spi0();
@@ -369,18 +619,18 @@ static void tsProgramSecurityRegister(const uint32_t regnum,const uint8_t* src,c
   //wait until programming finishes
   //It takes about 0.7-3.5ms
   busy_wait_us_32(300); //At least 50ns delay is needed after erase/write command (CS deselect time)
-  WaitUntilBusyClear(DEVICE0); 
-  MUTEXUNLOCK();
+  WaitUntilBusyClear(deviceNum); 
+  DEVICEUNLOCK(deviceNum);
 }
 
 ////////////////////////////////////////////////////////////////////
 // Erase Security Register (256 bytes)
 // Assume 4 Bytes addressing is being used.
 //
-// Input: Security Register Number (1-3),
+// Input: Device Number,
+//        Security Register Number (1-3),
 //
-// Note: Always erase flash chip #0
-void tsEraseSecurityRegister(const uint32_t regnum) {
+static void tsEraseSecurityRegisterDevice(const uint deviceNum,const uint32_t regnum) {
   if (regnum==0 || regnum >3) {
     assert(0);
     return;
@@ -395,9 +645,9 @@ void tsEraseSecurityRegister(const uint32_t regnum) {
   msg[2] = (uint8_t)(address);  address>>=8;
   msg[1] = (uint8_t)(address);
   
-  MUTEXLOCK();
-  WriteEnable(DEVICE0);
-  enable_spi0(DEVICE0);
+  DEVICELOCK(deviceNum);
+  WriteEnable(deviceNum);
+  enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 5);
   disable_spi0();
   
@@ -405,21 +655,31 @@ void tsEraseSecurityRegister(const uint32_t regnum) {
   //Actual Test:50ms
   //Wait until the operation is completed.
   sleep_ms(40);   //At least 50ns delay is needed after erase/write command (CS deselect time)
-  WaitUntilBusyClear(DEVICE0);
-  MUTEXUNLOCK();
+  WaitUntilBusyClear(deviceNum);
+  DEVICEUNLOCK(deviceNum);
 } 
 
+////////////////////////////////////////////////////////////////////
+// Erase Security Register (256 bytes)
+//
+// Input: Security Register Number (1-3),
+//
+// Note: Always erase flash chip #0
+void tsEraseSecurityRegister(const uint32_t regnum) {
+  tsEraseSecurityRegisterDevice(DEVICE0,regnum);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Read Security Register to dest
 // Assume 4 Bytes addressing is being used.
 //
-// Input: regnum - Security Register Number (1-3),
-//        dest   - Pointer to Destination
-//        offset - Read from offset
-//        len    - Length of data
+// Input: deviceNum - Device Number
+//        regnum    - Security Register Number (1-3),
+//        dest      - Pointer to Destination
+//        offset    - Read from offset
+//        len       - Length of data
 //
-// Note: Always Read from flash chip #0
-void tsReadSecurityRegister(const uint32_t regnum,uint8_t* dest,const uint8_t offset,const size_t len) {
+static void tsReadSecurityRegisterDevice(const uint deviceNum,const uint32_t regnum,uint8_t* dest,const uint8_t offset,const size_t len) {
   if (regnum==0 || regnum >3) {
     assert(0);
     return;
@@ -440,12 +700,25 @@ void tsReadSecurityRegister(const uint32_t regnum,uint8_t* dest,const uint8_t of
   msg[1] = (uint8_t)(address);
   msg[5] = 0;   //Dummy 8-bit 
   
-  MUTEXLOCK();
-  enable_spi0(DEVICE0);
+  DEVICELOCK(deviceNum);
+  enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 6);
   spi_read_blocking(spi0, REPEATED_TX_DATA, dest, len);  //No need to use DMA
   disable_spi0();
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(deviceNum);
+}
+
+////////////////////////////////////////////////////////////////////
+// Read Security Register to dest
+//
+// Input: regnum - Security Register Number (1-3),
+//        dest   - Pointer to Destination
+//        offset - Read from offset
+//        len    - Length of data
+//
+// Note: Always Read from flash chip #0
+void tsReadSecurityRegister(const uint32_t regnum,uint8_t* dest,const uint8_t offset,const size_t len) {
+  tsReadSecurityRegisterDevice(DEVICE0,regnum,dest,offset,len);
 }
 
 
@@ -474,7 +747,7 @@ void tsWriteSecurityRegister(const uint32_t regnum,uint8_t* src,const uint8_t of
   if (offset==0 && len==256) {
     //Overwrite the entire security register
     tsEraseSecurityRegister(regnum);  
-    tsProgramSecurityRegister(regnum,src,256);    
+    tsProgramSecurityRegister(DEVICE0,regnum,src,256);    
   }  else {
     //Read the existing data from security register
     uint8_t buffer[256];
@@ -485,7 +758,7 @@ void tsWriteSecurityRegister(const uint32_t regnum,uint8_t* src,const uint8_t of
 
     //Write the data back
     tsEraseSecurityRegister(regnum);
-    tsProgramSecurityRegister(regnum,buffer,len);    
+    tsProgramSecurityRegister(DEVICE0,regnum,buffer,len);    
   }
 }
 
@@ -524,6 +797,306 @@ blockloc_t __no_inline_not_in_flash_func(GetBlockLoc)(uint unitNum, const uint b
 }
 
 
+//******************************************************************
+//
+//      Erased Region Map and Stale Region Map
+//
+// Erased Region Map:
+// One bit for each 64kB region of a flash chip. The bit is set when the
+// region is known to be erased i.e. after tsEraseSector64k(), chip erase
+// or tsIsSector64kErased() has read the whole region. The bit is cleared
+// before any page in the region is programmed. If the bit is set,
+// tsIsSector64kErased() returns true without reading 64kB from flash.
+// So, erase unit, image transfer and format skip the regions which
+// are already erased without accessing the flash chip.
+//
+// Stale Region Map:
+// One bit for each 64kB region of a flash chip. The bit is set when the
+// unit is erased by Lazy Unit Erase (see LAZYERASE definition). A stale
+// region still holds the data of the previous generation of the unit.
+// Every block in a stale region is read as an erased block. Before a block
+// is written, the region is erased. LazyEraseTask() erases stale regions
+// in background. The bit is cleared when the region is erased.
+//
+// Checkpoint:
+// Both maps are checkpointed to Security Register 3 of each flash chip
+// and loaded by InitFlash(). To fit the checkpoint into one security
+// register, one bit of erased map covers ERASEDMAP_CP_REGIONS regions. It
+// is set only if all regions are erased. One bit of stale map covers
+// STALEMAP_CP_REGIONS regions. It is set if any region is stale. The other
+// regions covered by the bit which may be programmed are listed in
+// liveRegions. If the list is full, the stale regions covered by the bit
+// are erased when the checkpoint is written.
+//
+// The checkpoint must never report a programmed region as erased or
+// stale. Otherwise, data is lost after power cycle. So,
+// 1) If the checkpoint reports a region as erased, the checkpoint is
+//    erased (or rewritten if there are stale regions) before the region
+//    is programmed.
+// 2) If the checkpoint reports a region as stale, the region is erased
+//    (if it is stale in memory) and the checkpoint is rewritten with the
+//    region in liveRegions before a block in the region is written. The
+//    other stale regions covered by the same bit are left to
+//    LazyEraseTask().
+//
+// Other firmware versions:
+// The checkpoint has a version number. If it is written by another
+// firmware version (e.g. a downgrade and then an upgrade again), the bits
+// may have a different meaning. The checkpoint is rejected and replaced
+// by an empty one. No region is erased or stale.
+//
+// Firmware without this feature does not update the checkpoint when it
+// writes to flash. tsCheckGuardRegions() detects it by the guard region of
+// each unit and drops the claims of the unit. See the note there.
+//
+//******************************************************************
+
+////////////////////////////////////////////////////////////////////
+// Bit operations of region maps
+//
+static inline bool TestRegionBit(const uint32_t* map, const uint index) {
+  return map[index/32] & (1ul<<(index%32));
+}
+
+static inline void SetRegionBit(uint32_t* map, const uint index) {
+  map[index/32] |= 1ul<<(index%32);
+}
+
+static inline void ClearRegionBit(uint32_t* map, const uint index) {
+  map[index/32] &= ~(1ul<<(index%32));
+}
+
+////////////////////////////////////////////////////////////////////
+// Get the bit position of a 64kB region in region maps
+//
+static inline uint GetRegionIndex(const uint32_t address) {
+  const uint index = address>>16;
+  assert(index<MAXREGIONCOUNT);
+  return index;
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if a 64kB region is known to be erased
+//
+// Input: deviceNum - Device Number
+//        address   - Any address in the region
+//
+static inline bool IsRegionErased(const uint deviceNum, const uint32_t address) {
+  return TestRegionBit(erasedMap[deviceNum], GetRegionIndex(address));
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if a 64kB region is stale
+//
+// Input: deviceNum - Device Number
+//        address   - Any address in the region
+//
+static inline bool IsRegionStale(const uint deviceNum, const uint32_t address) {
+  return TestRegionBit(staleMap[deviceNum], GetRegionIndex(address));
+}
+
+////////////////////////////////////////////////////////////////////
+// Mark a 64kB region as erased. It is not stale anymore.
+// The caller must hold the Device Lock
+//
+// Input: deviceNum - Device Number
+//        address   - Any address in the region
+//
+static void SetRegionErased(const uint deviceNum, const uint32_t address) {
+  const uint index = GetRegionIndex(address);
+  SetRegionBit(erasedMap[deviceNum], index);
+  if (TestRegionBit(staleMap[deviceNum], index)) {
+    ClearRegionBit(staleMap[deviceNum], index);
+    --staleRegionCount[deviceNum];
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Mark a 64kB region as stale if it is not erased
+// The caller must hold the Device Lock
+//
+// Input: deviceNum - Device Number
+//        address   - Any address in the region
+//
+static void SetRegionStale(const uint deviceNum, const uint32_t address) {
+  const uint index = GetRegionIndex(address);
+  if (TestRegionBit(erasedMap[deviceNum], index)) return;
+  if (TestRegionBit(staleMap[deviceNum], index)) return;
+  SetRegionBit(staleMap[deviceNum], index);
+  ++staleRegionCount[deviceNum];
+}
+
+////////////////////////////////////////////////////////////////////
+// Mark all regions of a flash chip as erased
+// The caller must hold the Device Lock
+//
+static void SetAllRegionsErased(const uint deviceNum) {
+  memset(erasedMap[deviceNum], 0xff, sizeof(erasedMap[deviceNum]));
+  memset(staleMap[deviceNum], 0, sizeof(staleMap[deviceNum]));
+  staleRegionCount[deviceNum] = 0;
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if the checkpoint reports a region as stale
+//
+// Input: deviceNum - Device Number
+//        index     - Region Index
+//
+static bool IsRegionStaleInCheckpoint(const uint deviceNum, const uint index) {
+  if (!regionMapCheckpointed[deviceNum]) return false;
+  
+  const regionmapcp_t* cp = &checkpoint[deviceNum];
+  if (!TestRegionBit(cp->staleBits, index/STALEMAP_CP_REGIONS)) return false;
+  for(uint i=0;i<STALEMAP_CP_LIVE;++i) {
+    if (cp->liveRegions[i]==index) return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Write the checkpoint of region maps to flash
+// If liveRegions is full, stale regions are erased. See the note at
+// Erased Region Map and Stale Region Map.
+//
+// Input: deviceNum - Device Number
+//
+static void tsSaveRegionMap(const uint deviceNum) {
+  const uint32_t flashSize = (deviceNum==DEVICE0)?flashSize0:flashSize1;
+  if (flashSize==0) return;
+  
+  DEVICELOCK(deviceNum);
+  regionmapcp_t* cp = &checkpoint[deviceNum];
+  memset(cp, 0, sizeof(regionmapcp_t));
+  cp->magic = REGIONMAP_MAGIC;
+  cp->version = REGIONMAP_VERSION;
+  cp->flashSize = flashSize;
+  memset(cp->liveRegions, 0xff, sizeof(cp->liveRegions));
+  
+  uint liveCount = 0;
+  for(uint first=0;first<MAXREGIONCOUNT;first+=STALEMAP_CP_REGIONS) {
+    uint stale = 0;
+    uint live = 0;
+    for(uint i=first;i<first+STALEMAP_CP_REGIONS;++i) {
+      if (TestRegionBit(staleMap[deviceNum], i)) ++stale;
+      else if (!TestRegionBit(erasedMap[deviceNum], i)) ++live;
+    }
+    if (stale==0) continue;
+    
+    if (liveCount+live>STALEMAP_CP_LIVE) {
+      //No room for the live regions. Erase the stale regions now.
+      for(uint i=first;i<first+STALEMAP_CP_REGIONS;++i) {
+        if (TestRegionBit(staleMap[deviceNum], i)) tsEraseSector64k(deviceNum, i<<16);
+      }
+      continue;
+    }
+    
+    SetRegionBit(cp->staleBits, first/STALEMAP_CP_REGIONS);
+    for(uint i=first;i<first+STALEMAP_CP_REGIONS;++i) {
+      if (!TestRegionBit(staleMap[deviceNum], i) && !TestRegionBit(erasedMap[deviceNum], i)) {
+        cp->liveRegions[liveCount++] = i;
+      }
+    }
+  }
+  
+  for(uint i=0;i<MAXREGIONCOUNT;i+=ERASEDMAP_CP_REGIONS) {
+    bool allErased = true;
+    for(uint j=0;j<ERASEDMAP_CP_REGIONS;++j) {
+      if (!TestRegionBit(erasedMap[deviceNum], i+j)) allErased = false;
+    }
+    if (allErased) SetRegionBit(cp->erasedBits, i/ERASEDMAP_CP_REGIONS);
+  }
+  
+  tsEraseSecurityRegisterDevice(deviceNum, REGIONMAP_REGNUM);
+  tsProgramSecurityRegister(deviceNum, REGIONMAP_REGNUM, (const uint8_t*)cp, sizeof(regionmapcp_t));
+  regionMapCheckpointed[deviceNum] = true;
+  DEVICEUNLOCK(deviceNum);
+}
+
+////////////////////////////////////////////////////////////////////
+// Load the checkpoint of region maps from flash
+// If the checkpoint is not valid, all regions are unknown (not erased)
+// and no region is stale.
+//
+// Input: deviceNum - Device Number
+//
+static void tsLoadRegionMap(const uint deviceNum) {
+  const uint32_t flashSize = (deviceNum==DEVICE0)?flashSize0:flashSize1;
+  
+  memset(erasedMap[deviceNum], 0, sizeof(erasedMap[deviceNum]));
+  memset(staleMap[deviceNum], 0, sizeof(staleMap[deviceNum]));
+  staleRegionCount[deviceNum] = 0;
+  regionMapCheckpointed[deviceNum] = false;
+  if (flashSize==0) return;
+  
+  regionmapcp_t* cp = &checkpoint[deviceNum];
+  tsReadSecurityRegisterDevice(deviceNum, REGIONMAP_REGNUM, (uint8_t*)cp, 0, sizeof(regionmapcp_t));
+  if (cp->magic!=REGIONMAP_MAGIC) return;
+  if (cp->version!=REGIONMAP_VERSION || cp->flashSize!=flashSize) {
+    //Written by another firmware version or for another flash chip.
+    //Don't interpret the bits. Replace it with an empty checkpoint.
+    tsSaveRegionMap(deviceNum);
+    return;
+  }
+  
+  regionMapCheckpointed[deviceNum] = true;
+  for(uint i=0;i<MAXREGIONCOUNT;++i) {
+    if (TestRegionBit(cp->erasedBits, i/ERASEDMAP_CP_REGIONS)) {
+      SetRegionBit(erasedMap[deviceNum], i);
+    } else if (IsRegionStaleInCheckpoint(deviceNum, i)) {
+      SetRegionBit(staleMap[deviceNum], i);
+      ++staleRegionCount[deviceNum];
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Mark a 64kB region as not erased. It must be called before the
+// region is programmed. The caller must hold the Device Lock
+//
+// Input: deviceNum - Device Number
+//        address   - Any address in the region
+//
+static void ClearRegionErased(const uint deviceNum, const uint32_t address) {
+  const uint index = GetRegionIndex(address);
+  if (!TestRegionBit(erasedMap[deviceNum], index)) return;
+  ClearRegionBit(erasedMap[deviceNum], index);
+  
+  //The checkpoint in flash must not report this region as erased
+  if (regionMapCheckpointed[deviceNum] && TestRegionBit(checkpoint[deviceNum].erasedBits, index/ERASEDMAP_CP_REGIONS)) {
+    if (staleRegionCount[deviceNum]) {
+      //Stale regions must be kept in the checkpoint
+      tsSaveRegionMap(deviceNum);
+    } else {
+      tsEraseSecurityRegisterDevice(deviceNum, REGIONMAP_REGNUM);
+      regionMapCheckpointed[deviceNum] = false;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Make sure a block can be written to a region. If the region is stale
+// in memory, it is erased. If it is stale in memory or in the checkpoint,
+// the checkpoint is rewritten with the region in liveRegions. The other
+// stale regions covered by the same bit of checkpoint are erased by
+// LazyEraseTask() later.
+// The caller must hold the Device Lock
+//
+// Input: deviceNum - Device Number
+//        address   - Address of the block
+//
+static void tsPrepareRegionForWrite(const uint deviceNum, const uint32_t address) {
+  const uint index = GetRegionIndex(address);
+  const bool staleInMemory = TestRegionBit(staleMap[deviceNum], index);
+  if (!staleInMemory && !IsRegionStaleInCheckpoint(deviceNum, index)) return;
+  
+  if (staleInMemory) tsEraseSector64k(deviceNum, address);
+  
+  //The region is going to be programmed. It is a live region now.
+  ClearRegionBit(erasedMap[deviceNum], index);
+  tsSaveRegionMap(deviceNum);
+}
+
+
 
 ////////////////////////////////////////////////////////////////////
 // Erase the content of all flash chips
@@ -532,7 +1105,8 @@ blockloc_t __no_inline_not_in_flash_func(GetBlockLoc)(uint unitNum, const uint b
 static void tsEraseContent() {
   const uint8_t msg[]= {0x60}; //chip erase comand
   
-  MUTEXLOCK();
+  DEVICELOCK(DEVICE0);
+  DEVICELOCK(DEVICE1);
   //Start erase flash chip #0
   WriteEnable(DEVICE0);
   enable_spi0(DEVICE0);
@@ -561,7 +1135,10 @@ static void tsEraseContent() {
       sleep_ms(10);
     }
   }
-  MUTEXUNLOCK();
+  SetAllRegionsErased(DEVICE0);
+  SetAllRegionsErased(DEVICE1);
+  DEVICEUNLOCK(DEVICE1);
+  DEVICEUNLOCK(DEVICE0);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -573,6 +1150,7 @@ static void tsEraseSector(const uint deviceNum, uint32_t address) {
   
   //Make sure it aligns at the begining of a sector 
   address = address & 0xfffff000; 
+  const uint32_t sectorAddress = address;
   
   msg[0] = 0x21; //Sector Erase with 4-Byte Address Command
   msg[4] = (uint8_t)(address);  address>>=8;
@@ -580,7 +1158,8 @@ static void tsEraseSector(const uint deviceNum, uint32_t address) {
   msg[2] = (uint8_t)(address);  address>>=8;
   msg[1] = (uint8_t)(address);
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
+  FlashStatsCountOp(FLASHOP_ERASE4K);
   WriteEnable(deviceNum);
   enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 5);
@@ -589,9 +1168,9 @@ static void tsEraseSector(const uint deviceNum, uint32_t address) {
   //Accoridng to datasheet, Sector Erase needs at least 50ms.
   //Actual Test: 55-60ms
   //Wait until the operation is completed.
-  sleep_ms(40); //At least 50ns delay is needed after erase/write command (CS deselect time)
-  WaitUntilBusyClear(deviceNum);
-  MUTEXUNLOCK();
+  //At least 50ns delay is needed after erase/write command (CS deselect time)
+  WaitUntilBusyClearWithSuspend(deviceNum, sectorAddress, SECTORSIZE, 40*1000);
+  DEVICEUNLOCK(deviceNum);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -603,6 +1182,7 @@ void tsEraseSector64k(const uint deviceNum, uint32_t address) {
   
   //Make sure it aligns at the begining of a sector 
   address = address & 0xffff0000; 
+  const uint32_t sectorAddress = address;
   
   msg[0] = 0xdc; //64kB Sector Erase with 4-Byte Address Command
   msg[4] = (uint8_t)(address);  address>>=8;
@@ -610,7 +1190,12 @@ void tsEraseSector64k(const uint deviceNum, uint32_t address) {
   msg[2] = (uint8_t)(address);  address>>=8;
   msg[1] = (uint8_t)(address);
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
+#if SECTORCACHE
+  //Cached sectors in this region are going to be erased. Discard them
+  DiscardSectorCacheRange(deviceNum, sectorAddress, 0x10000);
+#endif
+  FlashStatsCountOp(FLASHOP_ERASE64K);
   WriteEnable(deviceNum);
   enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 5);
@@ -619,9 +1204,10 @@ void tsEraseSector64k(const uint deviceNum, uint32_t address) {
   //Accoridng to datasheet, Sector Erase needs at least 150ms.
   //Actual Test: 220-250ms
   //Wait until the operation is completed.
-  sleep_ms(140); //At least 50ns delay is needed after erase/write command (CS deselect time)
-  WaitUntilBusyClear(deviceNum);
-  MUTEXUNLOCK();
+  //At least 50ns delay is needed after erase/write command (CS deselect time)
+  WaitUntilBusyClearWithSuspend(deviceNum, sectorAddress, 0x10000, 140*1000);
+  SetRegionErased(deviceNum, sectorAddress);
+  DEVICEUNLOCK(deviceNum);
 }
   
 
@@ -629,10 +1215,22 @@ void tsEraseSector64k(const uint deviceNum, uint32_t address) {
 // Erase everything on chip
 //
 void tsEraseEverything() {
+#if SECTORCACHE
+  DEVICELOCK(DEVICE0);
+  DiscardSectorCacheRange(DEVICE0, 0, 0xffffffff);
+  DEVICEUNLOCK(DEVICE0);
+  DEVICELOCK(DEVICE1);
+  DiscardSectorCacheRange(DEVICE1, 0, 0xffffffff);
+  DEVICEUNLOCK(DEVICE1);
+#endif
   tsEraseSecurityRegister(1);
   tsEraseSecurityRegister(2);
   tsEraseSecurityRegister(3);
   tsEraseContent();
+  
+  //Everything is erased
+  tsSaveRegionMap(DEVICE0);
+  tsSaveRegionMap(DEVICE1);
 }
 
   
@@ -657,25 +1255,26 @@ static uint32_t __no_inline_not_in_flash_func(tsReadOneBlock)(const blockloc_t b
   msg[1] = (uint8_t)(blockAddress);
   msg[5] = 0;   //Dummy 8-bit
   
-  MUTEXLOCK();
+  DEVICELOCK(blockLoc.deviceNum);
   enable_spi0(blockLoc.deviceNum);
   spi_write_blocking(spi0, msg, 6);
   uint32_t crc=ReadFromFlashByDMA(dest,BLOCKSIZE);
   disable_spi0();
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(blockLoc.deviceNum);
   
   return crc;
 }
 
 
 ////////////////////////////////////////////////////////////////////
-// Read a sector (4kB) to sectorBuffer
+// Read a sector (4kB) to dest
 //
-// Input: Device Number, Sector Address
+// Input: Device Number, Sector Address,
+//        Pointer to destination (4kB buffer)
 //
 // Output: CRC32 of the sector data
 //
-static uint32_t __no_inline_not_in_flash_func(tsReadSector)(const uint deviceNum,uint32_t sectorAddress){
+static uint32_t __no_inline_not_in_flash_func(tsReadSectorTo)(const uint deviceNum,uint32_t sectorAddress,uint8_t* dest){
   uint8_t msg[6];
   
   //Make sure it aligns at the begining of a sector
@@ -688,16 +1287,28 @@ static uint32_t __no_inline_not_in_flash_func(tsReadSector)(const uint deviceNum
   msg[1] = (uint8_t)(sectorAddress);
   msg[5] = 0;   //Dummy 8-bit
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
   enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 6);
-  uint32_t crc=ReadFromFlashByDMA(sectorBuffer,SECTORSIZE);
+  uint32_t crc=ReadFromFlashByDMA(dest,SECTORSIZE);
   disable_spi0();
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(deviceNum);
   
   return crc;
 }
 
+////////////////////////////////////////////////////////////////////
+// Read a sector (4kB) to sectorBuffer of the device
+// The caller must hold the Device Lock
+//
+// Input: Device Number, Sector Address
+//
+// Output: CRC32 of the sector data
+//
+static inline uint32_t tsReadSector(const uint deviceNum,uint32_t sectorAddress){
+  return tsReadSectorTo(deviceNum,sectorAddress,sectorBuffer[deviceNum]);
+}
+
 ////////////////////////////////////////////////////////////////////
 // Program one page (256-bytes) to Flash
 //
@@ -706,6 +1317,7 @@ static uint32_t __no_inline_not_in_flash_func(tsReadSector)(const uint deviceNum
 static void __no_inline_not_in_flash_func(tsProgramOnePage)(const uint deviceNum,uint32_t pageAddress,const uint8_t* src) {
   //The lowest 8 bits of pageAddress should be 0.
   assert( (pageAddress & 0xff) == 0);
+  const uint32_t startAddress = pageAddress;
 
   uint8_t msg[5];
   msg[0] = 0x12; //Page Program with 4-Byte Address
@@ -714,7 +1326,9 @@ static void __no_inline_not_in_flash_func(tsProgramOnePage)(const uint deviceNum
   msg[2] = (uint8_t)(pageAddress);  pageAddress>>=8;
   msg[1] = (uint8_t)(pageAddress);
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
+  ClearRegionErased(deviceNum, startAddress);
+  FlashStatsCountOp(FLASHOP_PAGEPROGRAM);
   WriteEnable(deviceNum);
   enable_spi0(deviceNum);
   spi_write_blocking(spi0, msg, 5);
@@ -723,9 +1337,11 @@ static void __no_inline_not_in_flash_func(tsProgramOnePage)(const uint deviceNum
   
   //wait until programming finishes
   //It takes about 0.7-3.5ms
-  busy_wait_us_32(300); //At least 50ns delay is needed after erase/write command (CS deselect time)
-  WaitUntilBusyClear(deviceNum);
-  MUTEXUNLOCK();
+  //At least 50ns delay is needed after erase/write command (CS deselect time)
+  //The other pages in the same sector may be programmed next. So, the whole sector
+  //cannot be read during suspend.
+  WaitUntilBusyClearWithSuspend(deviceNum, startAddress & 0xfffff000, SECTORSIZE, 300);
+  DEVICEUNLOCK(deviceNum);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -793,6 +1409,34 @@ static bool __no_inline_not_in_flash_func(IsEmptyPage)(const uint8_t* srcBuffer)
 }
 
 
+////////////////////////////////////////////////////////////////////
+// Check if a 4kB Sector in Flash is erased by reading it
+// The caller must hold the Device Lock
+//
+// Input: Device Number, Sector Address
+//
+// Output: bool 
+//
+// Note:
+// CRC32 Checksum of 4kB sector filled with 0xff = 0xf154670a
+// 
+static bool tsIsSectorErased(const uint deviceNum, const uint32_t address) {
+  //Read one 4kB Sector
+  uint32_t crc32=tsReadSector(deviceNum, address);
+  if (crc32 != 0xf154670a) {
+    //Checksum not match. It is not erased.
+    return false;
+  }
+
+  //Check every byte in sectorBuffer
+  const uint32_t* srcData = (const uint32_t*)sectorBuffer[deviceNum];
+  for(uint j=SECTORSIZE/4;j!=0;--j) {   
+    if (*srcData != 0xffffffff) return false;
+    ++srcData;
+  }
+  return true;
+}
+
 ////////////////////////////////////////////////////////////////////
 // Check if a 64kB Sector in Flash is erased
 //
@@ -806,91 +1450,187 @@ static bool __no_inline_not_in_flash_func(IsEmptyPage)(const uint8_t* srcBuffer)
 bool tsIsSector64kErased(const uint deviceNum, uint32_t address) {
   assert( (address&0xffff)==0);
   bool retValue = false; //Assume false (Not erased)
+  const uint32_t regionAddress = address;
   
   //64kB = 16 4kB-Sector
   //Check each sector one by one
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
+#if SECTORCACHE
+  //A dirty sector in cache means the region is not erased
+  if (IsSectorCachedInRange(deviceNum, address, 0x10000)) {
+    retValue = false;
+    goto exit;
+  }
+#endif
+  //No need to read the region if it is known to be erased
+  if (IsRegionErased(deviceNum, regionAddress)) {
+    retValue = true;
+    goto exit;
+  }
+  
   for(uint i=0;i<16;++i) {
-    //Read one 4kB Sector
-    uint32_t crc32=tsReadSector(deviceNum, address);
-    if (crc32 != 0xf154670a) {
-      //Checksum not match. It is not erased.
+    if (!tsIsSectorErased(deviceNum, address)) {
       retValue = false;
       goto exit;
     }
     address += SECTORSIZE;  //Next Sector Address
-
-    //Check every byte in sectorBuffer
-    const uint32_t* srcData = (const uint32_t*)sectorBuffer;
-    for(uint j=SECTORSIZE/4;j!=0;--j) {   
-      if (*srcData != 0xffffffff) {
-        retValue = false;
-        goto exit;
-      }
-      ++srcData;
-    }
   }
   retValue = true;
+  SetRegionErased(deviceNum, regionAddress);
   
 exit:  
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(deviceNum);
   return retValue;
 }
 
+////////////////////////////////////////////////////////////////////
+// Check the guard region of each unit against the checkpoint
+//
+// The guard region is the first 64kB region of a unit. It holds block
+// 0-15 i.e. boot blocks, volume directory and the start of volume bitmap.
+// Lazy Unit Erase erases it at once. So, a firmware without the checkpoint
+// (e.g. after a downgrade) sees an unformatted unit instead of the previous
+// volume. It must program the guard region to use the unit.
+//
+// If the checkpoint reports the guard region as erased but it is
+// programmed, the checkpoint was not updated by the last writer. All
+// claims of the unit are dropped. If any region of the unit is stale but
+// the guard region is programmed, the stale claims are dropped. Dropping
+// is safe. The regions are just not erased. If the unit was formatted by
+// this firmware after Lazy Unit Erase, the previous data may be found in
+// free blocks until the blocks are written.
+//
+// Input: deviceNum - Device Number
+//
+static void tsCheckGuardRegions(const uint deviceNum) {
+  const uint32_t flashSize = (deviceNum==DEVICE0)?flashSize0:flashSize1;
+  if (!regionMapCheckpointed[deviceNum]) return;
+  
+  const uint32_t unitSize = SIZEPERUNIT_MB*1024*1024;
+  const uint regionsPerUnit = unitSize>>16;
+  bool dropped = false;
+  
+  DEVICELOCK(deviceNum);
+  for(uint32_t unitAddress=0;unitAddress<flashSize*1024*1024;unitAddress+=unitSize) {
+    const uint first = GetRegionIndex(unitAddress);
+    const bool guardErased = TestRegionBit(erasedMap[deviceNum], first);
+    bool stale = false;
+    for(uint i=first;i<first+regionsPerUnit;++i) {
+      if (TestRegionBit(staleMap[deviceNum], i)) stale = true;
+    }
+    if (!guardErased && !stale) continue;
+    
+    //Read the guard region. tsIsSector64kErased() would trust the map.
+    bool programmed = false;
+    for(uint32_t address=unitAddress;address<unitAddress+0x10000;address+=SECTORSIZE) {
+      if (!tsIsSectorErased(deviceNum, address)) {
+        programmed = true;
+        break;
+      }
+    }
+    if (!programmed) continue;
+    
+    for(uint i=first;i<first+regionsPerUnit;++i) {
+      if (guardErased) ClearRegionBit(erasedMap[deviceNum], i);
+      if (TestRegionBit(staleMap[deviceNum], i)) {
+        ClearRegionBit(staleMap[deviceNum], i);
+        --staleRegionCount[deviceNum];
+      }
+    }
+    dropped = true;
+  }
+  
+  if (dropped) tsSaveRegionMap(deviceNum);
+  DEVICEUNLOCK(deviceNum);
+}
+
 
 ////////////////////////////////////////////////////////////////////
-// Write one ProDOS block with erase operation
+// Erase a 4kB sector and program it with new data
 //
-// Input: blockLoc - Location of the block in flash
-//        srcBuffer    - Data to be written (512 Bytes)
+// Input: deviceNum     - Flash Chip device number
+//        sectorAddress - Address of the sector
+//        srcData       - Data to be written (4kB, 32-bit aligned)
 //
 // Output: true if write operation is successful
 //
-static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithErase)(const blockloc_t blockLoc, const uint8_t* srcBuffer) {
-  //Mutex Lock is needed because Memory DMA is not thread-safe.
-  MUTEXLOCK();  
-  
-  //
-  //Step 1: Read the entire 4kB sector to sectorBuffer
-  tsReadSector(blockLoc.deviceNum, blockLoc.blockAddress); 
+// Note: sectorBuffer of the device is overwritten during verification.
+// srcData may point to it.
+//
+static bool __no_inline_not_in_flash_func(tsEraseProgramSector)(const uint deviceNum, uint32_t sectorAddress, const uint8_t* srcData) {
+  DEVICELOCK(deviceNum);  
   
-  //
-  //Step 2: Copy data to be written to sectorBuffer in Background by DMA
-  const uint32_t pageOffset = blockLoc.blockAddress & 0xfff;
-  CopyMemoryAlignedBG(sectorBuffer+pageOffset, srcBuffer, BLOCKSIZE); 
+  //Align to the begining of the sector
+  sectorAddress &= 0xfffff000;
   
   //
-  //Step 3: Erase entire sector in flash while data is being copied by DMA
-  tsEraseSector(blockLoc.deviceNum, blockLoc.blockAddress);
-  DMAWaitFinish();    //make sure step 2 is complete    
+  //Step 1: Calculate the CRC32 of srcData by DMA
+  //Bus Lock is needed because Memory DMA is not thread-safe.
+  //It is not calculated in background because the CRC sniffer
+  //may be used by the other flash chip during the erase.
+  BUSLOCK();
+  SetCRC32Seed(GetMemoryDMAChannel(),DEFAULT_CRC32_SEED);
+  CopyMemoryAlignedBG((uint8_t*)srcData,srcData,SECTORSIZE);
+  DMAWaitFinish();
+  const uint32_t crc1=GetCRC();
+  BUSUNLOCK();
   
   //
-  //Step 4: Calculate the CRC32 of sectorBuffer in Background by DMA
-  SetCRC32Seed(GetMemoryDMAChannel(),DEFAULT_CRC32_SEED);
-  CopyMemoryAlignedBG(sectorBuffer,sectorBuffer,SECTORSIZE);
+  //Step 2: Erase entire sector in flash
+  tsEraseSector(deviceNum, sectorAddress);
   
   //
-  //Step 5: Program page by page
-  uint32_t currentAddress = blockLoc.blockAddress & 0xfffff000; //Align to the begining of the sector
-  uint8_t* srcData = sectorBuffer;
+  //Step 3: Program page by page
+  uint32_t currentAddress = sectorAddress;
+  const uint8_t* pageData = srcData;
   for(uint i=PAGEPERSECTOR;i!=0;--i) {      
-    if (!IsEmptyPage(srcData)) {
-      tsProgramOnePage(blockLoc.deviceNum, currentAddress, srcData);
+    if (!IsEmptyPage(pageData)) {
+      tsProgramOnePage(deviceNum, currentAddress, pageData);
     }
     currentAddress += PAGESIZE;
-    srcData += PAGESIZE;
+    pageData += PAGESIZE;
   }
   
   //
-  //Step 6: Verify the written data
-  DMAWaitFinish();  //make sure step 4 is finished
-  uint32_t crc1=GetCRC();
-  uint32_t crc2=tsReadSector(blockLoc.deviceNum, blockLoc.blockAddress); 
-  MUTEXUNLOCK();
+  //Step 4: Verify the written data
+  uint32_t crc2=tsReadSector(deviceNum, sectorAddress); 
+  DEVICEUNLOCK(deviceNum);
   
   return (crc1==crc2);
 }
 
+////////////////////////////////////////////////////////////////////
+// Write one ProDOS block with erase operation
+//
+// Input: blockLoc - Location of the block in flash
+//        srcBuffer    - Data to be written (512 Bytes)
+//
+// Output: true if write operation is successful
+//
+static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithErase)(const blockloc_t blockLoc, const uint8_t* srcBuffer) {
+  DEVICELOCK(blockLoc.deviceNum);  
+  uint8_t* buffer = sectorBuffer[blockLoc.deviceNum];
+  
+  //
+  //Step 1: Read the entire 4kB sector to sectorBuffer
+  tsReadSector(blockLoc.deviceNum, blockLoc.blockAddress); 
+  
+  //
+  //Step 2: Copy data to be written to sectorBuffer
+  //Bus Lock is needed because Memory DMA is not thread-safe.
+  const uint32_t pageOffset = blockLoc.blockAddress & 0xfff;
+  BUSLOCK();
+  CopyMemoryAligned(buffer+pageOffset, srcBuffer, BLOCKSIZE); 
+  BUSUNLOCK();
+  
+  //
+  //Step 3: Erase, program and verify the sector
+  bool success = tsEraseProgramSector(blockLoc.deviceNum, blockLoc.blockAddress, buffer);
+  DEVICEUNLOCK(blockLoc.deviceNum);
+  
+  return success;
+}
+
 
 
 ////////////////////////////////////////////////////////////////////
@@ -902,13 +1642,17 @@ static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithErase)(const blockl
 // Output: true if write operation is successful
 //
 static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithoutErase)(const blockloc_t blockLoc, const uint8_t* srcBuffer) {
-  //Mutex Lock is needed because Memory DMA is not thread-safe.
-  MUTEXLOCK();  
+  DEVICELOCK(blockLoc.deviceNum);  
   
   //
-  //Step 1: Calculate the CRC32 of the data in srcBuffer in Background by DMA
+  //Step 1: Calculate the CRC32 of the data in srcBuffer by DMA
+  //Bus Lock is needed because Memory DMA is not thread-safe.
+  BUSLOCK();
   SetCRC32Seed(GetMemoryDMAChannel(),DEFAULT_CRC32_SEED);
   CopyMemoryAlignedBG((uint8_t*)srcBuffer,srcBuffer,BLOCKSIZE);
+  DMAWaitFinish();
+  const uint32_t crc1=GetCRC();
+  BUSUNLOCK();
   
   //
   //Step 2: Program the data to flash 
@@ -919,17 +1663,369 @@ static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithoutErase)(const blo
     tsProgramOnePage(blockLoc.deviceNum, blockLoc.blockAddress+PAGESIZE, srcBuffer+PAGESIZE);  
   }
   
-  //Step 3: Read the result of step 1
-  DMAWaitFinish();
-  const uint32_t crc1=GetCRC();
-  
-  //Step 4: Verify the data
-  const uint32_t crc2=tsReadOneBlock(blockLoc, blockBuffer);
-  MUTEXUNLOCK();
+  //Step 3: Verify the data
+  const uint32_t crc2=tsReadOneBlock(blockLoc, blockBuffer[blockLoc.deviceNum]);
+  DEVICEUNLOCK(blockLoc.deviceNum);
   
   return (crc1==crc2);
 }
 
+
+//******************************************************************
+//
+//      Write-back Sector Cache
+//
+// Read the note at SECTORCACHE definition
+// A valid entry belongs to the flash chip in deviceNum. The caller must
+// hold the Device Lock of that chip. A free entry is claimed under Bus Lock.
+//
+//******************************************************************
+#if SECTORCACHE
+
+////////////////////////////////////////////////////////////////////
+// Find the cache entry of the sector which contains the block
+//
+// Input: blockLoc - Location of the block in flash
+//
+// Output: Pointer to cache entry. NULL if the sector is not cached
+//
+static sectorcache_t* __no_inline_not_in_flash_func(FindSectorCacheEntry)(const blockloc_t blockLoc) {
+  const uint32_t sectorAddress = blockLoc.blockAddress & 0xfffff000;
+  
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    sectorcache_t* entry = &sectorCache[i];
+    if (entry->valid && entry->deviceNum==blockLoc.deviceNum && entry->sectorAddress==sectorAddress) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+// Get the data buffer of a cache entry
+//
+static inline uint8_t* GetSectorCacheData(const sectorcache_t* entry) {
+  return sectorCacheData[entry-sectorCache];
+}
+
+////////////////////////////////////////////////////////////////////
+// Write a dirty cache entry back to flash
+//
+// Input: entry - Pointer to cache entry
+//
+// Output: true if write operation is successful
+//
+// If the operation fails, the entry is kept dirty so that it is
+// written back again later.
+//
+static bool FlushSectorCacheEntry(sectorcache_t* entry) {
+  if (!entry->valid) return true;
+  
+  bool success = tsEraseProgramSector(entry->deviceNum, entry->sectorAddress, GetSectorCacheData(entry));
+  if (success) {
+    entry->valid = false;
+  } else {
+    ERROR_PRINTF("Sector Cache: write back failed. dev=%d addr=%08X\n",entry->deviceNum,entry->sectorAddress);
+    entry->dirtySince = get_absolute_time();  //Retry after SECTORCACHE_DIRTY_MS
+  }
+  return success;
+}
+
+////////////////////////////////////////////////////////////////////
+// Discard cached sectors within a range of flash without writing
+// them back. It is called when the range is going to be erased.
+//
+// Input: deviceNum - Flash Chip device number
+//        address   - Start address of the range
+//        len       - Length of the range in bytes
+//
+static void DiscardSectorCacheRange(const uint deviceNum, const uint32_t address, const uint32_t len) {
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    sectorcache_t* entry = &sectorCache[i];
+    if (entry->valid && entry->deviceNum==deviceNum && 
+        entry->sectorAddress>=address && entry->sectorAddress-address<len) {
+      entry->valid = false;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if any sector within a range of flash is cached
+//
+// Input: deviceNum - Flash Chip device number
+//        address   - Start address of the range
+//        len       - Length of the range in bytes
+//
+static bool IsSectorCachedInRange(const uint deviceNum, const uint32_t address, const uint32_t len) {
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    const sectorcache_t* entry = &sectorCache[i];
+    if (entry->valid && entry->deviceNum==deviceNum && 
+        entry->sectorAddress>=address && entry->sectorAddress-address<len) {
+      return true;
+    }
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Claim a free cache entry for the sector which contains the block
+// Both chips may look for a free entry at the same time. So, Bus Lock is used.
+//
+// Input: blockLoc - Location of the block in flash
+//
+// Output: Pointer to cache entry. NULL if there is no free entry
+//
+static sectorcache_t* ClaimSectorCacheEntry(const blockloc_t blockLoc) {
+  sectorcache_t* entry = NULL;
+  
+  BUSLOCK();
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    if (!sectorCache[i].valid) {
+      entry = &sectorCache[i];
+      entry->deviceNum = blockLoc.deviceNum;
+      entry->sectorAddress = blockLoc.blockAddress & 0xfffff000;
+      entry->valid = true;
+      break;
+    }
+  }
+  BUSUNLOCK();
+  return entry;
+}
+
+////////////////////////////////////////////////////////////////////
+// Write one ProDOS block into the sector cache
+// It is called when an erase operation is needed.
+//
+// Input: blockLoc  - Location of the block in flash
+//        srcBuffer - Data to be written (512 Bytes)
+//
+// Output: true if write operation is successful
+//
+static bool __no_inline_not_in_flash_func(CacheWriteOneBlock)(const blockloc_t blockLoc, const uint8_t* srcBuffer) {
+  //
+  //Step 1: Claim a free entry
+  sectorcache_t* entry = ClaimSectorCacheEntry(blockLoc);
+  
+  //
+  //Step 2: No free entry. Evict the least recently used entry of this chip.
+  //Entries of the other chip cannot be evicted without its Device Lock.
+  //If no entry can be evicted, bypass the cache and write the block directly
+  if (entry==NULL) {
+    sectorcache_t* victim = NULL;
+    for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+      if (!sectorCache[i].valid || sectorCache[i].deviceNum!=blockLoc.deviceNum) continue;
+      if (victim==NULL || sectorCache[i].lastUsed < victim->lastUsed) victim = &sectorCache[i];
+    }
+    if (victim==NULL || !FlushSectorCacheEntry(victim)) {
+      return tsWriteOneBlockWithErase(blockLoc, srcBuffer);
+    }
+    
+    //The other chip may take the evicted entry
+    entry = ClaimSectorCacheEntry(blockLoc);
+    if (entry==NULL) return tsWriteOneBlockWithErase(blockLoc, srcBuffer);
+  }
+  
+  //
+  //Step 3: Load the sector into the entry and merge the block
+  uint8_t* data = GetSectorCacheData(entry);
+  tsReadSectorTo(blockLoc.deviceNum, blockLoc.blockAddress, data);
+  BUSLOCK();
+  CopyMemoryAligned(data+(blockLoc.blockAddress & 0xfff), srcBuffer, BLOCKSIZE);
+  BUSUNLOCK();
+  
+  entry->lastUsed = ++sectorCacheUseCounter;
+  entry->dirtySince = get_absolute_time();
+  
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Write a dirty cache entry back to flash with Device Lock
+//
+// Input: entry - Pointer to cache entry
+//        force - Write back even if the dirty timeout is not reached
+//
+static void tsFlushSectorCacheEntry(sectorcache_t* entry, const bool force) {
+  if (!entry->valid) return;
+  
+  const uint deviceNum = entry->deviceNum;
+  DEVICELOCK(deviceNum);
+  //The entry may be changed before we get the lock
+  if (entry->valid && entry->deviceNum==deviceNum) {
+    if (force || absolute_time_diff_us(entry->dirtySince, get_absolute_time()) >= SECTORCACHE_DIRTY_MS*1000ll) {
+      FlushSectorCacheEntry(entry);
+    }
+  }
+  DEVICEUNLOCK(deviceNum);
+}
+
+////////////////////////////////////////////////////////////////////
+// Write all dirty sectors back to flash
+//
+void tsFlushSectorCache() {
+  sectorCacheFlushRequested = false;
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    tsFlushSectorCacheEntry(&sectorCache[i], true);
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Request a write back of all dirty sectors.
+// It is safe to call this function from an interrupt handler.
+// The actual write back is done by FlushSectorCacheIfIdle()
+//
+void RequestFlushSectorCache() {
+  sectorCacheFlushRequested = true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Write dirty sectors back to flash if
+// 1) Flash is idle for SECTORCACHE_IDLE_MS or
+// 2) The sector has been dirty for SECTORCACHE_DIRTY_MS or
+// 3) RequestFlushSectorCache() has been called
+// If all entries are still dirty, the least recently used entry is
+// written back so that the next write does not need to evict it.
+//
+// This function should be called periodically by core 0.
+//
+void FlushSectorCacheIfIdle() {
+  //Quick check without mutex
+  uint dirtyCount = 0;
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    if (sectorCache[i].valid) ++dirtyCount;
+  }
+  if (dirtyCount==0) {
+    sectorCacheFlushRequested = false;
+    return;
+  }
+  
+  const bool idle = absolute_time_diff_us(lastFlashWriteTime, get_absolute_time()) >= SECTORCACHE_IDLE_MS*1000ll;
+  const bool flushAll = idle || sectorCacheFlushRequested;
+  sectorCacheFlushRequested = false;
+  
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    tsFlushSectorCacheEntry(&sectorCache[i], flushAll);
+  }
+  if (flushAll || dirtyCount<SECTORCACHE_COUNT) return;
+  
+  //Background LRU eviction. The entry is checked again with Device Lock.
+  sectorcache_t* victim = NULL;
+  for(uint i=0;i<SECTORCACHE_COUNT;++i) {
+    if (!sectorCache[i].valid) return;   //Freed by dirty timeout
+    if (victim==NULL || sectorCache[i].lastUsed < victim->lastUsed) victim = &sectorCache[i];
+  }
+  tsFlushSectorCacheEntry(victim, true);
+}
+
+#else
+void tsFlushSectorCache() {}
+void RequestFlushSectorCache() {}
+void FlushSectorCacheIfIdle() {}
+#endif
+
+
+#if ERASESUSPEND
+////////////////////////////////////////////////////////////////////
+// Serve the pending read request of a flash chip by suspending the
+// erase or program operation in progress.
+// The caller must hold the Device Lock.
+//
+// Input: deviceNum - Device Number
+//        address   - Start address of the region being erased/programmed
+//        len       - Length of the region
+//
+static void __no_inline_not_in_flash_func(ServeReadRequest)(const uint deviceNum, const uint32_t address, const uint32_t len) {
+  readrequest_t* req = &readRequest[deviceNum];
+  if (!time_reached(nextSuspendTime[deviceNum])) return;
+  __dmb();
+  const blockloc_t blockLoc = req->blockLoc;
+
+#if SECTORCACHE
+  //If the sector is cached, copy the block from the cache. No suspend is needed.
+  const sectorcache_t* entry = FindSectorCacheEntry(blockLoc);
+  if (entry) {
+    BUSLOCK();
+    CopyMemoryAligned(req->dest,GetSectorCacheData(entry)+(blockLoc.blockAddress & 0xfff),BLOCKSIZE);
+    BUSUNLOCK();
+    __dmb();
+    req->state = REQ_DONE;
+    return;
+  }
+#endif
+
+  //A block in stale region is read as an erased block. No suspend is needed.
+  if (IsRegionStale(deviceNum, blockLoc.blockAddress)) {
+    memset(req->dest,0xff,BLOCKSIZE);
+    __dmb();
+    req->state = REQ_DONE;
+    return;
+  }
+
+  //The region being erased or programmed cannot be read during suspend
+  if (blockLoc.blockAddress < address+len && blockLoc.blockAddress+BLOCKSIZE > address) return;
+
+  SuspendOperation(deviceNum);
+  FlashStatsCountOp(FLASHOP_SUSPEND);
+  
+  //It takes up to 20us to suspend. If the operation has just completed,
+  //the suspend command is ignored and SUS bit is not set.
+  WaitUntilBusyClear(deviceNum);
+  const bool suspended = ReadStatus2(deviceNum) & FLASH_SUSFLAG;
+  
+  tsReadOneBlock(blockLoc, req->dest);
+  
+  if (suspended) ResumeOperation(deviceNum);
+  nextSuspendTime[deviceNum] = make_timeout_time_us(SUSPEND_INTERVAL_US);
+  
+  __dmb();
+  req->state = REQ_DONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// Acquire the Device Lock for reading a block. If the Device Lock is
+// held by the other core, post a read request so that the block can
+// be read by the owner during an erase or program operation.
+//
+// Input: blockLoc - Location of the block in flash
+//        dest     - Destination Buffer (512 Bytes, 4-byte aligned)
+//
+// Output: true  - The block has been read into dest. Device Lock is not held.
+//         false - Device Lock is acquired. The caller should read the block.
+//
+static bool __no_inline_not_in_flash_func(tsLockOrRequestRead)(const blockloc_t blockLoc, uint8_t* dest) {
+  const uint deviceNum = blockLoc.deviceNum;
+  if (DEVICETRYLOCK(deviceNum)) return false;
+  
+  //Only the other core can hold the Device Lock. So, there is at most one
+  //request per flash chip.
+  readrequest_t* req = &readRequest[deviceNum];
+  req->blockLoc = blockLoc;
+  req->dest = dest;
+  __dmb();
+  req->state = REQ_PENDING;
+  
+  while(true) {
+    if (req->state==REQ_DONE) {
+      __dmb();
+      req->state = REQ_NONE;
+      return true;
+    }
+    if (DEVICETRYLOCK(deviceNum)) {
+      //The request may be served just before the Device Lock is released.
+      //Otherwise, withdraw it. The owner only accesses the request while
+      //holding the Device Lock.
+      const bool done = (req->state==REQ_DONE);
+      __dmb();
+      req->state = REQ_NONE;
+      if (done) DEVICEUNLOCK(deviceNum);
+      return done;
+    }
+    busy_wait_us_32(1);
+  }
+}
+#endif
+
+
 ////////////////////////////////////////////////////////////////////
 // Write one ProDOS block from srcBuffer to flash
 //
@@ -939,20 +2035,40 @@ static bool __no_inline_not_in_flash_func(tsWriteOneBlockWithoutErase)(const blo
 // Output: true if write operation is successful
 //
 static bool __no_inline_not_in_flash_func(WriteOneBlock)(const blockloc_t blockLoc, const uint8_t* srcBuffer) {
+#if SECTORCACHE
+    lastFlashWriteTime = get_absolute_time();
+    
+    //
+    //Step 0: If the sector is cached, merge the block into the cache entry.
+    sectorcache_t* entry = FindSectorCacheEntry(blockLoc);
+    if (entry) {
+      BUSLOCK();
+      CopyMemoryAligned(GetSectorCacheData(entry)+(blockLoc.blockAddress & 0xfff), srcBuffer, BLOCKSIZE);
+      BUSUNLOCK();
+      entry->lastUsed = ++sectorCacheUseCounter;
+      return true;
+    }
+#endif
+    
     //
     //Step 1: Read the block from Flash to blockBuffer;
-    tsReadOneBlock(blockLoc, blockBuffer);
+    uint8_t* flashData = blockBuffer[blockLoc.deviceNum];
+    tsReadOneBlock(blockLoc, flashData);
     
     //
     //Step 2: Is the data in flash identical to the data to be written?
-    if (VerifyOneBlock(srcBuffer, blockBuffer)) { 
+    if (VerifyOneBlock(srcBuffer, flashData)) { 
       return true;
     }
     
     //
     //Step 3: Dispatch to tsWriteOneBlockWithErase or tsWriteOneBlockWithoutErase
-    if (IsEraseNeeded(srcBuffer, blockBuffer)) {  
+    if (IsEraseNeeded(srcBuffer, flashData)) {  
+#if SECTORCACHE
+      return CacheWriteOneBlock(blockLoc,srcBuffer);
+#else
       return tsWriteOneBlockWithErase(blockLoc,srcBuffer);
+#endif
     } else {
       return tsWriteOneBlockWithoutErase(blockLoc,srcBuffer);   
     }     
@@ -971,11 +2087,11 @@ uint32_t tsReadJEDECID(const uint deviceNum) {
   uint8_t txbuffer[4]={0x9f}; 
   uint8_t rxbuffer[4];
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
   enable_spi0(deviceNum);
   spi_write_read_blocking(spi0, txbuffer,rxbuffer, 4);
   disable_spi0();
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(deviceNum);
 
   return (rxbuffer[1]<<16)|(rxbuffer[2]<<8)|rxbuffer[3];
 }
@@ -995,11 +2111,11 @@ uint64_t tsReadUniqueID(const uint deviceNum) {
   uint8_t __attribute__((aligned(8))) rxbuffer[16]={0,0,0x4b}; 
   //2-bytes padding so that the result is 64-bit aligned
   
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
   enable_spi0(deviceNum);
   spi_write_read_blocking(spi0,txbuffer+2,rxbuffer+2,14);
   disable_spi0();
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(deviceNum);
   
   uint64_t id = *(uint64_t*)(rxbuffer+8);
   
@@ -1249,6 +2365,12 @@ void InitFlash() {
   
   //Set SPI Speed to SPI_SPEED_FINAL
   spi_set_baudrate(spi0, SPI_SPEED_FINAL);
+  
+  //Load the checkpoint of Erased Region Map and Stale Region Map
+  tsLoadRegionMap(DEVICE0);
+  tsLoadRegionMap(DEVICE1);
+  tsCheckGuardRegions(DEVICE0);
+  tsCheckGuardRegions(DEVICE1);
 }
 
 //******************************************************************
@@ -1377,22 +2499,60 @@ static void __no_inline_not_in_flash_func(CopyBitInversion)(uint8_t* destBuffer,
 // Output: SP_NOERR, SP_IOERR
 //
 rwerror_t __no_inline_not_in_flash_func(tsReadBlockFlash_Public)(const uint unitNum, const uint blockNum, uint8_t* destBuffer) {
+  lastFlashAccessTime = time_us_32();
 #if BITINVERSION
   const blockloc_t blockLoc = GetBlockLoc(unitNum, blockNum);
-  
-  MUTEXLOCK();  
   uint8_t __attribute__((aligned(4))) tempReadBuffer[BLOCKSIZE];
-  tsReadOneBlock(blockLoc, tempReadBuffer);
+  
+#if ERASESUSPEND
+  //If the flash chip is busy, the block may be read by the owner of Device Lock
+  if (tsLockOrRequestRead(blockLoc, tempReadBuffer)) {
+    CopyBitInversion(destBuffer,tempReadBuffer,BLOCKSIZE);
+    return SP_NOERR;
+  }
+#else
+  DEVICELOCK(blockLoc.deviceNum);  
+#endif
+#if SECTORCACHE
+  //If the sector is cached, copy the block from the cache
+  const sectorcache_t* entry = FindSectorCacheEntry(blockLoc);
+  if (entry) {
+    CopyBitInversion(destBuffer,GetSectorCacheData(entry)+(blockLoc.blockAddress & 0xfff),BLOCKSIZE);
+    DEVICEUNLOCK(blockLoc.deviceNum);
+    return SP_NOERR;
+  }
+#endif
+  //A block in stale region is read as an erased block
+  if (IsRegionStale(blockLoc.deviceNum, blockLoc.blockAddress)) memset(tempReadBuffer,0xff,BLOCKSIZE);
+  else tsReadOneBlock(blockLoc, tempReadBuffer);
   CopyBitInversion(destBuffer,tempReadBuffer,BLOCKSIZE);
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(blockLoc.deviceNum);
   
   return SP_NOERR; 
 #else
   const blockloc_t blockLoc = GetBlockLoc(unitNum, blockNum);
 
-  MUTEXLOCK();  
-  tsReadOneBlock(blockLoc, destBuffer);
-  MUTEXUNLOCK();
+#if ERASESUSPEND
+  //If the flash chip is busy, the block may be read by the owner of Device Lock
+  if (tsLockOrRequestRead(blockLoc, destBuffer)) return SP_NOERR;
+#else
+  DEVICELOCK(blockLoc.deviceNum);  
+#endif
+#if SECTORCACHE
+  //If the sector is cached, copy the block from the cache
+  const sectorcache_t* entry = FindSectorCacheEntry(blockLoc);
+  if (entry) {
+    BUSLOCK();
+    CopyMemoryAligned(destBuffer,GetSectorCacheData(entry)+(blockLoc.blockAddress & 0xfff),BLOCKSIZE);
+    BUSUNLOCK();
+    DEVICEUNLOCK(blockLoc.deviceNum);
+    return SP_NOERR;
+  }
+#endif
+  //A block in stale region is read as an erased block
+  if (IsRegionStale(blockLoc.deviceNum, blockLoc.blockAddress)) memset(destBuffer,0xff,BLOCKSIZE);
+  else tsReadOneBlock(blockLoc, destBuffer);
+  DEVICEUNLOCK(blockLoc.deviceNum);
   
   return SP_NOERR;
 #endif
@@ -1410,22 +2570,25 @@ rwerror_t __no_inline_not_in_flash_func(tsReadBlockFlash_Public)(const uint unit
 // Output: SP_NOERR, SP_IOERR
 //
 rwerror_t __no_inline_not_in_flash_func(tsWriteBlockFlash_Public)(const uint unitNum, const uint blockNum, const uint8_t* srcBuffer){
+  lastFlashAccessTime = time_us_32();
 #if BITINVERSION  
   const blockloc_t blockLoc = GetBlockLoc(unitNum, blockNum);
   
-  MUTEXLOCK();   
+  DEVICELOCK(blockLoc.deviceNum);   
+  tsPrepareRegionForWrite(blockLoc.deviceNum, blockLoc.blockAddress);
   uint8_t __attribute__((aligned(4))) tempWriteBuffer[BLOCKSIZE];  
   CopyBitInversion(tempWriteBuffer,srcBuffer,BLOCKSIZE);
   bool success = WriteOneBlock(blockLoc, tempWriteBuffer);
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(blockLoc.deviceNum);
 
   return success? SP_NOERR : SP_IOERR;
 #else
   const blockloc_t blockLoc = GetBlockLoc(unitNum, blockNum);
  
-  MUTEXLOCK();  
+  DEVICELOCK(blockLoc.deviceNum);  
+  tsPrepareRegionForWrite(blockLoc.deviceNum, blockLoc.blockAddress);
   bool success = WriteOneBlock(blockLoc, srcBuffer);
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(blockLoc.deviceNum);
 
   return success? SP_NOERR : SP_IOERR;
 #endif  
@@ -1443,7 +2606,13 @@ rwerror_t __no_inline_not_in_flash_func(tsWriteBlockFlash_Public)(const uint uni
 //
 bool tsWriteOneBlockAlreadyErased_Public(const blockloc_t blockLoc, const uint8_t* srcBuffer){
   bool success;
-  MUTEXLOCK();
+  lastFlashAccessTime = time_us_32();
+  DEVICELOCK(blockLoc.deviceNum);
+  tsPrepareRegionForWrite(blockLoc.deviceNum, blockLoc.blockAddress);
+#if SECTORCACHE
+  //The caller has erased the region. Cached data of this sector is stale.
+  DiscardSectorCacheRange(blockLoc.deviceNum, blockLoc.blockAddress & 0xfffff000, SECTORSIZE);
+#endif
 #if BITINVERSION  
   uint8_t __attribute__((aligned(4))) tempWriteBuffer[BLOCKSIZE];  
   CopyBitInversion(tempWriteBuffer,srcBuffer,BLOCKSIZE);
@@ -1451,7 +2620,7 @@ bool tsWriteOneBlockAlreadyErased_Public(const blockloc_t blockLoc, const uint8_
 #else
   success = tsWriteOneBlockWithoutErase(blockLoc,srcBuffer);
 #endif  
-  MUTEXUNLOCK();
+  DEVICEUNLOCK(blockLoc.deviceNum);
   
   return success;
 }
@@ -1481,8 +2650,30 @@ void AbortEraseFlashDisk() {
 // Input: Unit Number
 //
 void tsEraseFlashDisk(const uint unitNum){
+  //All blocks of a unit are on the same flash chip
+  const uint deviceNum = GetBlockLoc(unitNum,0).deviceNum;
+  
+#if LAZYERASE
+  //Mark the regions of the unit as stale. They are erased by LazyEraseTask().
+  //Read the note at LAZYERASE definition
+  const uint32_t unitAddress = GetBlockLoc(unitNum,0).blockAddress;
+  const uint32_t unitSize = SIZEPERUNIT_MB*1024*1024;
+  
+  DEVICELOCK(deviceNum);
+#if SECTORCACHE
+  DiscardSectorCacheRange(deviceNum, unitAddress, unitSize);
+#endif
+  for(uint32_t address=unitAddress;address<unitAddress+unitSize;address+=0x10000) {
+    SetRegionStale(deviceNum, address);
+  }
+  
+  //Erase the guard region at once. Read the note at tsCheckGuardRegions()
+  if (IsRegionStale(deviceNum, unitAddress)) tsEraseSector64k(deviceNum, unitAddress);
+  tsSaveRegionMap(deviceNum);
+  DEVICEUNLOCK(deviceNum);
+#else
   abortEraseFlashDisk = false;
-  MUTEXLOCK();
+  DEVICELOCK(deviceNum);
 
   //Erase 64kB sector every 16 blocks and block number <8192
   for(uint blockNum=0;blockNum<8192;blockNum+=16) {
@@ -1495,7 +2686,85 @@ void tsEraseFlashDisk(const uint unitNum){
       tsEraseSector64k(blockLoc.deviceNum,blockLoc.blockAddress);
     }
   }
-  MUTEXUNLOCK();
+  
+  //Even if the process is aborted, the erased regions are recorded
+  tsSaveRegionMap(deviceNum);
+  DEVICEUNLOCK(deviceNum);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////
+// Erase one stale region in background
+// Read the note at LAZYERASE definition
+// This function should be called periodically by core 0.
+//
+void LazyEraseTask() {
+  if (staleRegionCount[DEVICE0]==0 && staleRegionCount[DEVICE1]==0) return;
+  
+  //Low priority. Wait until ProDOS blocks are not accessed for a while
+  if (time_us_32()-lastFlashAccessTime < LAZYERASE_IDLE_MS*1000) return;
+  
+  for(uint deviceNum=DEVICE0;deviceNum<=DEVICE1;++deviceNum) {
+    if (staleRegionCount[deviceNum]==0) continue;
+    
+    DEVICELOCK(deviceNum);
+    for(uint i=0;i<MAXREGIONCOUNT/32;++i) {
+      if (staleMap[deviceNum][i]==0) continue;
+      const uint index = i*32 + __builtin_ctz(staleMap[deviceNum][i]);
+      tsEraseSector64k(deviceNum, index<<16);
+      break;    //One region at a time
+    }
+    
+    //All stale regions are erased. Update the checkpoint.
+    if (staleRegionCount[deviceNum]==0) tsSaveRegionMap(deviceNum);
+    DEVICEUNLOCK(deviceNum);
+    return;
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Erase a 4kB sector whose 8 blocks are all free (TRIM)
+// Read the note in trim.c
+//
+// Input: unitNum    - Unit Number (1-N)
+//        sectorNum  - Sector Number of the unit (0-8191)
+//        abortCheck - Called with Device Lock held right before the
+//                     erase. Return true to cancel the erase.
+//
+// Output: trimresult_t
+//
+trimresult_t tsTrimSectorFlash_Public(const uint unitNum, const uint sectorNum, bool (*abortCheck)()) {
+  assert(sectorNum<8192);
+  trimresult_t result = TRIM_SKIPPED;
+  
+  //Block sectorNum is the first block of the sector
+  const blockloc_t blockLoc = GetBlockLoc(unitNum, sectorNum);
+  const uint deviceNum = blockLoc.deviceNum;
+  const uint32_t sectorAddress = blockLoc.blockAddress & 0xfffff000;
+  
+  DEVICELOCK(deviceNum);
+  //A block write issued after this check waits for Device Lock
+  if (abortCheck()) {
+    result = TRIM_ABORTED;
+    goto exit;
+  }
+  
+  //Erased or going to be erased by LazyEraseTask()
+  if (IsRegionErased(deviceNum, sectorAddress) || IsRegionStale(deviceNum, sectorAddress)) goto exit;
+  
+#if SECTORCACHE
+  //New data is waiting to be written back
+  if (IsSectorCachedInRange(deviceNum, sectorAddress, SECTORSIZE)) goto exit;
+#endif
+  
+  if (tsIsSectorErased(deviceNum, sectorAddress)) goto exit;
+  
+  tsEraseSector(deviceNum, sectorAddress);
+  result = TRIM_ERASED;
+
+exit:
+  DEVICEUNLOCK(deviceNum);
+  return result;
 }
 
 
@@ -44,11 +44,30 @@ rwerror_t tsReadBlockFlash_Public(const uint unitNum, const uint blockNum, uint8
 rwerror_t tsWriteBlockFlash_Public(const uint unitNum, const uint blockNum, const uint8_t* srcBuffer);
 bool tsWriteOneBlockAlreadyErased_Public(const blockloc_t blockLoc, const uint8_t* srcBuffer);
 
+//
+// Write-back Sector Cache
+//
+void tsFlushSectorCache();
+void RequestFlushSectorCache();
+void FlushSectorCacheIfIdle();
+
 //
 // Erase Flash Disk
 //
 void tsEraseFlashDisk(const uint unitNum);
 void AbortEraseFlashDisk();
+void LazyEraseTask();
+
+//
+// Pre-erase of free sectors (TRIM)
+//
+typedef enum {
+  TRIM_ERASED,    //The sector is erased
+  TRIM_SKIPPED,   //The sector is already erased or in use
+  TRIM_ABORTED    //Cancelled by abortCheck()
+} trimresult_t;
+
+trimresult_t tsTrimSectorFlash_Public(const uint unitNum, const uint sectorNum, bool (*abortCheck)());
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,97 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "defines.h"
+#include "flashstats.h"
+
+/****************************************************************************************
+Flash Statistics
+
+The flash code cannot be run without a Pico and flash chips. So, the performance is
+measured on the board. The counters below are updated by both cores:
+
+- ReadBlock/WriteBlock of flash units and a latency histogram of each. The latency is
+  measured in mediaaccess.c. So, it includes read-ahead hits and the sector cache.
+- Page Program, 4kB Sector Erase and 64kB Sector Erase. They are counted in flash.c
+  including the operations of core 0 (sector cache write-back, lazy erase and TRIM).
+- Erase/Program Suspend issued to serve a block read.
+
+Erases per write = (sectorsErased+regionsErased)/blocksWritten
+Percentiles of latency can be estimated from the histograms.
+
+Statistics can be read by CMD_GETFLASHSTAT command.
+*****************************************************************************************/
+
+static critical_section_t flashStatsCS;
+static flashstats_t stats;
+
+
+////////////////////////////////////////////////////////////////////
+// Initialize Flash statistics
+// It must be called before any flash operation.
+//
+void InitFlashStats() {
+  critical_section_init(&flashStatsCS);
+  memset(&stats,0,sizeof(stats));
+}
+
+////////////////////////////////////////////////////////////////////
+// Record a ReadBlock/WriteBlock of a flash unit
+//
+// Input: write     - true for WriteBlock
+//        startTime - time_us_32() at the start of the operation
+//
+void __no_inline_not_in_flash_func(FlashStatsRecordBlock)(const bool write, const uint32_t startTime) {
+  const uint32_t elapsed = time_us_32()-startTime;
+  
+  //Find the bucket
+  uint bucket = 0;
+  if (elapsed>>6) bucket = MIN(32-__builtin_clz(elapsed>>6), FLASHSTATS_BUCKETS-1);
+
+  critical_section_enter_blocking(&flashStatsCS);
+  if (write) {
+    ++stats.blocksWritten;
+    ++stats.writeLatency[bucket];
+  } else {
+    ++stats.blocksRead;
+    ++stats.readLatency[bucket];
+  }
+  critical_section_exit(&flashStatsCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Count a flash operation
+//
+// Input: op - Flash operation
+//
+void __no_inline_not_in_flash_func(FlashStatsCountOp)(const flashop_t op) {
+  critical_section_enter_blocking(&flashStatsCS);
+  switch(op) {
+    case FLASHOP_PAGEPROGRAM:
+      ++stats.pagesProgrammed;
+      break;
+    case FLASHOP_ERASE4K:
+      ++stats.sectorsErased;
+      break;
+    case FLASHOP_ERASE64K:
+      ++stats.regionsErased;
+      break;
+    case FLASHOP_SUSPEND:
+      ++stats.suspends;
+      break;
+  }
+  critical_section_exit(&flashStatsCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Get Flash statistics
+//
+// Input: statsOut - Pointer to structure to receive the statistics
+//        reset    - Reset the counters to zero
+//
+void GetFlashStats(flashstats_t* statsOut, const bool reset) {
+  critical_section_enter_blocking(&flashStatsCS);
+  *statsOut = stats;
+  if (reset) memset(&stats,0,sizeof(stats));
+  critical_section_exit(&flashStatsCS);
+}
@@ -0,0 +1,43 @@
+#ifndef _FLASHSTATS_H
+#define _FLASHSTATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Number of latency buckets
+//Bucket 0: <64us, Bucket n: (32<<n) to (64<<n)-1 us, Last Bucket: >=65536us
+#define FLASHSTATS_BUCKETS 12
+
+//Flash operations to be counted
+typedef enum {
+  FLASHOP_PAGEPROGRAM,
+  FLASHOP_ERASE4K,
+  FLASHOP_ERASE64K,
+  FLASHOP_SUSPEND
+} flashop_t;
+
+//Flash statistics
+typedef struct {
+  uint32_t blocksRead;        //ReadBlock of flash units
+  uint32_t blocksWritten;     //WriteBlock of flash units
+  uint32_t pagesProgrammed;   //256-byte Page Program
+  uint32_t sectorsErased;     //4kB Sector Erase
+  uint32_t regionsErased;     //64kB Sector Erase
+  uint32_t suspends;          //Erase/Program Suspend to serve a read
+  uint32_t readLatency[FLASHSTATS_BUCKETS];   //Histogram of ReadBlock time
+  uint32_t writeLatency[FLASHSTATS_BUCKETS];  //Histogram of WriteBlock time
+} flashstats_t;
+
+void InitFlashStats();
+void FlashStatsRecordBlock(const bool write, const uint32_t startTime);
+void FlashStatsCountOp(const flashop_t op);
+void GetFlashStats(flashstats_t* statsOut, const bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
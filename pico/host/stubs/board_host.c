@@ -0,0 +1,26 @@
+#include "pico/stdlib.h"
+#include "misc.h"
+#include "ipc.h"
+
+/****************************************************************************************
+Board functions of misc.c and main.c used by the code under test
+
+They are weak. A test can define its own version.
+*****************************************************************************************/
+
+__attribute__((weak)) bool CheckPicoW() {
+  return true;
+}
+
+__attribute__((weak)) bool WasAppleConnected() {
+  return false;
+}
+
+__attribute__((weak)) void Core0BackgroundTasks() {
+}
+
+__attribute__((weak)) void TurnOnPicoLed() {
+}
+
+__attribute__((weak)) void TurnOffPicoLed() {
+}
@@ -0,0 +1,11 @@
+#ifndef _HOST_A2BUS_RP2350_PIO_H
+#define _HOST_A2BUS_RP2350_PIO_H
+
+//
+// Host stand-in of the header generated by pioasm from a2bus_rp2350.pio
+// The PIO programs are not used on the host.
+//
+
+#include "hardware/pio.h"
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _HOST_HARDWARE_CLOCKS_H
+#define _HOST_HARDWARE_CLOCKS_H
+
+//
+// Host stand-in of hardware/clocks.h
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum clock_index {clk_gpout0=0, clk_ref=4, clk_sys=5, clk_peri=6};
+
+static inline uint32_t clock_get_hz(enum clock_index clk_index) {
+  return clk_index==clk_ref ? 12000000 : 150000000;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
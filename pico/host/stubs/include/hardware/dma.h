@@ -0,0 +1,65 @@
+#ifndef _HOST_HARDWARE_DMA_H
+#define _HOST_HARDWARE_DMA_H
+
+//
+// Host stand-in of hardware/dma.h
+// A transfer is done at once when the channel is triggered. So, a channel
+// is never busy. A channel reading from or writing to the data register
+// of SPI is paced by SPI. The TX and RX channels of SPI must be started
+// together by dma_start_channel_mask(). The sniffer supports CRC32R,
+// CRC16 and SUM. See spidma_host.c
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NUM_DMA_CHANNELS 12
+
+enum dma_channel_transfer_size {DMA_SIZE_8=0, DMA_SIZE_16=1, DMA_SIZE_32=2};
+
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC32  0
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC32R 1
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16  2
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16R 3
+#define DMA_SNIFF_CTRL_CALC_VALUE_EVEN   0xe
+#define DMA_SNIFF_CTRL_CALC_VALUE_SUM    0xf
+
+typedef struct {
+  enum dma_channel_transfer_size size;
+  bool readIncrement;
+  bool writeIncrement;
+  bool sniff;
+  uint dreq;
+} dma_channel_config;
+typedef dma_channel_config dma_channel_config_t;
+
+int dma_claim_unused_channel(bool required);
+void dma_channel_unclaim(uint channel);
+dma_channel_config dma_channel_get_default_config(uint channel);
+
+static inline void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size) {c->size = size;}
+static inline void channel_config_set_read_increment(dma_channel_config *c, bool incr) {c->readIncrement = incr;}
+static inline void channel_config_set_write_increment(dma_channel_config *c, bool incr) {c->writeIncrement = incr;}
+static inline void channel_config_set_sniff_enable(dma_channel_config *c, bool sniff) {c->sniff = sniff;}
+static inline void channel_config_set_dreq(dma_channel_config *c, uint dreq) {c->dreq = dreq;}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger);
+void dma_start_channel_mask(uint32_t chan_mask);
+static inline bool dma_channel_is_busy(uint channel) {(void)channel; return false;}
+static inline void dma_channel_wait_for_finish_blocking(uint channel) {(void)channel;}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable);
+void dma_sniffer_set_output_invert_enabled(bool invert);
+void dma_sniffer_set_output_reverse_enabled(bool reverse);
+void dma_sniffer_set_data_accumulator(uint32_t seed_value);
+uint32_t dma_sniffer_get_data_accumulator();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
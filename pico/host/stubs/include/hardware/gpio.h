@@ -0,0 +1,54 @@
+#ifndef _HOST_HARDWARE_GPIO_H
+#define _HOST_HARDWARE_GPIO_H
+
+//
+// Host stand-in of hardware/gpio.h
+// GPIO state is kept in a 32-bit variable. No pin has a function.
+// host_gpio_changed is called when a mask operation changes the state.
+// The flash chip model uses it to see its /CS pin.
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GPIO_OUT 1
+#define GPIO_IN  0
+
+enum gpio_function {GPIO_FUNC_SPI=1, GPIO_FUNC_UART=2, GPIO_FUNC_PIO0=6, GPIO_FUNC_SIO=5};
+enum gpio_slew_rate {GPIO_SLEW_RATE_SLOW=0, GPIO_SLEW_RATE_FAST=1};
+enum gpio_drive_strength {GPIO_DRIVE_STRENGTH_2MA=0, GPIO_DRIVE_STRENGTH_4MA=1, GPIO_DRIVE_STRENGTH_8MA=2, GPIO_DRIVE_STRENGTH_12MA=3};
+
+extern volatile uint32_t host_gpio_state;
+extern void (*host_gpio_changed)(const uint32_t before, const uint32_t after);
+
+static inline void gpio_init(uint gpio) {(void)gpio;}
+static inline void gpio_set_dir(uint gpio, bool out) {(void)gpio; (void)out;}
+static inline void gpio_pull_up(uint gpio) {(void)gpio;}
+static inline void gpio_pull_down(uint gpio) {(void)gpio;}
+static inline void gpio_set_function(uint gpio, enum gpio_function fn) {(void)gpio; (void)fn;}
+static inline void gpio_set_pulls(uint gpio, bool up, bool down) {(void)gpio; (void)up; (void)down;}
+static inline void gpio_set_slew_rate(uint gpio, enum gpio_slew_rate slew) {(void)gpio; (void)slew;}
+static inline void gpio_set_drive_strength(uint gpio, enum gpio_drive_strength drive) {(void)gpio; (void)drive;}
+static inline void gpio_set_dir_out_masked(uint32_t mask) {(void)mask;}
+
+static inline void host_gpio_write(const uint32_t state) {
+  const uint32_t before = host_gpio_state;
+  host_gpio_state = state;
+  if (host_gpio_changed && before!=state) host_gpio_changed(before,state);
+}
+static inline void gpio_set_mask(uint32_t mask) {host_gpio_write(host_gpio_state|mask);}
+static inline void gpio_clr_mask(uint32_t mask) {host_gpio_write(host_gpio_state&~mask);}
+static inline void gpio_put(uint gpio, bool value) {
+  if (value) gpio_set_mask(1ul<<gpio);
+  else gpio_clr_mask(1ul<<gpio);
+}
+static inline bool gpio_get(uint gpio) {return (host_gpio_state>>gpio)&1;}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _HOST_HARDWARE_PIO_H
+#define _HOST_HARDWARE_PIO_H
+
+//
+// Host stand-in of hardware/pio.h
+// Only the FIFO accesses of the bus loops are supported. Each evaluation
+// of pio0 is counted as one access to a PIO register (host_pio_accesses).
+// pio_sm_get_blocking() of the listener gets the next word from
+// host_pio_listener. See pio_host.c
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  volatile uint32_t txf[4];
+  volatile uint32_t rxf[4];
+  volatile uint32_t rxf_putget[4][4];
+} pio_hw_t;
+typedef pio_hw_t* PIO;
+
+extern uint32_t host_pio_accesses;
+extern uint32_t (*host_pio_listener)(const uint sm);
+PIO host_pio0();
+#define pio0 host_pio0()
+
+uint32_t pio_sm_get_blocking(PIO pio, uint sm);
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm);
+bool pio_interrupt_get(PIO pio, uint pio_interrupt_num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
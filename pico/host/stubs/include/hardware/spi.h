@@ -0,0 +1,54 @@
+#ifndef _HOST_HARDWARE_SPI_H
+#define _HOST_HARDWARE_SPI_H
+
+//
+// Host stand-in of hardware/spi.h
+// Each byte is exchanged with the device set by host_spi_set_device().
+// Without a device, 0xff is read. The transfer time at the current baud
+// rate is added to the virtual time. See spidma_host.c
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  volatile uint32_t dr;
+} spi_hw_t;
+
+typedef struct {
+  spi_hw_t hw;
+  uint baudrate;
+  uint8_t (*device)(const uint8_t tx);
+} spi_inst_t;
+
+extern spi_inst_t host_spi[2];
+#define spi0 (&host_spi[0])
+#define spi1 (&host_spi[1])
+
+typedef enum {SPI_CPHA_0=0, SPI_CPHA_1=1} spi_cpha_t;
+typedef enum {SPI_CPOL_0=0, SPI_CPOL_1=1} spi_cpol_t;
+typedef enum {SPI_LSB_FIRST=0, SPI_MSB_FIRST=1} spi_order_t;
+
+uint spi_init(spi_inst_t *spi, uint baudrate);
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate);
+void spi_set_format(spi_inst_t *spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order);
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len);
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len);
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len);
+
+static inline spi_hw_t* spi_get_hw(spi_inst_t *spi) {return &spi->hw;}
+static inline uint spi_get_index(const spi_inst_t *spi) {return spi==spi1;}
+static inline uint spi_get_dreq(spi_inst_t *spi, bool is_tx) {return 16+spi_get_index(spi)*2+(is_tx?0:1);}
+
+//Host only
+void host_spi_set_device(spi_inst_t *spi, uint8_t (*device)(const uint8_t tx));
+uint8_t host_spi_exchange(spi_inst_t *spi, const uint8_t tx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
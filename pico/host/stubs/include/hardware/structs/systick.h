@@ -0,0 +1,29 @@
+#ifndef _HOST_HARDWARE_STRUCTS_SYSTICK_H
+#define _HOST_HARDWARE_STRUCTS_SYSTICK_H
+
+//
+// Host stand-in of hardware/structs/systick.h
+// SysTick does not count on the host.
+//
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  volatile uint32_t csr;
+  volatile uint32_t rvr;
+  volatile uint32_t cvr;
+  volatile uint32_t calib;
+} systick_hw_t;
+
+extern systick_hw_t host_systick_hw;
+#define systick_hw (&host_systick_hw)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
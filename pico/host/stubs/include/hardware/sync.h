@@ -0,0 +1,29 @@
+#ifndef _HOST_HARDWARE_SYNC_H
+#define _HOST_HARDWARE_SYNC_H
+
+//
+// Host stand-in of hardware/sync.h
+//
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline void __dmb() {__sync_synchronize();}
+static inline void __dsb() {__sync_synchronize();}
+static inline void __compiler_memory_barrier() {__asm__ volatile ("" : : : "memory");}
+static inline void __sev() {}
+static inline void __wfe() {}
+static inline void __wfi() {}
+static inline void __nop() {}
+
+static inline uint32_t save_and_disable_interrupts() {return 0;}
+static inline void restore_interrupts(uint32_t status) {(void)status;}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
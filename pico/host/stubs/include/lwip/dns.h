@@ -0,0 +1,24 @@
+#ifndef _HOST_LWIP_DNS_H
+#define _HOST_LWIP_DNS_H
+
+//
+// Host stand-in of lwip/dns.h
+// Hostnames are resolved synchronously by the host resolver.
+//
+
+#include "lwip/ip_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg);
+const ip_addr_t* dns_getserver(u8_t numdns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _HOST_LWIP_IP_ADDR_H
+#define _HOST_LWIP_IP_ADDR_H
+
+//
+// Host stand-in of lwip/ip_addr.h (IPv4 only, like lwipopts.h)
+// addr is in network byte order.
+//
+
+#include "lwip/err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ip4_addr {
+  u32_t addr;
+} ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+
+extern const ip_addr_t ip_addr_any;
+
+#define IPADDR4_INIT(u32val) { u32val }
+#define IP4_ADDR_ANY (&ip_addr_any)
+#define IP_ADDR_ANY  (&ip_addr_any)
+#define ip_addr_cmp(addr1, addr2) ((addr1)->addr == (addr2)->addr)
+#define ip4_addr_get_u32(src_ipaddr) ((src_ipaddr)->addr)
+#define ip_addr_set_zero(ipaddr) ((ipaddr)->addr = 0)
+#define ip_addr_isany(ipaddr) ((ipaddr)==NULL || (ipaddr)->addr==0)
+
+char *ip4addr_ntoa(const ip4_addr_t *addr);
+int ip4addr_aton(const char *cp, ip4_addr_t *addr);
+#define ipaddr_ntoa(ipaddr) ip4addr_ntoa(ipaddr)
+#define ipaddr_aton(cp, addr) ip4addr_aton(cp, addr)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _HOST_LWIP_NETIF_H
+#define _HOST_LWIP_NETIF_H
+
+//
+// Host stand-in of lwip/netif.h
+//
+
+#include "lwip/ip_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct netif {
+  ip4_addr_t ip_addr;
+  ip4_addr_t netmask;
+  ip4_addr_t gw;
+};
+
+#define netif_ip4_addr(netif)    ((const ip4_addr_t*)&((netif)->ip_addr))
+#define netif_ip4_netmask(netif) ((const ip4_addr_t*)&((netif)->netmask))
+#define netif_ip4_gw(netif)      ((const ip4_addr_t*)&((netif)->gw))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _HOST_LWIP_PBUF_H
+#define _HOST_LWIP_PBUF_H
+
+//
+// Host stand-in of lwip/pbuf.h
+// Only PBUF_RAM and PBUF_REF are supported. A received packet is split into
+// a chain of pbufs of at most host_lwip_rx_segment bytes (0=one pbuf).
+//
+
+#include "lwip/err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  PBUF_TRANSPORT,
+  PBUF_IP,
+  PBUF_LINK,
+  PBUF_RAW_TX,
+  PBUF_RAW
+} pbuf_layer;
+
+typedef enum {
+  PBUF_RAM,
+  PBUF_ROM,
+  PBUF_REF,
+  PBUF_POOL
+} pbuf_type;
+
+struct pbuf {
+  struct pbuf *next;
+  void *payload;
+  u16_t tot_len;
+  u16_t len;
+  u8_t type;
+  u8_t ref;
+};
+
+extern u16_t host_lwip_rx_segment;
+
+struct pbuf *pbuf_alloc(pbuf_layer l, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+void pbuf_chain(struct pbuf *head, struct pbuf *tail);
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
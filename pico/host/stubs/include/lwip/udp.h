@@ -0,0 +1,33 @@
+#ifndef _HOST_LWIP_UDP_H
+#define _HOST_LWIP_UDP_H
+
+//
+// Host stand-in of lwip/udp.h
+// Each udp_pcb is a non-blocking UDP socket of the host. Packets are
+// received by cyw43_arch_poll(). See lwip_host.c
+//
+
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+struct udp_pcb *udp_new();
+void udp_remove(struct udp_pcb *pcb);
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+err_t udp_connect(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+void udp_disconnect(struct udp_pcb *pcb);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port);
+err_t udp_send(struct udp_pcb *pcb, struct pbuf *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _HOST_MATH_H
+#define _HOST_MATH_H
+
+//
+// Host stand-in of math.h
+// Adds infinity() of newlib, which is used by fpu.c, to math.h of the host.
+//
+
+#include_next <math.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+double infinity(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef _HOST_PICO_AON_TIMER_H
+#define _HOST_PICO_AON_TIMER_H
+
+//
+// Host stand-in of pico/aon_timer.h
+// The calendar time is the local time of the host.
+//
+
+#include <time.h>
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline bool aon_timer_get_time_calendar(struct tm* tm) {
+  const time_t now = time(NULL);
+  return localtime_r(&now,tm)!=NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
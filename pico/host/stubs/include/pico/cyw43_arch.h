@@ -0,0 +1,76 @@
+#ifndef _HOST_PICO_CYW43_ARCH_H
+#define _HOST_PICO_CYW43_ARCH_H
+
+//
+// Host stand-in of pico/cyw43_arch.h
+// There is no radio. Joining any SSID brings the link up at once and the
+// host network is used by lwIP (lwip_host.c). Set host_cyw43_link_status
+// to simulate a lost connection.
+//
+
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+#include "lwip/netif.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CYW43_LINK_DOWN    (0)
+#define CYW43_LINK_JOIN    (1)
+#define CYW43_LINK_NOIP    (2)
+#define CYW43_LINK_UP      (3)
+#define CYW43_LINK_FAIL    (-1)
+#define CYW43_LINK_NONET   (-2)
+#define CYW43_LINK_BADAUTH (-3)
+
+#define CYW43_ITF_STA 0
+#define CYW43_ITF_AP  1
+
+#define CYW43_AUTH_OPEN                 (0)
+#define CYW43_AUTH_WPA_TKIP_PSK         (0x00200002)
+#define CYW43_AUTH_WPA2_AES_PSK         (0x00400004)
+#define CYW43_AUTH_WPA2_MIXED_PSK       (0x00400006)
+#define CYW43_AUTH_WPA3_SAE_AES_PSK     (0x01000004)
+#define CYW43_AUTH_WPA3_WPA2_AES_PSK    (0x01400004)
+
+#define CYW43_CHANNEL_NONE       (0xffffffff)
+#define CYW43_COUNTRY_WORLDWIDE  (0x5858)   //"XX"
+#define CYW43_IOCTL_GET_CHANNEL  (0x3a)
+#define CYW43_WL_GPIO_LED_PIN    0
+
+typedef struct {
+  struct netif netif[2];
+} cyw43_t;
+
+extern cyw43_t cyw43_state;
+extern volatile int host_cyw43_link_status;
+
+int cyw43_arch_init();
+int cyw43_arch_init_with_country(uint32_t country);
+void cyw43_arch_deinit();
+void cyw43_arch_enable_sta_mode();
+void cyw43_arch_disable_sta_mode();
+void cyw43_arch_poll();
+void cyw43_arch_wait_for_work_until(absolute_time_t until);
+void cyw43_arch_gpio_put(uint wl_gpio, bool value);
+bool cyw43_arch_gpio_get(uint wl_gpio);
+int cyw43_arch_wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, uint32_t timeout);
+static inline void cyw43_arch_lwip_begin() {}
+static inline void cyw43_arch_lwip_end() {}
+
+int cyw43_wifi_join(cyw43_t *self, size_t ssid_len, const uint8_t *ssid, size_t key_len, const uint8_t *key,
+                    uint32_t auth_type, const uint8_t *bssid, uint32_t channel);
+int cyw43_wifi_leave(cyw43_t *self, int itf);
+int cyw43_tcpip_link_status(cyw43_t *self, int itf);
+int cyw43_wifi_get_bssid(cyw43_t *self, uint8_t bssid[6]);
+int cyw43_ioctl(cyw43_t *self, uint32_t cmd, size_t len, uint8_t *buf, uint32_t iface);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
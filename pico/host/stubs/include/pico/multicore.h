@@ -0,0 +1,33 @@
+#ifndef _HOST_PICO_MULTICORE_H
+#define _HOST_PICO_MULTICORE_H
+
+//
+// Host stand-in of pico/multicore.h
+// The inter-core FIFO is a queue in each direction. get_core_num() is
+// the core number given to the thread by host_set_core_num().
+//
+
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint get_core_num();
+void host_set_core_num(const uint coreNum);
+
+void multicore_launch_core1(void (*entry)(void));
+bool multicore_fifo_rvalid();
+bool multicore_fifo_wready();
+void multicore_fifo_push_blocking(uint32_t data);
+bool multicore_fifo_push_timeout_us(uint32_t data, uint64_t timeout_us);
+uint32_t multicore_fifo_pop_blocking();
+bool multicore_fifo_pop_timeout_us(uint64_t timeout_us, uint32_t *out);
+void multicore_fifo_drain();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef _HOST_PICO_STDLIB_H
+#define _HOST_PICO_STDLIB_H
+
+//
+// Host stand-in of pico/stdlib.h
+// Types, macros and time functions of pico-sdk used by the firmware.
+// Time is the monotonic clock of the host or a virtual clock. See pico_host.c
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+#ifndef MIN
+#define MIN(a,b) ((b)>(a)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+#define count_of(a) (sizeof(a)/sizeof((a)[0]))
+
+//Placement attributes have no meaning on the host
+#define __not_in_flash(group)
+#define __not_in_flash_func(func_name) func_name
+#define __no_inline_not_in_flash_func(func_name) __attribute__((noinline)) func_name
+#define __time_critical_func(func_name) func_name
+#define __scratch_x(group)
+#define __scratch_y(group)
+#define __force_inline inline __attribute__((always_inline))
+#define __unused __attribute__((unused))
+
+enum {
+  PICO_OK = 0,
+  PICO_ERROR_NONE = 0,
+  PICO_ERROR_GENERIC = -1,
+  PICO_ERROR_TIMEOUT = -2,
+  PICO_ERROR_NO_DATA = -3,
+  PICO_ERROR_NOT_PERMITTED = -4,
+  PICO_ERROR_INVALID_ARG = -5,
+  PICO_ERROR_IO = -6,
+  PICO_ERROR_BADAUTH = -7,
+  PICO_ERROR_CONNECT_FAILED = -8,
+};
+
+void panic(const char *fmt, ...) __attribute__((noreturn));
+
+//
+// Time
+//
+#define at_the_end_of_time ((absolute_time_t)INT64_MAX)
+#define nil_time ((absolute_time_t)0)
+
+uint64_t time_us_64();
+uint32_t time_us_32();
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+void busy_wait_us_32(uint32_t us);
+void busy_wait_us(uint64_t us);
+
+//Virtual time (host only)
+void host_use_virtual_time();
+void host_advance_time_ns(const uint64_t ns);
+
+static inline absolute_time_t get_absolute_time() {return time_us_64();}
+static inline uint32_t to_ms_since_boot(absolute_time_t t) {return (uint32_t)(t/1000);}
+static inline uint64_t to_us_since_boot(absolute_time_t t) {return t;}
+static inline absolute_time_t delayed_by_us(const absolute_time_t t, uint64_t us) {
+  return (t>at_the_end_of_time-us) ? at_the_end_of_time : t+us;
+}
+static inline absolute_time_t delayed_by_ms(const absolute_time_t t, uint32_t ms) {
+  return delayed_by_us(t,(uint64_t)ms*1000);
+}
+static inline absolute_time_t make_timeout_time_us(uint64_t us) {return delayed_by_us(get_absolute_time(),us);}
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {return delayed_by_ms(get_absolute_time(),ms);}
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {return (int64_t)(to-from);}
+static inline bool time_reached(absolute_time_t t) {return get_absolute_time()>=t;}
+static inline void tight_loop_contents() {}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef _HOST_PICO_SYNC_H
+#define _HOST_PICO_SYNC_H
+
+//
+// Host stand-in of pico/sync.h
+// Critical sections and mutexes are pthread mutexes. Each core of the
+// firmware is a thread on the host.
+//
+
+#include <pthread.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  pthread_mutex_t m;
+} critical_section_t;
+
+typedef struct {
+  pthread_mutex_t m;
+} mutex_t;
+
+//owner is only compared by the thread holding m
+typedef struct {
+  pthread_mutex_t m;
+  volatile pthread_t owner;
+  volatile uint count;
+} recursive_mutex_t;
+
+#define auto_init_mutex(name) mutex_t name = {PTHREAD_MUTEX_INITIALIZER}
+#define auto_init_recursive_mutex(name) recursive_mutex_t name = {PTHREAD_MUTEX_INITIALIZER,0,0}
+
+void critical_section_init(critical_section_t *crit_sec);
+void critical_section_enter_blocking(critical_section_t *crit_sec);
+void critical_section_exit(critical_section_t *crit_sec);
+void critical_section_deinit(critical_section_t *crit_sec);
+
+void mutex_init(mutex_t *mtx);
+void mutex_enter_blocking(mutex_t *mtx);
+bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out);
+void mutex_exit(mutex_t *mtx);
+
+void recursive_mutex_init(recursive_mutex_t *mtx);
+void recursive_mutex_enter_blocking(recursive_mutex_t *mtx);
+bool recursive_mutex_try_enter(recursive_mutex_t *mtx, uint32_t *owner_out);
+void recursive_mutex_exit(recursive_mutex_t *mtx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
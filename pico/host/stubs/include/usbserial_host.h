@@ -0,0 +1,23 @@
+#ifndef _USBSERIAL_HOST_H
+#define _USBSERIAL_HOST_H
+
+//
+// Host stand-in of usbserial.c
+// USB serial is a file descriptor of the host (a pty or a socket).
+// See usbserial_host.c
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void host_serial_open(const int fd);
+void host_serial_set_noise(const double errorRate, const uint32_t seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "lwip/dns.h"
+
+/****************************************************************************************
+Host implementation of CYW43 and the UDP part of lwIP
+
+A udp_pcb is a non-blocking UDP socket. cyw43_arch_poll() reads all pending
+datagrams and calls the receive callback of the pcb like lwIP does. The callback
+owns the pbuf. cyw43_arch_wait_for_work_until() sleeps in poll() until a socket
+is readable or the time is reached.
+
+A received datagram is one pbuf unless host_lwip_rx_segment is set. Then, it is
+a chain of pbufs of at most host_lwip_rx_segment bytes to test scatter lists.
+*****************************************************************************************/
+
+const ip_addr_t ip_addr_any = IPADDR4_INIT(0);
+u16_t host_lwip_rx_segment = 0;
+
+cyw43_t cyw43_state;
+volatile int host_cyw43_link_status = CYW43_LINK_DOWN;
+static bool wlLed = false;
+
+struct udp_pcb {
+  int fd;
+  udp_recv_fn recv;
+  void *recv_arg;
+  struct udp_pcb *next;
+};
+static struct udp_pcb *pcbList = NULL;
+
+//////////////////////////////////////////////////////////
+// pbuf
+//
+struct pbuf *pbuf_alloc(pbuf_layer l, u16_t length, pbuf_type type) {
+  (void)l;
+  const size_t dataSize = (type==PBUF_REF || type==PBUF_ROM) ? 0 : length;
+  struct pbuf *p = (struct pbuf*)malloc(sizeof(struct pbuf)+dataSize);
+  if (p==NULL) return NULL;
+  p->next = NULL;
+  p->payload = dataSize ? (void*)(p+1) : NULL;
+  p->tot_len = length;
+  p->len = length;
+  p->type = (u8_t)type;
+  p->ref = 1;
+  return p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+  u8_t count = 0;
+  while (p!=NULL) {
+    if (--p->ref!=0) break;
+    struct pbuf *next = p->next;
+    free(p);
+    ++count;
+    p = next;
+  }
+  return count;
+}
+
+void pbuf_ref(struct pbuf *p) {
+  if (p) ++p->ref;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail) {
+  struct pbuf *p;
+  for (p=head; p->next!=NULL; p=p->next) p->tot_len += tail->tot_len;
+  p->tot_len += tail->tot_len;
+  p->next = tail;
+}
+
+void pbuf_chain(struct pbuf *head, struct pbuf *tail) {
+  pbuf_cat(head,tail);
+  pbuf_ref(tail);
+}
+
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len) {
+  if (buf==NULL || buf->tot_len<len) return ERR_ARG;
+  const uint8_t *src = (const uint8_t*)dataptr;
+  for (struct pbuf *p=buf; len!=0 && p!=NULL; p=p->next) {
+    const u16_t n = MIN(len,p->len);
+    memcpy(p->payload,src,n);
+    src += n;
+    len -= n;
+  }
+  return ERR_OK;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+  uint8_t *dest = (uint8_t*)dataptr;
+  u16_t copied = 0;
+  for (; len!=0 && p!=NULL; p=p->next) {
+    if (offset>=p->len) {
+      offset -= p->len;
+      continue;
+    }
+    const u16_t n = MIN(len,p->len-offset);
+    memcpy(dest+copied,(const uint8_t*)p->payload+offset,n);
+    copied += n;
+    len -= n;
+    offset = 0;
+  }
+  return copied;
+}
+
+//////////////////////////////////////////////////////////
+// IP Address
+//
+char *ip4addr_ntoa(const ip4_addr_t *addr) {
+  static char str[INET_ADDRSTRLEN];
+  struct in_addr in;
+  in.s_addr = addr->addr;
+  return (char*)inet_ntop(AF_INET,&in,str,sizeof(str));
+}
+
+int ip4addr_aton(const char *cp, ip4_addr_t *addr) {
+  struct in_addr in;
+  if (inet_aton(cp,&in)==0) return 0;
+  if (addr) addr->addr = in.s_addr;
+  return 1;
+}
+
+//////////////////////////////////////////////////////////
+// UDP
+//
+static void ToSockAddr(struct sockaddr_in *sa, const ip_addr_t *ipaddr, u16_t port) {
+  memset(sa,0,sizeof(*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_addr.s_addr = ipaddr ? ipaddr->addr : INADDR_ANY;
+  sa->sin_port = htons(port);
+}
+
+struct udp_pcb *udp_new() {
+  struct udp_pcb *pcb = (struct udp_pcb*)calloc(1,sizeof(struct udp_pcb));
+  if (pcb==NULL) return NULL;
+  pcb->fd = socket(AF_INET,SOCK_DGRAM,0);
+  if (pcb->fd<0) {
+    free(pcb);
+    return NULL;
+  }
+  fcntl(pcb->fd,F_SETFL,fcntl(pcb->fd,F_GETFL)|O_NONBLOCK);
+  pcb->next = pcbList;
+  pcbList = pcb;
+  return pcb;
+}
+
+void udp_remove(struct udp_pcb *pcb) {
+  for (struct udp_pcb **pp=&pcbList; *pp!=NULL; pp=&(*pp)->next) {
+    if (*pp==pcb) {
+      *pp = pcb->next;
+      break;
+    }
+  }
+  close(pcb->fd);
+  free(pcb);
+}
+
+err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
+  struct sockaddr_in sa;
+  ToSockAddr(&sa,ipaddr,port);
+  if (bind(pcb->fd,(struct sockaddr*)&sa,sizeof(sa))==0) return ERR_OK;
+  return errno==EADDRINUSE ? ERR_USE : ERR_VAL;
+}
+
+err_t udp_connect(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port) {
+  struct sockaddr_in sa;
+  ToSockAddr(&sa,ipaddr,port);
+  return connect(pcb->fd,(struct sockaddr*)&sa,sizeof(sa))==0 ? ERR_OK : ERR_VAL;
+}
+
+void udp_disconnect(struct udp_pcb *pcb) {
+  struct sockaddr sa;
+  memset(&sa,0,sizeof(sa));
+  sa.sa_family = AF_UNSPEC;
+  connect(pcb->fd,&sa,sizeof(sa));
+}
+
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg) {
+  pcb->recv = recv;
+  pcb->recv_arg = recv_arg;
+}
+
+static err_t SendPbuf(struct udp_pcb *pcb, struct pbuf *p, const struct sockaddr_in *sa) {
+  static uint8_t buffer[65536];
+  const u16_t len = pbuf_copy_partial(p,buffer,p->tot_len,0);
+  const ssize_t sent = sa ? sendto(pcb->fd,buffer,len,0,(const struct sockaddr*)sa,sizeof(*sa))
+                          : send(pcb->fd,buffer,len,0);
+  return sent==len ? ERR_OK : ERR_BUF;
+}
+
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port) {
+  struct sockaddr_in sa;
+  ToSockAddr(&sa,dst_ip,dst_port);
+  return SendPbuf(pcb,p,&sa);
+}
+
+err_t udp_send(struct udp_pcb *pcb, struct pbuf *p) {
+  return SendPbuf(pcb,p,NULL);
+}
+
+//////////////////////////////////////////////////////////
+// Build a pbuf (chain) of a received datagram
+//
+static struct pbuf *MakeRxPbuf(const uint8_t *data, const u16_t len) {
+  const u16_t segment = (host_lwip_rx_segment==0 || len==0) ? len : host_lwip_rx_segment;
+  struct pbuf *head = NULL;
+  u16_t offset = 0;
+  do {
+    const u16_t n = MIN(segment,len-offset);
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT,n,PBUF_RAM);
+    memcpy(p->payload,data+offset,n);
+    if (head) pbuf_cat(head,p);
+    else head = p;
+    offset += n;
+  } while (offset<len);
+  return head;
+}
+
+//////////////////////////////////////////////////////////
+// DNS
+//
+err_t dns_gethostbyname(const char *hostname, ip_addr_t *addr, dns_found_callback found, void *callback_arg) {
+  (void)found;
+  (void)callback_arg;
+  if (ip4addr_aton(hostname,addr)) return ERR_OK;
+
+  struct addrinfo hints, *result;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(hostname,NULL,&hints,&result)!=0) return ERR_ARG;
+  addr->addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr.s_addr;
+  freeaddrinfo(result);
+  return ERR_OK;
+}
+
+const ip_addr_t* dns_getserver(u8_t numdns) {
+  (void)numdns;
+  return &ip_addr_any;
+}
+
+//////////////////////////////////////////////////////////
+// CYW43
+//
+int cyw43_arch_init() {
+  return 0;
+}
+
+int cyw43_arch_init_with_country(uint32_t country) {
+  (void)country;
+  return 0;
+}
+
+void cyw43_arch_deinit() {
+  host_cyw43_link_status = CYW43_LINK_DOWN;
+}
+
+void cyw43_arch_enable_sta_mode() {
+}
+
+void cyw43_arch_disable_sta_mode() {
+  host_cyw43_link_status = CYW43_LINK_DOWN;
+}
+
+void cyw43_arch_gpio_put(uint wl_gpio, bool value) {
+  (void)wl_gpio;
+  wlLed = value;
+}
+
+bool cyw43_arch_gpio_get(uint wl_gpio) {
+  (void)wl_gpio;
+  return wlLed;
+}
+
+int cyw43_wifi_join(cyw43_t *self, size_t ssid_len, const uint8_t *ssid, size_t key_len, const uint8_t *key,
+                    uint32_t auth_type, const uint8_t *bssid, uint32_t channel) {
+  ip4addr_aton("127.0.0.1",&self->netif[CYW43_ITF_STA].ip_addr);
+  ip4addr_aton("255.0.0.0",&self->netif[CYW43_ITF_STA].netmask);
+  ip4addr_aton("127.0.0.1",&self->netif[CYW43_ITF_STA].gw);
+  host_cyw43_link_status = CYW43_LINK_UP;
+  return 0;
+}
+
+int cyw43_arch_wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, uint32_t timeout) {
+  return cyw43_wifi_join(&cyw43_state,strlen(ssid),(const uint8_t*)ssid,strlen(pw),(const uint8_t*)pw,auth,NULL,CYW43_CHANNEL_NONE);
+}
+
+int cyw43_wifi_leave(cyw43_t *self, int itf) {
+  host_cyw43_link_status = CYW43_LINK_DOWN;
+  return 0;
+}
+
+int cyw43_tcpip_link_status(cyw43_t *self, int itf) {
+  return host_cyw43_link_status;
+}
+
+int cyw43_wifi_get_bssid(cyw43_t *self, uint8_t bssid[6]) {
+  static const uint8_t HOST_BSSID[6] = {0x02,0x00,0x00,0x00,0x00,0x01};
+  memcpy(bssid,HOST_BSSID,6);
+  return 0;
+}
+
+int cyw43_ioctl(cyw43_t *self, uint32_t cmd, size_t len, uint8_t *buf, uint32_t iface) {
+  if (cmd==CYW43_IOCTL_GET_CHANNEL && len>=4) {
+    const uint32_t channel = 6;
+    memcpy(buf,&channel,4);
+    return 0;
+  }
+  return -1;
+}
+
+//////////////////////////////////////////////////////////
+// Receive all pending datagrams
+//
+// Several packets may be delivered in one poll like lwIP.
+// A callback may remove any pcb. So, a snapshot of the list
+// is taken and each pcb is checked before it is used.
+//
+static bool IsPcbInList(const struct udp_pcb *pcb) {
+  for (const struct udp_pcb *p=pcbList; p!=NULL; p=p->next) {
+    if (p==pcb) return true;
+  }
+  return false;
+}
+
+void cyw43_arch_poll() {
+  static uint8_t buffer[65536];
+  struct udp_pcb *snapshot[16];
+  uint32_t n = 0;
+  for (struct udp_pcb *pcb=pcbList; pcb!=NULL && n<count_of(snapshot); pcb=pcb->next) snapshot[n++] = pcb;
+
+  for (uint32_t i=0; i<n; ++i) {
+    struct udp_pcb *pcb = snapshot[i];
+    while (IsPcbInList(pcb)) {
+      struct sockaddr_in sa;
+      socklen_t salen = sizeof(sa);
+      const ssize_t len = recvfrom(pcb->fd,buffer,sizeof(buffer),0,(struct sockaddr*)&sa,&salen);
+      if (len<0) break;
+
+      struct pbuf *p = MakeRxPbuf(buffer,(u16_t)len);
+      if (pcb->recv==NULL) {
+        pbuf_free(p);
+        continue;
+      }
+      ip_addr_t addr;
+      addr.addr = sa.sin_addr.s_addr;
+      pcb->recv(pcb->recv_arg,pcb,p,&addr,ntohs(sa.sin_port));
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Wait until a socket is readable or until is reached
+//
+void cyw43_arch_wait_for_work_until(absolute_time_t until) {
+  struct pollfd fds[16];
+  nfds_t n = 0;
+  for (struct udp_pcb *pcb=pcbList; pcb!=NULL && n<count_of(fds); pcb=pcb->next) {
+    fds[n].fd = pcb->fd;
+    fds[n].events = POLLIN;
+    ++n;
+  }
+  const int64_t us = absolute_time_diff_us(get_absolute_time(),until);
+  if (us<=0) return;
+  const int timeout_ms = (int)MIN((us+999)/1000,1000);
+  poll(fds,n,timeout_ms);
+}
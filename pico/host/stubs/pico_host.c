@@ -0,0 +1,260 @@
+#include <time.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "pico/multicore.h"
+#include "hardware/gpio.h"
+
+/****************************************************************************************
+Host implementation of the pico-sdk functions used by the firmware
+
+- Time is CLOCK_MONOTONIC of the host since the first call. After
+  host_use_virtual_time(), it is a virtual clock instead. It is advanced by
+  sleep and busy wait, by host_advance_time_ns() (e.g. SPI transfer time) and
+  by VIRTUALTIME_QUERY_NS at each query so that a loop polling the time makes
+  progress. Virtual time is for single-threaded programs only.
+- Critical sections and mutexes are pthread mutexes.
+- Each core is a thread. The main thread is core 0. multicore_launch_core1()
+  starts a thread for core 1. The FIFO of each direction holds 8 words like
+  the SIO FIFO of RP2350.
+*****************************************************************************************/
+
+volatile uint32_t host_gpio_state = 0;
+void (*host_gpio_changed)(const uint32_t before, const uint32_t after) = NULL;
+
+void panic(const char *fmt, ...) {
+  va_list args;
+  va_start(args,fmt);
+  fprintf(stderr,"PANIC: ");
+  vfprintf(stderr,fmt,args);
+  fprintf(stderr,"\n");
+  va_end(args);
+  abort();
+}
+
+//////////////////////////////////////////////////////////
+// Time
+//
+#define VIRTUALTIME_QUERY_NS 50
+
+static bool virtualTime = false;
+static uint64_t virtualTimeNs = 1000;   //Time starts at 1us. 0 is nil_time
+
+void host_use_virtual_time() {
+  virtualTime = true;
+}
+
+void host_advance_time_ns(const uint64_t ns) {
+  if (virtualTime) virtualTimeNs += ns;
+}
+
+uint64_t time_us_64() {
+  if (virtualTime) {
+    virtualTimeNs += VIRTUALTIME_QUERY_NS;
+    return virtualTimeNs/1000;
+  }
+  static uint64_t start = 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  const uint64_t now = (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+  if (start==0) start = now-1;   //Time starts at 1us. 0 is nil_time
+  return now-start;
+}
+
+uint32_t time_us_32() {
+  return (uint32_t)time_us_64();
+}
+
+void sleep_us(uint64_t us) {
+  if (virtualTime) {
+    virtualTimeNs += us*1000;
+    return;
+  }
+  struct timespec ts = {(time_t)(us/1000000),(long)(us%1000000)*1000};
+  while (nanosleep(&ts,&ts)!=0 && errno==EINTR);
+}
+
+void sleep_ms(uint32_t ms) {
+  sleep_us((uint64_t)ms*1000);
+}
+
+void busy_wait_us(uint64_t us) {
+  if (virtualTime) {
+    virtualTimeNs += us*1000;
+    return;
+  }
+  const uint64_t until = time_us_64()+us;
+  while (time_us_64()<until);
+}
+
+void busy_wait_us_32(uint32_t us) {
+  busy_wait_us(us);
+}
+
+//////////////////////////////////////////////////////////
+// Critical Section and Mutex
+//
+void critical_section_init(critical_section_t *crit_sec) {
+  pthread_mutex_init(&crit_sec->m,NULL);
+}
+
+void critical_section_enter_blocking(critical_section_t *crit_sec) {
+  pthread_mutex_lock(&crit_sec->m);
+}
+
+void critical_section_exit(critical_section_t *crit_sec) {
+  pthread_mutex_unlock(&crit_sec->m);
+}
+
+void critical_section_deinit(critical_section_t *crit_sec) {
+  pthread_mutex_destroy(&crit_sec->m);
+}
+
+void mutex_init(mutex_t *mtx) {
+  pthread_mutex_init(&mtx->m,NULL);
+}
+
+void mutex_enter_blocking(mutex_t *mtx) {
+  pthread_mutex_lock(&mtx->m);
+}
+
+bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out) {
+  if (pthread_mutex_trylock(&mtx->m)==0) return true;
+  if (owner_out) *owner_out = 0;
+  return false;
+}
+
+void mutex_exit(mutex_t *mtx) {
+  pthread_mutex_unlock(&mtx->m);
+}
+
+void recursive_mutex_init(recursive_mutex_t *mtx) {
+  pthread_mutex_init(&mtx->m,NULL);
+  mtx->count = 0;
+}
+
+static bool IsRecursiveMutexOwner(recursive_mutex_t *mtx) {
+  return mtx->count!=0 && pthread_equal(mtx->owner,pthread_self());
+}
+
+void recursive_mutex_enter_blocking(recursive_mutex_t *mtx) {
+  if (!IsRecursiveMutexOwner(mtx)) {
+    pthread_mutex_lock(&mtx->m);
+    mtx->owner = pthread_self();
+  }
+  ++mtx->count;
+}
+
+bool recursive_mutex_try_enter(recursive_mutex_t *mtx, uint32_t *owner_out) {
+  if (!IsRecursiveMutexOwner(mtx)) {
+    if (pthread_mutex_trylock(&mtx->m)!=0) {
+      if (owner_out) *owner_out = 0;
+      return false;
+    }
+    mtx->owner = pthread_self();
+  }
+  ++mtx->count;
+  return true;
+}
+
+void recursive_mutex_exit(recursive_mutex_t *mtx) {
+  assert(IsRecursiveMutexOwner(mtx));
+  if (--mtx->count==0) pthread_mutex_unlock(&mtx->m);
+}
+
+//////////////////////////////////////////////////////////
+// Multicore
+//
+#define FIFO_DEPTH 8
+
+static __thread uint coreNum = 0;
+static pthread_mutex_t fifoMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  uint32_t data[FIFO_DEPTH];
+  uint32_t head;
+  uint32_t count;
+} fifo[2];      //fifo[n] is read by core n
+
+uint get_core_num() {
+  return coreNum;
+}
+
+void host_set_core_num(const uint num) {
+  coreNum = num;
+}
+
+static void* Core1Thread(void* arg) {
+  host_set_core_num(1);
+  ((void (*)(void))arg)();
+  return NULL;
+}
+
+void multicore_launch_core1(void (*entry)(void)) {
+  pthread_t thread;
+  pthread_create(&thread,NULL,Core1Thread,(void*)entry);
+  pthread_detach(thread);
+}
+
+bool multicore_fifo_rvalid() {
+  return fifo[coreNum].count!=0;
+}
+
+bool multicore_fifo_wready() {
+  return fifo[coreNum^1].count<FIFO_DEPTH;
+}
+
+bool multicore_fifo_push_timeout_us(uint32_t data, uint64_t timeout_us) {
+  const uint64_t until = time_us_64()+timeout_us;
+  pthread_mutex_lock(&fifoMutex);
+  while (fifo[coreNum^1].count==FIFO_DEPTH) {
+    if (time_us_64()>=until) {
+      pthread_mutex_unlock(&fifoMutex);
+      return false;
+    }
+    pthread_mutex_unlock(&fifoMutex);
+    sleep_us(10);
+    pthread_mutex_lock(&fifoMutex);
+  }
+  const uint32_t tail = (fifo[coreNum^1].head+fifo[coreNum^1].count)%FIFO_DEPTH;
+  fifo[coreNum^1].data[tail] = data;
+  ++fifo[coreNum^1].count;
+  pthread_mutex_unlock(&fifoMutex);
+  return true;
+}
+
+void multicore_fifo_push_blocking(uint32_t data) {
+  multicore_fifo_push_timeout_us(data,UINT64_MAX/2);
+}
+
+bool multicore_fifo_pop_timeout_us(uint64_t timeout_us, uint32_t *out) {
+  const uint64_t until = time_us_64()+timeout_us;
+  pthread_mutex_lock(&fifoMutex);
+  while (fifo[coreNum].count==0) {
+    if (time_us_64()>=until) {
+      pthread_mutex_unlock(&fifoMutex);
+      return false;
+    }
+    pthread_mutex_unlock(&fifoMutex);
+    sleep_us(10);
+    pthread_mutex_lock(&fifoMutex);
+  }
+  *out = fifo[coreNum].data[fifo[coreNum].head];
+  fifo[coreNum].head = (fifo[coreNum].head+1)%FIFO_DEPTH;
+  --fifo[coreNum].count;
+  pthread_mutex_unlock(&fifoMutex);
+  return true;
+}
+
+uint32_t multicore_fifo_pop_blocking() {
+  uint32_t data;
+  multicore_fifo_pop_timeout_us(UINT64_MAX/2,&data);
+  return data;
+}
+
+void multicore_fifo_drain() {
+  pthread_mutex_lock(&fifoMutex);
+  fifo[coreNum].count = 0;
+  pthread_mutex_unlock(&fifoMutex);
+}
@@ -0,0 +1,261 @@
+#include "pico/stdlib.h"
+#include "hardware/spi.h"
+#include "hardware/dma.h"
+
+/****************************************************************************************
+Host implementation of SPI and DMA
+
+- SPI exchanges each byte with the device function of the instance (e.g. the flash
+  chip model). The device sees its /CS pin through host_gpio_changed. The time of the
+  transfer at the current baud rate is added to the virtual time.
+- A DMA transfer is done when the channel is triggered. A pair of TX and RX channels
+  on the data register of SPI is a full-duplex transfer of SPI. It must be started by
+  dma_start_channel_mask() like the firmware does.
+- The sniffer calculates over the bytes in memory order. So, a CRC of a 32-bit
+  transfer is the same as the CRC of the same data by 8-bit transfer.
+*****************************************************************************************/
+
+spi_inst_t host_spi[2];
+
+//////////////////////////////////////////////////////////
+// SPI
+//
+uint spi_init(spi_inst_t *spi, uint baudrate) {
+  return spi_set_baudrate(spi,baudrate);
+}
+
+uint spi_set_baudrate(spi_inst_t *spi, uint baudrate) {
+  spi->baudrate = baudrate;
+  return baudrate;
+}
+
+void spi_set_format(spi_inst_t *spi, uint data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order) {
+  assert(data_bits==8 && order==SPI_MSB_FIRST);
+  (void)spi; (void)cpol; (void)cpha;
+}
+
+void host_spi_set_device(spi_inst_t *spi, uint8_t (*device)(const uint8_t tx)) {
+  spi->device = device;
+}
+
+static void AddTransferTime(spi_inst_t *spi, const size_t len) {
+  if (spi->baudrate!=0) host_advance_time_ns((uint64_t)len*8*1000000000ull/spi->baudrate);
+}
+
+uint8_t host_spi_exchange(spi_inst_t *spi, const uint8_t tx) {
+  return spi->device ? spi->device(tx) : 0xff;
+}
+
+int spi_write_blocking(spi_inst_t *spi, const uint8_t *src, size_t len) {
+  for (size_t i=0; i<len; ++i) host_spi_exchange(spi,src[i]);
+  AddTransferTime(spi,len);
+  return (int)len;
+}
+
+int spi_read_blocking(spi_inst_t *spi, uint8_t repeated_tx_data, uint8_t *dst, size_t len) {
+  for (size_t i=0; i<len; ++i) dst[i] = host_spi_exchange(spi,repeated_tx_data);
+  AddTransferTime(spi,len);
+  return (int)len;
+}
+
+int spi_write_read_blocking(spi_inst_t *spi, const uint8_t *src, uint8_t *dst, size_t len) {
+  for (size_t i=0; i<len; ++i) dst[i] = host_spi_exchange(spi,src[i]);
+  AddTransferTime(spi,len);
+  return (int)len;
+}
+
+static spi_inst_t* GetSpiOfRegister(const volatile void* addr) {
+  for (uint i=0; i<count_of(host_spi); ++i) {
+    if (addr==&host_spi[i].hw.dr) return &host_spi[i];
+  }
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////
+// Sniffer
+//
+static struct {
+  uint channel;
+  uint mode;
+  bool enabled;
+  bool invert;
+  bool reverse;
+  uint32_t acc;
+} sniffer;
+
+static uint32_t Reverse32(uint32_t v) {
+  uint32_t r = 0;
+  for (uint i=0; i<32; ++i, v>>=1) r = (r<<1)|(v&1);
+  return r;
+}
+
+static void SniffBytes(const uint8_t* data, const uint len) {
+  if (sniffer.mode==DMA_SNIFF_CTRL_CALC_VALUE_CRC32R) {
+    //CRC-32 with bit-reversed data is the reflected CRC-32 of reversed state
+    uint32_t r = Reverse32(sniffer.acc);
+    for (uint i=0; i<len; ++i) {
+      r ^= data[i];
+      for (uint b=0; b<8; ++b) r = (r>>1)^(0xEDB88320u & (0u-(r&1)));
+    }
+    sniffer.acc = Reverse32(r);
+  } else if (sniffer.mode==DMA_SNIFF_CTRL_CALC_VALUE_CRC32) {
+    for (uint i=0; i<len; ++i) {
+      sniffer.acc ^= (uint32_t)data[i]<<24;
+      for (uint b=0; b<8; ++b) sniffer.acc = (sniffer.acc<<1)^(0x04C11DB7u & (0u-(sniffer.acc>>31)));
+    }
+  } else if (sniffer.mode==DMA_SNIFF_CTRL_CALC_VALUE_CRC16) {
+    for (uint i=0; i<len; ++i) {
+      sniffer.acc ^= (uint32_t)data[i]<<8;
+      for (uint b=0; b<8; ++b) sniffer.acc = ((sniffer.acc<<1)^((sniffer.acc&0x8000)?0x1021:0))&0xffff;
+    }
+  } else {
+    assert(0);    //Not used by the firmware
+  }
+}
+
+static void SniffElement(const uint32_t value, const uint size) {
+  if (sniffer.mode==DMA_SNIFF_CTRL_CALC_VALUE_SUM) {
+    sniffer.acc += value;
+  } else {
+    const uint8_t bytes[4] = {(uint8_t)value,(uint8_t)(value>>8),(uint8_t)(value>>16),(uint8_t)(value>>24)};
+    SniffBytes(bytes,size);
+  }
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+  (void)force_channel_enable;
+  sniffer.channel = channel;
+  sniffer.mode = mode;
+  sniffer.enabled = true;
+}
+
+void dma_sniffer_set_output_invert_enabled(bool invert) {
+  sniffer.invert = invert;
+}
+
+void dma_sniffer_set_output_reverse_enabled(bool reverse) {
+  sniffer.reverse = reverse;
+}
+
+void dma_sniffer_set_data_accumulator(uint32_t seed_value) {
+  sniffer.acc = seed_value;
+}
+
+uint32_t dma_sniffer_get_data_accumulator() {
+  uint32_t value = sniffer.acc;
+  if (sniffer.reverse) value = Reverse32(value);
+  if (sniffer.invert) value = ~value;
+  return value;
+}
+
+//////////////////////////////////////////////////////////
+// DMA
+//
+static struct {
+  bool claimed;
+  dma_channel_config config;
+  volatile void* writeAddr;
+  const volatile void* readAddr;
+  uint count;
+} channels[NUM_DMA_CHANNELS];
+
+int dma_claim_unused_channel(bool required) {
+  for (uint i=0; i<NUM_DMA_CHANNELS; ++i) {
+    if (!channels[i].claimed) {
+      channels[i].claimed = true;
+      return (int)i;
+    }
+  }
+  assert(!required);
+  return -1;
+}
+
+void dma_channel_unclaim(uint channel) {
+  channels[channel].claimed = false;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+  (void)channel;
+  const dma_channel_config config = {DMA_SIZE_32,true,false,false,0x3f};
+  return config;
+}
+
+static bool IsSniffed(const uint channel) {
+  return sniffer.enabled && sniffer.channel==channel && channels[channel].config.sniff;
+}
+
+static uint32_t ReadElement(const volatile void* addr, const uint size) {
+  if (size==1) return *(const volatile uint8_t*)addr;
+  if (size==2) return *(const volatile uint16_t*)addr;
+  return *(const volatile uint32_t*)addr;
+}
+
+static void WriteElement(volatile void* addr, const uint32_t value, const uint size) {
+  if (size==1) *(volatile uint8_t*)addr = (uint8_t)value;
+  else if (size==2) *(volatile uint16_t*)addr = (uint16_t)value;
+  else *(volatile uint32_t*)addr = value;
+}
+
+static void MemoryTransfer(const uint channel) {
+  const uint size = 1u<<channels[channel].config.size;
+  const bool sniffed = IsSniffed(channel);
+  const volatile uint8_t* src = (const volatile uint8_t*)channels[channel].readAddr;
+  volatile uint8_t* dest = (volatile uint8_t*)channels[channel].writeAddr;
+  for (uint i=0; i<channels[channel].count; ++i) {
+    const uint32_t value = ReadElement(src,size);
+    WriteElement(dest,value,size);
+    if (sniffed) SniffElement(value,size);
+    if (channels[channel].config.readIncrement) src += size;
+    if (channels[channel].config.writeIncrement) dest += size;
+  }
+}
+
+static void SpiTransfer(spi_inst_t* spi, const uint txChannel, const uint rxChannel) {
+  assert(channels[txChannel].count==channels[rxChannel].count);
+  assert(channels[txChannel].config.size==DMA_SIZE_8 && channels[rxChannel].config.size==DMA_SIZE_8);
+  const bool sniffed = IsSniffed(rxChannel);
+  const volatile uint8_t* src = (const volatile uint8_t*)channels[txChannel].readAddr;
+  volatile uint8_t* dest = (volatile uint8_t*)channels[rxChannel].writeAddr;
+  const uint count = channels[rxChannel].count;
+  for (uint i=0; i<count; ++i) {
+    const uint8_t rx = host_spi_exchange(spi,*src);
+    *dest = rx;
+    if (sniffed) SniffBytes(&rx,1);
+    if (channels[txChannel].config.readIncrement) ++src;
+    if (channels[rxChannel].config.writeIncrement) ++dest;
+  }
+  AddTransferTime(spi,count);
+}
+
+void dma_start_channel_mask(uint32_t chan_mask) {
+  int txChannel = -1;
+  int rxChannel = -1;
+  spi_inst_t* spi = NULL;
+  for (uint i=0; i<NUM_DMA_CHANNELS; ++i) {
+    if (!(chan_mask & (1u<<i))) continue;
+    if (GetSpiOfRegister(channels[i].writeAddr)) {
+      txChannel = (int)i;
+      spi = GetSpiOfRegister(channels[i].writeAddr);
+    } else if (GetSpiOfRegister(channels[i].readAddr)) {
+      rxChannel = (int)i;
+    } else {
+      MemoryTransfer(i);
+    }
+  }
+  if (spi) {
+    assert(rxChannel>=0 && GetSpiOfRegister(channels[rxChannel].readAddr)==spi);
+    SpiTransfer(spi,(uint)txChannel,(uint)rxChannel);
+  } else {
+    assert(rxChannel<0);
+  }
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger) {
+  assert(channel<NUM_DMA_CHANNELS);
+  channels[channel].config = *config;
+  channels[channel].writeAddr = write_addr;
+  channels[channel].readAddr = read_addr;
+  channels[channel].count = transfer_count;
+  if (trigger) dma_start_channel_mask(1u<<channel);
+}
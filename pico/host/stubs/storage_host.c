@@ -0,0 +1,92 @@
+#include <math.h>
+#include "pico/stdlib.h"
+#include "defines.h"
+#include "misc.h"
+#include "romdisk.h"
+#include "rtc.h"
+#include "trim.h"
+#include "userconfig.h"
+
+/****************************************************************************************
+Functions used by the storage modules (flash.c, mediaaccess.c, ...) which are not
+compiled for the host
+
+- There is no ROM Disk. All flash units are enabled.
+- The ProDOS timestamp is fixed.
+- The volume of a unit is never recognized. So, the image transfer size of a unit is
+  its actual size.
+- Trim does not track writes.
+
+They are weak. A test can define its own version.
+*****************************************************************************************/
+
+//
+// romdisk.h
+//
+__attribute__((weak)) bool GetRomdiskFirst(void) {
+  return false;
+}
+
+__attribute__((weak)) uint32_t GetUnitCountRomdisk() {
+  return 0;
+}
+
+__attribute__((weak)) uint32_t GetBlockCountRomdisk() {
+  return 0;
+}
+
+__attribute__((weak)) uint32_t GetBlockCountRomdiskActual() {
+  return 0;
+}
+
+__attribute__((weak)) void GetDIBRomdisk(uint8_t *destBuffer) {
+  (void)destBuffer;
+}
+
+__attribute__((weak)) rwerror_t ReadBlockRomdisk(const uint blockNum, uint8_t* destBuffer) {
+  (void)blockNum; (void)destBuffer;
+  return SP_NODRVERR;
+}
+
+//
+// userconfig.h
+//
+__attribute__((weak)) uint8_t GetFlashdriveEnableFlag() {
+  return 0xff;
+}
+
+//
+// rtc.h
+//
+__attribute__((weak)) void GetProdosTimestamp(uint8_t *timestamp) {
+  //17-Oct-2026 12:00
+  const uint16_t date = (26<<9)|(10<<5)|17;
+  timestamp[0] = (uint8_t)date;
+  timestamp[1] = (uint8_t)(date>>8);
+  timestamp[2] = 0;
+  timestamp[3] = 12;
+}
+
+//
+// misc.h
+//
+__attribute__((weak)) bool GetVolumeInfo(const uint unitNum, VolumeInfo *infoOut) {
+  (void)unitNum;
+  memset(infoOut,0,sizeof(*infoOut));
+  infoOut->type = TYPE_UNKNOWN;
+  return false;
+}
+
+//
+// trim.h
+//
+__attribute__((weak)) void TrimNoteWrite(const uint mediumUnit, const uint blockNum) {
+  (void)mediumUnit; (void)blockNum;
+}
+
+//
+// newlib
+//
+double infinity(void) {
+  return INFINITY;
+}
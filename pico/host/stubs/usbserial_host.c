@@ -0,0 +1,119 @@
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include "pico/stdlib.h"
+#include "usbserial.h"
+#include "usbserial_host.h"
+
+/****************************************************************************************
+Host implementation of usbserial.h
+
+The port is a file descriptor, e.g. the master of a pty or one end of a socketpair. The
+functions have the same timeouts as usbserial.c but wait in poll() instead of polling
+TinyUSB. The keys of User Terminal are not supported.
+
+Noise: Each byte sent is corrupted with the probability of the error rate. It tests
+the error recovery of the file transfer protocols. The random sequence is fixed by the
+seed.
+*****************************************************************************************/
+
+static int serialFd = -1;
+static double noiseRate = 0;
+static uint32_t noiseSeed = 1;
+
+void host_serial_open(const int fd) {
+  serialFd = fd;
+}
+
+void host_serial_set_noise(const double errorRate, const uint32_t seed) {
+  noiseRate = errorRate;
+  noiseSeed = seed;
+}
+
+static bool NextIsNoise() {
+  noiseSeed = noiseSeed*1103515245+12345;
+  return ((noiseSeed>>8)&0xffff)<noiseRate*65536;
+}
+
+/////////////////////////////////////////////////////////////////
+//Read the bytes available within timeout_us
+//
+static int InChars(char* buf, const int len, const uint32_t timeout_us) {
+  struct pollfd pfd = {serialFd, POLLIN, 0};
+  if (poll(&pfd,1,(int)((timeout_us+999)/1000))<=0) return 0;
+  const ssize_t count = read(serialFd,buf,len);
+  return count>0 ? (int)count : 0;
+}
+
+void usb_putchar(const char ch) {
+  usb_putraw(&ch,1);
+}
+
+void usb_putraw(const char* buf,const int len) {
+  char noisy[256];
+  int sent = 0;
+  while (sent<len) {
+    const int chunk = MIN(len-sent,(int)sizeof(noisy));
+    memcpy(noisy,buf+sent,chunk);
+    if (noiseRate>0) {
+      for (int i=0; i<chunk; ++i) if (NextIsNoise()) noisy[i] ^= 0x55;
+    }
+    int written = 0;
+    while (written<chunk) {
+      const ssize_t count = write(serialFd,noisy+written,chunk-written);
+      if (count>0) written += (int)count;
+      else if (count<0 && errno!=EAGAIN && errno!=EINTR) return;   //Port closed
+    }
+    sent += chunk;
+  }
+}
+
+int usb_getchar_timeout_us(const uint32_t timeout_us) {
+  char ch;
+  return usb_getraw_timeout(&ch,1,timeout_us)==1 ? (uint8_t)ch : -1;
+}
+
+uint32_t usb_getraw_timeout(char *buf,const uint32_t len,const uint32_t timeout_us) {
+  uint32_t receivedCount = 0;
+  const uint64_t start = time_us_64();
+  uint64_t elapsed = 0;
+  do {
+    receivedCount += InChars(buf+receivedCount,len-receivedCount,timeout_us-elapsed);
+    elapsed = time_us_64()-start;
+  } while (receivedCount<len && elapsed<timeout_us);
+  return receivedCount;
+}
+
+int usb_getkey_timeout_us(const uint32_t timeout_us) {
+  return usb_getchar_timeout_us(timeout_us);
+}
+
+int usb_getkey() {
+  int key;
+  do {
+    key = usb_getkey_timeout_us(1000);
+  } while (key==-1);
+  return key;
+}
+
+uint32_t usb_getstring(char* buf,const uint32_t len,bool *cancelled) {
+  (void)len;
+  buf[0] = '\0';
+  if (cancelled) *cancelled = true;
+  return 0;
+}
+
+void usb_discard() {
+  char buf[256];
+  while (InChars(buf,sizeof(buf),0)>0);
+}
+
+void usb_discard_duration_us(const uint32_t duration_us) {
+  char buf[256];
+  const uint64_t start = time_us_64();
+  uint64_t elapsed = 0;
+  do {
+    InChars(buf,sizeof(buf),duration_us-elapsed);
+    elapsed = time_us_64()-start;
+  } while (elapsed<duration_us);
+}
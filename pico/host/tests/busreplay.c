@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "pico/stdlib.h"
+#include "hardware/pio.h"
+#include "defines.h"
+#include "busloop.h"
+#include "slinky.h"
+#include "cmdhandler.h"
+#include "blockstream.h"
+#include "uthernet2.h"
+#include "ramdisk.h"
+
+/****************************************************************************************
+Bus Trace Replay
+
+Feeds a bus trace through BusLoop() and BusLoopSlinky() compiled for the host and
+estimates the CPU cycles of each access with a cost model. The report has the worst
+case of each path (Read Flag + 4-bit address), like the table of BusTraceDump().
+
+The trace is the output of BusTraceDump() (see bustrace.c), i.e. lines of
+"index word start cycles" in hex/hex/hex/decimal, or one hex listener word per line.
+# starts a comment. The cycles of a dump are measured on the board. They are shown
+next to the model so that the model can be calibrated.
+
+Cost model
+busloop.c and slinky.c are compiled with -fsanitize-coverage=trace-pc. The compiler
+calls __sanitizer_cov_trace_pc() at each basic block. An access costs
+  basic blocks * cycles per block + PIO register accesses * cycles per PIO access
+An access starts when the listener word is returned and ends when the loop asks for
+the next word. The PIO access of the wait itself is not counted. Each evaluation of
+pio0 is one PIO access (see pio_host.c). The blocks of x86 code are not the blocks of
+Cortex-M33 code. But both compilers keep the branches of the C code. So, the model is
+good to compare paths and to find a regression, not to get the exact cycles.
+
+Calls out of the loop (DoCommand(), BlockStreamNextBuffer(), U2_HandleBusAccess() etc.)
+are stubs. Their cycles are not counted. The number of calls is reported instead. An
+access with such a call is expected to be long (e.g. a command sets the busy flag).
+
+The loop runs like core1Main(). With -s, BusLoopSlinky() runs first. When the
+activation sequence is detected, BusLoopDataInit() and BusLoop() continue the replay.
+
+Exit code is 1 if an access without a call out of the loop exceeds the budget of one
+Apple bus cycle.
+
+  busreplay [-s] [-c clockMHz] [-b cyclesPerBlock] [-p cyclesPerPioAccess] <trace file>
+    -s  Start with Slinky
+    -c  CPU clock in MHz (default 150)
+    -b  Cycles per basic block (default 5)
+    -p  Cycles per PIO register access (default 4)
+*****************************************************************************************/
+
+//Apple IIc bus clock
+#define APPLE_CLOCK_HZ 1020484
+
+#define PATHCOUNT  32   //Read Flag + 4-bit address
+#define MAXACCESS  (1024*1024)
+
+typedef struct {
+  uint16_t word;          //Listener FIFO word
+  uint16_t boardCycles;   //Cycles measured on the board. 0=unknown
+  uint lineNum;
+} access_t;
+
+typedef struct {
+  uint count;
+  uint calls;             //Accesses with calls out of the loop
+  uint64_t totalCycles;
+  uint worst;
+  uint worstLine;
+  uint worstBoard;        //Worst case measured on the board
+} pathstat_t;
+
+static access_t* trace;
+static uint traceCount = 0;
+static uint nextAccess = 0;
+static pathstat_t stats[PATHCOUNT];
+static uint cyclesPerBlock = 5;
+static uint cyclesPerPio = 4;
+static uint budget;
+static uint overBudget = 0;
+static jmp_buf endOfTrace;
+
+//Counters of the current access
+static uint64_t blockCount = 0;
+static uint calls = 0;
+
+
+//////////////////////////////////////////////////////////
+// Coverage callback of busloop.c and slinky.c
+//
+void __sanitizer_cov_trace_pc(void) {
+  ++blockCount;
+}
+
+//////////////////////////////////////////////////////////
+// Stubs of the modules called by the bus loops
+//
+union {
+  uint8_t  r[16];
+  uint32_t i32[4];
+} registers;
+
+bool asyncCommandWaiting = false;
+streammode_t blockStreamMode = STREAM_NONE;
+bool blockStreamWaiting = false;
+static uint8_t slinkyData[SLINKY_SIZE];
+
+void DoCommand(const uint32_t command) { (void)command; ++calls; }
+void AsyncCommandPoll() { ++calls; }
+bool EndAsyncCommand(const uint32_t command) { (void)command; ++calls; return true; }
+void BlockStreamNextBuffer() { ++calls; }
+bool EndBlockStream(const uint32_t command) { (void)command; ++calls; return true; }
+void CompleteBlockStream() { ++calls; }
+void U2_HandleBusAccess(uint32_t busdata, uint8_t *read_byte_out) { (void)busdata; *read_byte_out = 0; ++calls; }
+uint8_t* GetRamdiskDataPointer() { return slinkyData; }
+size_t GetRamdiskSize() { return sizeof(slinkyData); }
+void tsEraseRamdiskQuick() { memset(slinkyData,0,sizeof(slinkyData)); }
+
+//////////////////////////////////////////////////////////
+// Account the access that has been executed by the loop
+//
+static void EndAccess(const uint pioAccesses) {
+  if (nextAccess==0) return;    //No access yet
+  const access_t* access = &trace[nextAccess-1];
+  const uint cycles = (uint)blockCount*cyclesPerBlock + pioAccesses*cyclesPerPio;
+  pathstat_t* stat = &stats[access->word & (PATHCOUNT-1)];
+  ++stat->count;
+  stat->totalCycles += cycles;
+  if (calls) ++stat->calls;
+  if (cycles>stat->worst) {
+    stat->worst = cycles;
+    stat->worstLine = access->lineNum;
+  }
+  if (access->boardCycles>stat->worstBoard) stat->worstBoard = access->boardCycles;
+  if (calls==0 && cycles>budget) {
+    if (overBudget==0) printf("Line %u: %u cycles without call out of the loop\n",access->lineNum,cycles);
+    ++overBudget;
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Listener of pio_host.c
+// Called by GetAppleBusBlocking() of the loop
+//
+static uint32_t Listener(const uint sm) {
+  (void)sm;
+  //The pio0 of GetAppleBusBlocking() is part of the wait
+  EndAccess(host_pio_accesses-1);
+  if (nextAccess==traceCount) longjmp(endOfTrace,1);
+
+  blockCount = 0;
+  calls = 0;
+  host_pio_accesses = 0;
+  return trace[nextAccess++].word;
+}
+
+//////////////////////////////////////////////////////////
+// Load a trace file
+//
+static bool LoadTrace(const char* path) {
+  FILE* f = fopen(path,"r");
+  if (!f) {
+    printf("Cannot open %s\n",path);
+    return false;
+  }
+  trace = (access_t*)malloc(MAXACCESS*sizeof(access_t));
+  char line[128];
+  uint lineNum = 0;
+  while (fgets(line,sizeof(line),f)) {
+    ++lineNum;
+    if (line[0]=='#' || line[0]=='\n' || line[0]=='\r') continue;
+    uint index, word, start, cycles = 0;
+    const int n = sscanf(line,"%u %x %x %u",&index,&word,&start,&cycles);
+    if ((n!=4 && sscanf(line,"%x",&word)!=1) || word>0x1fff || traceCount==MAXACCESS) {
+      printf("%s:%u: invalid line\n",path,lineNum);
+      fclose(f);
+      return false;
+    }
+    trace[traceCount++] = (access_t){(uint16_t)word,(uint16_t)(n==4 ? cycles : 0),lineNum};
+  }
+  fclose(f);
+  return true;
+}
+
+static void PrintReport() {
+  printf("Budget = %u cycles per bus cycle\n",budget);
+  printf("%-14s %7s %7s %7s %7s %7s %7s\n","Path","count","calls","mean","worst","line","board");
+  for (uint path=0; path<PATHCOUNT; ++path) {
+    const pathstat_t* stat = &stats[path];
+    if (stat->count==0) continue;
+    char board[8] = "-";
+    if (stat->worstBoard) snprintf(board,sizeof(board),"%u",stat->worstBoard);
+    printf("%s $C0C%X    %7u %7u %7.1f %7u %7u %7s\n",(path & 0x10)?"Read ":"Write",path & 0x0f,
+           stat->count,stat->calls,(double)stat->totalCycles/stat->count,stat->worst,stat->worstLine,board);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  bool slinky = false;
+  uint clockMHz = 150;
+  const char* path = NULL;
+  for (int i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"-s")==0) slinky = true;
+    else if (strcmp(argv[i],"-c")==0 && i+1<argc) clockMHz = (uint)strtoul(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-b")==0 && i+1<argc) cyclesPerBlock = (uint)strtoul(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-p")==0 && i+1<argc) cyclesPerPio = (uint)strtoul(argv[++i],NULL,0);
+    else if (argv[i][0]!='-' && path==NULL) path = argv[i];
+    else {
+      path = NULL;
+      break;
+    }
+  }
+  if (path==NULL || clockMHz==0) {
+    fprintf(stderr,"Usage: %s [-s] [-c clockMHz] [-b cyclesPerBlock] [-p cyclesPerPioAccess] <trace file>\n",argv[0]);
+    return 2;
+  }
+  if (!LoadTrace(path)) return 1;
+  budget = (uint)((uint64_t)clockMHz*1000000/APPLE_CLOCK_HZ);
+
+  host_pio_listener = Listener;
+  if (setjmp(endOfTrace)==0) {
+    if (slinky) {
+      SlinkyInit();
+      BusLoopSlinky();
+      //Activation sequence detected. The last access includes BusLoopDataInit()
+      //like the board measures it.
+    }
+    BusLoopDataInit();
+    BusLoop();
+  }
+
+  printf("%u accesses, %uMHz, %u cycles/block, %u cycles/PIO access\n",traceCount,clockMHz,cyclesPerBlock,cyclesPerPio);
+  PrintReport();
+  free(trace);
+  if (overBudget) {
+    printf("FAILED: %u accesses without call out of the loop exceed the budget\n",overBudget);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/pio.h"
+#include "defines.h"
+#include "busloop.h"
+#include "cmdhandler.h"
+#include "blockstream.h"
+#include "uthernet2.h"
+#include "romdisk.h"
+#include "rtc.h"
+#include "trim.h"
+#include "userconfig.h"
+#include "network.h"
+#include "misc.h"
+
+/****************************************************************************************
+Command handler test from the 6502 side
+
+BusLoop() (busloop.c) and the command table (cmdhandler.c) run on core 1 like
+core1Main(). The test is the 6502. It reads and writes $C0C0-$C0C3 with A2Read() and
+A2Write(). Each access is one word of the listener FIFO. A read returns the register
+value that BusLoop() has prepared before the access, like the PIO state machine does.
+
+The tests use the command sequences of the 6502 code:
+  1) CMD_RESETPARAMPTR before the error code is read again (readblocks in megaflash.s)
+  2) TESTWIFI and TFTPRUN on a Pico without W report NETERR_NOTPICOW before the
+     Write Enable Key is checked. A wrong key on a Pico W sets MFERR_INVALIDWEKEY.
+  3) An unknown command sets MFERR_UNKNOWNCMD.
+  4) A command written while core 0 executes a long command is deferred. BusLoop()
+     keeps serving the bus and the busy flag stays set until both are done.
+
+  cmdhandler_test
+*****************************************************************************************/
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in a2bus.c
+union {
+  uint8_t  r[16];
+  uint32_t i32[4];
+} registers;
+//--------------------------------------------------------------
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n",__FILE__,__LINE__,#cond); ++failures; } } while(0)
+
+//busloop.c is compiled with the coverage callback of busreplay
+void __sanitizer_cov_trace_pc(void) {
+}
+
+//////////////////////////////////////////////////////////
+// Stubs of the modules called by the command handlers
+// The commands of these modules are not tested here.
+//
+static bool picoW = true;
+bool CheckPicoW() { return picoW; }
+
+volatile bool updateNTPNow = false;
+const uint8_t cpanelData[] = {0};
+const uint32_t cpanelDataLen[] = {0};
+
+streammode_t blockStreamMode = STREAM_NONE;
+bool blockStreamWaiting = false;
+void BlockStreamNextBuffer() {}
+bool EndBlockStream(const uint32_t command) { (void)command; return true; }
+void CompleteBlockStream() {}
+void SetBlockStreamWorkerReady(const bool ready) { (void)ready; }
+void StartReadStream(const uint unitNum, const uint blockNum, const uint count) { (void)unitNum; (void)blockNum; (void)count; }
+void StartWriteStream(const uint unitNum, const uint blockNum, const uint count) { (void)unitNum; (void)blockNum; (void)count; }
+
+void U2_HandleBusAccess(uint32_t busdata, uint8_t *read_byte_out) { (void)busdata; *read_byte_out = 0; }
+
+void EnableRomdisk() {}
+void DisableRomdisk() {}
+void SetRomdiskFirst(bool first) { (void)first; }
+
+bool IsRTCRunning() { return false; }
+void SetNewTimezoneOffset(const int32_t newOffset) { (void)newOffset; }
+void GetProdos25Timestamp(uint8_t *timestamp) { memset(timestamp,0,6); }
+void SetRTCFromProdosTimestamp(uint8_t *timestamp) { (void)timestamp; }
+void SetRTCFromProdos25Timestamp(uint8_t *timestamp) { (void)timestamp; }
+
+void GetTrimStats(trimstats_t* statsOut, const bool reset) { (void)reset; memset(statsOut,0,sizeof(*statsOut)); }
+
+uint8_t GetConfigByte1() { return 0; }
+uint8_t GetConfigByte2() { return 0; }
+int32_t GetTimezoneOffset() { return 0; }
+bool GetNTPClientEnabled() { return false; }
+const char* GetTFTPLastServer() { return ""; }
+void SaveTFTPLastServer(const char* hostname) { (void)hostname; }
+void SaveTrimEnabled(const bool enable) { (void)enable; }
+bool SaveUserSettings(void *settingPtr) { (void)settingPtr; return true; }
+bool SaveWifiSettings(void *settingPtr) { (void)settingPtr; return true; }
+void GetUserSettings(uint8_t* dest) { (void)dest; }
+void EraseUserSettingsFromFlash() {}
+void EraseWifiSettingsFromFlash() {}
+void EraseAdvancedSettingsFromFlash() {}
+void EraseAllSettingsFromFlash() {}
+
+void GetDeviceInfoString(char* dest) { dest[0] = 0; }
+char* strtrim(char* str) { return str; }
+void UDPTask_RequestAbortIfRunning() {}
+bool UDPTask_AbortTimeout_ms(const uint32_t timeout_ms) { (void)timeout_ms; return true; }
+
+//////////////////////////////////////////////////////////
+// Bus between the 6502 (main thread) and BusLoop() (core 1 thread)
+//
+static pthread_mutex_t busMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t busCond = PTHREAD_COND_INITIALIZER;
+static bool busIdle = false;      //BusLoop() waits for the next access
+static bool wordValid = false;
+static uint32_t busWord;
+
+//Listener of pio_host.c. Called by GetAppleBusBlocking() of BusLoop().
+static uint32_t Listener(const uint sm) {
+  (void)sm;
+  pthread_mutex_lock(&busMutex);
+  busIdle = true;
+  pthread_cond_broadcast(&busCond);
+  while (!wordValid) pthread_cond_wait(&busCond,&busMutex);
+  wordValid = false;
+  busIdle = false;
+  const uint32_t word = busWord;
+  pthread_mutex_unlock(&busMutex);
+  return word;
+}
+
+//Core 0 of main.c. It executes the long commands posted by core 1 while core0Run is true.
+static volatile bool core0Run = true;
+
+static void* Core0Thread(void* arg) {
+  (void)arg;
+  for (;;) {
+    if (core0Run) AsyncCommandTask();
+    sleep_us(10);
+  }
+  return NULL;
+}
+
+static void Core1Main() {
+  BusLoopDataInit();
+  BusLoop();
+}
+
+//////////////////////////////////////////////////////////
+// One bus cycle of the 6502
+//
+// Input: addr  - Register address 0-3 ($C0C0-$C0C3)
+//        read  - true for read
+//        data  - Data to write
+//
+// Output: Register value seen by the 6502
+//
+static uint8_t A2Access(const uint addr, const bool read, const uint8_t data) {
+  pthread_mutex_lock(&busMutex);
+  while (!busIdle || wordValid) pthread_cond_wait(&busCond,&busMutex);
+  const uint8_t value = registers.r[addr];
+  busWord = (uint32_t)data<<5 | (read ? 1u<<4 : 0) | addr;
+  wordValid = true;
+  pthread_cond_broadcast(&busCond);
+  pthread_mutex_unlock(&busMutex);
+  return value;
+}
+
+static uint8_t A2Read(const uint addr) { return A2Access(addr,true,0); }
+static void A2Write(const uint addr, const uint8_t data) { A2Access(addr,false,data); }
+
+//Like execute of megaflash.s: write the command and wait until it is not busy
+//Output: Status register
+static uint8_t Execute(const uint8_t command) {
+  A2Write(CMDREG,command);
+  uint8_t status;
+  while ((status = A2Read(STATUSREG)) & BUSYFLAG);
+  return status;
+}
+
+//////////////////////////////////////////////////////////
+// Tests
+//
+static void TestResetParamPtr() {
+  printf("CMD_RESETPARAMPTR\n");
+  Execute(CMD_RESETBOTHPTRS);
+  A2Write(PARAMREG,0x12);
+  A2Write(PARAMREG,0x34);
+  A2Write(PARAMREG,0x56);
+  A2Write(DATAREG,0xa1);
+  A2Write(DATAREG,0xa2);
+
+  //The parameter pointer is back at 0. The data pointer is kept.
+  CHECK(Execute(CMD_RESETPARAMPTR)==0);
+  CHECK(A2Read(PARAMREG)==0x12);
+  CHECK(A2Read(PARAMREG)==0x34);
+  A2Write(DATAREG,0xa3);
+  Execute(CMD_RESETDATAPTR);
+  CHECK(A2Read(DATAREG)==0xa1);
+  CHECK(A2Read(DATAREG)==0xa2);
+  CHECK(A2Read(DATAREG)==0xa3);
+
+  //readblocks reads the error code at parameter 0 after the transfer. The parameter
+  //pointer has advanced by the first read of the error code.
+  Execute(CMD_RESETBOTHPTRS);
+  A2Write(PARAMREG,0);
+  A2Write(PARAMREG,0x77);
+  Execute(CMD_RESETPARAMPTR);
+  CHECK(A2Read(PARAMREG)==0);
+  Execute(CMD_RESETPARAMPTR);
+  CHECK(A2Read(PARAMREG)==0);
+}
+
+static void TestNetworkKeyOrder() {
+  const struct {
+    const char* name;
+    uint8_t command;
+    uint keyIndex;
+  } commands[] = {
+    {"CMD_TESTWIFI",CMD_TESTWIFI,0},
+    {"CMD_TFTPRUN",CMD_TFTPRUN,3},
+  };
+
+  for (uint i=0; i<count_of(commands); ++i) {
+    printf("%s\n",commands[i].name);
+
+    //Pico: NETERR_NOTPICOW without error flag, whatever the key is
+    picoW = false;
+    Execute(CMD_RESETBOTHPTRS);
+    for (uint j=0; j<=commands[i].keyIndex; ++j) A2Write(PARAMREG,0);
+    CHECK(Execute(commands[i].command)==0);
+    Execute(CMD_RESETPARAMPTR);
+    CHECK(A2Read(PARAMREG)==NETERR_NOTPICOW);
+
+    //Pico W: wrong key. The handler is not called.
+    picoW = true;
+    Execute(CMD_RESETBOTHPTRS);
+    for (uint j=0; j<=commands[i].keyIndex; ++j) A2Write(PARAMREG,0);
+    CHECK(Execute(commands[i].command)==(ERRORFLAG|MFERR_INVALIDWEKEY));
+  }
+}
+
+static void TestUnknownCommand() {
+  printf("Unknown command\n");
+  CHECK(Execute(0xff)==(ERRORFLAG|MFERR_UNKNOWNCMD));
+  CHECK(Execute(CMD_RESETBOTHPTRS)==0);
+}
+
+static void TestCommandWhileCore0Busy() {
+  printf("Command written while core 0 executes a long command\n");
+
+  //CMD_FORMATDISK with a wrong Write Enable Key is posted to core 0
+  core0Run = false;
+  Execute(CMD_RESETBOTHPTRS);
+  for (uint i=0; i<5; ++i) A2Write(PARAMREG,0);
+  A2Write(CMDREG,CMD_FORMATDISK);
+  CHECK(A2Read(STATUSREG)&BUSYFLAG);
+
+  //The 6502 does not wait for the busy flag. BusLoop() must not wait for core 0.
+  A2Write(CMDREG,0xff);
+  for (uint i=0; i<100; ++i) CHECK(A2Read(STATUSREG)&BUSYFLAG);
+
+  //The deferred command is executed after core 0 has finished
+  core0Run = true;
+  uint8_t status;
+  while ((status = A2Read(STATUSREG)) & BUSYFLAG);
+  CHECK(status==(ERRORFLAG|MFERR_UNKNOWNCMD));
+  CHECK(Execute(CMD_RESETBOTHPTRS)==0);
+}
+
+int main() {
+  host_pio_listener = Listener;
+  CommandHandlerInit();
+  InitAsyncCommand();
+  multicore_launch_core1(Core1Main);
+
+  pthread_t core0;
+  pthread_create(&core0,NULL,Core0Thread,NULL);
+  pthread_detach(core0);
+  SetAsyncWorkerReady(true);
+
+  TestResetParamPtr();
+  TestNetworkKeyOrder();
+  TestUnknownCommand();
+  TestCommandWhileCore0Busy();
+
+  if (failures) {
+    printf("%d FAILED\n",failures);
+    return 1;
+  }
+  return 0;
+}
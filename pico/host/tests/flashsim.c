@@ -0,0 +1,40 @@
+#include "pico/stdlib.h"
+#include "flash.h"
+#include "mediaaccess.h"
+#include "dmamemops.h"
+#include "readahead.h"
+#include "flashstats.h"
+#include "flashunitmapper.h"
+#include "w25q01.h"
+#include "flashsim.h"
+
+//////////////////////////////////////////////////////////
+// Initialize the firmware modules over a W25Q01 model
+// like main() does
+//
+// Output: true if 4 flash units are found
+//
+bool FlashSim_Init() {
+  host_use_virtual_time();
+  W25Q01_Init(1,&W25Q01_TYPICAL);
+  InitFlashStats();
+  InitSpi();
+  InitFlash();
+  InitDMAChannel();
+  InitReadAhead();
+  SetupFlashUnitMapping();
+  return GetUnitCountFlashActual()==4;
+}
+
+//////////////////////////////////////////////////////////
+// Apple is busy for some time. Then, core 0 runs its
+// background tasks once.
+//
+// Input: us - Time in us
+//
+void FlashSim_Idle(const uint32_t us) {
+  sleep_us(us);
+  ReadAheadTask();
+  FlushSectorCacheIfIdle();
+  LazyEraseTask();
+}
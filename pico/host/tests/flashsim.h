@@ -0,0 +1,23 @@
+#ifndef _FLASHSIM_H
+#define _FLASHSIM_H
+
+//
+// Flash simulator for host tests
+// flash.c and mediaaccess.c over one W25Q01 model (4 units) in virtual time.
+// Core 0 and core 1 are the same thread.
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool FlashSim_Init();
+void FlashSim_Idle(const uint32_t us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
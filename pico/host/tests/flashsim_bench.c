@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "flash.h"
+#include "mediaaccess.h"
+#include "w25q01.h"
+#include "flashsim.h"
+
+/****************************************************************************************
+Flash simulator benchmark
+
+flash.c and mediaaccess.c run over one W25Q01 model (4 units) in virtual time. The
+6502 side is ReadBlock()/WriteBlock() of unit 1. Between two blocks, the Apple is busy
+for the gap time and core 0 runs its background tasks (read-ahead, sector cache flush,
+lazy erase) once. Core 0 and core 1 are the same thread. So, a background task delays
+the next block like the Device Lock does on the Pico.
+
+Phases over blocks 0 to N-1:
+  1) Sequential write to erased flash
+  2) Sequential read
+  3) Random read
+  4) Rewrite with different data. The sector cache is flushed at the end.
+
+For each phase, it reports blocks/s (including the gaps and background tasks), 4kB
+erases per written block, page programs per written block and the latency percentiles
+of ReadBlock()/WriteBlock(). The data read is verified. Exit code is 1 on mismatch.
+
+  flashsim_bench [-n blocks] [-g gapUs] [-m]
+    -n  Number of blocks (default 2048)
+    -g  Gap between blocks in us (default 1000)
+    -m  Print the erase count matrix of the blocks
+*****************************************************************************************/
+
+static uint32_t blockCount = 2048;
+static uint32_t gapUs = 1000;
+static bool printMatrix = false;
+static int failures = 0;
+
+static uint32_t* latencies;
+
+//////////////////////////////////////////////////////////
+// Content of a block. Each generation has different data.
+//
+static void FillBlock(uint8_t* buffer, const uint blockNum, const uint generation) {
+  for (uint i=0; i<BLOCKSIZE; ++i) buffer[i] = (uint8_t)(i*13+blockNum*7+generation*101+(i>>8));
+}
+
+static int CompareLatency(const void* a, const void* b) {
+  const uint32_t x = *(const uint32_t*)a;
+  const uint32_t y = *(const uint32_t*)b;
+  return x<y ? -1 : x>y;
+}
+
+static uint32_t Percentile(const uint32_t* sorted, const uint32_t count, const uint p) {
+  return sorted[(uint64_t)(count-1)*p/100];
+}
+
+//////////////////////////////////////////////////////////
+// Run one phase and print its result
+//
+// Input: name       - Name of the phase
+//        write      - true to write, false to read
+//        random     - Random block order
+//        generation - Data generation to write or to be read
+//
+static void RunPhase(const char* name, const bool write, const bool random, const uint generation) {
+  uint8_t __attribute__((aligned(4))) buffer[BLOCKSIZE];
+  uint8_t __attribute__((aligned(4))) expected[BLOCKSIZE];
+  uint32_t seed = 12345;
+  uint mismatches = 0;
+
+  W25Q01_ResetStats();
+  const uint64_t startTime = time_us_64();
+  for (uint32_t i=0; i<blockCount; ++i) {
+    uint blockNum = i;
+    if (random) {
+      seed = seed*1103515245+12345;
+      blockNum = (seed>>8)%blockCount;
+    }
+    uint8_t spError;
+    const uint64_t opStart = time_us_64();
+    if (write) {
+      FillBlock(buffer,blockNum,generation);
+      WriteBlock(1,blockNum,buffer,&spError);
+    } else {
+      ReadBlock(1,blockNum,buffer,&spError);
+    }
+    latencies[i] = (uint32_t)(time_us_64()-opStart);
+    if (spError!=SP_NOERR) ++mismatches;
+    if (!write) {
+      FillBlock(expected,blockNum,generation);
+      if (memcmp(buffer,expected,BLOCKSIZE)!=0) ++mismatches;
+    }
+    FlashSim_Idle(gapUs);
+  }
+  if (write) tsFlushSectorCache();
+  const uint64_t elapsed = time_us_64()-startTime;
+
+  w25q01_stats_t stats;
+  W25Q01_GetStats(0,&stats);
+  qsort(latencies,blockCount,sizeof(latencies[0]),CompareLatency);
+  const double perBlock = write ? 1.0/blockCount : 0;
+  printf("%-16s %9.1f %12.3f %14.3f %8u %8u %8u %8u\n",name,
+         blockCount*1e6/elapsed,
+         W25Q01_GetTotalErases()*perBlock,
+         stats.pagePrograms*perBlock,
+         Percentile(latencies,blockCount,50),
+         Percentile(latencies,blockCount,90),
+         Percentile(latencies,blockCount,99),
+         latencies[blockCount-1]);
+  if (stats.busyViolations!=0) {
+    printf("FAILED %s: %llu commands sent while the chip was busy\n",name,(unsigned long long)stats.busyViolations);
+    ++failures;
+  }
+  if (mismatches!=0) {
+    printf("FAILED %s: %u blocks with error or wrong data\n",name,mismatches);
+    ++failures;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  for (int i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"-n")==0 && i+1<argc) blockCount = (uint32_t)strtoul(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-g")==0 && i+1<argc) gapUs = (uint32_t)strtoul(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-m")==0) printMatrix = true;
+    else {
+      fprintf(stderr,"Usage: %s [-n blocks] [-g gapUs] [-m]\n",argv[0]);
+      return 2;
+    }
+  }
+  if (blockCount==0 || blockCount>0xffff) {
+    fprintf(stderr,"Number of blocks must be 1-65535\n");
+    return 2;
+  }
+  latencies = (uint32_t*)malloc(blockCount*sizeof(latencies[0]));
+
+  if (!FlashSim_Init()) {
+    printf("FAILED: %u flash units found\n",(uint)GetUnitCountFlashActual());
+    return 1;
+  }
+
+  printf("%u blocks, gap %uus, %u sector cache entries\n",(uint)blockCount,(uint)gapUs,SECTORCACHE_COUNT);
+  printf("%-16s %9s %12s %14s %8s %8s %8s %8s\n","Phase","blocks/s","erases/write","programs/write","p50 us","p90 us","p99 us","max us");
+  RunPhase("seq write",true,false,1);
+  RunPhase("seq read",false,false,1);
+  RunPhase("random read",false,true,1);
+  RunPhase("rewrite",true,false,2);
+  RunPhase("seq read",false,false,2);
+
+  if (printMatrix) {
+    //Block n is in sector n%8192 of the unit. See GetBlockLoc()
+    const uint32_t sectors = blockCount<8192 ? blockCount : 8192;
+    W25Q01_PrintEraseMatrix(stdout,0,0,(sectors*W25Q01_SECTORSIZE+0xffff)&~0xffffu);
+  }
+
+  free(latencies);
+  if (failures) {
+    printf("%d FAILED\n",failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,116 @@
+#include "pico/stdlib.h"
+#include "mediaaccess.h"
+#include "ramunits.h"
+
+/****************************************************************************************
+RAM units
+
+Unit 1-N are images in RAM. They are ProDOS-less images. So, the file size of RRQ is
+the whole unit (GetBlockCountForImageTransfer() = GetBlockCountActual()). There is no
+RAM Disk unit.
+*****************************************************************************************/
+
+static uint unitCount = 0;
+static uint32_t blockCount = 0;
+static uint8_t* images[RAMUNITS_MAX];
+static bool writable[RAMUNITS_MAX];
+static uint32_t writeCount = 0;
+static uint badUnit = 0;        //ReadBlock() of badBlock fails
+static uint32_t badBlock = 0;
+
+void RamUnits_Init(const uint count, const uint32_t blocks) {
+  assert(count<=RAMUNITS_MAX);
+  for (uint i=0; i<unitCount; ++i) free(images[i]);
+  unitCount = count;
+  blockCount = blocks;
+  writeCount = 0;
+  badUnit = 0;
+  for (uint i=0; i<unitCount; ++i) {
+    images[i] = (uint8_t*)malloc(blockCount*BLOCKSIZE);
+    for (uint32_t j=0; j<blockCount*BLOCKSIZE; ++j) images[i][j] = (uint8_t)(j*7+j/BLOCKSIZE+i*31);
+    writable[i] = true;
+  }
+}
+
+uint8_t* RamUnits_GetImage(const uint unitNum) {
+  return images[unitNum-1];
+}
+
+void RamUnits_SetWritable(const uint unitNum, const bool value) {
+  writable[unitNum-1] = value;
+}
+
+uint32_t RamUnits_GetWriteCount() {
+  return writeCount;
+}
+
+//Make ReadBlock() of a block fail. blockNum<0 clears it.
+void RamUnits_SetBadBlock(const uint unitNum, const int32_t blockNum) {
+  badUnit = blockNum<0 ? 0 : unitNum;
+  badBlock = (uint32_t)blockNum;
+}
+
+//
+// mediaaccess.h
+//
+uint GetTotalUnitCount() {
+  return unitCount;
+}
+
+bool IsValidUnitNum(const uint unitNum) {
+  return unitNum>=1 && unitNum<=unitCount;
+}
+
+bool IsUnitWritable(const uint unitNum) {
+  return IsValidUnitNum(unitNum) && writable[unitNum-1];
+}
+
+uint32_t GetBlockCount(const uint unitNum) {
+  return IsValidUnitNum(unitNum) ? blockCount : 0;
+}
+
+uint32_t GetBlockCountActual(const uint unitNum) {
+  return GetBlockCount(unitNum);
+}
+
+uint32_t GetBlockCountForImageTransfer(const uint32_t unitNum) {
+  return GetBlockCount(unitNum);
+}
+
+int GetMediumType(const uint unitNum) {
+  return TYPE_FLASH;
+}
+
+uint GetRamdiskUnitNum() {
+  return 0;
+}
+
+uint ReadBlock(const uint unitNum, const uint blockNum, uint8_t* destBuffer,uint8_t* spErrorOut) {
+  if (!IsValidUnitNum(unitNum) || blockNum>=blockCount) {
+    if (spErrorOut) *spErrorOut = SP_IOERR;
+    return MFERR_INVALIDBLK;
+  }
+  if (unitNum==badUnit && blockNum==badBlock) {
+    if (spErrorOut) *spErrorOut = SP_IOERR;
+    return MFERR_RWERROR;
+  }
+  memcpy(destBuffer,images[unitNum-1]+blockNum*BLOCKSIZE,BLOCKSIZE);
+  if (spErrorOut) *spErrorOut = SP_NOERR;
+  return MFERR_NONE;
+}
+
+uint WriteBlock(const uint unitNum, const uint blockNum, uint8_t* srcBuffer,uint8_t* spErrorOut) {
+  if (!IsUnitWritable(unitNum) || blockNum>=blockCount) {
+    if (spErrorOut) *spErrorOut = SP_NOWRITEERR;
+    return MFERR_RWERROR;
+  }
+  memcpy(images[unitNum-1]+blockNum*BLOCKSIZE,srcBuffer,BLOCKSIZE);
+  ++writeCount;
+  if (spErrorOut) *spErrorOut = SP_NOERR;
+  return MFERR_NONE;
+}
+
+bool WriteBlockForImageTransfer(uint unitNum, const uint blockNum, const uint8_t* srcBuffer) {
+  uint8_t spError;
+  return WriteBlock(unitNum,blockNum,(uint8_t*)srcBuffer,&spError)==MFERR_NONE;
+}
@@ -0,0 +1,28 @@
+#ifndef _RAMUNITS_H
+#define _RAMUNITS_H
+
+//
+// RAM units for tests of the network code
+// Implements the functions of mediaaccess.h used by the TFTP server
+// over images in RAM instead of flash.c/ramdisk.c.
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RAMUNITS_MAX 4
+
+void RamUnits_Init(const uint unitCount, const uint32_t blockCount);
+uint8_t* RamUnits_GetImage(const uint unitNum);
+void RamUnits_SetWritable(const uint unitNum, const bool writable);
+uint32_t RamUnits_GetWriteCount();
+void RamUnits_SetBadBlock(const uint unitNum, const int32_t blockNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
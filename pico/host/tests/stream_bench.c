@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include "pico/stdlib.h"
+#include "usbserial_host.h"
+#include "filetransfer.h"
+#include "imagestream.h"
+#include "dmamemops.h"
+#include "ramunits.h"
+
+/****************************************************************************************
+Image stream benchmark
+
+Measures the throughput of the Image Stream Protocol (imagestream.c) and of XMODEM
+(filetransfer.c) over a pty. The firmware is on the master of the pty like the USB serial
+port of MegaFlash. The other side runs in a child process on the slave.
+
+  xmodem, xmodem1k  Download(2) of the firmware sends drive 2 to Upload(1) of the firmware
+  stream upload     The host side of the protocol sends drive 2 to StreamUpload(1)
+  stream download   StreamDownload(2) sends drive 2 to the host side of the protocol
+  read error        StreamDownload(2) with a block that cannot be read. The host side
+                    must receive ABORT instead of waiting for a timeout.
+
+The host side is a C version of tools/mfstream.py. Its CRC is zlib crc32(). So, the
+test also checks that CRC32Aligned() (the DMA sniffer) is zlib compatible.
+
+For each transfer, it reports seconds and MB/s. The data received is compared with
+drive 2. Exit code is 1 on mismatch or if a stream transfer is not faster than XMODEM-1K.
+
+  stream_bench [-n blocks]
+    -n  Number of blocks (default 2048)
+*****************************************************************************************/
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in busloop.c
+uint8_t __attribute__((aligned(4))) dataBufferPool[2][DATABUFFERSIZE];
+uint8_t* dataBuffer = dataBufferPool[0];
+//--------------------------------------------------------------
+
+//Same as imagestream.c and mfstream.py
+#define FRAME_START   'S'
+#define FRAME_READY   'R'
+#define FRAME_DATA    'D'
+#define FRAME_ACK     'A'
+#define FRAME_NAK     'N'
+#define FRAME_END     'E'
+#define FRAME_ABORT   'X'
+
+#define HEADERSIZE    12
+#define CRCSIZE       4
+#define MAXPAYLOAD    STREAM_FRAMESIZE
+#define RXBUFSIZE     (4*(HEADERSIZE+MAXPAYLOAD+CRCSIZE))
+
+typedef struct {
+  uint8_t  type;
+  uint32_t seq;
+  uint32_t len;
+  bool     crcOk;
+  uint8_t  payload[MAXPAYLOAD];
+} frame_t;
+
+static uint32_t blockCount = 2048;
+static int failures = 0;
+
+//Host side of the pty
+static int peerFd;
+static uint8_t rxBuffer[RXBUFSIZE];
+static uint32_t rxLen = 0;
+static bool peerAborted = false;   //ABORT received
+
+//////////////////////////////////////////////////////////
+// Send a frame to the firmware
+//
+static void PeerSend(const uint8_t type, const uint32_t seq, const void* payload, const uint32_t len) {
+  static uint8_t buffer[HEADERSIZE+MAXPAYLOAD+CRCSIZE];
+  buffer[0] = 'M';
+  buffer[1] = 'F';
+  buffer[2] = type;
+  buffer[3] = 0;
+  memcpy(buffer+4,&seq,4);
+  memcpy(buffer+8,&len,4);
+  if (len) memcpy(buffer+HEADERSIZE,payload,len);
+  const uint32_t crc = (uint32_t)crc32(0,buffer,HEADERSIZE+len);
+  memcpy(buffer+HEADERSIZE+len,&crc,CRCSIZE);
+
+  const uint8_t* p = buffer;
+  size_t remaining = HEADERSIZE+len+CRCSIZE;
+  while (remaining) {
+    const ssize_t count = write(peerFd,p,remaining);
+    if (count<=0) return;
+    p += count;
+    remaining -= (size_t)count;
+  }
+}
+
+static inline void DropBytes(const uint32_t count) {
+  memmove(rxBuffer,rxBuffer+count,rxLen-count);
+  rxLen -= count;
+}
+
+//////////////////////////////////////////////////////////
+// Parse a frame in the receive buffer. Same as FramePort._parse() of mfstream.py
+//
+// Output: true if a frame is returned
+//
+static bool ParseFrame(frame_t* frame) {
+  for (;;) {
+    const uint8_t* start = memmem(rxBuffer,rxLen,"MF",2);
+    if (start==NULL) {
+      DropBytes(rxLen && rxBuffer[rxLen-1]=='M' ? rxLen-1 : rxLen);   //Keep 'M' at the end
+      return false;
+    }
+    DropBytes((uint32_t)(start-rxBuffer));
+    if (rxLen<HEADERSIZE) return false;
+
+    uint32_t seq, len;
+    memcpy(&seq,rxBuffer+4,4);
+    memcpy(&len,rxBuffer+8,4);
+    if (len%4!=0 || len>MAXPAYLOAD) {
+      DropBytes(1);   //False sync
+      continue;
+    }
+    const uint32_t total = HEADERSIZE+len+CRCSIZE;
+    if (rxLen<total) return false;
+
+    uint32_t crc;
+    memcpy(&crc,rxBuffer+HEADERSIZE+len,CRCSIZE);
+    frame->type = rxBuffer[2];
+    frame->crcOk = crc==(uint32_t)crc32(0,rxBuffer,HEADERSIZE+len);
+    if (!frame->crcOk && frame->type!=FRAME_DATA) {
+      DropBytes(1);   //Broken control frame
+      continue;
+    }
+    frame->seq = seq;
+    frame->len = len;
+    memcpy(frame->payload,rxBuffer+HEADERSIZE,len);
+    DropBytes(total);
+    return true;
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Receive a frame from the firmware
+//
+// Output: true if a frame is received. false if timeout.
+//
+static bool PeerReceive(frame_t* frame, const uint32_t timeoutMs) {
+  const uint64_t deadline = time_us_64()+timeoutMs*1000ull;
+  for (;;) {
+    if (ParseFrame(frame)) return true;
+    const uint64_t now = time_us_64();
+    if (now>=deadline) return false;
+
+    struct pollfd pfd = {peerFd,POLLIN,0};
+    if (poll(&pfd,1,(int)((deadline-now+999)/1000))<=0) continue;
+    const ssize_t count = read(peerFd,rxBuffer+rxLen,RXBUFSIZE-rxLen);
+    if (count<=0) return false;   //Port closed
+    rxLen += (uint32_t)count;
+  }
+}
+
+//////////////////////////////////////////////////////////
+// START and READY
+//
+// Input: count - Number of blocks to upload. 0 for download.
+//
+// Output: READY frame. NULL if no response.
+//
+static const uint32_t* PeerStart(const uint32_t count, frame_t* frame) {
+  for (uint i=0; i<STREAM_MAXERROR; ++i) {
+    PeerSend(FRAME_START,0,&count,4);
+    while (PeerReceive(frame,STREAM_TIMEOUT_MS)) {
+      if (frame->type==FRAME_READY && frame->len>=12) return (const uint32_t*)frame->payload;
+      if (frame->type==FRAME_ABORT) return NULL;
+    }
+  }
+  return NULL;
+}
+
+static bool PeerWaitEnd(frame_t* frame, uint32_t* resultOut) {
+  for (uint i=0; i<STREAM_MAXERROR; ++i) {
+    if (!PeerReceive(frame,STREAM_TIMEOUT_MS)) continue;
+    if (frame->type==FRAME_ABORT) return false;
+    if (frame->type==FRAME_END && frame->len>=4) {
+      memcpy(resultOut,frame->payload,4);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void PeerSendData(const uint8_t* image, const uint32_t seq, const uint32_t frameBlocks) {
+  const uint32_t count = MIN(frameBlocks,blockCount-seq*frameBlocks);
+  PeerSend(FRAME_DATA,seq,image+seq*frameBlocks*BLOCKSIZE,count*BLOCKSIZE);
+}
+
+//////////////////////////////////////////////////////////
+// Host to firmware. Same as upload() of mfstream.py
+//
+static bool PeerUpload(const uint8_t* image) {
+  static frame_t frame;
+  const uint32_t* ready = PeerStart(blockCount,&frame);
+  if (ready==NULL) return false;
+  const uint32_t frameBlocks = ready[1];
+  const uint32_t window = ready[2];
+  const uint32_t frameCount = (blockCount+frameBlocks-1)/frameBlocks;
+
+  uint32_t base = 0, nextSend = 0;
+  uint errorCount = 0;
+  while (base<frameCount) {
+    for (; nextSend<frameCount && nextSend<base+window; ++nextSend) {
+      PeerSendData(image,nextSend,frameBlocks);
+    }
+
+    if (!PeerReceive(&frame,STREAM_TIMEOUT_MS)) {
+      if (++errorCount>STREAM_MAXERROR) return false;
+      PeerSendData(image,base,frameBlocks);
+      continue;
+    }
+    if (frame.type==FRAME_ACK && frame.seq>base) {
+      base = frame.seq;
+      errorCount = 0;
+    } else if (frame.type==FRAME_NAK && frame.seq>=base && frame.seq<nextSend) {
+      PeerSendData(image,frame.seq,frameBlocks);
+    } else if (frame.type==FRAME_ABORT) {
+      return false;
+    }
+  }
+
+  uint32_t verificationErrorCount;
+  return PeerWaitEnd(&frame,&verificationErrorCount) && verificationErrorCount==0;
+}
+
+//////////////////////////////////////////////////////////
+// Firmware to host. Same as download() of mfstream.py
+//
+// Input: image - Buffer to receive the image of blockCount blocks
+//
+static bool PeerDownload(uint8_t* image) {
+  static frame_t frame;
+  const uint32_t* ready = PeerStart(0,&frame);
+  if (ready==NULL || ready[0]!=blockCount) return false;
+  const uint32_t frameBlocks = ready[1];
+  const uint32_t window = ready[2];
+  const uint32_t frameSize = frameBlocks*BLOCKSIZE;
+  const uint32_t frameCount = (blockCount+frameBlocks-1)/frameBlocks;
+  bool* received = (bool*)calloc(frameCount,sizeof(bool));
+  bool* naked = (bool*)calloc(frameCount,sizeof(bool));
+
+  uint32_t expected = 0;
+  uint errorCount = 0;
+  bool success = false;
+  while (expected<frameCount) {
+    if (!PeerReceive(&frame,STREAM_TIMEOUT_MS)) {
+      if (++errorCount>STREAM_MAXERROR) goto exit;
+      PeerSend(FRAME_NAK,expected,NULL,0);
+      continue;
+    }
+    if (frame.type==FRAME_ABORT) {
+      peerAborted = true;
+      goto exit;
+    }
+    if (frame.type!=FRAME_DATA || frame.seq<expected || frame.seq>=expected+window || frame.seq>=frameCount) continue;
+    if (!frame.crcOk) {
+      PeerSend(FRAME_NAK,frame.seq,NULL,0);
+      continue;
+    }
+
+    memcpy(image+frame.seq*frameSize,frame.payload,frame.len);
+    received[frame.seq] = true;
+    for (uint32_t seq=expected; seq<frame.seq; ++seq) {
+      if (!received[seq] && !naked[seq]) {
+        naked[seq] = true;
+        PeerSend(FRAME_NAK,seq,NULL,0);
+      }
+    }
+    while (expected<frameCount && received[expected]) {
+      ++expected;
+      errorCount = 0;
+    }
+    PeerSend(FRAME_ACK,expected,NULL,0);
+  }
+  uint32_t zero;
+  success = PeerWaitEnd(&frame,&zero);
+
+exit:
+  free(received);
+  free(naked);
+  return success;
+}
+
+//////////////////////////////////////////////////////////
+// Open a raw pty and fork
+//
+// Output: Master of the pty in the parent, slave in the child. -1 if failed.
+//
+static int ForkOnPty(pid_t* pid) {
+  int master, slave;
+  if (openpty(&master,&slave,NULL,NULL,NULL)!=0) return -1;
+  struct termios tio;
+  tcgetattr(slave,&tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave,TCSANOW,&tio);
+
+  *pid = fork();
+  if (*pid==0) {
+    close(master);
+    return slave;
+  }
+  close(slave);
+  return master;
+}
+
+static int WaitExitCode(const pid_t pid) {
+  int status;
+  waitpid(pid,&status,0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+typedef struct {
+  const char* name;
+  const char* direction;
+  uint64_t us;
+  bool success;
+} result_t;
+
+static result_t results[4];
+static uint resultCount = 0;
+
+//////////////////////////////////////////////////////////
+// Record the result of a transfer
+//
+// Output: MB/s
+//
+static double AddResult(const char* name, const char* direction, const uint64_t us, const bool success) {
+  results[resultCount++] = (result_t){name,direction,us,success};
+  if (!success) ++failures;
+  return us ? (double)blockCount*BLOCKSIZE/us : 0;
+}
+
+static void PrintResults() {
+  printf("\n%-10s %-9s %7s %9s %8s\n","Protocol","Direction","blocks","seconds","MB/s");
+  for (uint i=0; i<resultCount; ++i) {
+    const result_t* r = &results[i];
+    printf("%-10s %-9s %7u %9.2f %8.2f %s\n",r->name,r->direction,(uint)blockCount,r->us/1e6,
+           r->us ? (double)blockCount*BLOCKSIZE/r->us : 0,r->success?"match":"FAILED");
+  }
+}
+
+static bool CheckDrive1() {
+  return memcmp(RamUnits_GetImage(1),RamUnits_GetImage(2),blockCount*BLOCKSIZE)==0;
+}
+
+//////////////////////////////////////////////////////////
+// Download() of the firmware to Upload() of the firmware
+//
+static double RunXModem(const char* name, const enum TxProtocol protocol) {
+  memset(RamUnits_GetImage(1),0,blockCount*BLOCKSIZE);
+  pid_t pid;
+  const int fd = ForkOnPty(&pid);
+  if (fd<0) return AddResult(name,"upload",0,false);
+  if (pid==0) {
+    host_serial_open(fd);
+    Download(2,protocol);
+    exit(0);
+  }
+  host_serial_open(fd);
+  const uint64_t start = time_us_64();
+  Upload(1);
+  const uint64_t elapsed = time_us_64()-start;
+  WaitExitCode(pid);   //Closing the master first would drop the ACK of EOT
+  close(fd);
+  return AddResult(name,"upload",elapsed,CheckDrive1());
+}
+
+//////////////////////////////////////////////////////////
+// Host side to StreamUpload()
+//
+static double RunStreamUpload() {
+  memset(RamUnits_GetImage(1),0,blockCount*BLOCKSIZE);
+  pid_t pid;
+  const int fd = ForkOnPty(&pid);
+  if (fd<0) return AddResult("stream","upload",0,false);
+  if (pid==0) {
+    peerFd = fd;
+    exit(PeerUpload(RamUnits_GetImage(2)) ? 0 : 1);
+  }
+  host_serial_open(fd);
+  const uint64_t start = time_us_64();
+  StreamUpload(1);
+  const uint64_t elapsed = time_us_64()-start;
+  const bool peerOk = WaitExitCode(pid)==0;   //Closing the master first would drop END
+  close(fd);
+  return AddResult("stream","upload",elapsed,peerOk && CheckDrive1());
+}
+
+//////////////////////////////////////////////////////////
+// StreamDownload() to host side
+// The child compares the image received with its copy of drive 2.
+//
+static double RunStreamDownload() {
+  pid_t pid;
+  const int fd = ForkOnPty(&pid);
+  if (fd<0) return AddResult("stream","download",0,false);
+  if (pid==0) {
+    peerFd = fd;
+    uint8_t* image = (uint8_t*)calloc(blockCount,BLOCKSIZE);
+    const bool success = PeerDownload(image) && memcmp(image,RamUnits_GetImage(2),blockCount*BLOCKSIZE)==0;
+    exit(success ? 0 : 1);
+  }
+  host_serial_open(fd);
+  const uint64_t start = time_us_64();
+  StreamDownload(2);
+  const uint64_t elapsed = time_us_64()-start;
+  const bool peerOk = WaitExitCode(pid)==0;
+  close(fd);
+  return AddResult("stream","download",elapsed,peerOk);
+}
+
+//////////////////////////////////////////////////////////
+// StreamDownload() of a drive with a bad block
+// The child exits with 3 if the session is aborted by the firmware.
+//
+static void RunStreamReadError() {
+  printf("stream download with read error\n");
+  RamUnits_SetBadBlock(2,blockCount/2);
+  pid_t pid;
+  const int fd = ForkOnPty(&pid);
+  if (fd<0) {
+    ++failures;
+    return;
+  }
+  if (pid==0) {
+    peerFd = fd;
+    uint8_t* image = (uint8_t*)calloc(blockCount,BLOCKSIZE);
+    PeerDownload(image);
+    exit(peerAborted ? 3 : 1);
+  }
+  host_serial_open(fd);
+  StreamDownload(2);
+  const int exitCode = WaitExitCode(pid);
+  close(fd);
+  RamUnits_SetBadBlock(2,-1);
+  if (exitCode!=3) {
+    printf("FAILED: the host side did not receive ABORT\n");
+    ++failures;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  for (int i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"-n")==0 && i+1<argc) blockCount = (uint32_t)strtoul(argv[++i],NULL,0);
+    else {
+      fprintf(stderr,"Usage: %s [-n blocks]\n",argv[0]);
+      return 2;
+    }
+  }
+  if (blockCount==0 || blockCount>0xffff) {
+    fprintf(stderr,"Number of blocks must be 1-65535\n");
+    return 2;
+  }
+
+  //Messages of the firmware are not buffered like USB serial
+  setvbuf(stdout,NULL,_IONBF,0);
+  signal(SIGPIPE,SIG_IGN);
+  InitDMAChannel();
+  RamUnits_Init(2,blockCount);
+  uint32_t seed = 12345;
+  uint8_t* image = RamUnits_GetImage(2);
+  for (uint32_t i=0; i<blockCount*BLOCKSIZE; ++i) {
+    seed = seed*1103515245+12345;
+    image[i] = (uint8_t)(seed>>16);
+  }
+
+  RunXModem("xmodem",XMODEM128);
+  const double xmodem1k = RunXModem("xmodem1k",XMODEM1K);
+  const double upload = RunStreamUpload();
+  const double download = RunStreamDownload();
+  RunStreamReadError();
+
+  PrintResults();
+  printf("Stream/XMODEM-1K: upload %.1fx, download %.1fx\n",upload/xmodem1k,download/xmodem1k);
+  if (upload<=xmodem1k || download<=xmodem1k) {
+    printf("FAILED: stream is not faster than XMODEM-1K\n");
+    ++failures;
+  }
+  if (failures) {
+    printf("%d FAILED\n",failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "tftpservertask.h"
+#include "tftpstate.h"
+#include "ramunits.h"
+
+/****************************************************************************************
+TFTP Server Mode test
+
+CTFTPServerTask runs in a thread over the host UDP stack (lwip_host.c) and RAM units.
+curl is the TFTP client:
+  1) RRQ of unit1.po with blksize 512 and 1024. The file must match the unit.
+  2) RRQ of a file which does not exist. curl must report "File not found".
+  3) WRQ with write disabled. curl must report "Access violation". Unit unchanged.
+  4) WRQ with write enabled. The unit must match the uploaded file. The Data packets
+     are received in chains of pbufs.
+  5) WRQ of a read-only unit. curl must report "Access violation".
+  6) WRQ with write enabled while the Apple is connected. curl must report "Access
+     violation". Unit unchanged.
+
+The test is skipped (exit code 77) if curl is not installed.
+*****************************************************************************************/
+
+extern "C" volatile tftp_state_t tftp_state;
+
+//curl exit codes
+static const int CURLE_OK = 0;
+static const int CURLE_TFTP_NOTFOUND = 68;
+static const int CURLE_TFTP_PERM = 69;
+
+static const uint32_t UNIT_BLOCKS = 1600;    //800kB
+static int failures = 0;
+
+//Replace the weak stub of board_host.c
+static volatile bool appleConnected = false;
+extern "C" bool WasAppleConnected() {
+  return appleConnected;
+}
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n",__FILE__,__LINE__,#cond); ++failures; } } while(0)
+
+//////////////////////////////////////////////////////////
+// Find a free UDP port
+//
+static uint16_t GetFreePort() {
+  const int fd = socket(AF_INET,SOCK_DGRAM,0);
+  struct sockaddr_in sa = {};
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd,(struct sockaddr*)&sa,sizeof(sa));
+  socklen_t len = sizeof(sa);
+  getsockname(fd,(struct sockaddr*)&sa,&len);
+  close(fd);
+  return ntohs(sa.sin_port);
+}
+
+//////////////////////////////////////////////////////////
+// Run curl and return its exit code
+//
+static int Curl(const std::string& args) {
+  const std::string cmd = "curl -s -S --max-time 60 "+args;
+  printf("$ %s\n",cmd.c_str());
+  fflush(stdout);
+  const int status = system(cmd.c_str());
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static std::vector<uint8_t> ReadFile(const char* path) {
+  std::vector<uint8_t> data;
+  FILE* f = fopen(path,"rb");
+  if (f==NULL) return data;
+  uint8_t buffer[4096];
+  size_t n;
+  while ((n=fread(buffer,1,sizeof(buffer),f))!=0) data.insert(data.end(),buffer,buffer+n);
+  fclose(f);
+  return data;
+}
+
+static void WriteFile(const char* path,const uint8_t* data,const size_t len) {
+  FILE* f = fopen(path,"wb");
+  fwrite(data,1,len,f);
+  fclose(f);
+}
+
+static bool UnitEquals(const uint unitNum,const std::vector<uint8_t>& data) {
+  return data.size()==UNIT_BLOCKS*BLOCKSIZE &&
+         memcmp(RamUnits_GetImage(unitNum),data.data(),data.size())==0;
+}
+
+//////////////////////////////////////////////////////////
+// Server thread
+//
+class CServer {
+public:
+  CServer(const uint16_t port,const bool writeEnabled) {
+    InitTFTPState();
+    tftp_state.dir = 2;
+    tftp_state.serverWriteEnabled = writeEnabled;
+    thread = std::thread([=]() {
+      CTFTPServerTask task(1000,5,port,TFTP_WINDOWSIZE_DEFAULT,writeEnabled);
+      try {
+        task.Run("HOST","");
+      } catch(int e) {
+        exitCode = e;
+      }
+    });
+
+    WaitListening();
+  }
+
+  ~CServer() {
+    CUDPTask::AbortTimeout_ms(5000);
+    thread.join();
+  }
+
+  //After the last ACK of WRQ, the server waits for TFTP_TIMEOUT_LASTACK_MIN in case
+  //the ACK is lost. Then, it listens again.
+  bool WaitListening() {
+    for (int i=0; i<2000 && tftp_state.status!=TFTPSTATUS_LISTENING; ++i) sleep_ms(5);
+    return tftp_state.status==TFTPSTATUS_LISTENING;
+  }
+  int exitCode = CUDPTask::ERR_NONE;
+
+private:
+  std::thread thread;
+};
+
+
+int main() {
+  if (system("curl --version >/dev/null 2>&1")!=0) {
+    printf("curl not found. Test skipped\n");
+    return 77;
+  }
+
+  char dir[] = "/tmp/tftpserver_test.XXXXXX";
+  if (mkdtemp(dir)==NULL) return 1;
+  const std::string downloadPath = std::string(dir)+"/download.po";
+  const std::string uploadPath = std::string(dir)+"/upload.po";
+
+  RamUnits_Init(2,UNIT_BLOCKS);
+  const std::vector<uint8_t> original(RamUnits_GetImage(1),RamUnits_GetImage(1)+UNIT_BLOCKS*BLOCKSIZE);
+  std::vector<uint8_t> upload(original.size());
+  for (size_t i=0; i<upload.size(); ++i) upload[i] = (uint8_t)(i*13+i/4096);
+  WriteFile(uploadPath.c_str(),upload.data(),upload.size());
+
+  const uint16_t port = GetFreePort();
+  const std::string url = "tftp://127.0.0.1:"+std::to_string(port)+"/";
+
+  {
+    //
+    // Write disabled
+    //
+    CServer server(port,false);
+    CHECK(server.WaitListening());
+
+    for (const char* blksize : {"512","1024"}) {
+      unlink(downloadPath.c_str());
+      CHECK(Curl(std::string("--tftp-blksize ")+blksize+" -o "+downloadPath+" "+url+"unit1.po")==CURLE_OK);
+      CHECK(UnitEquals(1,ReadFile(downloadPath.c_str())));
+    }
+
+    CHECK(Curl("-o "+downloadPath+" "+url+"nosuchfile.po")==CURLE_TFTP_NOTFOUND);
+
+    CHECK(Curl("-T "+uploadPath+" "+url+"unit1.po")==CURLE_TFTP_PERM);
+    CHECK(RamUnits_GetWriteCount()==0);
+    CHECK(UnitEquals(1,original));
+  }
+
+  {
+    //
+    // Write enabled
+    //
+    CServer server(port,true);
+    CHECK(server.WaitListening());
+
+    //Data packets arrive in chains of pbufs. The server linearizes them.
+    host_lwip_rx_segment = 300;
+
+    CHECK(Curl("--tftp-blksize 1024 -T "+uploadPath+" "+url+"UNIT1.PO")==CURLE_OK);
+    CHECK(UnitEquals(1,upload));
+    CHECK(RamUnits_GetWriteCount()==UNIT_BLOCKS);
+    CHECK(server.WaitListening());
+    CHECK(tftp_state.error==TFTPERROR_NOERR);
+
+    RamUnits_SetWritable(2,false);
+    CHECK(Curl("-T "+uploadPath+" "+url+"unit2.po")==CURLE_TFTP_PERM);
+
+    //Units are read-only while the Apple is connected
+    RamUnits_SetWritable(2,true);
+    appleConnected = true;
+    CHECK(Curl("-T "+uploadPath+" "+url+"unit2.po")==CURLE_TFTP_PERM);
+    CHECK(RamUnits_GetWriteCount()==UNIT_BLOCKS);
+    CHECK(server.WaitListening());
+    appleConnected = false;
+  }
+
+  unlink(downloadPath.c_str());
+  unlink(uploadPath.c_str());
+  rmdir(dir);
+
+  printf("%s\n",failures==0?"PASSED":"FAILED");
+  return failures==0 ? 0 : 1;
+}
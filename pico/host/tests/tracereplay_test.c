@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "flash.h"
+#include "mediaaccess.h"
+#include "formatter.h"
+#include "w25q01.h"
+#include "flashsim.h"
+
+/****************************************************************************************
+Block trace replay test
+
+Replays a trace of ProDOS block reads and writes (e.g. traces/prodos_copy.trace) on the
+flash simulator and reports the 4kB erases per written block. Unit 1 is formatted first.
+
+  1) The trace is replayed on the freshly formatted unit.
+  2) The trace is replayed again. Every block written has been written before. So,
+     without the sector cache, each written block would need an erase.
+
+Between two blocks, the Apple is busy for 1ms (see FlashSim_Idle()). The sector cache is
+flushed at the end of each pass and the erases of the flush are counted. A block read
+back must have the data last written to it. The test fails if the second pass needs an
+erase for every written block, i.e. the sector cache merges no rewrite.
+
+  tracereplay_test <trace file>
+*****************************************************************************************/
+
+#define GAP_US 1000
+#define MAXOPS 65536
+
+typedef struct {
+  char rw;
+  uint8_t unitNum;
+  uint16_t blockNum;
+} op_t;
+
+static op_t ops[MAXOPS];
+static uint opCount = 0;
+static uint16_t generation[65536];    //Data generation of each block of unit 1. 0=not written
+static uint sequence = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAILED %s:%d: %s\n",__FILE__,__LINE__,#cond); ++failures; } } while(0)
+
+static void FillBlock(uint8_t* buffer, const uint blockNum, const uint gen) {
+  for (uint i=0; i<BLOCKSIZE; ++i) buffer[i] = (uint8_t)(i*29+blockNum*3+gen*71+(i>>7));
+}
+
+//////////////////////////////////////////////////////////
+// Load a trace file
+// Each line is "<R|W> <unit> <block>". # starts a comment.
+//
+static bool LoadTrace(const char* path) {
+  FILE* f = fopen(path,"r");
+  if (!f) {
+    printf("Cannot open %s\n",path);
+    return false;
+  }
+  char line[128];
+  uint lineNum = 0;
+  while (fgets(line,sizeof(line),f)) {
+    ++lineNum;
+    if (line[0]=='#' || line[0]=='\n') continue;
+    char rw;
+    uint unitNum, blockNum;
+    if (sscanf(line," %c %u %u",&rw,&unitNum,&blockNum)!=3 || (rw!='R' && rw!='W') ||
+        unitNum<1 || unitNum>4 || blockNum>0xffff || opCount==MAXOPS) {
+      printf("%s:%u: invalid line\n",path,lineNum);
+      fclose(f);
+      return false;
+    }
+    ops[opCount++] = (op_t){rw,(uint8_t)unitNum,(uint16_t)blockNum};
+  }
+  fclose(f);
+  return true;
+}
+
+//////////////////////////////////////////////////////////
+// Replay the trace once and print the result
+//
+// Output: Erases per written block
+//
+static double Replay(const char* name) {
+  uint8_t __attribute__((aligned(4))) buffer[BLOCKSIZE];
+  uint8_t __attribute__((aligned(4))) expected[BLOCKSIZE];
+  uint writes = 0;
+  uint mismatches = 0;
+
+  W25Q01_ResetStats();
+  const uint64_t startTime = time_us_64();
+  for (uint i=0; i<opCount; ++i) {
+    const op_t* op = &ops[i];
+    uint8_t spError;
+    if (op->rw=='W') {
+      //Only unit 1 is tracked. The other units get the same data each time.
+      const uint gen = op->unitNum==1 ? ++sequence : 1;
+      if (op->unitNum==1) generation[op->blockNum] = (uint16_t)gen;
+      FillBlock(buffer,op->blockNum,gen);
+      WriteBlock(op->unitNum,op->blockNum,buffer,&spError);
+      ++writes;
+    } else {
+      ReadBlock(op->unitNum,op->blockNum,buffer,&spError);
+      if (op->unitNum==1 && generation[op->blockNum]!=0) {
+        FillBlock(expected,op->blockNum,generation[op->blockNum]);
+        if (memcmp(buffer,expected,BLOCKSIZE)!=0) ++mismatches;
+      }
+    }
+    if (spError!=SP_NOERR) ++mismatches;
+    FlashSim_Idle(GAP_US);
+  }
+  tsFlushSectorCache();
+  const uint64_t elapsed = time_us_64()-startTime;
+
+  w25q01_stats_t stats;
+  W25Q01_GetStats(0,&stats);
+  const uint64_t erases = W25Q01_GetTotalErases();
+  const double erasesPerWrite = writes ? (double)erases/writes : 0;
+  printf("%-12s %6u %7u %8llu %12.3f %10.2f\n",name,opCount,writes,(unsigned long long)erases,
+         erasesPerWrite,elapsed/1e6);
+  CHECK(mismatches==0);
+  CHECK(stats.busyViolations==0);
+  return erasesPerWrite;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc!=2) {
+    fprintf(stderr,"Usage: %s <trace file>\n",argv[0]);
+    return 2;
+  }
+  if (!LoadTrace(argv[1])) return 1;
+  if (!FlashSim_Init()) {
+    printf("FAILED: %u flash units found\n",(uint)GetUnitCountFlashActual());
+    return 1;
+  }
+
+  const char volName[] = "COPY";
+  CHECK(FormatUnit(1,0xffff,volName,sizeof(volName)-1));
+  tsFlushSectorCache();
+
+  printf("%u sector cache entries\n",SECTORCACHE_COUNT);
+  printf("%-12s %6s %7s %8s %12s %10s\n","Pass","ops","writes","erases","erases/write","seconds");
+  Replay("formatted");
+  const double rewrite = Replay("rewrite");
+  CHECK(rewrite<1.0);
+
+  if (failures) {
+    printf("%d FAILED\n",failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pty.h>
+#include <termios.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "pico/stdlib.h"
+#include "usbserial_host.h"
+#include "filetransfer.h"
+#include "zmodem.h"
+#include "dmamemops.h"
+#include "ramunits.h"
+
+/****************************************************************************************
+File transfer protocol test
+
+Loopback (default)
+The sender and the receiver of the firmware run in two processes connected by a
+socketpair. The sender is Download*() of drive 2. The receiver is Upload*() to drive 1.
+So, both directions of the protocol are firmware code. Drive 1 must be the same as
+drive 2 at the end. The first 4kB of drive 2 are the bytes escaped by ZMODEM (ZDLE,
+XON, XOFF, CR after @ etc.). With -e, the bytes sent by both sides are corrupted at
+the error rate. Only ZMODEM recovers from errors. XMODEM retransmits a packet but gives
+up after 10 errors. YMODEM-G aborts by design.
+With -b, a block of drive 2 cannot be read (ZMODEM only). The sender must cancel the
+transfer. So, the last block of drive 1 must not be written.
+
+lrzsz (-l, ZMODEM only)
+sz and rz of lrzsz run on the slave of a pty. The firmware is on the master like the
+USB serial port of MegaFlash.
+  1) "sz -b" uploads a copy of drive 2 to drive 1.
+  2) DownloadZModem(2) sends drive 2 to "rz -b -y" in a temporary directory.
+The exit code is 77 (skipped) if sz or rz is not installed.
+
+  transfer_test [-n blocks] [-e errorRate] [-b badBlock] [-l] <xmodem|xmodem1k|ymodemg|zmodem>
+*****************************************************************************************/
+
+#define SKIPPED 77
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in busloop.c
+uint8_t __attribute__((aligned(4))) dataBufferPool[2][DATABUFFERSIZE];
+uint8_t* dataBuffer = dataBufferPool[0];
+//--------------------------------------------------------------
+
+typedef enum {
+  PROTOCOL_XMODEM,
+  PROTOCOL_XMODEM1K,
+  PROTOCOL_YMODEMG,
+  PROTOCOL_ZMODEM
+} protocol_t;
+
+static uint32_t blockCount = 256;
+static double errorRate = 0;
+static int32_t badBlock = -1;
+
+//////////////////////////////////////////////////////////
+// Fill the first 4kB of drive 2 with the bytes escaped by the protocols
+//
+static void FillSpecialBytes() {
+  static const uint8_t special[] = {0x18,0x10,0x11,0x13,0x90,0x91,0x93,'@','\r',0x8d,0x7f,0xff,'*'};
+  uint8_t* image = RamUnits_GetImage(2);
+  const uint32_t len = MIN(blockCount*BLOCKSIZE,4096u);
+  for (uint32_t i=0; i<len; ++i) image[i] = special[i%sizeof(special)];
+}
+
+static void Send(const protocol_t protocol) {
+  if (protocol==PROTOCOL_XMODEM) Download(2,XMODEM128);
+  else if (protocol==PROTOCOL_XMODEM1K) Download(2,XMODEM1K);
+  else if (protocol==PROTOCOL_YMODEMG) DownloadYModemG(2);
+  else DownloadZModem(2);
+}
+
+static void Receive(const protocol_t protocol) {
+  if (protocol==PROTOCOL_YMODEMG) UploadYModemG(1);
+  else if (protocol==PROTOCOL_ZMODEM) UploadZModem(1);
+  else Upload(1);
+}
+
+static bool CheckDrive1(const char* name, const double seconds) {
+  const bool match = memcmp(RamUnits_GetImage(1),RamUnits_GetImage(2),blockCount*BLOCKSIZE)==0;
+  printf("\n%s: %u blocks, %s, %.2fs\n",name,(uint)blockCount,match?"match":"MISMATCH",seconds);
+  return match;
+}
+
+//////////////////////////////////////////////////////////
+// Firmware to firmware over a socketpair
+//
+static bool Loopback(const protocol_t protocol) {
+  int sv[2];
+  if (socketpair(AF_UNIX,SOCK_STREAM,0,sv)!=0) return false;
+
+  const pid_t pid = fork();
+  if (pid==0) {
+    close(sv[0]);
+    host_serial_open(sv[1]);
+    host_serial_set_noise(errorRate,2);
+    Send(protocol);
+    exit(0);
+  }
+  close(sv[1]);
+  host_serial_open(sv[0]);
+  host_serial_set_noise(errorRate,1);
+  const uint64_t start = time_us_64();
+  Receive(protocol);
+  const double seconds = (time_us_64()-start)/1e6;
+  close(sv[0]);
+  waitpid(pid,NULL,0);
+  if (badBlock<0) return CheckDrive1("loopback",seconds);
+
+  const uint8_t* lastBlock = RamUnits_GetImage(1)+(blockCount-1)*BLOCKSIZE;
+  bool written = false;
+  for (uint i=0; i<BLOCKSIZE; ++i) written |= lastBlock[i]!=0;
+  printf("\nread error at block %d: %s, %.2fs\n",(int)badBlock,written?"NOT CANCELLED":"cancelled",seconds);
+  return !written;
+}
+
+//////////////////////////////////////////////////////////
+// Run a program of lrzsz on the slave of a pty
+//
+// Input: argv - Program and arguments
+//        dir  - Working directory
+//        pid  - Pointer to receive the process id
+//
+// Output: Master of the pty. -1 if failed
+//
+static int StartOnPty(char* const argv[], const char* dir, pid_t* pid) {
+  int master, slave;
+  if (openpty(&master,&slave,NULL,NULL,NULL)!=0) return -1;
+  struct termios tio;
+  tcgetattr(slave,&tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave,TCSANOW,&tio);
+
+  *pid = fork();
+  if (*pid==0) {
+    close(master);
+    setsid();
+    dup2(slave,STDIN_FILENO);
+    dup2(slave,STDOUT_FILENO);
+    close(slave);
+    if (chdir(dir)!=0) exit(127);
+    execvp(argv[0],argv);
+    exit(127);
+  }
+  close(slave);
+  return master;
+}
+
+static int WaitExitCode(const pid_t pid) {
+  int status;
+  waitpid(pid,&status,0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool IsInstalled(const char* program) {
+  char command[64];
+  snprintf(command,sizeof(command),"command -v %s >/dev/null 2>&1",program);
+  return system(command)==0;
+}
+
+//////////////////////////////////////////////////////////
+// Firmware against sz/rz of lrzsz
+//
+static int Lrzsz() {
+  if (!IsInstalled("sz") || !IsInstalled("rz")) {
+    printf("lrzsz is not installed. Skipped.\n");
+    return SKIPPED;
+  }
+  char dir[] = "/tmp/zmodemXXXXXX";
+  if (!mkdtemp(dir)) return 1;
+  char path[64];
+  int failures = 0;
+
+  //1) sz -> UploadZModem(1)
+  snprintf(path,sizeof(path),"%s/upload.po",dir);
+  FILE* f = fopen(path,"wb");
+  fwrite(RamUnits_GetImage(2),BLOCKSIZE,blockCount,f);
+  fclose(f);
+  char* const szArgs[] = {"sz","-b","upload.po",NULL};
+  pid_t pid;
+  const int master = StartOnPty(szArgs,dir,&pid);
+  if (master<0) return 1;
+  host_serial_open(master);
+  uint64_t start = time_us_64();
+  UploadZModem(1);
+  double seconds = (time_us_64()-start)/1e6;
+  close(master);
+  const int szExit = WaitExitCode(pid);
+  printf("sz exit code %d\n",szExit);
+  if (!CheckDrive1("sz",seconds) || szExit!=0) ++failures;
+
+  //2) DownloadZModem(2) -> rz
+  char* const rzArgs[] = {"rz","-b","-y",NULL};
+  const int master2 = StartOnPty(rzArgs,dir,&pid);
+  if (master2<0) return 1;
+  host_serial_open(master2);
+  start = time_us_64();
+  DownloadZModem(2);
+  seconds = (time_us_64()-start)/1e6;
+  close(master2);
+  const int rzExit = WaitExitCode(pid);
+  printf("rz exit code %d\n",rzExit);
+
+  snprintf(path,sizeof(path),"%s/drive2.po",dir);
+  f = fopen(path,"rb");
+  uint8_t* received = (uint8_t*)calloc(blockCount,BLOCKSIZE);
+  const size_t len = f ? fread(received,1,blockCount*BLOCKSIZE,f) : 0;
+  if (f) fclose(f);
+  const bool match = len==blockCount*BLOCKSIZE && memcmp(received,RamUnits_GetImage(2),len)==0;
+  printf("\nrz: %u blocks, %s, %.2fs\n",(uint)blockCount,match?"match":"MISMATCH",seconds);
+  if (!match || rzExit!=0) ++failures;
+  free(received);
+
+  char command[96];
+  snprintf(command,sizeof(command),"rm -rf %s",dir);
+  if (system(command)!=0) printf("Cannot remove %s\n",dir);
+  return failures ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+  bool lrzsz = false;
+  const char* name = NULL;
+  for (int i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"-n")==0 && i+1<argc) blockCount = (uint32_t)strtoul(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-e")==0 && i+1<argc) errorRate = atof(argv[++i]);
+    else if (strcmp(argv[i],"-b")==0 && i+1<argc) badBlock = (int32_t)strtol(argv[++i],NULL,0);
+    else if (strcmp(argv[i],"-l")==0) lrzsz = true;
+    else if (argv[i][0]!='-' && name==NULL) name = argv[i];
+    else {
+      name = NULL;
+      break;
+    }
+  }
+  protocol_t protocol;
+  if (name && strcmp(name,"xmodem")==0) protocol = PROTOCOL_XMODEM;
+  else if (name && strcmp(name,"xmodem1k")==0) protocol = PROTOCOL_XMODEM1K;
+  else if (name && strcmp(name,"ymodemg")==0) protocol = PROTOCOL_YMODEMG;
+  else if (name && strcmp(name,"zmodem")==0) protocol = PROTOCOL_ZMODEM;
+  else name = NULL;
+  if (name==NULL || blockCount==0 || ((lrzsz || badBlock>=0) && protocol!=PROTOCOL_ZMODEM) ||
+      badBlock>=(int32_t)blockCount-1) {
+    fprintf(stderr,"Usage: %s [-n blocks] [-e errorRate] [-b badBlock] [-l] <xmodem|xmodem1k|ymodemg|zmodem>\n",argv[0]);
+    fprintf(stderr,"  -b and -l are for zmodem only. badBlock must be before the last block.\n");
+    return 2;
+  }
+
+  //Messages of the firmware are not buffered like USB serial
+  setvbuf(stdout,NULL,_IONBF,0);
+  //The other side may exit before the last byte is sent, e.g. the final 'G' of YMODEM-G.
+  //A write to the closed port fails like a disconnected USB port.
+  signal(SIGPIPE,SIG_IGN);
+  InitDMAChannel();
+  RamUnits_Init(2,blockCount);
+  memset(RamUnits_GetImage(1),0,blockCount*BLOCKSIZE);
+  FillSpecialBytes();
+  RamUnits_SetBadBlock(2,badBlock);
+
+  if (lrzsz) return Lrzsz();
+  return Loopback(protocol) ? 0 : 1;
+}
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "defines.h"
+#include "uthernet2.h"
+#include "uthernet2_net.h"
+#include "w5100_regs.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_TSC 1
+#endif
+
+/****************************************************************************************
+Uthernet II microbenchmark
+
+uthernet2.c runs over a fake network layer (instead of uthernet2_net.c and lwIP). The
+6502 side is U2_HandleBusAccess() with the bus accesses of a W5100 driver in
+auto-increment mode. Socket 0 is a TCP socket with 2kB TX and RX buffers.
+
+RX: The peer sends TCP segments of 1460 bytes. Like drain_tcp_rx() of uthernet2_net.c,
+    the fake layer moves the segments into the RX ring as far as there is room. Each
+    segment is a pbuf chain of 512-byte pieces. The 6502 reads RSR and RX_RD, reads the
+    data through the data port, advances RX_RD and issues RECV.
+TX: The 6502 reads TX_FSR and TX_WR, writes 1460 bytes through the data port, advances
+    TX_WR and issues SEND. The fake layer receives the two spans of the TX ring.
+
+Core 1 (bus accesses) and core 0 (U2_Poll()) run in turns on one thread. For each
+direction, it reports bytes/s and the time per byte of each core. Cycles are the
+time-stamp counter of the host (x86 only). The data is verified. Exit code is 1 on
+mismatch.
+
+  u2bench [-n segments]
+    -n  Number of 1460-byte segments in each direction (default 10000)
+*****************************************************************************************/
+
+#define SEGMENTSIZE   1460
+#define PBUFSIZE      512
+#define SOCKET        0
+#define READFLAG      (1u<<4)
+
+static uint32_t segmentCount = 10000;
+static const u2_rx_ops_t* rxOps;
+static uint8_t status[W5100_NUM_SOCKETS];
+static int failures = 0;
+
+//Peer of socket 0
+static uint64_t rxQueued;       //Bytes sent by the peer, not yet in the RX ring
+static uint64_t rxOffset;       //Stream offset of the next byte moved into the RX ring
+static uint64_t txReceived;     //Bytes received by the peer
+
+static inline uint8_t StreamByte(const uint64_t offset) {
+  return (uint8_t)(offset*7+(offset>>11));
+}
+
+//////////////////////////////////////////////////////////
+// Fake network layer (uthernet2_net.h)
+//
+void U2_Net_Init(const u2_rx_ops_t *rx_ops) {
+  rxOps = rx_ops;
+  memset(status,W5100_SN_SR_CLOSED,sizeof(status));
+}
+
+void U2_Net_Close(int i) { status[i] = W5100_SN_SR_CLOSED; }
+int U2_Net_OpenUdp(int i, uint16_t local_port) { (void)local_port; status[i] = W5100_SN_SR_SOCK_UDP; return 0; }
+int U2_Net_OpenTcp(int i) { status[i] = W5100_SN_SR_SOCK_INIT; return 0; }
+int U2_Net_OpenMacraw(int i) { status[i] = W5100_SN_SR_SOCK_MACRAW; return 0; }
+void U2_Net_SendMacraw(int i, const u2_span_t seg[2]) { (void)i; (void)seg; }
+void U2_Net_FeedMacrawRx(int i, const uint8_t *data, uint16_t len) { (void)i; (void)data; (void)len; }
+int U2_Net_ListenTcp(int i, uint16_t local_port) { (void)local_port; status[i] = W5100_SN_SR_SOCK_INIT; return 0; }
+void U2_Net_SendUdp(int i, const u2_span_t seg[2], uint32_t dest_ip_net, uint16_t dest_port) {
+  (void)i; (void)seg; (void)dest_ip_net; (void)dest_port;
+}
+uint8_t U2_Net_GetStatus(int i) { return status[i]; }
+
+int U2_Net_ConnectTcpEx(int i, uint32_t dest_ip_net, uint16_t dest_port) {
+  (void)dest_ip_net; (void)dest_port;
+  status[i] = W5100_SN_SR_ESTABLISHED;
+  return 0;
+}
+
+void U2_Net_SendTcp(int i, const u2_span_t seg[2]) {
+  (void)i;
+  for (int k=0; k<2; ++k) {
+    for (uint16_t j=0; j<seg[k].len; ++j) {
+      if (seg[k].data[j]!=StreamByte(txReceived)) ++failures;
+      ++txReceived;
+    }
+  }
+}
+
+//Move the queued data into the RX ring like drain_tcp_rx()
+static void DrainRx(const int i) {
+  static uint8_t pbuf[PBUFSIZE];
+  while (rxQueued) {
+    uint16_t n = rxOps->room(i);
+    if (n>rxQueued) n = (uint16_t)rxQueued;
+    if (n==0 || !rxOps->begin(i,n,U2_RX_TCP,0,0)) break;
+    for (uint16_t left=n; left; ) {
+      //A pbuf ends at a segment boundary or after PBUFSIZE bytes
+      const uint32_t inSegment = (uint32_t)(rxOffset%SEGMENTSIZE);
+      uint16_t k = (uint16_t)MIN(MIN((uint32_t)PBUFSIZE-inSegment%PBUFSIZE,SEGMENTSIZE-inSegment),left);
+      for (uint16_t j=0; j<k; ++j) pbuf[j] = StreamByte(rxOffset+j);
+      rxOps->write(i,pbuf,k);
+      rxOffset += k;
+      left -= k;
+    }
+    rxOps->commit(i);
+    rxQueued -= n;
+  }
+}
+
+void U2_Net_RecvConfirm(int i, uint16_t len) {
+  (void)len;
+  DrainRx(i);
+}
+
+void U2_Net_Poll(void) {
+  DrainRx(SOCKET);
+}
+
+//////////////////////////////////////////////////////////
+// 6502 side
+//
+static inline void BusWrite(const uint loc, const uint8_t data) {
+  uint8_t dummy;
+  U2_HandleBusAccess(U2_C0X_OFFSET+loc | (uint32_t)data<<5, &dummy);
+}
+
+static inline uint8_t BusRead(const uint loc) {
+  uint8_t data;
+  U2_HandleBusAccess(U2_C0X_OFFSET+loc | READFLAG, &data);
+  return data;
+}
+
+static void SetAddress(const uint16_t address) {
+  BusWrite(U2_C0X_ADDRESS_HIGH,(uint8_t)(address>>8));
+  BusWrite(U2_C0X_ADDRESS_LOW,(uint8_t)address);
+}
+
+static uint16_t ReadRegister16(const uint16_t address) {
+  SetAddress(address);
+  const uint8_t hi = BusRead(U2_C0X_DATA_PORT);
+  return (uint16_t)(hi<<8 | BusRead(U2_C0X_DATA_PORT));
+}
+
+static void WriteRegister16(const uint16_t address, const uint16_t value) {
+  SetAddress(address);
+  BusWrite(U2_C0X_DATA_PORT,(uint8_t)(value>>8));
+  BusWrite(U2_C0X_DATA_PORT,(uint8_t)value);
+}
+
+static void WriteRegister(const uint16_t address, const uint8_t value) {
+  SetAddress(address);
+  BusWrite(U2_C0X_DATA_PORT,value);
+}
+
+static uint8_t ReadRegister(const uint16_t address) {
+  SetAddress(address);
+  return BusRead(U2_C0X_DATA_PORT);
+}
+
+//////////////////////////////////////////////////////////
+// Time of each core
+//
+typedef struct {
+  uint64_t ns;
+  uint64_t cycles;
+} cost_t;
+
+static cost_t core1Cost, core0Cost;
+static uint64_t startNs, startCycles;
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+static inline void StartCost() {
+  startNs = NowNs();
+#if HAS_TSC
+  startCycles = __rdtsc();
+#endif
+}
+
+static inline void EndCost(cost_t* cost) {
+#if HAS_TSC
+  cost->cycles += __rdtsc()-startCycles;
+#endif
+  cost->ns += NowNs()-startNs;
+}
+
+//Core 0 executes the socket command posted by core 1
+static void Core0() {
+  StartCost();
+  host_set_core_num(0);
+  multicore_fifo_drain();
+  U2_Poll();
+  host_set_core_num(1);
+  EndCost(&core0Cost);
+}
+
+//Issue a socket command and wait until it is executed
+static void SocketCommand(const uint8_t command) {
+  const uint16_t registers = W5100_S0_BASE+(SOCKET<<8);
+  StartCost();
+  WriteRegister(registers+W5100_SN_CR,command);
+  EndCost(&core1Cost);
+  Core0();
+  StartCost();
+  while (ReadRegister(registers+W5100_SN_CR)!=0);
+  EndCost(&core1Cost);
+}
+
+static void OpenSocket() {
+  const uint16_t registers = W5100_S0_BASE+(SOCKET<<8);
+  //MR reads back RST until core 0 has reset the buffers
+  BusWrite(U2_C0X_MODE_REGISTER,W5100_MR_RST);
+  if (BusRead(U2_C0X_MODE_REGISTER)!=W5100_MR_RST) {
+    printf("FAILED: RST is cleared before core 0 has done the reset\n");
+    ++failures;
+  }
+  Core0();
+  if (BusRead(U2_C0X_MODE_REGISTER)!=0) {
+    printf("FAILED: RST is not cleared by core 0\n");
+    ++failures;
+  }
+  BusWrite(U2_C0X_MODE_REGISTER,W5100_MR_AI);
+  WriteRegister(registers+W5100_SN_MR,W5100_SN_MR_TCP);
+  SocketCommand(W5100_SN_CR_OPEN);
+  SocketCommand(W5100_SN_CR_CONNECT);
+  if (ReadRegister(registers+W5100_SN_SR)!=W5100_SN_SR_ESTABLISHED) {
+    printf("FAILED: socket is not established\n");
+    ++failures;
+  }
+}
+
+static void PrintResult(const char* name, const uint64_t bytes, const uint64_t accesses) {
+  const double seconds = (core1Cost.ns+core0Cost.ns)/1e9;
+  printf("%-4s %10llu %12.0f %12.2f %12.2f", name, (unsigned long long)bytes, bytes/seconds,
+         (double)accesses/bytes, (double)core1Cost.ns/bytes);
+#if HAS_TSC
+  printf(" %12.2f", (double)core1Cost.cycles/bytes);
+#else
+  printf(" %12s", "-");
+#endif
+  printf(" %12.2f", (double)core0Cost.ns/bytes);
+#if HAS_TSC
+  printf(" %12.2f", (double)core0Cost.cycles/bytes);
+#else
+  printf(" %12s", "-");
+#endif
+  printf("\n");
+}
+
+//////////////////////////////////////////////////////////
+// Receive segmentCount segments
+//
+static void RunRx() {
+  const uint16_t registers = W5100_S0_BASE+(SOCKET<<8);
+  const uint16_t size = 2048;
+  const uint16_t base = W5100_RX_BASE+SOCKET*size;
+  const uint64_t total = (uint64_t)segmentCount*SEGMENTSIZE;
+  uint64_t received = 0;
+  uint64_t accesses = 0;
+
+  memset(&core1Cost,0,sizeof(core1Cost));
+  memset(&core0Cost,0,sizeof(core0Cost));
+  rxQueued = total;
+  rxOffset = 0;
+  Core0();
+  while (received<total) {
+    StartCost();
+    const uint16_t rsr = ReadRegister16(registers+W5100_SN_RX_RSR0);
+    accesses += 4;
+    if (rsr==0) {
+      EndCost(&core1Cost);
+      Core0();
+      continue;
+    }
+    uint16_t rd = ReadRegister16(registers+W5100_SN_RX_RD0);
+    accesses += 4;
+    //Read up to the end of the ring, then from the start
+    uint16_t offset = rd&(size-1);
+    SetAddress(base+offset);
+    accesses += 2;
+    for (uint16_t i=0; i<rsr; ++i) {
+      if (offset==size) {
+        offset = 0;
+        SetAddress(base);
+        accesses += 2;
+      }
+      if (BusRead(U2_C0X_DATA_PORT)!=StreamByte(received+i)) ++failures;
+      ++offset;
+    }
+    accesses += rsr;
+    rd = (uint16_t)(rd+rsr);
+    WriteRegister16(registers+W5100_SN_RX_RD0,rd);
+    accesses += 4;
+    EndCost(&core1Cost);
+    received += rsr;
+    SocketCommand(W5100_SN_CR_RECV);
+    accesses += 6;
+  }
+  PrintResult("RX",received,accesses);
+}
+
+//////////////////////////////////////////////////////////
+// Send segmentCount segments
+//
+static void RunTx() {
+  const uint16_t registers = W5100_S0_BASE+(SOCKET<<8);
+  const uint16_t size = 2048;
+  const uint16_t base = W5100_TX_BASE+SOCKET*size;
+  uint64_t sent = 0;
+  uint64_t accesses = 0;
+
+  memset(&core1Cost,0,sizeof(core1Cost));
+  memset(&core0Cost,0,sizeof(core0Cost));
+  txReceived = 0;
+  for (uint32_t n=0; n<segmentCount; ++n) {
+    StartCost();
+    const uint16_t fsr = ReadRegister16(registers+W5100_SN_TX_FSR0);
+    accesses += 4;
+    if (fsr<SEGMENTSIZE) {
+      printf("FAILED: TX buffer is not free (%u bytes)\n",fsr);
+      ++failures;
+      return;
+    }
+    uint16_t wr = ReadRegister16(registers+W5100_SN_TX_WR0);
+    accesses += 4;
+    uint16_t offset = wr&(size-1);
+    SetAddress(base+offset);
+    accesses += 2;
+    for (uint16_t i=0; i<SEGMENTSIZE; ++i) {
+      if (offset==size) {
+        offset = 0;
+        SetAddress(base);
+        accesses += 2;
+      }
+      BusWrite(U2_C0X_DATA_PORT,StreamByte(sent+i));
+      ++offset;
+    }
+    accesses += SEGMENTSIZE;
+    wr = (uint16_t)(wr+SEGMENTSIZE);
+    WriteRegister16(registers+W5100_SN_TX_WR0,wr);
+    accesses += 4;
+    EndCost(&core1Cost);
+    sent += SEGMENTSIZE;
+    SocketCommand(W5100_SN_CR_SEND);
+    accesses += 6;
+  }
+  if (txReceived!=sent) {
+    printf("FAILED: %llu bytes sent, %llu bytes received by the peer\n",
+           (unsigned long long)sent,(unsigned long long)txReceived);
+    ++failures;
+  }
+  PrintResult("TX",sent,accesses);
+}
+
+int main(int argc, char* argv[]) {
+  for (int i=1; i<argc; ++i) {
+    if (strcmp(argv[i],"-n")==0 && i+1<argc) segmentCount = (uint32_t)strtoul(argv[++i],NULL,0);
+    else {
+      fprintf(stderr,"Usage: %s [-n segments]\n",argv[0]);
+      return 2;
+    }
+  }
+
+  host_set_core_num(1);
+  U2_Init();
+  OpenSocket();
+
+  printf("%u segments of %u bytes, 2kB buffers\n",(uint)segmentCount,SEGMENTSIZE);
+  printf("%-4s %10s %12s %12s %12s %12s %12s %12s\n","","bytes","bytes/s","access/byte",
+         "core1 ns/B","core1 cyc/B","core0 ns/B","core0 cyc/B");
+  RunRx();
+  RunTx();
+
+  if (failures) {
+    printf("%d FAILED\n",failures);
+    return 1;
+  }
+  return 0;
+}
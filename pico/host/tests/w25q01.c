@@ -0,0 +1,392 @@
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+#include "w25q01.h"
+
+/****************************************************************************************
+W25Q01JV model
+
+Chip #0 is selected by CS0_PIN and chip #1 by CS1_PIN of flash.c. The model sees the
+/CS edges through host_gpio_changed and the bytes through the device function of spi0.
+
+- The memory is allocated per 64kB region when it is first programmed. A region which
+  is not allocated is erased (0xff).
+- Page Program, Erase and Write Status Register are executed when /CS goes high, like
+  the chip does. Program and erase need Write Enable. They change the memory at once and
+  the chip is busy for the time in w25q01_timing_t.
+- While the chip is busy, only Read Status, Suspend and Reset are accepted. Other
+  commands are ignored and counted in busyViolations.
+- Suspend stops the timer of the operation. The chip is busy for suspendUs and then
+  the SUS flag is set. Resume restarts the timer.
+- The times are from the notes in flash.c (actual tests), not the datasheet maximum.
+*****************************************************************************************/
+
+extern const uint CS0_PIN;
+extern const uint CS1_PIN;
+
+const w25q01_timing_t W25Q01_TYPICAL = {
+  .pageProgramUs = 700,
+  .erase4kUs     = 55*1000,
+  .erase64kUs    = 230*1000,
+  .chipEraseMs   = 200*1000,
+  .suspendUs     = 20,
+};
+
+#define REGIONSIZE  0x10000
+#define REGIONCOUNT (W25Q01_SIZE/REGIONSIZE)
+#define PAGESIZE    256
+
+typedef struct {
+  uint8_t* regions[REGIONCOUNT];
+  uint8_t securityRegisters[3][PAGESIZE];
+  uint16_t eraseCounts[W25Q01_SECTORCOUNT];
+  w25q01_stats_t stats;
+
+  //Status
+  bool wel;
+  bool addr4;
+  bool resetEnabled;
+  uint8_t status3;
+  uint64_t busyUntil;         //Operation in progress if busy
+  bool busy;
+  bool suspended;
+  uint64_t remainingUs;       //Time left of suspended operation
+  uint64_t suspendDoneTime;
+
+  //Current transaction
+  bool selected;
+  bool ignored;
+  uint8_t cmd;
+  uint index;
+  uint32_t address;
+  uint8_t pageBuffer[PAGESIZE];
+  bool pageBufferUsed;
+  uint8_t value;
+} chip_t;
+
+static chip_t chips[W25Q01_MAXCHIPS];
+static uint chipCount = 0;
+static w25q01_timing_t timing;
+
+//////////////////////////////////////////////////////////
+// Memory
+//
+static uint8_t GetByte(const chip_t* c, const uint32_t address) {
+  const uint8_t* region = c->regions[address/REGIONSIZE];
+  return region ? region[address%REGIONSIZE] : 0xff;
+}
+
+static void ProgramPage(chip_t* c, const uint32_t pageAddress, const uint8_t* data) {
+  uint8_t** region = &c->regions[pageAddress/REGIONSIZE];
+  if (*region==NULL) {
+    *region = (uint8_t*)malloc(REGIONSIZE);
+    memset(*region,0xff,REGIONSIZE);
+  }
+  uint8_t* page = *region+pageAddress%REGIONSIZE;
+  for (uint i=0; i<PAGESIZE; ++i) page[i] &= data[i];   //Program can only clear bits
+  ++c->stats.pagePrograms;
+}
+
+static void Erase(chip_t* c, const uint32_t address, const uint32_t len) {
+  for (uint32_t a=address; a<address+len; a+=W25Q01_SECTORSIZE) ++c->eraseCounts[a/W25Q01_SECTORSIZE];
+  uint8_t** region = &c->regions[address/REGIONSIZE];
+  if (len>=REGIONSIZE) {
+    for (uint32_t i=0; i<len/REGIONSIZE; ++i, ++region) {
+      free(*region);
+      *region = NULL;
+    }
+  } else if (*region) {
+    memset(*region+address%REGIONSIZE,0xff,len);
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Status
+//
+static bool IsBusy(chip_t* c) {
+  const uint64_t now = time_us_64();
+  if (c->suspended) return now<c->suspendDoneTime;
+  if (c->busy && now>=c->busyUntil) {
+    c->busy = false;
+    c->wel = false;
+  }
+  return c->busy;
+}
+
+static void StartOperation(chip_t* c, const uint64_t us) {
+  c->busy = true;
+  c->busyUntil = time_us_64()+us;
+}
+
+static uint8_t GetStatus1(chip_t* c) {
+  return (IsBusy(c)?0x01:0)|(c->wel?0x02:0);
+}
+
+static uint8_t GetStatus2(const chip_t* c) {
+  return c->suspended && time_us_64()>=c->suspendDoneTime ? 0x80 : 0;
+}
+
+//Commands accepted while the chip is busy
+static bool IsAllowedWhenBusy(const uint8_t cmd) {
+  return cmd==0x05 || cmd==0x35 || cmd==0x15 || cmd==0x75 || cmd==0x66 || cmd==0x99;
+}
+
+//Commands which cannot be executed during suspend
+static bool IsNotAllowedWhenSuspended(const uint8_t cmd) {
+  return cmd==0x12 || cmd==0x21 || cmd==0xdc || cmd==0x60 || cmd==0x42 || cmd==0x44;
+}
+
+//////////////////////////////////////////////////////////
+// Transaction
+//
+static void BeginTransaction(chip_t* c) {
+  c->selected = true;
+  c->ignored = false;
+  c->index = 0;
+  c->address = 0;
+  c->pageBufferUsed = false;
+}
+
+static void EndTransaction(chip_t* c) {
+  c->selected = false;
+  if (c->ignored || c->index==0) return;
+
+  const uint8_t cmd = c->cmd;
+  if (cmd!=0x99) c->resetEnabled = false;
+  switch (cmd) {
+    case 0x06: c->wel = true; break;
+    case 0x04: c->wel = false; break;
+    case 0x50: break;     //Volatile SR Write Enable
+    case 0xb7: c->addr4 = true; break;
+    case 0x66: c->resetEnabled = true; break;
+    case 0x99:
+      if (c->resetEnabled) {
+        c->resetEnabled = false;
+        c->busy = false;
+        c->suspended = false;
+        c->wel = false;
+        c->addr4 = false;
+      }
+      break;
+    case 0x11:
+      if (c->index>=2) c->status3 = c->value;
+      break;
+    case 0x12:  //Page Program
+    case 0x42:  //Program Security Register
+      if (!c->wel || !c->pageBufferUsed) break;
+      if (cmd==0x12) {
+        ProgramPage(c,c->address & ~(PAGESIZE-1),c->pageBuffer);
+      } else {
+        uint8_t* reg = c->securityRegisters[((c->address>>12)&3)-1];
+        for (uint i=0; i<PAGESIZE; ++i) reg[i] &= c->pageBuffer[i];
+      }
+      StartOperation(c,timing.pageProgramUs);
+      break;
+    case 0x21:  //4kB Sector Erase
+    case 0x44:  //Erase Security Register
+      if (!c->wel) break;
+      if (cmd==0x21) {
+        Erase(c,c->address & ~(W25Q01_SECTORSIZE-1),W25Q01_SECTORSIZE);
+        ++c->stats.erases4k;
+      } else {
+        memset(c->securityRegisters[((c->address>>12)&3)-1],0xff,PAGESIZE);
+      }
+      StartOperation(c,timing.erase4kUs);
+      break;
+    case 0xdc:  //64kB Block Erase
+      if (!c->wel) break;
+      Erase(c,c->address & ~(REGIONSIZE-1),REGIONSIZE);
+      ++c->stats.erases64k;
+      StartOperation(c,timing.erase64kUs);
+      break;
+    case 0x60:  //Chip Erase
+      if (!c->wel) break;
+      Erase(c,0,W25Q01_SIZE);
+      ++c->stats.chipErases;
+      StartOperation(c,(uint64_t)timing.chipEraseMs*1000);
+      break;
+    case 0x75:  //Suspend
+      if (c->busy && !c->suspended && time_us_64()<c->busyUntil) {
+        c->suspended = true;
+        c->remainingUs = c->busyUntil-time_us_64();
+        c->suspendDoneTime = time_us_64()+timing.suspendUs;
+        ++c->stats.suspends;
+      }
+      break;
+    case 0x7a:  //Resume
+      if (c->suspended) {
+        c->suspended = false;
+        c->busyUntil = time_us_64()+c->remainingUs;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+//Number of address bytes of commands which follow the address mode
+static uint GetAddressLength(const chip_t* c) {
+  return c->addr4 ? 4 : 3;
+}
+
+static uint8_t Exchange(chip_t* c, const uint8_t tx) {
+  const uint i = c->index++;
+  if (i==0) {
+    c->cmd = tx;
+    if ((IsBusy(c) && !IsAllowedWhenBusy(tx)) || (c->suspended && IsNotAllowedWhenSuspended(tx))) {
+      c->ignored = true;
+      ++c->stats.busyViolations;
+    }
+    return 0xff;
+  }
+  if (c->ignored) return 0xff;
+
+  switch (c->cmd) {
+    case 0x9f: {  //JEDEC ID
+      static const uint8_t id[] = {0xef,0x40,0x21};
+      return i<=3 ? id[i-1] : 0xff;
+    }
+    case 0x05: return GetStatus1(c);
+    case 0x35: return GetStatus2(c);
+    case 0x15: return c->status3|(c->addr4?0x01:0);
+    case 0x11: c->value = tx; return 0xff;
+    case 0x4b: {  //Unique ID
+      const uint dummy = GetAddressLength(c)+1;
+      if (i<=dummy) return 0xff;
+      const uint n = i-dummy-1;
+      return n<8 ? (uint8_t)(0xd0+n+(c-chips)*0x10) : 0xff;
+    }
+    case 0x0c:  //Fast Read with 4-Byte Address
+      if (i<=4) {
+        c->address = (c->address<<8)|tx;
+        return 0xff;
+      }
+      if (i==5) return 0xff;    //Dummy
+      ++c->stats.bytesRead;
+      return GetByte(c,(c->address+i-6)%W25Q01_SIZE);
+    case 0x12:  //Page Program with 4-Byte Address
+      if (i<=4) {
+        c->address = (c->address<<8)|tx;
+        if (i==4) memset(c->pageBuffer,0xff,PAGESIZE);
+        return 0xff;
+      }
+      c->pageBuffer[(c->address+i-5)%PAGESIZE] = tx;   //Wrap within the page
+      c->pageBufferUsed = true;
+      return 0xff;
+    case 0x21:
+    case 0xdc:
+      if (i<=4) c->address = (c->address<<8)|tx;
+      return 0xff;
+    case 0x42:
+    case 0x44:
+    case 0x48: {
+      const uint alen = GetAddressLength(c);
+      if (i<=alen) {
+        c->address = (c->address<<8)|tx;
+        if (i==alen) memset(c->pageBuffer,0xff,PAGESIZE);
+        return 0xff;
+      }
+      if (c->cmd==0x42) {
+        c->pageBuffer[(c->address+i-alen-1)%PAGESIZE] = tx;
+        c->pageBufferUsed = true;
+        return 0xff;
+      }
+      if (c->cmd==0x48 && i>alen+1) {
+        return c->securityRegisters[((c->address>>12)&3)-1][(c->address+i-alen-2)%PAGESIZE];
+      }
+      return 0xff;
+    }
+    default:
+      return 0xff;
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Connection to spi0 and /CS pins
+//
+static uint32_t GetCSMask(const uint deviceNum) {
+  return 1ul<<(deviceNum==0?CS0_PIN:CS1_PIN);
+}
+
+static void OnGpioChanged(const uint32_t before, const uint32_t after) {
+  for (uint i=0; i<chipCount; ++i) {
+    const uint32_t mask = GetCSMask(i);
+    if ((before&mask) && !(after&mask)) BeginTransaction(&chips[i]);
+    else if (!(before&mask) && (after&mask)) EndTransaction(&chips[i]);
+  }
+}
+
+static uint8_t OnSpiByte(const uint8_t tx) {
+  for (uint i=0; i<chipCount; ++i) {
+    if (chips[i].selected) return Exchange(&chips[i],tx);
+  }
+  return 0xff;
+}
+
+void W25Q01_Init(const uint count, const w25q01_timing_t* t) {
+  assert(count>=1 && count<=W25Q01_MAXCHIPS);
+  for (uint i=0; i<W25Q01_MAXCHIPS; ++i) {
+    for (uint r=0; r<REGIONCOUNT; ++r) free(chips[i].regions[r]);
+  }
+  memset(chips,0,sizeof(chips));
+  for (uint i=0; i<W25Q01_MAXCHIPS; ++i) memset(chips[i].securityRegisters,0xff,sizeof(chips[i].securityRegisters));
+  chipCount = count;
+  timing = t ? *t : W25Q01_TYPICAL;
+  host_gpio_state |= GetCSMask(0)|GetCSMask(1);
+  host_gpio_changed = OnGpioChanged;
+  host_spi_set_device(spi0,OnSpiByte);
+}
+
+//////////////////////////////////////////////////////////
+// Statistics
+//
+void W25Q01_GetStats(const uint deviceNum, w25q01_stats_t* stats) {
+  *stats = chips[deviceNum].stats;
+}
+
+void W25Q01_ResetStats() {
+  for (uint i=0; i<W25Q01_MAXCHIPS; ++i) memset(&chips[i].stats,0,sizeof(chips[i].stats));
+}
+
+//Number of erases in 4kB sectors. A 64kB erase is 16 sector erases.
+uint64_t W25Q01_GetTotalErases() {
+  uint64_t total = 0;
+  for (uint i=0; i<chipCount; ++i) {
+    total += chips[i].stats.erases4k+chips[i].stats.erases64k*(REGIONSIZE/W25Q01_SECTORSIZE)+chips[i].stats.chipErases*W25Q01_SECTORCOUNT;
+  }
+  return total;
+}
+
+const uint16_t* W25Q01_GetEraseCounts(const uint deviceNum) {
+  return chips[deviceNum].eraseCounts;
+}
+
+//////////////////////////////////////////////////////////
+// Print the erase counts of the sectors in an address range
+// One row per 64kB region, one column per 4kB sector.
+// Regions which have never been erased are not printed.
+//
+void W25Q01_PrintEraseMatrix(FILE* out, const uint deviceNum, const uint32_t address, const uint32_t len) {
+  const uint16_t* counts = chips[deviceNum].eraseCounts;
+  const uint perRegion = REGIONSIZE/W25Q01_SECTORSIZE;
+  uint32_t total = 0;
+  uint16_t maxCount = 0;
+  uint touched = 0;
+
+  fprintf(out,"Erase count matrix of chip #%u ($%08x-$%08x)\n",deviceNum,address,address+len-1);
+  for (uint32_t r=address/REGIONSIZE; r<(address+len)/REGIONSIZE; ++r) {
+    bool any = false;
+    for (uint s=0; s<perRegion; ++s) any |= counts[r*perRegion+s]!=0;
+    if (!any) continue;
+    fprintf(out,"  $%08x:",r*REGIONSIZE);
+    for (uint s=0; s<perRegion; ++s) {
+      const uint16_t n = counts[r*perRegion+s];
+      fprintf(out," %3u",n);
+      total += n;
+      if (n) ++touched;
+      if (n>maxCount) maxCount = n;
+    }
+    fprintf(out,"\n");
+  }
+  fprintf(out,"  %u erases in %u sectors, max %u per sector\n",total,touched,maxCount);
+}
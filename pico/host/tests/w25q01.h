@@ -0,0 +1,53 @@
+#ifndef _W25Q01_H
+#define _W25Q01_H
+
+//
+// Model of Winbond W25Q01JV flash chips on spi0
+// The commands used by flash.c are modelled with page program, 4kB erase,
+// 64kB erase and chip erase timings. The erases of each 4kB sector are
+// counted. Use it with the virtual time of pico_host.c.
+//
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define W25Q01_SIZE         (128u*1024*1024)
+#define W25Q01_SECTORSIZE   4096
+#define W25Q01_SECTORCOUNT  (W25Q01_SIZE/W25Q01_SECTORSIZE)
+#define W25Q01_MAXCHIPS     2
+
+typedef struct {
+  uint32_t pageProgramUs;
+  uint32_t erase4kUs;
+  uint32_t erase64kUs;
+  uint32_t chipEraseMs;
+  uint32_t suspendUs;         //Time from Suspend command to busy flag cleared
+} w25q01_timing_t;
+
+typedef struct {
+  uint64_t pagePrograms;
+  uint64_t erases4k;
+  uint64_t erases64k;
+  uint64_t chipErases;
+  uint64_t suspends;
+  uint64_t bytesRead;
+  uint64_t busyViolations;    //Commands ignored because the chip was busy
+} w25q01_stats_t;
+
+extern const w25q01_timing_t W25Q01_TYPICAL;
+
+void W25Q01_Init(const uint chipCount, const w25q01_timing_t* timing);
+void W25Q01_GetStats(const uint deviceNum, w25q01_stats_t* stats);
+void W25Q01_ResetStats();
+uint64_t W25Q01_GetTotalErases();
+const uint16_t* W25Q01_GetEraseCounts(const uint deviceNum);
+void W25Q01_PrintEraseMatrix(FILE* out, const uint deviceNum, const uint32_t address, const uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "usbserial.h"
+#include "dmamemops.h"
+#include "imagestream.h"
+#include "defines.h"
+#include "debug.h"
+#include "misc.h"
+#include "mediaaccess.h"
+
+/****************************************************************************************
+Image Stream Protocol
+
+XMODEM waits for an ACK after every 1kB packet. The throughput is limited by the round
+trip time of USB. This protocol streams a whole ProDOS image in large frames. The host
+may send STREAM_WINDOW frames before they are acknowledged. The host tool is
+pico/tools/mfstream.py.
+
+Frame format (little-endian):
+  0  'M','F'     Magic
+  2  type        Frame type (FRAME_*)
+  3  0           Reserved
+  4  seq         Frame sequence number. Data frame n holds blocks n*STREAM_FRAMEBLOCKS...
+  8  len         Payload length. Multiple of 4.
+  12 payload
+  12+len crc     CRC32 (zlib) of bytes 0 to 12+len-1. Calculated by DMA sniffer.
+
+Session:
+  Host -> START(blockCount)     blockCount is ignored for download
+  Pico -> READY(blockCount, STREAM_FRAMEBLOCKS, STREAM_WINDOW)
+  DATA frames, ACK and NAK
+  Pico -> END(verificationErrorCount)
+Either side may send ABORT.
+
+Upload (Host to Pico):
+- Frames are received into a ring of STREAM_WINDOW buffers. A frame may arrive after a
+  missing one. It is kept. Only the missing frame is retransmitted.
+- Bad CRC or a gap in the sequence is reported by NAK(seq).
+- Flash writes are interleaved with USB receive. One block is written between polls of
+  the USB port. So, the host keeps streaming while a frame is written.
+- ACK(seq) means all frames before seq are written. The host may send frames up to
+  seq+STREAM_WINDOW-1.
+
+Download (Pico to Host):
+- The host sends ACK(seq) when all frames before seq are received, NAK(seq) to request
+  a frame again.
+- If there is no progress for STREAM_TIMEOUT_MS, the oldest frame not acknowledged is
+  sent again.
+*****************************************************************************************/
+
+//Frame Types
+#define FRAME_START   'S'
+#define FRAME_READY   'R'
+#define FRAME_DATA    'D'
+#define FRAME_ACK     'A'
+#define FRAME_NAK     'N'
+#define FRAME_END     'E'
+#define FRAME_ABORT   'X'
+
+#define HEADERSIZE      12
+#define CRCSIZE         4
+#define CTRLPAYLOADMAX  12    //Max payload size of control frames
+#define FRAMEBUFSIZE    (HEADERSIZE+STREAM_FRAMESIZE+CRCSIZE)
+#define CTRLBUFSIZE     (HEADERSIZE+CTRLPAYLOADMAX+CRCSIZE)
+
+#define CTRLC 03
+#define CAN   24
+
+typedef struct {
+  uint8_t  magic[2];
+  uint8_t  type;
+  uint8_t  reserved;
+  uint32_t seq;
+  uint32_t len;
+} frameheader_t;
+
+static_assert(sizeof(frameheader_t)==HEADERSIZE, "frameheader_t must be 12 bytes");
+
+typedef enum {
+  RX_NONE,      //Frame not complete yet
+  RX_FRAME,     //Valid frame received
+  RX_BADFRAME,  //CRC error
+  RX_CANCEL     //User typed Ctrl-C
+} rxresult_t;
+
+typedef enum {
+  RXSTATE_SYNC,     //Waiting for 'M'
+  RXSTATE_SYNC2,    //Waiting for 'F'
+  RXSTATE_HEADER,
+  RXSTATE_BODY,
+  RXSTATE_DISCARD   //Skipping a frame we don't want
+} rxstate_t;
+
+//Receiver
+static rxstate_t rxState;
+static uint32_t  rxCount;     //Bytes of current frame received
+static uint32_t  rxNeed;      //Total bytes of current frame
+static uint8_t*  rxDest;      //Buffer of current frame
+static uint32_t  rxHeader[HEADERSIZE/4];
+static uint32_t  rxCtrlBuffer[CTRLBUFSIZE/4];
+static bool      rxCancelAllowed;
+
+//Ring of data frames
+static uint8_t*  slotBuffer;                //STREAM_WINDOW*FRAMEBUFSIZE bytes from heap
+static bool      slotValid[STREAM_WINDOW];
+static bool      slotNakSent[STREAM_WINDOW];
+static uint32_t  slotBase;                  //Sequence number of the oldest frame in ring
+static uint32_t  frameCount;
+static uint32_t  blockCount;
+
+static inline uint8_t* GetSlot(const uint32_t seq) {
+  return slotBuffer + (seq%STREAM_WINDOW)*FRAMEBUFSIZE;
+}
+
+//Number of blocks in data frame seq
+static inline uint32_t GetFrameBlockCount(const uint32_t seq) {
+  return MIN(STREAM_FRAMEBLOCKS, blockCount-seq*STREAM_FRAMEBLOCKS);
+}
+
+
+////////////////////////////////////////////////////////////////////
+// Send a control frame
+//
+// Input: type    - Frame type
+//        seq     - Sequence number
+//        payload - Array of 32-bit words. Can be NULL if count is 0.
+//        count   - Number of words in payload
+//
+static void SendCtrlFrame(const uint8_t type, const uint32_t seq, const uint32_t* payload, const uint count) {
+  uint32_t buffer[CTRLBUFSIZE/4];
+  assert(count*4<=CTRLPAYLOADMAX);
+
+  frameheader_t* header = (frameheader_t*)buffer;
+  header->magic[0] = 'M';
+  header->magic[1] = 'F';
+  header->type = type;
+  header->reserved = 0;
+  header->seq = seq;
+  header->len = count*4;
+  for(uint i=0;i<count;++i) buffer[HEADERSIZE/4+i] = payload[i];
+  buffer[HEADERSIZE/4+count] = CRC32Aligned((uint8_t*)buffer, HEADERSIZE+count*4);
+
+  usb_putraw((const char*)buffer, HEADERSIZE+count*4+CRCSIZE);
+}
+
+////////////////////////////////////////////////////////////////////
+// Build and send a data frame
+// The frame buffer is kept for retransmission.
+//
+// Input: unitNum - Unit to read
+//        seq     - Sequence number
+//
+// Output: false if a block cannot be read. Nothing is sent.
+//
+static bool SendDataFrame(const uint32_t unitNum, const uint32_t seq) {
+  uint8_t* frame = GetSlot(seq);
+  const uint32_t len = GetFrameBlockCount(seq)*BLOCKSIZE;
+
+  if (!slotValid[seq%STREAM_WINDOW]) {
+    frameheader_t* header = (frameheader_t*)frame;
+    header->magic[0] = 'M';
+    header->magic[1] = 'F';
+    header->type = FRAME_DATA;
+    header->reserved = 0;
+    header->seq = seq;
+    header->len = len;
+
+    TurnOnActLed();
+    TurnOnPicoLed();
+    uint8_t* dest = frame+HEADERSIZE;
+    uint error = MFERR_NONE;
+    for(uint32_t i=0;i<len/BLOCKSIZE && error==MFERR_NONE;++i) {
+      error = ReadBlock(unitNum, seq*STREAM_FRAMEBLOCKS+i, dest, NULL);
+      dest += BLOCKSIZE;
+    }
+    TurnOffActLed();
+    TurnOffPicoLed();
+    if (error!=MFERR_NONE) return false;
+
+    const uint32_t crc = CRC32Aligned(frame, HEADERSIZE+len);
+    memcpy(dest, &crc, CRCSIZE);
+    slotValid[seq%STREAM_WINDOW] = true;
+  }
+
+  usb_putraw((const char*)frame, HEADERSIZE+len+CRCSIZE);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Get the buffer to receive a data frame
+//
+// Input: seq - Sequence number
+//        len - Payload length
+//
+// Output: Pointer to the slot. NULL if the frame is not wanted.
+//
+static uint8_t* GetRxSlot(const uint32_t seq, const uint32_t len) {
+  if (slotBuffer==NULL || frameCount==0) return NULL;   //Not receiving
+  if (seq<slotBase || seq>=slotBase+STREAM_WINDOW || seq>=frameCount) return NULL;
+  if (slotValid[seq%STREAM_WINDOW]) return NULL;   //Duplicate
+  if (len!=GetFrameBlockCount(seq)*BLOCKSIZE) return NULL;
+  return GetSlot(seq);
+}
+
+////////////////////////////////////////////////////////////////////
+// Reset the receiver to search for the next frame
+//
+static inline void ResetReceiver() {
+  rxState = RXSTATE_SYNC;
+}
+
+////////////////////////////////////////////////////////////////////
+// Receive bytes which are already available from USB.
+// It never waits. Call it repeatedly until a frame is complete.
+//
+// Input: frameOut - Pointer to receive the frame if the result is RX_FRAME or
+//                   RX_BADFRAME. The frame is valid until the next call.
+//
+// Output: rxresult_t
+//
+static rxresult_t ReceiveFrame(frameheader_t** frameOut) {
+  switch(rxState) {
+    case RXSTATE_SYNC:
+    case RXSTATE_SYNC2: {
+      const int ch = usb_getchar_timeout_us(0);
+      if (ch<0) return RX_NONE;
+
+      if (rxState==RXSTATE_SYNC) {
+        if (ch=='M') rxState = RXSTATE_SYNC2;
+        else if (rxCancelAllowed && (ch==CTRLC || ch==CAN)) return RX_CANCEL;
+      } else {
+        if (ch=='F') {
+          rxState = RXSTATE_HEADER;
+          rxCount = 2;
+          ((uint8_t*)rxHeader)[0] = 'M';
+          ((uint8_t*)rxHeader)[1] = 'F';
+        }
+        else if (ch!='M') rxState = RXSTATE_SYNC;
+      }
+      return RX_NONE;
+    }
+
+    case RXSTATE_HEADER: {
+      rxCount += usb_getraw_timeout((char*)rxHeader+rxCount, HEADERSIZE-rxCount, 0);
+      if (rxCount<HEADERSIZE) return RX_NONE;
+
+      //Sanity check. A false sync is dropped here or by CRC.
+      const frameheader_t* header = (frameheader_t*)rxHeader;
+      if (header->len%4!=0 || header->len>STREAM_FRAMESIZE) {
+        ResetReceiver();
+        return RX_NONE;
+      }
+
+      if (header->type==FRAME_DATA) rxDest = GetRxSlot(header->seq, header->len);
+      else if (header->len<=CTRLPAYLOADMAX) rxDest = (uint8_t*)rxCtrlBuffer;
+      else rxDest = NULL;
+
+      rxNeed = HEADERSIZE+header->len+CRCSIZE;
+      if (rxDest) {
+        memcpy(rxDest, rxHeader, HEADERSIZE);
+        rxState = RXSTATE_BODY;
+      } else {
+        rxState = RXSTATE_DISCARD;
+      }
+      return RX_NONE;
+    }
+
+    case RXSTATE_BODY: {
+      rxCount += usb_getraw_timeout((char*)rxDest+rxCount, rxNeed-rxCount, 0);
+      if (rxCount<rxNeed) return RX_NONE;
+
+      ResetReceiver();
+      const uint32_t len = rxNeed-HEADERSIZE-CRCSIZE;
+      uint32_t crc;
+      memcpy(&crc, rxDest+HEADERSIZE+len, CRCSIZE);
+      *frameOut = (frameheader_t*)rxDest;
+      return (crc==CRC32Aligned(rxDest, HEADERSIZE+len))?RX_FRAME:RX_BADFRAME;
+    }
+
+    case RXSTATE_DISCARD: {
+      char buf[64];
+      rxCount += usb_getraw_timeout(buf, MIN(sizeof(buf),rxNeed-rxCount), 0);
+      if (rxCount>=rxNeed) ResetReceiver();
+      return RX_NONE;
+    }
+  }
+  return RX_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// Init the receiver and ring buffer, wait for START frame
+//
+// Output: START frame. NULL if cancelled or timeout
+//
+static frameheader_t* WaitForStart() {
+  frameheader_t* frame;
+  absolute_time_t timeout = make_timeout_time_ms(90*1000);
+
+  ResetReceiver();
+  rxCancelAllowed = true;
+  frameCount = 0;
+  slotBase = 0;
+  memset(slotValid, 0, sizeof(slotValid));
+  memset(slotNakSent, 0, sizeof(slotNakSent));
+
+  while(!time_reached(timeout)) {
+    rxresult_t result = ReceiveFrame(&frame);
+    if (result==RX_CANCEL) return NULL;
+    if (result==RX_FRAME && frame->type==FRAME_START && frame->len>=4) {
+      rxCancelAllowed = false;
+      return frame;
+    }
+  }
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////////////
+// Send READY frame
+//
+static void SendReady() {
+  const uint32_t payload[] = {blockCount, STREAM_FRAMEBLOCKS, STREAM_WINDOW};
+  SendCtrlFrame(FRAME_READY, 0, payload, count_of(payload));
+}
+
+////////////////////////////////////////////////////////////////////
+// Abort the session and discard all input
+//
+static void AbortSession() {
+  SendCtrlFrame(FRAME_ABORT, 0, NULL, 0);
+  sleep_ms(100);
+  usb_discard();
+}
+
+////////////////////////////////////////////////////////////////////
+// Stream Receive (Host to MegaFlash)
+//
+// Input: unitNum - ProDOS Drive to be written
+//        verificationErrorOut - Pointer to receive number of write errors
+//
+// Output: Number of blocks written. -1 if aborted.
+//
+static int StreamReceive(const uint32_t unitNum, uint32_t* verificationErrorOut) {
+  frameheader_t* frame = WaitForStart();
+  if (!frame) return -1;
+
+  //Image larger than the drive
+  const uint32_t requested = ((uint32_t*)frame)[HEADERSIZE/4];
+  if (requested==0 || requested>GetBlockCountForImageTransfer(unitNum)) {
+    AbortSession();
+    return -1;
+  }
+
+  blockCount = requested;
+  frameCount = (blockCount+STREAM_FRAMEBLOCKS-1)/STREAM_FRAMEBLOCKS;
+  SendReady();
+
+  uint32_t verificationErrorCount = 0;
+  uint32_t blockInFrame = 0;    //Next block to be written in the oldest frame
+  uint errorCount = 0;
+  absolute_time_t timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+
+  while(slotBase<frameCount) {
+    //Receive
+    rxresult_t result = ReceiveFrame(&frame);
+    if (result==RX_FRAME) {
+      if (frame->type==FRAME_DATA) {
+        //GetRxSlot() has checked the sequence number
+        slotValid[frame->seq%STREAM_WINDOW] = true;
+        timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+        errorCount = 0;
+
+        //Request frames which are skipped
+        for(uint32_t seq=slotBase;seq<frame->seq;++seq) {
+          if (!slotValid[seq%STREAM_WINDOW] && !slotNakSent[seq%STREAM_WINDOW]) {
+            slotNakSent[seq%STREAM_WINDOW] = true;
+            SendCtrlFrame(FRAME_NAK, seq, NULL, 0);
+          }
+        }
+      }
+      else if (frame->type==FRAME_START) SendReady();   //READY was lost
+      else if (frame->type==FRAME_ABORT) return -1;
+    } else if (result==RX_BADFRAME) {
+      if (frame->type==FRAME_DATA) {
+        slotNakSent[frame->seq%STREAM_WINDOW] = true;
+        SendCtrlFrame(FRAME_NAK, frame->seq, NULL, 0);
+      }
+    }
+
+    //Write one block of the oldest frame
+    if (slotValid[slotBase%STREAM_WINDOW]) {
+      const uint8_t* src = GetSlot(slotBase)+HEADERSIZE+blockInFrame*BLOCKSIZE;
+      TurnOnActLed();
+      TurnOnPicoLed();
+      bool success = WriteBlockForImageTransfer(unitNum, slotBase*STREAM_FRAMEBLOCKS+blockInFrame, src);
+      if (!success) ++verificationErrorCount;
+      TurnOffActLed();
+      TurnOffPicoLed();
+
+      if (++blockInFrame==GetFrameBlockCount(slotBase)) {
+        //Frame is written. Free the slot.
+        slotValid[slotBase%STREAM_WINDOW] = false;
+        slotNakSent[slotBase%STREAM_WINDOW] = false;
+        ++slotBase;
+        blockInFrame = 0;
+        SendCtrlFrame(FRAME_ACK, slotBase, NULL, 0);
+      }
+      timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+    }
+
+    //No progress. Request the oldest frame again.
+    if (time_reached(timeout)) {
+      if (++errorCount>STREAM_MAXERROR) {
+        AbortSession();
+        return -1;
+      }
+      ResetReceiver();
+      SendCtrlFrame(FRAME_NAK, slotBase, NULL, 0);
+      timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+    }
+  }
+
+  SendCtrlFrame(FRAME_END, frameCount, &verificationErrorCount, 1);
+  *verificationErrorOut = verificationErrorCount;
+  return blockCount;
+}
+
+////////////////////////////////////////////////////////////////////
+// Stream Transmit (MegaFlash to Host)
+//
+// Input: unitNum - ProDOS Drive to be read
+//
+// Output: Number of blocks sent. -1 if aborted.
+//         The session is aborted if a block cannot be read.
+//
+static int StreamTransmit(const uint32_t unitNum) {
+  frameheader_t* frame = WaitForStart();
+  if (!frame) return -1;
+
+  blockCount = GetBlockCountForImageTransfer(unitNum);
+  frameCount = (blockCount+STREAM_FRAMEBLOCKS-1)/STREAM_FRAMEBLOCKS;
+  SendReady();
+
+  uint32_t nextSend = 0;
+  uint errorCount = 0;
+  absolute_time_t timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+
+  while(slotBase<frameCount) {
+    //Send next frame if the window is not full
+    if (nextSend<frameCount && nextSend<slotBase+STREAM_WINDOW) {
+      if (!SendDataFrame(unitNum, nextSend++)) goto readerror;
+    }
+
+    //Receive ACK/NAK
+    rxresult_t result = ReceiveFrame(&frame);
+    if (result==RX_FRAME) {
+      const uint32_t seq = frame->seq;
+      if (frame->type==FRAME_ACK && seq>slotBase && seq<=nextSend) {
+        //Free the acknowledged slots
+        while(slotBase<seq) slotValid[(slotBase++)%STREAM_WINDOW] = false;
+        timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+        errorCount = 0;
+      }
+      else if (frame->type==FRAME_NAK && seq>=slotBase && seq<nextSend) {
+        if (!SendDataFrame(unitNum, seq)) goto readerror;
+      }
+      else if (frame->type==FRAME_START && nextSend==0) SendReady();  //READY was lost
+      else if (frame->type==FRAME_ABORT) return -1;
+    }
+
+    //No progress. Send the oldest frame again.
+    if (time_reached(timeout)) {
+      if (++errorCount>STREAM_MAXERROR) {
+        AbortSession();
+        return -1;
+      }
+      if (slotBase<nextSend && !SendDataFrame(unitNum, slotBase)) goto readerror;
+      timeout = make_timeout_time_ms(STREAM_TIMEOUT_MS);
+    }
+  }
+
+  const uint32_t zero = 0;
+  SendCtrlFrame(FRAME_END, frameCount, &zero, 1);
+  return blockCount;
+
+readerror:
+  AbortSession();
+  printf("\nRead Error.\n");
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////
+// Allocate the ring of frame buffers
+// Heap is used because it is only needed during transfer.
+//
+static bool AllocSlots() {
+  slotBuffer = malloc(STREAM_WINDOW*FRAMEBUFSIZE);
+  if (!slotBuffer) {
+    printf("\nError: Not enough memory.\n");
+    return false;
+  }
+  return true;
+}
+
+static void FreeSlots() {
+  free(slotBuffer);
+  slotBuffer = NULL;
+}
+
+//PC -> MegaFlash
+void StreamUpload(const uint32_t unitNum) {
+  if (!AllocSlots()) return;
+
+  printf("\nYou are ready to upload ProDOS image file to drive %d.\n",unitNum);
+  printf("Please start mfstream.py within 90 seconds. Type Ctrl-C to abort.\n");
+
+  uint32_t verificationErrorCount = 0;
+  int count = StreamReceive(unitNum, &verificationErrorCount);
+  FreeSlots();
+
+  if (count<0) printf("\nAborted.\n");
+  else {
+    printf("\n\n%d blocks received.\n",count);
+    printf("Verification Error:%d\n",verificationErrorCount);
+  }
+}
+
+//MegaFlash -> PC
+void StreamDownload(const uint32_t unitNum) {
+  if (!AllocSlots()) return;
+
+  printf("\nYou are ready to download ProDOS image file (.po) from drive %d.\n",unitNum);
+  printf("Please start mfstream.py within 90 seconds. Type Ctrl-C to abort.\n");
+
+  int count = StreamTransmit(unitNum);
+  FreeSlots();
+
+  if (count<0) printf("\nAborted.\n");
+  else {
+    printf("\n\nDownload Completed.\n");
+    printf("%d blocks sent.\n",count);
+  }
+}
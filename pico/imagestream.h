@@ -0,0 +1,23 @@
+#ifndef _IMAGESTREAM_H
+#define _IMAGESTREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+#define STREAM_FRAMEBLOCKS  8                                 //ProDOS blocks per data frame
+#define STREAM_FRAMESIZE    (STREAM_FRAMEBLOCKS*BLOCKSIZE)    //Payload size of data frame
+#define STREAM_WINDOW       4                                 //Data frames in flight
+#define STREAM_TIMEOUT_MS   3000                              //Retransmit if no progress
+#define STREAM_MAXERROR     10                                //Abort after consecutive timeouts
+
+void StreamUpload(const uint32_t unitNum);
+void StreamDownload(const uint32_t unitNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
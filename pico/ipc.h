@@ -7,7 +7,10 @@ extern "C" {
 
 typedef enum {
   IPCCMD_WIFITEST,
-  IPCCMD_TFTP
+  IPCCMD_TFTP,
+  IPCCMD_BLOCKSTREAM,   //Wake up core 0 to read/write a block of multi-block transfer
+  IPCCMD_ASYNCCMD,      //Wake up core 0 to execute a long command
+  IPCCMD_U2             //Wake up core 0 to execute a Uthernet II socket command
 } IpcCmd;
 
 
@@ -16,6 +19,9 @@ struct IpcMsg {
   uint32_t data;
 };
 
+//Background tasks of core 0 (main.c)
+void Core0BackgroundTasks();
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,6 +11,8 @@
 #include "busloop_wa.h"
 #include "flash.h"
 #include "flashunitmapper.h"
+#include "romdisk.h"
+#include "ramdisk.h"
 #include "dmamemops.h"
 #include "misc.h"
 #include "userconfig.h"
@@ -19,8 +21,15 @@
 #include "slinky.h"
 #include "ipc.h"
 #include "network.h"
+#include "wifisession.h"
+#include "usbmsc.h"
 #include "tftpstate.h"
 #include "uthernet2.h"
+#include "readahead.h"
+#include "blockstream.h"
+#include "trim.h"
+#include "flashstats.h"
+#include "bustrace.h"
 
 static inline void InitActLed() {
   gpio_init(ACT_LED_PIN);
@@ -42,6 +51,10 @@ void gpio_intr_callback(uint gpio, uint32_t events){
     //Abort Erase Flash Disk
     //Read the note at AbortEraseFlashDisk() for more info
     AbortEraseFlashDisk();
+    
+    //Write dirty sectors in cache back to flash
+    //It cannot be done in interrupt handler. Core 0 will do it.
+    RequestFlushSectorCache();
   }
 }
 
@@ -60,6 +73,9 @@ void __no_inline_not_in_flash_func(core1Main)() {
   //No interrupt on this core
   //Bus Loop is time critical
   save_and_disable_interrupts();  
+#if BUSTRACE
+  BusTraceInitCore1();
+#endif
 
   //Initalize data
   CommandHandlerInit();
@@ -78,6 +94,46 @@ void __no_inline_not_in_flash_func(core1Main)() {
 }
 
 volatile bool updateNTPNow = false;
+extern volatile tftp_state_t tftp_state;
+
+//Polling interval of background tasks on core 0
+//It is short so that read-ahead can start before the next ReadBlock
+#define CORE0_POLL_US 1000
+
+//
+//Background tasks of core 0
+//They are called by core0Loop() and by the event loop of network tasks,
+//which may run for minutes
+//
+void Core0BackgroundTasks() {
+  //Execute a long command from the Apple
+  AsyncCommandTask();
+  
+  //Execute Uthernet II socket commands and poll network
+  U2_Poll();
+  
+  //Read/Write a block of multi-block transfer
+  BlockStreamTask();
+  
+  //Read the next blocks if ReadBlock is sequential
+  ReadAheadTask();
+  
+  //Write dirty sectors in cache back to flash when idle
+  FlushSectorCacheIfIdle();
+  
+  //Erase stale regions of lazily erased units when idle
+  LazyEraseTask();
+  
+  //Pre-erase free sectors of ProDOS volumes when idle
+  TrimTask();
+  
+  //Serve USB Mass Storage and CDC
+  USBTask();
+#if BUSTRACE
+  //Keys of USB serial, e.g. 't' to dump the bus trace
+  TerminalKeyTask();
+#endif
+}
 
 //
 //Use Core 0 to run background task such as TFTP or NTP Time sync
@@ -90,40 +146,72 @@ void __no_inline_not_in_flash_func(core0Loop)() {
   if (CheckPicoW()) {
     do {
       updateNTPNow = false;
+      SetAsyncWorkerReady(false);   //Long commands are executed by core 1
+      tsFlushSectorCache();   //Network task may run for a long time
       int err = GetNetworkTime();
       DEBUG_PRINTF("GetNTP err=%d (%d=NETERR_NONE)\n",err,NETERR_NONE);
       if (err==NETERR_NONE) nextUpdateTime = make_timeout_time_ms(NEXTUPDATE_SUCCESS);
       else nextUpdateTime = make_timeout_time_ms(NEXTUPDATE_FAILED);
+      SetAsyncWorkerReady(true);
 
         //wait until nextUpdateTime or msg from other core
         do {
           uint32_t param;
-          bool msgReceived = multicore_fifo_pop_timeout_us(50*1000,&param);
+          bool msgReceived = multicore_fifo_pop_timeout_us(CORE0_POLL_US,&param);
           if (msgReceived) {
             struct IpcMsg* msg=(struct IpcMsg*)param;
             if (msg->command == IPCCMD_WIFITEST) {
+              SetAsyncWorkerReady(false);
+              tsFlushSectorCache();   //Network task may run for a long time
               TestWifi((TestResult_t*)msg->data);
+              SetAsyncWorkerReady(true);
             } else if (msg->command == IPCCMD_TFTP) {
+              //Server Mode runs until it is aborted. The Apple keeps working
+              //while it runs. So, its event loop executes long commands.
+              const bool serverMode = (tftp_state.dir==2);
+              if (!serverMode) SetAsyncWorkerReady(false);
+              tsFlushSectorCache();   //Network task may run for a long time
               ExecuteTFTP(msg->data /*taskid*/);
+              SetAsyncWorkerReady(true);
             }
+            //IPCCMD_BLOCKSTREAM, IPCCMD_ASYNCCMD, IPCCMD_U2: Nothing to do. Just wake up.
           }
+          
+          //Execute a long command from the Apple and other background tasks
+          Core0BackgroundTasks();
+          
+          //Keep idle WIFI connection alive until it times out
+          WifiSessionTask();
         }while (!time_reached(nextUpdateTime) && !updateNTPNow);
       
     } while(1);
   } else {
     //Not running on PicoW
-    //Keep popping fifo queue to avoid blocking
-    while(1) multicore_fifo_pop_blocking();
+    //Keep popping fifo queue to avoid blocking, execute long commands,
+    //serve multi-block transfer, read-ahead blocks, write dirty sectors
+    //in cache back to flash, erase stale regions and pre-erase free
+    //sectors when idle, execute Uthernet II socket commands
+    SetAsyncWorkerReady(true);
+    while(1) {
+      uint32_t param;
+      multicore_fifo_pop_timeout_us(CORE0_POLL_US,&param);
+      Core0BackgroundTasks();
+    }
   }
 }
 
 int main() {
   InitPIO();  
+  InitFlashStats();
   InitSpi();
   InitFlash();
   InitActLed();
   InitDMAChannel();
   InitTFTPState();
+  InitReadAhead();
+  InitTrim();
+  InitAsyncCommand();
+  InitBlockStream();
   
   //Enable Pull-down resistors of unused GPIOs
   gpio_pull_down(0);
@@ -202,8 +290,21 @@ int main() {
   //       User Terminal if not.
   //
   if (appleConnected) {
+#if BUSTRACE
+    BusTraceInit();
+#endif
+#if USBMSC_WITH_APPLE
+    InitUSBMSC(true);   //Read-only units
+    stdio_usb_init();
+#endif
     core0Loop();  //Running Wifi
   } else {
+    //The host sees the same units as User Terminal
+    DisableFlashUnitMapping();
+    DisableRomdisk();
+    DisableRamdisk();
+
+    InitUSBMSC(false);
     stdio_usb_init();
     InitPicoLed();
     
@@ -211,7 +312,9 @@ int main() {
       if (stdio_usb_connected()) {
         UserTerminal();
       } else {
-        sleep_ms(1000);
+        USBTask();    //Serve USB Mass Storage
+        FlushSectorCacheIfIdle();   //Write blocks from the host back to flash
+        sleep_ms(1);
       }
     }
   }
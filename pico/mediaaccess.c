@@ -5,6 +5,9 @@
 #include "romdisk.h"
 #include "ramdisk.h"
 #include "misc.h"
+#include "readahead.h"
+#include "flashstats.h"
+#include "trim.h"
 
 //******************************************************************
 //
@@ -110,6 +113,22 @@ static void __no_inline_not_in_flash_func(TranslateUnitNum)(uint unitNum, MediaT
   assert(false);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Get the medium unit number of a unit
+//
+// Input: unitNum - Smartport unit number
+//
+// Output: uint - Medium unit number. 0 if unitNum is invalid.
+//
+uint GetMediumUnitNum(const uint unitNum) {
+  if (!IsValidUnitNum(unitNum)) return 0;
+  
+  uint mediumUnitNum;
+  MediaType type;
+  TranslateUnitNum(unitNum,&type,&mediumUnitNum);
+  return mediumUnitNum;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Get the unit number of RAM Disk (first RAM disk unit)
 //
@@ -281,11 +300,15 @@ uint __no_inline_not_in_flash_func(ReadBlock)(const uint unitNum, const uint blo
       if (spResult != SP_NOERR) retValue=MFERR_RWERROR;  
       goto exit;
       break;
-    case TYPE_FLASH:
-      spResult = tsReadBlockFlash_Public(mediumUnitNum, blockNum,destBuffer);
+    case TYPE_FLASH: {
+      const uint32_t startTime = time_us_32();
+      //Try the read-ahead ring first
+      if (ReadAheadLookup(mediumUnitNum, blockNum, destBuffer)) spResult = SP_NOERR;
+      else spResult = tsReadBlockFlash_Public(mediumUnitNum, blockNum,destBuffer);
       if (spResult != SP_NOERR) retValue=MFERR_RWERROR;  
+      FlashStatsRecordBlock(false, startTime);
       goto exit;
-      break;
+    }
     case TYPE_RAMDISK:
       spResult = tsReadBlockRamdisk(blockNum, destBuffer);
       if (spResult != SP_NOERR) retValue=MFERR_RWERROR;  
@@ -341,10 +364,16 @@ uint __no_inline_not_in_flash_func(WriteBlock)(const uint unitNum, const uint bl
       spResult = SP_NOWRITEERR;   //ROMDisk is read-only
       retValue = MFERR_RWERROR;
       goto exit;
-    case TYPE_FLASH:
+    case TYPE_FLASH: {
+      const uint32_t startTime = time_us_32();
+      TrimNoteWrite(mediumUnitNum, blockNum);   //Before the write. See trim.c
+      ReadAheadInvalidateBlock(mediumUnitNum, blockNum);
       spResult = tsWriteBlockFlash_Public(mediumUnitNum, blockNum, srcBuffer);
+      ReadAheadInvalidateBlock(mediumUnitNum, blockNum);  //Core 0 may have read the old data during the write
       if (spResult != SP_NOERR) retValue=MFERR_RWERROR;  
+      FlashStatsRecordBlock(true, startTime);
       goto exit;
+    }
     case TYPE_RAMDISK:
       spResult = tsWriteBlockRamdisk(blockNum, srcBuffer);
       if (spResult != SP_NOERR) retValue=MFERR_RWERROR;  
@@ -403,6 +432,8 @@ bool WriteBlockForImageTransfer(uint unitNum, const uint blockNum, const uint8_t
     //Write to Flash
     //
     blockloc_t blockLoc = GetBlockLoc(mediumUnitNum,blockNum);
+    TrimNoteWrite(mediumUnitNum, blockNum);
+    ReadAheadInvalidateBlock(mediumUnitNum, blockNum);
     
     //Erase 64kB sector every 16 blocks and block number <8192
     if (blockNum<8192 && blockNum%16 == 0) {
@@ -415,6 +446,7 @@ bool WriteBlockForImageTransfer(uint unitNum, const uint blockNum, const uint8_t
 
     //Program the block
     success = tsWriteOneBlockAlreadyErased_Public(blockLoc, srcBuffer);    
+    ReadAheadInvalidateBlock(mediumUnitNum, blockNum);
   }
   else if (type==TYPE_RAMDISK) {
     //
@@ -467,7 +499,8 @@ uint32_t GetBlockCountForImageTransfer(const uint32_t unitNum) {
 //
 // Output: bool - success
 //
-// Note: It takes 2 minutes to erase a FlashDisk
+// Note: It takes 2 minutes to erase a FlashDisk unless Lazy Unit Erase
+//       is enabled (LAZYERASE in flash.c)
 //
 bool EraseEntireUnit(const uint unitNum) {
   bool success = true;  //Assume success
@@ -487,7 +520,9 @@ bool EraseEntireUnit(const uint unitNum) {
       success = false;
       goto exit;
     case TYPE_FLASH:
+      ReadAheadInvalidateUnit(mediumUnitNum);
       tsEraseFlashDisk(mediumUnitNum);
+      ReadAheadInvalidateUnit(mediumUnitNum);
       success = true;
       goto exit;
     case TYPE_RAMDISK:
@@ -501,3 +536,32 @@ bool EraseEntireUnit(const uint unitNum) {
 exit:
     return success;
 }
+
+/////////////////////////////////////////////////////////////
+// Erase a 4kB sector of a FlashDisk whose blocks are all free
+// Read the note in trim.c
+//
+// Input: unitNum    - Unit Number (1-N)
+//        sectorNum  - Sector Number of the unit (0-8191)
+//        abortCheck - Return true to cancel the erase
+//
+// Output: trimresult_t
+//
+trimresult_t TrimFlashSector(const uint unitNum, const uint sectorNum, bool (*abortCheck)()) {
+  //Validate unitNum
+  if (!IsValidUnitNum(unitNum)) return TRIM_SKIPPED;
+  
+  uint mediumUnitNum;
+  MediaType type;
+  TranslateUnitNum(unitNum,&type,&mediumUnitNum);
+  if (type!=TYPE_FLASH) return TRIM_SKIPPED;
+
+  trimresult_t result = tsTrimSectorFlash_Public(mediumUnitNum, sectorNum, abortCheck);
+  if (result==TRIM_ERASED) {
+    //Sector n holds blocks n+k*8192 (k=0-7)
+    for(uint k=0;k<8;++k) {
+      ReadAheadInvalidateBlock(mediumUnitNum, sectorNum+k*8192);
+    }
+  }
+  return result;
+}
@@ -2,6 +2,7 @@
 #define _MEDIAACCESS_H
 
 #include "pico/stdlib.h"
+#include "flash.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,8 +19,10 @@ uint ReadBlock(const uint unitNum, const uint blockNum, uint8_t* destBuffer,uint
 uint WriteBlock(const uint unitNum, const uint blockNum, uint8_t* srcBuffer,uint8_t* spErrorOut);
 bool WriteBlockForImageTransfer(uint unitNum, const uint blockNum, const uint8_t* srcBuffer);
 uint32_t GetBlockCountForImageTransfer(const uint32_t unitNum);
+uint GetMediumUnitNum(const uint unitNum);
 uint GetRamdiskUnitNum();
 bool EraseEntireUnit(const uint unitNum);
+trimresult_t TrimFlashSector(const uint unitNum, const uint sectorNum, bool (*abortCheck)());
 
 
 //Device Status Byte:
@@ -74,6 +74,8 @@ uint32_t EndTimer() {
 }
 
 
+static bool appleConnected = false;   //Result of IsAppleConnected()
+
 /////////////////////////////////////////////////////////////////
 // Check if Apple II is connected by detecting PHI0 signal
 //
@@ -115,9 +117,20 @@ bool IsAppleConnected() {
   //Restore Function
   gpio_set_function(PHI0_PIN, orgFunc);
   
+  appleConnected = phi0ClockFound;
   return phi0ClockFound;
 }
 
+/////////////////////////////////////////////////////////////////
+// Get the result of IsAppleConnected() called at boot
+// PHI0 pin is not probed again. It is used by PIO after boot.
+//
+// Output: true if Apple II is connected
+//
+bool WasAppleConnected() {
+  return appleConnected;
+}
+
 
 
 /////////////////////////////////////////////////
@@ -333,6 +346,9 @@ bool GetVolumeInfo(const uint unitNum, VolumeInfo *infoOut) {
     
     //Block Count as defined in VDH
     infoOut->blockCount = buffer[0x2a]*256 + buffer[0x29];
+    
+    //Volume Bitmap Pointer
+    infoOut->bitmapBlock = buffer[0x28]*256 + buffer[0x27];
   } 
   else {
     infoOut->type = TYPE_UNKNOWN; //Unknown
@@ -17,6 +17,7 @@ void StartTimer();
 uint32_t EndTimer();
 
 bool IsAppleConnected();
+bool WasAppleConnected();
 bool CheckPicoW();
 void InitPicoLed();
 void TurnOnPicoLed();
@@ -34,6 +35,7 @@ typedef struct  {
   char volName[VOLNAMELENMAX+1];
   uint8_t volNameLen;
   uint8_t type; //0=ProDOS, 1=empty, 2=Unknown as defined in VolumeType enum
+  uint16_t bitmapBlock; //Block Number of Volume Bitmap (ProDOS only)
 } VolumeInfo;
 
 bool GetVolumeInfo(const uint unitNum, VolumeInfo *infoOut);
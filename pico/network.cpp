@@ -8,6 +8,7 @@
 #include "testwifitask.h"
 #include "tftprxtask.h"
 #include "tftptxtask.h"
+#include "tftpservertask.h"
 #include "userconfig.h"
 #include "rtc.h"
 #include "network.h"
@@ -82,6 +83,8 @@ static int ConvertExceptionToTFTPError(int e) {
       return TFTPERROR_ABORTED;
     case CTFTPTask::ERR_RWFAILED:
       return TFTPERROR_RWFAILED;
+    case CTFTPServerTask::ERR_BINDFAILED:
+      return TFTPERROR_PORTINUSE;
     default:
       return TFTPERROR_UNKNOWN;
   }
@@ -114,8 +117,9 @@ void ExecuteTFTP(const uint32_t taskid) {
   CTFTPTask *task = NULL;
 
   try {
-    if (dir==0)      task = new CTFTPRXTask(unitNum,hostname,filename,GetTFTPEnable1kBlockSize(), GetTFTPTimeout(),GetTFTPMaxAttempt(),GetTFTPServerPort());
-    else if (dir==1) task = new CTFTPTXTask(unitNum,hostname,filename,GetTFTPEnable1kBlockSize(), GetTFTPTimeout(),GetTFTPMaxAttempt(),GetTFTPServerPort());
+    if (dir==0)      task = new CTFTPRXTask(unitNum,hostname,filename,GetTFTPEnable1kBlockSize(), GetTFTPTimeout(),GetTFTPMaxAttempt(),GetTFTPServerPort(),GetTFTPWindowSize());
+    else if (dir==1) task = new CTFTPTXTask(unitNum,hostname,filename,GetTFTPEnable1kBlockSize(), GetTFTPTimeout(),GetTFTPMaxAttempt(),GetTFTPServerPort(),GetTFTPWindowSize());
+    else if (dir==2) task = new CTFTPServerTask(GetTFTPTimeout(),GetTFTPMaxAttempt(),GetTFTPServerPort(),GetTFTPWindowSize(),tftp_state.serverWriteEnabled);
     else {
       assert(0); //should not happen
     }  
@@ -128,6 +132,9 @@ void ExecuteTFTP(const uint32_t taskid) {
     
     //Map CUDPTask exception to tftp_error_t error code
     errorcode = ConvertExceptionToTFTPError(e);
+    
+    //Server Mode runs until it is aborted. Keep the result of last transfer.
+    if (dir==2 && e==CUDPTask::ERR_ABORTED) errorcode = tftp_state.error;
   } catch(...) {
     //make sure no exception goto C code    
     errorcode = TFTPERROR_UNKNOWN;
@@ -61,8 +61,10 @@ void CNTPTask::EvtDNSResult(const int dnserr, const ip_addr_t *ipaddr){
   SendNTPRequest();
 }
 
-void CNTPTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port){
-  CUDPTask::EvtUDPReceived(payload, payloadlen, remote_addr, remote_port);
+void CNTPTask::EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port){
+  CUDPTask::EvtUDPReceived(view, remote_addr, remote_port);
+  const uint8_t* payload = Linearize(view);
+  const uint16_t payloadlen = view.len;
   
   //Cancel Timeout timer  
   CancelTimer();  
@@ -97,6 +99,7 @@ void CNTPTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr
 
 void CNTPTask::EvtTimeout(uint32_t arg){
   CUDPTask::EvtTimeout(arg);
+  ForgetServerAddr();   //The cached IP address of server may be outdated
   AttemptNTP(); //Try again
 }
 
@@ -23,7 +23,7 @@ protected:
   //Override base class methods
   void EvtStart();
   void EvtDNSResult(const int dnserr, const ip_addr_t *ipaddr);
-  void EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port);
+  void EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port);
   void EvtTimeout(uint32_t arg);
 };
 
@@ -0,0 +1,248 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "defines.h"
+#include "debug.h"
+#include "flash.h"
+#include "readahead.h"
+
+/****************************************************************************************
+Sequential Read-ahead for Flash units
+
+ReadBlock() of a flash unit is executed on core 1 while the 6502 is waiting for the
+busy flag. Core 0 is idle most of the time. When the blocks of a flash unit are read
+sequentially (e.g. ProDOS file loading, BLOAD or booting), core 0 reads the next
+READAHEAD_COUNT blocks into a small RAM ring. Then, ReadBlock() is served by a memory
+copy from the ring instead of a SPI transaction.
+
+Access pattern detection and the ring are shared by both cores and protected by
+readaheadCS. Core 1 never waits for flash access of core 0 because core 0 does not
+hold readaheadCS while it is reading flash. A slot being filled is in SLOT_FILLING
+state and is ignored by ReadAheadLookup().
+
+Invalidation:
+Any write to a block, erase of a unit or image transfer to a unit must invalidate
+the ring before and after the flash is changed. Every invalidation increments
+generation. A slot which is being filled when generation changes is discarded after
+the read completes because its data may be stale. The second invalidation removes a
+slot that core 0 filled from the old flash contents while the write was in progress.
+
+Statistics can be read by CMD_GETREADAHEADSTAT command.
+*****************************************************************************************/
+
+//Number of sequential reads to trigger read-ahead
+#define READAHEAD_TRIGGER 2
+
+//Slot States
+typedef enum {
+  SLOT_EMPTY,
+  SLOT_FILLING,   //Core 0 is reading flash into the slot
+  SLOT_VALID
+} slotstate_t;
+
+typedef struct {
+  slotstate_t state;
+  uint unitNum;     //Flash unit number (1-N)
+  uint blockNum;
+} raslot_t;
+
+static critical_section_t readaheadCS;
+static raslot_t slots[READAHEAD_COUNT];
+static uint8_t __attribute__((aligned(4))) slotData[READAHEAD_COUNT][BLOCKSIZE];
+
+//Access Pattern
+static uint lastUnitNum = 0;
+static uint lastBlockNum = 0;
+static uint seqCount = 0;
+
+//Read-ahead Request. requestUnitNum = 0 means no request
+static uint requestUnitNum = 0;
+static uint requestBlockNum;     //Next block to be read
+static uint requestEndBlockNum;  //Last block to be read + 1
+
+static uint32_t generation = 0;
+static readaheadstats_t stats;
+
+
+////////////////////////////////////////////////////////////////////
+// Initialize Read-ahead data
+//
+void InitReadAhead() {
+  critical_section_init(&readaheadCS);
+  for(uint i=0;i<READAHEAD_COUNT;++i) {
+    slots[i].state = SLOT_EMPTY;
+  }
+  memset(&stats,0,sizeof(stats));
+}
+
+////////////////////////////////////////////////////////////////////
+// Find the slot which holds or is going to hold a block
+// Caller must hold readaheadCS
+//
+// Output: Slot index or -1 if not found
+//
+static int __no_inline_not_in_flash_func(FindSlot)(const uint unitNum, const uint blockNum) {
+  for(uint i=0;i<READAHEAD_COUNT;++i) {
+    if (slots[i].state!=SLOT_EMPTY && slots[i].unitNum==unitNum && slots[i].blockNum==blockNum) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////
+// Copy a block from read-ahead ring if it is available and update
+// access pattern. It is called by ReadBlock() for flash units.
+//
+// Input: flashUnitNum - Flash unit number (1-N)
+//        blockNum     - Block Number
+//        destBuffer   - Destination Buffer (512 Bytes)
+//
+// Output: true if the block is copied to destBuffer
+//
+bool __no_inline_not_in_flash_func(ReadAheadLookup)(const uint flashUnitNum, const uint blockNum, uint8_t* destBuffer) {
+  bool hit = false;
+
+  critical_section_enter_blocking(&readaheadCS);
+
+  //Step 1: Copy the block from the ring
+  int i = FindSlot(flashUnitNum, blockNum);
+  if (i>=0 && slots[i].state==SLOT_VALID) {
+    memcpy(destBuffer,slotData[i],BLOCKSIZE);
+    hit = true;
+    ++stats.hits;
+  } else {
+    ++stats.misses;
+  }
+
+  //Step 2: Update access pattern
+  if (flashUnitNum==lastUnitNum && blockNum==lastBlockNum+1) ++seqCount;
+  else seqCount = 0;
+  lastUnitNum  = flashUnitNum;
+  lastBlockNum = blockNum;
+
+  //Step 3: Request core 0 to read the next blocks
+  if (seqCount>=READAHEAD_TRIGGER) {
+    uint endBlockNum = MIN(blockNum+1+READAHEAD_COUNT, GetBlockCountFlash(flashUnitNum));
+    if (requestUnitNum!=flashUnitNum || requestBlockNum<=blockNum || requestBlockNum>endBlockNum) {
+      requestBlockNum = blockNum+1;
+    }
+    requestUnitNum = flashUnitNum;
+    requestEndBlockNum = endBlockNum;
+  } else if (requestUnitNum==flashUnitNum) {
+    //Not sequential anymore
+    requestUnitNum = 0;
+  }
+
+  critical_section_exit(&readaheadCS);
+  return hit;
+}
+
+////////////////////////////////////////////////////////////////////
+// Invalidate a block in read-ahead ring
+// It must be called before and after the block is written
+//
+// Input: flashUnitNum - Flash unit number (1-N)
+//        blockNum     - Block Number
+//
+void __no_inline_not_in_flash_func(ReadAheadInvalidateBlock)(const uint flashUnitNum, const uint blockNum) {
+  critical_section_enter_blocking(&readaheadCS);
+  ++generation;
+  int i = FindSlot(flashUnitNum, blockNum);
+  if (i>=0 && slots[i].state==SLOT_VALID) slots[i].state = SLOT_EMPTY;
+  critical_section_exit(&readaheadCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Invalidate all blocks of a unit in read-ahead ring
+// It must be called before and after the unit is erased or overwritten
+//
+// Input: flashUnitNum - Flash unit number (1-N)
+//
+void ReadAheadInvalidateUnit(const uint flashUnitNum) {
+  critical_section_enter_blocking(&readaheadCS);
+  ++generation;
+  for(uint i=0;i<READAHEAD_COUNT;++i) {
+    if (slots[i].state==SLOT_VALID && slots[i].unitNum==flashUnitNum) slots[i].state = SLOT_EMPTY;
+  }
+  if (requestUnitNum==flashUnitNum) requestUnitNum = 0;
+  critical_section_exit(&readaheadCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Find a slot for a new block
+// An empty slot or a slot which is outside the current read-ahead window.
+// Caller must hold readaheadCS
+//
+// Output: Slot index or -1 if all slots are in use
+//
+static int GetFreeSlot() {
+  for(uint i=0;i<READAHEAD_COUNT;++i) {
+    if (slots[i].state==SLOT_EMPTY) return i;
+  }
+
+  for(uint i=0;i<READAHEAD_COUNT;++i) {
+    if (slots[i].state!=SLOT_VALID) continue;
+    if (slots[i].unitNum!=requestUnitNum ||
+        slots[i].blockNum<=lastBlockNum || slots[i].blockNum>=requestEndBlockNum) return i;
+  }
+  return -1;
+}
+
+////////////////////////////////////////////////////////////////////
+// Read the requested blocks into read-ahead ring
+// This function should be called periodically by core 0.
+//
+void ReadAheadTask() {
+  for(uint n=READAHEAD_COUNT;n!=0;--n) {
+    critical_section_enter_blocking(&readaheadCS);
+    if (requestUnitNum==0 || requestBlockNum>=requestEndBlockNum) {
+      critical_section_exit(&readaheadCS);
+      return;   //Nothing to do
+    }
+
+    const uint unitNum  = requestUnitNum;
+    const uint blockNum = requestBlockNum++;
+    if (FindSlot(unitNum, blockNum)>=0) {
+      critical_section_exit(&readaheadCS);
+      continue; //Already in the ring
+    }
+
+    int i = GetFreeSlot();
+    if (i<0) {
+      --requestBlockNum;  //Try again later
+      critical_section_exit(&readaheadCS);
+      return;
+    }
+    slots[i].state = SLOT_FILLING;
+    slots[i].unitNum = unitNum;
+    slots[i].blockNum = blockNum;
+    const uint32_t gen = generation;
+    critical_section_exit(&readaheadCS);
+
+    //Read the block without holding readaheadCS
+    rwerror_t error = tsReadBlockFlash_Public(unitNum, blockNum, slotData[i]);
+
+    critical_section_enter_blocking(&readaheadCS);
+    if (error==SP_NOERR && gen==generation) {
+      slots[i].state = SLOT_VALID;
+      ++stats.prefetched;
+    } else {
+      slots[i].state = SLOT_EMPTY;  //Stale data
+    }
+    critical_section_exit(&readaheadCS);
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Get Read-ahead statistics
+//
+// Input: statsOut - Pointer to structure to receive the statistics
+//        reset    - Reset the counters to zero
+//
+void GetReadAheadStats(readaheadstats_t* statsOut, const bool reset) {
+  critical_section_enter_blocking(&readaheadCS);
+  *statsOut = stats;
+  if (reset) memset(&stats,0,sizeof(stats));
+  critical_section_exit(&readaheadCS);
+}
@@ -0,0 +1,28 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Read-ahead statistics
+typedef struct {
+  uint32_t hits;        //ReadBlock served from read-ahead ring
+  uint32_t misses;      //ReadBlock of flash unit read from flash
+  uint32_t prefetched;  //Blocks read into the ring by core 0
+} readaheadstats_t;
+
+void InitReadAhead();
+bool ReadAheadLookup(const uint flashUnitNum, const uint blockNum, uint8_t* destBuffer);
+void ReadAheadInvalidateBlock(const uint flashUnitNum, const uint blockNum);
+void ReadAheadInvalidateUnit(const uint flashUnitNum);
+void ReadAheadTask();
+void GetReadAheadStats(readaheadstats_t* statsOut, const bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,7 @@
 #include "a2bus.h"
 #include "ramdisk.h"
 #include "slinky.h"
+#include "bustrace.h"
 
 /**********************************************************************
 This module emulates a Slinky Card using internal RAM.
@@ -73,7 +74,9 @@ void __no_inline_not_in_flash_func(BusLoopSlinky)() {
   uint8_t* slinky_data = GetRamdiskDataPointer();
   
   do {
+    BusTraceEnd();  //Debug Build only. See bustrace.c
     uint32_t busdata = GetAppleBusBlocking();    
+    BusTraceBegin(busdata);
     uint32_t addr = busdata & 0b0011;     //Ignore A3-A2
     uint32_t data = (busdata >>5) & 0xff;
 
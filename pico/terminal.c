@@ -3,6 +3,8 @@
 #include "pico/stdlib.h"
 #include "usbserial.h"
 #include "filetransfer.h"
+#include "imagestream.h"
+#include "zmodem.h"
 #include "formatter.h"
 #include "misc.h"
 #include "flash.h"
@@ -10,11 +12,13 @@
 #include "romdisk.h"
 #include "ramdisk.h"
 #include "flashunitmapper.h"
+#include "usbmsc.h"
+#include "bustrace.h"
 
 //--------------------------------------------------------------
 //The definitions below must be the same as the ones in busloop.c
 
-extern uint8_t dataBuffer[];
+extern uint8_t* dataBuffer;
 //--------------------------------------------------------------
 
 static void PrintBanner() {
@@ -142,7 +146,9 @@ static void EraseFlash() {
     printf("\nErasing... Please wait.");
     TurnOnActLed();
     TurnOnPicoLed();
+    USBMSC_SetMediaBusy(true);
     tsEraseEverything();
+    USBMSC_SetMediaBusy(false);
     TurnOffActLed();
     TurnOffPicoLed();
     printf("\nDone!\n");
@@ -172,7 +178,7 @@ static void UploadImage() {
   printf("===================\n\n");
   
   printf("A ProDOS order disk image (.po/.hdv) can be uploaded to MegaFlash and\n");
-  printf("written to a drive with XMODEM-CRC protocol.\n");
+  printf("written to a drive with XMODEM, YMODEM-G, ZMODEM protocol or mfstream.py.\n");
 
   
   PrintAllPartitions();
@@ -186,7 +192,29 @@ static void UploadImage() {
 
   printf("WARNING: All data stored in the drive will be destroyed.\n");
   if (Confirm()) {
-    Upload(unitNum);
+    //Ask for Protocol
+    uint32_t key;
+    do {
+      printf("\nFile Transfer Protocol:\n");
+      printf("1:XModem-1k or XModem/CRC (Default)\n");
+      printf("2:Stream (mfstream.py)\n");
+      printf("3:YModem-G\n");
+      printf("4:ZModem\n");
+      printf("\nPlease select the protocol:");
+
+      key=usb_getkey();
+      if (key=='1' || key=='\r') {key='1'; putchar('1'); break;}
+      else if (key>='2' && key<='4') {putchar(key); break;}
+      else putchar('\n');
+    } while (1);
+    putchar('\n');
+
+    USBMSC_SetMediaBusy(true);
+    if (key=='2') StreamUpload(unitNum);
+    else if (key=='3') UploadYModemG(unitNum);
+    else if (key=='4') UploadZModem(unitNum);
+    else Upload(unitNum);
+    USBMSC_SetMediaBusy(false);
     WaitForAnyKey();
   }
 }
@@ -211,17 +239,31 @@ static void DownloadImage() {
     printf("\nFile Transfer Protocol:\n");
     printf("1:XModem/CRC (128 Bytes Packet)\n");
     printf("2:XModem-1k (1024 Bytes Packet) (Default)\n");
+    printf("3:Stream (mfstream.py)\n");
+    printf("4:YModem-G\n");
+    printf("5:ZModem\n");
     printf("\nPlease select the protocol:");
 
     key=usb_getkey();
     if (key=='1') {putchar('1'); break;}
-    else if (key=='2' || key=='\r') {putchar('2'); break;}
+    else if (key=='2' || key=='\r') {key='2'; putchar('2'); break;}
+    else if (key>='3' && key<='5') {putchar(key); break;}
     else putchar('\n');
   } while (1);
   putchar('\n');
 
-  protocol = (key=='1')?XMODEM128:XMODEM1K;
-  Download(unitNum,protocol); 
+  USBMSC_SetMediaBusy(true);
+  if (key=='3') {
+    StreamDownload(unitNum);
+  } else if (key=='4') {
+    DownloadYModemG(unitNum);
+  } else if (key=='5') {
+    DownloadZModem(unitNum);
+  } else {
+    protocol = (key=='1')?XMODEM128:XMODEM1K;
+    Download(unitNum,protocol); 
+  }
+  USBMSC_SetMediaBusy(false);
   WaitForAnyKey();
 }
 
@@ -248,9 +290,15 @@ void UserTerminal() {
       printf("2) Upload ProDOS Image file to MegaFlash\n");
       printf("3) Download ProDOS Image file from MegaFlash\n");
       printf("4) Erase Flash Content\n");
+#if BUSTRACE
+      printf("T) Dump Bus Trace\n");
+#endif
       printf("\nPlease Select:");
       key = usb_getkey();
       printf("%c\n\n",key);
+#if BUSTRACE
+      if (key=='t' || key=='T') BusTraceDump();
+#endif
       
     }while(key<'1' || key>'4');
     
@@ -260,3 +308,19 @@ void UserTerminal() {
     else if (key=='4') EraseFlash();
   }
 }
+
+//
+// Handle the keys of USB serial while the Apple is connected.
+// User Terminal is not running then. Called periodically by core 0.
+// Only Debug Build with BUSTRACE has a key to handle. It is the only
+// reader of USB serial in this case. So, a key is never taken from
+// User Terminal or a file transfer.
+//
+void TerminalKeyTask() {
+#if BUSTRACE
+  if (!stdio_usb_connected()) return;
+  
+  const int key = usb_getkey_timeout_us(0);
+  if (key=='t' || key=='T') BusTraceDump();
+#endif
+}
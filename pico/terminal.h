@@ -8,6 +8,7 @@ extern "C" {
 #include "defines.h"
 
 void UserTerminal();
+void TerminalKeyTask();
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,22 @@
 #define TFTP_SERVERPORT_DEFAULT    69
 #define TFTP_ENABLE1KBLOCK_DEFAULT true
 
+//TFTP Window Size (RFC 7440). Number of Data packets per Ack
+//1 means lock-step. The windowsize option is not sent.
+//The effective maximum is also limited by UDP_RXQUEUE_LEN (udptask.h).
+//It is 1 if CUDPTask has no receive queue.
+#define TFTP_WINDOWSIZE_DEFAULT 4
+#define TFTP_WINDOWSIZE_MIN     1
+#define TFTP_WINDOWSIZE_MAX    16
+
+//Size of RX Ring in number of ProDOS blocks. Received data is queued
+//in the ring and written to the drive in background.
+//It must be able to hold a whole window of 1024-byte Data packets.
+#define TFTP_RXRING_BLOCKS     64
+
+//Server Mode. Period of timer event when no transfer is in progress (ms)
+#define TFTP_SERVER_HEARTBEAT 5000
+
 /* The default timeout of most TFTP server is 3s. For the last Ack, the server
 does not response if the Ack message is delivered succesfully. So, we need to
 wait slightly longer than 3s before we terminate the process. This is the minimum
@@ -19,13 +19,17 @@ extern "C" volatile tftp_state_t tftp_state;
 // Constructor
 // 
 CTFTPRXTask::CTFTPRXTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,
-                         const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort):
-                         CTFTPTask(unitNum, hostname, filename,enable1kBlockSize,tftpTimeout,tftpMaxAttempt,tftpServerPort) {
+                         const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize):
+                         CTFTPTask(unitNum, hostname, filename,enable1kBlockSize,tftpTimeout,tftpMaxAttempt,tftpServerPort,tftpWindowSize) {
   
   OACKReceived = false;
   hasCompleted = false;
   serverTIDAccepted = false;
   blockReceived = 0;
+  ringHead = 0;
+  ringCount = 0;
+  blockWritten = 0;
+  ackWithheld = false;
   tftpBlockSize = 512;
   blockCapacity = GetBlockCountActual(unitNum);
   DEBUG_PRINTF("blockCapacity = %d\n",blockCapacity);
@@ -74,11 +78,16 @@ void CTFTPRXTask::StartTransfer() {
     AddOption("blksize","1024");
     AddOption("tsize","0");   //Request server to report file size
   }
+  if (tftpWindowSize>1) AddOption("windowsize",tftpWindowSize);
+  windowSize = 1;   //Until it is acknowledged by OACK
   
   SendPacket();
   SetTimer(tftpTimeout);
   attempt = 1; //First Attempt
   expectedBlock = 1;  //Expecting to receive block #1
+  packetsNotAcked = 0;
+  gapAcked = false;
+  ackWithheld = false;
   
   tftp_critical_section_enter_blocking();
   tftp_state.status = TFTPSTATUS_REQUEST;
@@ -104,11 +113,11 @@ void CTFTPRXTask::StartTransfer() {
 //
 //When an invalid packet is found, the packet is discarded.
 //
-void CTFTPRXTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port){
-  CTFTPTask::EvtUDPReceived(payload,payloadlen,remote_addr,remote_port);
+void CTFTPRXTask::EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port){
+  CTFTPTask::EvtUDPReceived(view,remote_addr,remote_port);
   
   //validate the packet format
-  if (payloadlen<4) {
+  if (view.len<4) {
     TRACE_PRINTF("Discard Packet: payloadlen<4\n");
     return;
   }
@@ -128,15 +137,19 @@ void CTFTPRXTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_a
   }
   
   //check opcode should be 1-6
-  const uint16_t opcode = payload[0]*256+payload[1];
+  //Only the header is copied. The data of Data packet is copied 
+  //from the pbuf to RX Ring directly.
+  uint8_t header[4];
+  CopyFromView(view,header,4,0);
+  const uint16_t opcode = header[0]*256+header[1];
   if (opcode==0 || opcode >=7) {
     TRACE_PRINTF("Discard Packet: Invalid TFTP OPCODE\n");
     return;
   }
   
-  if (opcode == OP_OACK) ProcessOACKPacket(payload,payloadlen,remote_port);
-  else if (opcode == OP_DATA) ProcessDataPacket(payload,payloadlen,remote_port);
-  else if (opcode == OP_ERROR) ProcessErrorPacket(payload, payloadlen);
+  if (opcode == OP_OACK) ProcessOACKPacket(Linearize(view),view.len,remote_port);
+  else if (opcode == OP_DATA) ProcessDataPacket(view,header[2]*256+header[3],remote_port);
+  else if (opcode == OP_ERROR) ProcessErrorPacket(Linearize(view),view.len);
   //discard other opcode packets
 }
 
@@ -169,6 +182,7 @@ void CTFTPRXTask::ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,u
       DEBUG_PRINTF("option: %s=%s\n",option,value);
       if (0==strcmp(option,"blksize")) HandleOACK_blksize(value);
       else if (0==strcmp(option,"tsize")) HandleOACK_tsize(value);
+      else if (0==strcmp(option,"windowsize")) HandleOACK_windowsize(value);
     }
   } catch(int e) {
     if (e==E_NEEDRESTART) {
@@ -265,6 +279,8 @@ bool CTFTPRXTask::IsValidBlockNumber(const uint32_t blockNum) {
   else { 
     //Set error and stop immedately
     //The server will timeout and quit
+    //Blocks in RX Ring are written first as if they were written on arrival
+    FlushRing();
     this->Complete();      
     tftp_critical_section_enter_blocking();
     tftp_state.status = TFTPSTATUS_COMPLETED;
@@ -281,18 +297,30 @@ bool CTFTPRXTask::IsValidBlockNumber(const uint32_t blockNum) {
 // Process Data Packet
 // Assume the packet is valid.
 //
-void CTFTPRXTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port) {
-  uint16_t block = payload[2]*256+payload[3];
-  uint16_t dataSize = payloadlen-4;
-  bool success = true;
+// Input: view  - View of the packet. Data starts at offset 4
+//        block - TFTP block number in the header
+//
+void CTFTPRXTask::ProcessDataPacket(const udp_view_t& view,uint16_t block,uint16_t remote_port) {
+  uint16_t dataSize = view.len-4;
 
   //Validate Block Number
+  //Block numbers wrap around at 65536. So, uint16_t arithmetic is used.
   if (block != expectedBlock) {
-    if (block==expectedBlock-1) {
-      //Last Data Block is received. It means Ack is lost. 
-      //Retry without any delay.
+    const uint16_t behind = expectedBlock-block;
+    const uint16_t ahead = block-expectedBlock;
+    if (behind==1) {
+      //Last Data Block is received again. It means Ack is lost. 
+      //Retry without any delay. If the server sends the whole window
+      //again, only its last packet is answered.
       this->Retry(); 
       return;
+    } else if (ahead<windowSize && !gapAcked) {
+      //A Data packet within the window is lost. Ack the last good
+      //block once so that the server sends again from the lost one
+      //without waiting for its timeout (RFC 7440).
+      gapAcked = true;
+      this->Retry();
+      return;
     }
     else {
       TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
@@ -303,6 +331,7 @@ void CTFTPRXTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,u
   //
   //Valid Data Packet!
   //  
+  gapAcked = false;
 
   //First data packet?
   if (blockReceived==0) { 
@@ -338,18 +367,16 @@ void CTFTPRXTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,u
     hasCompleted = true;
     
     if (eof_with512payload) {
-      #if WRITETOFLASH
       if (!IsValidBlockNumber(blockReceived)) return;
-      success = WriteBlockForImageTransfer(unitNum, blockReceived, payload+4);  //Actual Data starts at offset 4
-      if (!success) throw CTFTPTask::ERR_RWFAILED;
-      #endif
-      ++blockReceived;    
+      //The ring has room for the whole window. But make sure.
+      if (ringCount==TFTP_RXRING_BLOCKS) WriteOneBlock();
+      EnqueueBlock(view,4);  //Actual Data starts at offset 4
     }
     
+    //Blocks in RX Ring are written before the status is set to COMPLETED
     tftp_critical_section_enter_blocking();
     tftp_state.status = TFTPSTATUS_COMPLETING;
     tftp_state.error = TFTPERROR_NOERR;
-    tftp_state.blockTransferred = blockReceived;
     tftp_critical_section_exit();
     INFO_PRINTF("\ntftp_state.status = TFTPSTATUS_COMPLETING\n");
     return;    
@@ -385,36 +412,43 @@ void CTFTPRXTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,u
   }
   
   //If dataSize = tftpBlockSize, it is a normal and good data block
-  //write it to flash
+  //queue it in RX Ring
   if (dataSize == tftpBlockSize) {
-    //Send ACK
-    BuildAckPacket(block);
-    SendPacket();
-    SetTimer(tftpTimeout);    
-    attempt=1;    //Reset attempt to 1 since we have a good data block
-    ++expectedBlock;
+    //No room in RX Ring. It should not happen since ACK is withheld
+    //until the ring has room for a whole window. 
+    //Discard it and let the timeout mechanism to retry.
+    if (TFTP_RXRING_BLOCKS-ringCount < dataSize/PRODOS_BLOCKSIZE) {
+      TRACE_PRINTF("Discard Packet: RX Ring is full\n");
+      return;
+    }
     
-    #if WRITETOFLASH
     //blockReceived has been validated above
-    success = WriteBlockForImageTransfer(unitNum, blockReceived, payload+4);  //Actual Data starts at offset 4
-    if (!success) throw CTFTPTask::ERR_RWFAILED;
-    #endif
-    ++blockReceived;    
-    tftp_critical_section_enter_blocking();
-    tftp_state.blockTransferred = blockReceived;
-    tftp_critical_section_exit();    
+    EnqueueBlock(view,4);  //Actual Data starts at offset 4
     
     if (dataSize==1024) {
-      #if WRITETOFLASH
       if (!IsValidBlockNumber(blockReceived)) return;      
-      success = WriteBlockForImageTransfer(unitNum, blockReceived, payload+4+512);  //Actual Data starts at offset 4
-      if (!success) throw CTFTPTask::ERR_RWFAILED;
-      #endif
-      ++blockReceived;
-      tftp_critical_section_enter_blocking();
-      tftp_state.blockTransferred = blockReceived;
-      tftp_critical_section_exit();    
+      EnqueueBlock(view,4+512);
+    }
+    
+    //Send ACK at the end of window (cumulative ACK)
+    //The ACK is always built so that Retry() acks the last good block
+    //The blocks of this packet are already in RX Ring. If it cannot 
+    //hold next window, the ACK is withheld. 
+    //EvtIdle() sends it when enough blocks are written.
+    BuildAckPacket(block);
+    if (++packetsNotAcked >= windowSize) {
+      packetsNotAcked = 0;
+      if (HasRoomForWindow()) SendPacket();
+      else {
+        ackWithheld = true;
+        tftp_critical_section_enter_blocking();
+        ++tftp_state.rxRingStalls;
+        tftp_critical_section_exit();
+      }
     }
+    SetTimer(tftpTimeout);    
+    attempt=1;    //Reset attempt to 1 since we have a good data block
+    ++expectedBlock;
     
     return;
   } 
@@ -437,12 +471,14 @@ void CTFTPRXTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,u
 //
 void CTFTPRXTask::EvtTimeout(uint32_t arg){
   if (hasCompleted) {
+    FlushRing();
     this->Complete();
     tftp_critical_section_enter_blocking();
     tftp_state.status = TFTPSTATUS_COMPLETED;
     tftp_critical_section_exit();    
     INFO_PRINTF("tftp_state.status = TFTPSTATUS_COMPLETED\n");    
     INFO_PRINTF("RX Transfer Completed! Block Count = %d\n",blockReceived);
+    INFO_PRINTF("RX Ring High Water = %d, Stalls = %d\n",tftp_state.rxRingHighWater,tftp_state.rxRingStalls);
     return;
   }
   
@@ -452,7 +488,8 @@ void CTFTPRXTask::EvtTimeout(uint32_t arg){
 /////////////////////////////////////////////////////////////
 // Retry Method
 //
-// Send the last packet again.
+// Send the last packet again. It acks the last good Data packet.
+// The server sends a new window after it. 
 // If hadCompleted is set, send the last ACK Packet one more
 // time and then stop
 //
@@ -461,6 +498,7 @@ void CTFTPRXTask::Retry() {
     //Try Send last ACK Packet one more time and then stop
     INFO_PRINTF("Sending last ACK Packet again\n");
     SendPacket();
+    FlushRing();
     this->Complete();
     tftp_critical_section_enter_blocking();
     tftp_state.status = TFTPSTATUS_COMPLETED;
@@ -470,10 +508,96 @@ void CTFTPRXTask::Retry() {
     return;    
   }
   
+  //The server sends a new window after the ACK. 
+  //Withhold it if RX Ring cannot hold the window.
+  packetsNotAcked = 0;
+  if (!HasRoomForWindow()) {
+    ackWithheld = true;
+    return;
+  }
+  
   //Using base class implemntation
   CTFTPTask::Retry();
 }
 
+//////////////////////////////////////////////////////////
+// Idle Handler
+//
+// Write one block from RX Ring to the unit. Then, send the
+// withheld ACK if RX Ring has room for next window.
+//
+// return true if there are more blocks in RX Ring
+//
+bool CTFTPRXTask::EvtIdle() {
+  if (ringCount==0) return false;
+  
+  WriteOneBlock();
+  if (ackWithheld && HasRoomForWindow()) {
+    TRACE_PRINTF("Sending withheld ACK\n");
+    ackWithheld = false;
+    SendPacket();
+    SetTimer(tftpTimeout);
+  }
+  return ringCount!=0;
+}
+
+//////////////////////////////////////////////////////////
+// Check if RX Ring can hold a whole window of Data packets
+//
+bool CTFTPRXTask::HasRoomForWindow() const {
+  return TFTP_RXRING_BLOCKS-ringCount >= windowSize*(tftpBlockSize/PRODOS_BLOCKSIZE);
+}
+
+//////////////////////////////////////////////////////////
+// Copy a ProDOS block from the received packet to RX Ring
+// The caller should make sure the ring is not full and
+// the block number is valid.
+//
+// Input: view   - View of the received packet
+//        offset - Offset of 512 bytes of block data in the packet
+//
+void CTFTPRXTask::EnqueueBlock(const udp_view_t& view,const uint16_t offset) {
+  assert(ringCount<TFTP_RXRING_BLOCKS);
+  CopyFromView(view,ring[ringHead],PRODOS_BLOCKSIZE,offset);
+  if (++ringHead==TFTP_RXRING_BLOCKS) ringHead = 0;
+  ++ringCount;
+  ++blockReceived;
+  
+  if (ringCount>tftp_state.rxRingHighWater) {
+    tftp_critical_section_enter_blocking();
+    tftp_state.rxRingHighWater = ringCount;
+    tftp_critical_section_exit();
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Write the oldest block in RX Ring to the unit
+//
+// throw ERR_RWFAILED if the write fails
+//
+void CTFTPRXTask::WriteOneBlock() {
+  assert(ringCount!=0);
+  const uint32_t tail = (ringHead+TFTP_RXRING_BLOCKS-ringCount)%TFTP_RXRING_BLOCKS;
+  
+  #if WRITETOFLASH
+  //blockWritten has been validated when the block is queued
+  if (!WriteBlockForImageTransfer(unitNum, blockWritten, ring[tail])) throw CTFTPTask::ERR_RWFAILED;
+  #endif
+  --ringCount;
+  ++blockWritten;
+  
+  tftp_critical_section_enter_blocking();
+  tftp_state.blockTransferred = blockWritten;
+  tftp_critical_section_exit();
+}
+
+//////////////////////////////////////////////////////////
+// Write all blocks in RX Ring to the unit
+//
+void CTFTPRXTask::FlushRing() {
+  while(ringCount!=0) WriteOneBlock();
+}
+
 
 /**************************************************************************************
 Handling of last ACK
@@ -498,3 +622,28 @@ ACK packet one more time and then complete the process
 
 
 
+
+
+/**************************************************************************************
+RX Ring
+
+Writing a block to flash may take a long time. Every 16 blocks, a 64kB sector is checked
+and may be erased. If the block is written when the Data packet is received, the network
+is not polled in the meantime. The packets of the window pile up in the network driver
+or get dropped.
+
+So, the data of a Data packet is copied to RX Ring and the packet is acked immediately.
+The blocks are written to the unit by EvtIdle(), one block per pass of the event loop.
+Network events are handled between the blocks.
+
+Backpressure:
+An ACK is sent only if RX Ring has room for the whole next window. Otherwise, the ACK is
+withheld and EvtIdle() sends it when enough blocks are written. The server does not send
+more Data packets until the ACK is received. So, RX Ring never overflows.
+
+All blocks in RX Ring are written before the status is set to COMPLETED, including the
+oversize case. If a write fails, ERR_RWFAILED is thrown as before.
+
+tftp_state.rxRingHighWater and tftp_state.rxRingStalls tell how full the ring got and how
+many times the ACK was withheld.
+****************************************************************************************/
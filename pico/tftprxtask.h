@@ -1,13 +1,14 @@
 #ifndef _TFTPRXTASK_H
 #define _TFTPRXTASK_H
 
+#include "tftp.h"
 #include "tftptask.h"
 
 
 class CTFTPRXTask:public CTFTPTask {
 public:
   CTFTPRXTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,
-              const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort);
+              const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize);
 
   //Override Run()
   virtual void Run(const char* ssid, const char* wpakey);
@@ -20,22 +21,36 @@ protected:
   uint32_t blockCapacity;     //The capacity of the unit in number of ProDOS blocks.
   uint32_t tftpBlockSize;     //TFTP block size (512 or 1024)
   bool serverTIDAccepted;     //Server TID (remote_port) accepted
+  uint32_t packetsNotAcked;   //Number of Data packets received since last ACK was sent
+  bool gapAcked;              //ACK has been sent because a Data packet is lost
+  
+  //RX Ring. See the note at the end of tftprxtask.cpp
+  uint8_t ring[TFTP_RXRING_BLOCKS][PRODOS_BLOCKSIZE];
+  uint32_t ringHead;          //Next slot to be filled
+  uint32_t ringCount;         //Number of blocks waiting to be written
+  uint32_t blockWritten;      //Number of ProDOS block written to the unit
+  bool ackWithheld;           //ACK is not sent until RX Ring has room for a window
 
   //Event Handlers
   //void EvtStart();
   void EvtDNSResult(const int dns_error, const ip_addr_t *ipaddr);
-  void EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port);
+  void EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port);
   void EvtTimeout(uint32_t arg);
+  bool EvtIdle();
   
   void StartTransfer();  
   void Retry(); 
   void ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port);
-  void ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port);
+  void ProcessDataPacket(const udp_view_t& view,uint16_t block,uint16_t remote_port);
   void HandleOACK_blksize(const char* value);
   void HandleOACK_tsize(const char* value);
 private:
   //Helper method
   bool IsValidBlockNumber(const uint32_t blockNum);
+  bool HasRoomForWindow() const;
+  void EnqueueBlock(const udp_view_t& view,const uint16_t offset);
+  void WriteOneBlock();
+  void FlushRing();
 };
 
 
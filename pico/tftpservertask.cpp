@@ -0,0 +1,683 @@
+#include <strings.h>
+#include "tftp.h"
+#include "tftptask.h"
+#include "tftpservertask.h"
+#include "tftpstate.h"
+#include "misc.h"
+#include "mediaaccess.h"
+#include "debug.h"
+#include "defines.h"
+
+extern "C" volatile tftp_state_t tftp_state;
+
+/**************************************************************************************
+TFTP Server Mode
+
+MegaFlash listens on tftpServerPort. A TFTP client on the network can read (backup) or
+write (restore) a unit as a virtual file. Anyone on the network can reach the server. So,
+WRQ is refused with "Access violation" unless write is enabled explicitly (Bit1 of Flag
+of CMD_TFTPRUN). WRQ is refused as well while the Apple is connected, in the same way as
+USB Mass Storage. ProDOS may have the volume open and it does not see the new contents.
+A unit is restored by TFTP download of the Control Panel instead:
+
+  unit1.po, unit2.po, ...  Unit 1-N. Same as the drive numbers of the Control Panel.
+  ramdisk.po               RAM Disk
+
+Filenames are case insensitive. A leading '/' is ignored. The file size of RRQ is the
+size of ProDOS volume (See GetBlockCountForImageTransfer()). Only octet mode is supported.
+blksize (512 or 1024), tsize and windowsize (RFC 7440) options are supported.
+
+One transfer is served at a time. A request from another client gets a "Server busy"
+error. Each transfer uses a new local port (TID). The Data packets of RRQ are built by
+ReadBlock() directly into txbuffer.
+
+The server runs until it is aborted (Apple reset or another network command). Core 0
+keeps executing long commands and multi-block transfers of the Apple while it runs (See
+core0Loop()).
+tftp_state shows the current or last transfer. tftp_state.status is TFTPSTATUS_LISTENING
+when no transfer is in progress. tftp_state.error is the result of last transfer.
+****************************************************************************************/
+
+//////////////////////////////////////////////////////////
+// Constructor
+//
+CTFTPServerTask::CTFTPServerTask(const uint32_t tftpTimeout,const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize,const bool writeEnabled):
+                                 CTFTPTask(0,"","",true,tftpTimeout,tftpMaxAttempt,tftpServerPort,tftpWindowSize) {
+  listenPcb = NULL;
+  this->writeEnabled = writeEnabled;
+  requestPending = false;
+  requestLen = 0;
+  requestPort = 0;
+  sessionActive = false;
+  isRead = false;
+  dataStarted = false;
+  hasCompleted = false;
+  sessionError = TFTPERROR_NOERR;
+  tftpBlockSize = 512;
+  blockCount = 0;
+  blockTransferred = 0;
+  sentSeq = ackedSeq = lastSeq = 0;
+  expectedBlock = 1;
+  packetsNotAcked = 0;
+  gapAcked = false;
+}
+
+CTFTPServerTask::~CTFTPServerTask() {
+  cyw43_arch_lwip_begin();
+  if (listenPcb) udp_remove(listenPcb);
+  cyw43_arch_lwip_end();
+}
+
+//////////////////////////////////////////////////////////
+// Override Run()
+//
+void CTFTPServerTask::Run(const char* ssid, const char* wpakey){
+  tftp_critical_section_enter_blocking();
+  tftp_state.status = TFTPSTATUS_WIFICONNECTING;
+  tftp_critical_section_exit();
+  INFO_PRINTF("tftp_state.status = TFTPSTATUS_WIFICONNECTING\n");
+
+  CTFTPTask::Run(ssid,wpakey);
+}
+
+//////////////////////////////////////////////////////////
+// UDP Received callback function of listening port
+//
+// The request is copied to requestBuffer. It is processed
+// by EvtIdle(). If a request is pending, the new one is
+// dropped. The client will send it again.
+//
+void tftp_server_listen_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pbuf, const ip_addr_t *remote_addr, u16_t remote_port) {
+  CTFTPServerTask* pTask = (CTFTPServerTask*) arg;
+
+  //make sure the callback is for this object
+  //see note at dns_callback()
+  if (CUDPTask::GetRunningObject()==pTask && pTask!=NULL) {
+    if (!pTask->requestPending && pbuf->tot_len<=TFTP_REQUEST_MAXLEN) {
+      pTask->requestLen = pbuf->tot_len;
+      pbuf_copy_partial(pbuf,pTask->requestBuffer,pbuf->tot_len,0);
+      pTask->requestAddr = *remote_addr;
+      pTask->requestPort = remote_port;
+      pTask->requestPending = true;
+    }
+  } else {
+    WARN_PRINTF("tftp_server_listen_callback() arg NOT POINTING to current UDPTask object. Ignore it!\n");
+  }
+
+  if (pbuf) pbuf_free(pbuf);
+}
+
+//////////////////////////////////////////////////////////
+// Event Start Handler
+//
+// Open the listening port. No DNS lookup is needed.
+// throw ERR_BINDFAILED if the port cannot be opened
+//
+void CTFTPServerTask::EvtStart() {
+  CUDPTask::EvtStart();
+
+  cyw43_arch_lwip_begin();
+  listenPcb = udp_new();
+  if (listenPcb) {
+    if (udp_bind(listenPcb, IP4_ADDR_ANY, tftpServerPort)==ERR_OK) {
+      udp_recv(listenPcb,tftp_server_listen_callback,this);
+    } else {
+      udp_remove(listenPcb);
+      listenPcb = NULL;
+    }
+  }
+  cyw43_arch_lwip_end();
+  if (listenPcb==NULL) throw CTFTPServerTask::ERR_BINDFAILED;
+
+  INFO_PRINTF("TFTP Server listening on port %d. Write %s\n",tftpServerPort,writeEnabled?"enabled":"disabled");
+  Listen();
+}
+
+//////////////////////////////////////////////////////////
+// Wait for next request
+//
+void CTFTPServerTask::Listen() {
+  sessionActive = false;
+  SetTimer(TFTP_SERVER_HEARTBEAT);
+
+  tftp_critical_section_enter_blocking();
+  tftp_state.status = TFTPSTATUS_LISTENING;
+  tftp_critical_section_exit();
+  INFO_PRINTF("tftp_state.status = TFTPSTATUS_LISTENING\n");
+}
+
+//////////////////////////////////////////////////////////
+// Idle Handler
+//
+// Process the request received by listening port
+//
+bool CTFTPServerTask::EvtIdle() {
+  if (requestPending) {
+    ProcessRequest();
+    requestPending = false;
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////
+// Find the unit of a virtual file
+//
+// Input: filename - Filename in request
+//        unitNumOut - Pointer to receive the unit number
+//
+// return true if the file exists
+//
+bool CTFTPServerTask::LookupFile(const char* filename, uint32_t* unitNumOut) {
+  if (filename[0]=='/') ++filename;
+
+  if (0==strcasecmp(filename,"ramdisk.po")) {
+    const uint unitNum = GetRamdiskUnitNum();
+    if (!IsValidUnitNum(unitNum) || GetMediumType(unitNum)!=TYPE_RAMDISK) return false;
+    *unitNumOut = unitNum;
+    return true;
+  }
+
+  if (0==strncasecmp(filename,"unit",4)) {
+    char* end;
+    const uint32_t unitNum = strtoul(filename+4,&end,10);
+    if (end!=filename+4 && 0==strcasecmp(end,".po") && IsValidUnitNum(unitNum)) {
+      *unitNumOut = unitNum;
+      return true;
+    }
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////
+// Process RRQ/WRQ received by listening port
+//
+// Validate the request and options. Then, start the transfer
+// by sending OACK, first Data packet (RRQ) or ACK#0 (WRQ).
+//
+void CTFTPServerTask::ProcessRequest() {
+  //validate the packet format
+  //The packet should end with NULL character
+  if (requestLen<4 || requestBuffer[requestLen-1]!='\0') {
+    TRACE_PRINTF("Discard Request: Invalid format\n");
+    return;
+  }
+
+  const uint16_t opcode = requestBuffer[0]*256+requestBuffer[1];
+  if (opcode!=OP_RRQ && opcode!=OP_WRQ) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_ILLEGAL_OP,GetErrorMessage(TFTPERROR_ILLEGAL_OP));
+    return;
+  }
+
+  //One transfer at a time
+  if (sessionActive) {
+    //The client has sent the request again. Ignore it.
+    if (ip_addr_cmp(&server_addr,&requestAddr) && server_port==requestPort) return;
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_UNKNOWN,"Server busy");
+    return;
+  }
+
+  //Filename and mode
+  size_t currentPos=2;
+  const char *filename,*mode;
+  if (!ParseOption(requestBuffer,requestLen,&currentPos,&filename,&mode)) {
+    TRACE_PRINTF("Discard Request: No filename or mode\n");
+    return;
+  }
+  DEBUG_PRINTF("%s filename=%s mode=%s\n",opcode==OP_RRQ?"RRQ":"WRQ",filename,mode);
+
+  if (0!=strcasecmp(mode,"octet")) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_ILLEGAL_OP,"Only octet mode is supported");
+    return;
+  }
+
+  uint32_t unitNum;
+  if (!LookupFile(filename,&unitNum)) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_FILENOTFOUND,"File not found");
+    return;
+  }
+
+  const bool readRequest = (opcode==OP_RRQ);
+  if (!readRequest && !writeEnabled) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_ACCESSVIOLATION,"Write is disabled");
+    return;
+  }
+  if (!readRequest && WasAppleConnected()) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_ACCESSVIOLATION,"Apple is connected");
+    return;
+  }
+  if (!readRequest && !IsUnitWritable(unitNum)) {
+    SendErrorTo(&requestAddr,requestPort,TFTPERROR_ACCESSVIOLATION,"Unit is read-only");
+    return;
+  }
+
+  //Accept the request
+  server_addr = requestAddr;
+  server_port = requestPort;
+  StartSession(readRequest,unitNum,filename);
+
+  //Options
+  //Build OACK in txbuffer. The server may reply a smaller blksize (RFC 2348)
+  //and windowsize (RFC 7440). An option is ignored if we cannot support it.
+  txbuffer[0] = 0;
+  txbuffer[1] = OP_OACK;
+  txpacketlen = 2;
+  const char *option,*value;
+  while(ParseOption(requestBuffer,requestLen,&currentPos,&option,&value)) {
+    DEBUG_PRINTF("option: %s=%s\n",option,value);
+    const uint32_t v = strtoul(value,NULL,10);
+    if (0==strcasecmp(option,"blksize")) {
+      if (v>=1024) tftpBlockSize = 1024;
+      if (v>=512)  AddOption("blksize",tftpBlockSize);
+    } else if (0==strcasecmp(option,"tsize")) {
+      if (isRead) AddOption("tsize",blockCount*PRODOS_BLOCKSIZE);
+      else if (v>blockCount*PRODOS_BLOCKSIZE) {
+        SendErrorTo(&server_addr,server_port,TFTPERROR_DISKFULL,"File size exceeds the capacity of the unit");
+        EndSession(TFTPERROR_OVERSIZE);
+        return;
+      } else {
+        tftp_critical_section_enter_blocking();
+        tftp_state.tsize = v;
+        tftp_critical_section_exit();
+        AddOption("tsize",v);
+      }
+    } else if (0==strcasecmp(option,"windowsize")) {
+      if (v>=1) {
+        windowSize = MIN(v,tftpWindowSize);
+        AddOption("windowsize",windowSize);
+      }
+    }
+  }
+
+  if (txpacketlen>2) {
+    //Send OACK. RRQ: Wait for ACK#0. WRQ: OACK acks block 0
+    DEBUG_PRINTF("Sending OACK\n");
+    SendPacket();
+    SetTimer(tftpTimeout);
+  } else if (isRead) {
+    StartData();
+  } else {
+    BuildAckPacket(0);
+    SendPacket();
+    SetTimer(tftpTimeout);
+  }
+}
+
+//////////////////////////////////////////////////////////
+// Start a transfer
+//
+// Input: isRead   - true=RRQ, false=WRQ
+//        unitNum  - Unit of the virtual file
+//        filename - Filename in request
+//
+void CTFTPServerTask::StartSession(const bool isRead,const uint32_t unitNum,const char* filename) {
+  //Use a new local port (TID) for each transfer
+  cyw43_arch_lwip_begin();
+  udp_bind(this->pcb, IP4_ADDR_ANY, 0 /*random port*/);
+  cyw43_arch_lwip_end();
+
+  sessionActive = true;
+  this->isRead = isRead;
+  this->unitNum = unitNum;
+  dataStarted = false;
+  hasCompleted = false;
+  sessionError = TFTPERROR_NOERR;
+  tftpBlockSize = 512;
+  windowSize = 1;   //Until windowsize option is accepted
+  blockTransferred = 0;
+  attempt = 1;
+  expectedBlock = 1;
+  packetsNotAcked = 0;
+  gapAcked = false;
+  blockCount = isRead ? GetBlockCountForImageTransfer(unitNum) : GetBlockCountActual(unitNum);
+
+  TFTPCopyFilename(filename);
+  tftp_critical_section_enter_blocking();
+  tftp_state.startTime = get_absolute_time();
+  tftp_state.unitNum = unitNum;
+  tftp_state.status = TFTPSTATUS_TRANSFER;
+  tftp_state.blockTransferred = 0;
+  tftp_state.tsize = isRead ? blockCount*PRODOS_BLOCKSIZE : TFTPSTATE_INVALIDTSIZE;
+  tftp_state.error = TFTPERROR_NOERR;
+  tftp_state.retries = 0;
+  tftp_critical_section_exit();
+  INFO_PRINTF("%s started. Client=%s:%d Unit=%d\n",isRead?"RRQ":"WRQ",ipaddr_ntoa(&server_addr),server_port,unitNum);
+}
+
+//////////////////////////////////////////////////////////
+// End the transfer and wait for next request
+//
+// Input: error - Result of the transfer
+//
+void CTFTPServerTask::EndSession(const int32_t error) {
+  tftp_critical_section_enter_blocking();
+  tftp_state.error = error;
+  tftp_state.blockTransferred = blockTransferred;
+  tftp_critical_section_exit();
+  INFO_PRINTF("%s ended. Block Count = %d, error = %d\n",isRead?"RRQ":"WRQ",blockTransferred,error);
+
+  Listen();
+}
+
+//////////////////////////////////////////////////////////
+// Send an Error packet without touching txbuffer
+//
+// Input: addr, port - Destination
+//        errorcode  - TFTP Error Code (0-8)
+//        errormsg   - Error Message
+//
+void CTFTPServerTask::SendErrorTo(const ip_addr_t* addr,const uint16_t port,const int errorcode,const char* errormsg) {
+  assert(errorcode>=0 && errorcode<=8);
+  const size_t MSG_MAXLEN = 63;
+  uint8_t buffer[4+MSG_MAXLEN+1];
+  buffer[0] = 0;
+  buffer[1] = OP_ERROR;
+  buffer[2] = 0;
+  buffer[3] = (uint8_t)errorcode;
+  const size_t msglen = MIN(strlen(errormsg),MSG_MAXLEN);
+  memcpy(buffer+4,errormsg,msglen);
+  buffer[4+msglen] = '\0';
+
+  cyw43_arch_lwip_begin();
+    struct pbuf *pbuf = pbuf_alloc(PBUF_TRANSPORT, 4+msglen+1, PBUF_RAM);
+    if (pbuf) {
+      pbuf_take(pbuf,buffer,4+msglen+1);
+      udp_sendto(this->pcb, pbuf, addr, port);
+      pbuf_free(pbuf);
+    }
+  cyw43_arch_lwip_end();
+  DEBUG_PRINTF("Error packet sent: %d %s\n",errorcode,errormsg);
+}
+
+//////////////////////////////////////////////////////////
+// UDP Received Handler of transfer port
+//
+// Discard all invalid packet and let the timeout mechanism
+// to retry.
+//
+void CTFTPServerTask::EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port){
+  CTFTPTask::EvtUDPReceived(view,remote_addr,remote_port);
+  //Data packets are written from the pbuf directly if it is in one segment
+  const uint8_t* payload = Linearize(view);
+  const uint16_t payloadlen = view.len;
+  if (!sessionActive) return;
+
+  //validate the packet format
+  if (payloadlen<4) {
+    TRACE_PRINTF("Discard Packet: payloadlen<4\n");
+    return;
+  }
+
+  //Packet from another client (TID)
+  if (!ip_addr_cmp(&server_addr,&remote_addr) || remote_port!=server_port) {
+    SendErrorTo(&remote_addr,remote_port,TFTPERROR_UNKNOWN_TID,GetErrorMessage(TFTPERROR_UNKNOWN_TID));
+    return;
+  }
+
+  const uint16_t opcode = payload[0]*256+payload[1];
+  if (opcode == OP_ACK && isRead) ProcessACKPacket(payload,payloadlen);
+  else if (opcode == OP_DATA && !isRead) ProcessDataPacket(payload,payloadlen);
+  else if (opcode == OP_ERROR) ProcessClientErrorPacket(payload,payloadlen);
+  //discard other opcode packets
+}
+
+//////////////////////////////////////////////////////////
+// Process Error Packet from client
+// Any Errorcode ends the transfer except TFTPERROR_UNKNOWN_TID
+//
+void CTFTPServerTask::ProcessClientErrorPacket(const uint8_t* payload,uint16_t payloadlen) {
+  const uint16_t errorcode = payload[2]*256+payload[3];
+  DEBUG_PRINTF("Error Packet Received. errorcode = %d\n",errorcode);
+  if (errorcode == TFTPERROR_UNKNOWN_TID) return;
+
+  //See CTFTPTask::ProcessErrorPacket() for errorcode 99
+  EndSession(errorcode==99 ? TFTPERROR_ABORTED : errorcode);
+}
+
+//////////////////////////////////////////////////////////
+// RRQ: Start sending Data packets
+// Called when ACK of block #0 (OACK) is received or
+// no option is accepted
+//
+void CTFTPServerTask::StartData() {
+  dataStarted = true;
+
+  //Data packet n carries the ProDOS blocks from (n-1)*blocksPerPacket.
+  //The last one is shorter than tftpBlockSize. It can be empty.
+  lastSeq = blockCount/(tftpBlockSize/PRODOS_BLOCKSIZE)+1;
+  sentSeq = 0;
+  ackedSeq = 0;
+  attempt = 1;
+  SendWindow();
+}
+
+//////////////////////////////////////////////////////////
+// RRQ: Build and send Data packets until windowSize packets
+// are not acknowledged (RFC 7440)
+// See CTFTPTXTask::SendWindow()
+//
+void CTFTPServerTask::SendWindow() {
+  const uint32_t blocksPerPacket = tftpBlockSize/PRODOS_BLOCKSIZE;
+
+  while(sentSeq<lastSeq && sentSeq-ackedSeq<windowSize) {
+    ++sentSeq;
+    txpacketlen = BuildDataPacket(txbuffer,(uint16_t)sentSeq,(sentSeq-1)*blocksPerPacket);
+    SendPacket();
+  }
+  SetTimer(tftpTimeout);
+  if (sentSeq==lastSeq) hasCompleted = true;
+}
+
+//////////////////////////////////////////////////////////
+// RRQ: Build Data Packet
+// See CTFTPTXTask::BuildDataPacket()
+//
+// Input: destBuffer - Pointer to destination buffer
+//        tftpBlock  - TFTP Block number of this packet
+//        blockNum   - ProDOS block number of payload data
+//
+// Output: uint32_t - Length of Data Packet
+//
+// throw ERR_RWFAILED if the unit cannot be read
+//
+uint32_t CTFTPServerTask::BuildDataPacket(uint8_t *destBuffer,uint16_t tftpBlockNum, uint32_t blockNum) {
+  uint32_t packetLen = 4; //Length of header
+  destBuffer[0] =0;
+  destBuffer[1] = OP_DATA;
+  destBuffer[3] = (uint8_t) tftpBlockNum;      //low byte
+  destBuffer[2] = (uint8_t)(tftpBlockNum>>8);  //high byte
+
+  assert(blockNum <= blockCount);
+  const uint32_t blocks = MIN(blockCount-blockNum,tftpBlockSize/PRODOS_BLOCKSIZE);
+  for(uint32_t i=0;i<blocks;++i) {
+    uint error = ReadBlock(unitNum, blockNum+i, destBuffer+packetLen, NULL); //Read ProDOS block
+    if (error!=MFERR_NONE) throw CTFTPTask::ERR_RWFAILED;
+    packetLen += PRODOS_BLOCKSIZE;
+  }
+
+  assert(packetLen==4 || packetLen==516 || packetLen==1028);
+  return packetLen;
+}
+
+//////////////////////////////////////////////////////////
+// RRQ: Process ACK
+// The ACK is cumulative (go-back-N). See CTFTPTXTask::ProcessACKPacket()
+//
+void CTFTPServerTask::ProcessACKPacket(const uint8_t* payload,uint16_t payloadlen) {
+  const uint16_t block = payload[2]*256+payload[3];
+
+  //ACK of OACK
+  if (!dataStarted) {
+    if (block==0) StartData();
+    return;
+  }
+
+  //Number of Data packets acknowledged by this ACK
+  //Block numbers wrap around at 65536. So, uint16_t arithmetic is used.
+  const uint16_t newlyAcked = block-(uint16_t)ackedSeq;
+
+  if (newlyAcked==0) {
+    //Data Block is lost. Retry without any delay
+    if (sentSeq!=ackedSeq) this->Retry();
+    return;
+  }
+
+  if (newlyAcked > sentSeq-ackedSeq) {
+    TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
+    return;
+  }
+
+  //Proper Ack Received.
+  ackedSeq += newlyAcked;
+  sentSeq = ackedSeq;
+  attempt = 1;
+  blockTransferred = MIN(ackedSeq*(tftpBlockSize/PRODOS_BLOCKSIZE),blockCount);
+  tftp_critical_section_enter_blocking();
+  tftp_state.blockTransferred = blockTransferred;
+  tftp_critical_section_exit();
+
+  if (ackedSeq==lastSeq) EndSession(TFTPERROR_NOERR);
+  else SendWindow();
+}
+
+//////////////////////////////////////////////////////////
+// WRQ: Process Data Packet
+// See CTFTPRXTask::ProcessDataPacket()
+//
+// Data is written before the ACK is sent. So, the client
+// does not send more than a window ahead of the writes.
+//
+void CTFTPServerTask::ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen) {
+  const uint16_t block = payload[2]*256+payload[3];
+  const uint16_t dataSize = payloadlen-4;
+
+  //Validate Block Number
+  //Block numbers wrap around at 65536. So, uint16_t arithmetic is used.
+  if (block != expectedBlock) {
+    const uint16_t behind = expectedBlock-block;
+    const uint16_t ahead = block-expectedBlock;
+    if (behind==1) {
+      //ACK is lost. Send it again
+      if (hasCompleted) SendPacket();
+      else this->Retry();
+    } else if (ahead<windowSize && !gapAcked && !hasCompleted) {
+      //A Data packet within the window is lost. Ack the last good block once
+      gapAcked = true;
+      this->Retry();
+    } else {
+      TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
+    }
+    return;
+  }
+  if (hasCompleted || dataSize>tftpBlockSize) {
+    TRACE_PRINTF("Discard Packet: Invalid block size\n");
+    return;
+  }
+
+  //
+  //Valid Data Packet!
+  //
+  gapAcked = false;
+  dataStarted = true;
+
+  //The size of a disk image should be multiple of 512. A short packet ends the transfer.
+  const bool isLast = dataSize<tftpBlockSize;
+  const bool isOdd = (dataSize%PRODOS_BLOCKSIZE)!=0;
+
+  if (!isOdd) {
+    //Check for oversize
+    const uint32_t blocks = dataSize/PRODOS_BLOCKSIZE;
+    if (blockTransferred+blocks>blockCount) {
+      SendErrorTo(&server_addr,server_port,TFTPERROR_DISKFULL,"File size exceeds the capacity of the unit");
+      EndSession(TFTPERROR_OVERSIZE);
+      return;
+    }
+
+    for(uint32_t i=0;i<blocks;++i) {
+      if (!WriteBlockForImageTransfer(unitNum, blockTransferred, payload+4+i*PRODOS_BLOCKSIZE)) {
+        SendErrorTo(&server_addr,server_port,TFTPERROR_UNKNOWN,"Storage medium I/O error");
+        EndSession(TFTPERROR_RWFAILED);
+        return;
+      }
+      ++blockTransferred;
+    }
+    tftp_critical_section_enter_blocking();
+    tftp_state.blockTransferred = blockTransferred;
+    tftp_critical_section_exit();
+  }
+
+  BuildAckPacket(block);
+  ++expectedBlock;
+  attempt = 1;
+
+  if (isLast) {
+    //Send last ACK. Wait for the duplicate of last Data packet
+    //in case the ACK is lost. See the note at the end of tftprxtask.cpp
+    SendPacket();
+    hasCompleted = true;
+    sessionError = isOdd ? TFTPERROR_ODDSIZE : TFTPERROR_NOERR;
+    SetTimer(tftpTimeoutLastACK);
+    return;
+  }
+
+  //Send ACK at the end of window (cumulative ACK)
+  if (++packetsNotAcked >= windowSize) {
+    packetsNotAcked = 0;
+    SendPacket();
+  }
+  SetTimer(tftpTimeout);
+}
+
+//////////////////////////////////////////////////////////
+// Timer timeout Handler
+//
+void CTFTPServerTask::EvtTimeout(uint32_t arg){
+  if (!sessionActive) {
+    //Nothing to do. The event loop resets its watchdog timer
+    //before this handler is called.
+    SetTimer(TFTP_SERVER_HEARTBEAT);
+    return;
+  }
+
+  //WRQ: Last ACK has been delivered
+  if (!isRead && hasCompleted) {
+    EndSession(sessionError);
+    return;
+  }
+
+  this->Retry();
+}
+
+/////////////////////////////////////////////////////////////
+// Retry Method
+//
+// RRQ: Send again from the start of window after Data has started.
+// Otherwise, send the last packet (OACK or ACK) again.
+// The transfer ends if the client does not respond. The server
+// keeps running.
+//
+void CTFTPServerTask::Retry() {
+  if (!sessionActive) return;
+
+  if (attempt>=tftpMaxAttempt) {
+    ERROR_PRINTF("Too many retries. Give up\n");
+    EndSession(TFTPERROR_TIMEOUT);
+    return;
+  }
+
+  if (isRead && dataStarted) {
+    ++attempt;
+    INFO_PRINTF("#");
+    tftp_critical_section_enter_blocking();
+    ++tftp_state.retries;
+    tftp_critical_section_exit();
+
+    sentSeq = ackedSeq;
+    hasCompleted = false;
+    SendWindow();
+    return;
+  }
+
+  //Using base class implementation
+  packetsNotAcked = 0;
+  CTFTPTask::Retry();
+}
@@ -0,0 +1,85 @@
+#ifndef _TFTPSERVERTASK_H
+#define _TFTPSERVERTASK_H
+
+#include "tftp.h"
+#include "tftptask.h"
+
+//Max length of RRQ/WRQ packet
+#define TFTP_REQUEST_MAXLEN 512
+
+
+class CTFTPServerTask:public CTFTPTask {
+public:
+  static const int ERR_BINDFAILED = CTFTPTask::ERR_RWFAILED+1;   //Unable to open the listening port
+
+  CTFTPServerTask(const uint32_t tftpTimeout,const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize,const bool writeEnabled);
+  virtual ~CTFTPServerTask();
+
+  //Override Run()
+  virtual void Run(const char* ssid, const char* wpakey);
+
+  //Declare callback function as friend
+  friend void tftp_server_listen_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pbuf, const ip_addr_t *remote_addr, u16_t remote_port);
+
+protected:
+  //
+  // Listening Port
+  //
+  struct udp_pcb *listenPcb;  //Bound to tftpServerPort to receive RRQ/WRQ
+  bool writeEnabled;          //WRQ is accepted. Otherwise, units are read-only
+  bool requestPending;        //A request is received by listen callback
+  uint8_t requestBuffer[TFTP_REQUEST_MAXLEN];
+  uint16_t requestLen;
+  ip_addr_t requestAddr;
+  uint16_t requestPort;
+
+  //
+  // Session (One transfer at a time)
+  // server_addr and server_port are the address and port of the client.
+  //
+  bool sessionActive;         //A transfer is in progress
+  bool isRead;                //true=RRQ (Unit to client), false=WRQ (Client to unit)
+  bool dataStarted;           //RRQ: Data packet has been sent. WRQ: Data packet has been received
+  bool hasCompleted;          //RRQ: Last Data packet is sent. WRQ: Last ACK is sent
+  int32_t sessionError;       //Result of the session
+  uint32_t tftpBlockSize;     //TFTP block size (512 or 1024)
+  uint32_t blockCount;        //RRQ: Number of ProDOS blocks to be sent. WRQ: Capacity of the unit
+  uint32_t blockTransferred;  //Number of ProDOS block sent and acknowledged, or received
+
+  //RRQ (See CTFTPTXTask)
+  uint32_t sentSeq;           //Number of Data packets sent
+  uint32_t ackedSeq;          //Number of Data packets acknowledged by client
+  uint32_t lastSeq;           //Sequence number of the last Data packet
+
+  //WRQ (See CTFTPRXTask)
+  uint16_t expectedBlock;     //The TFTP block number we are expecting
+  uint32_t packetsNotAcked;   //Number of Data packets received since last ACK was sent
+  bool gapAcked;              //ACK has been sent because a Data packet is lost
+
+  //Event Handlers
+  void EvtStart();
+  void EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port);
+  void EvtTimeout(uint32_t arg);
+  bool EvtIdle();
+
+  void Retry();
+  void ProcessRequest();
+  void StartSession(const bool isRead,const uint32_t unitNum,const char* filename);
+  void EndSession(const int32_t error);
+  void StartData();
+  void SendWindow();
+  void ProcessACKPacket(const uint8_t* payload,uint16_t payloadlen);
+  void ProcessDataPacket(const uint8_t* payload,uint16_t payloadlen);
+  void ProcessClientErrorPacket(const uint8_t* payload,uint16_t payloadlen);
+  void SendErrorTo(const ip_addr_t* addr,const uint16_t port,const int errorcode,const char* errormsg);
+  uint32_t BuildDataPacket(uint8_t *destBuffer,uint16_t tftpBlock, uint32_t blockNum);
+
+private:
+  //Helper methods
+  static bool LookupFile(const char* filename, uint32_t* unitNumOut);
+  void Listen();
+};
+
+
+
+#endif
@@ -4,6 +4,7 @@
 #include "debug.h"
 #include "tftp.h"
 #include "tftpstate.h"
+#include "dnscache.h"
 
 /****************************************************************************************
 tftp_state is used to passing information between cores.
@@ -38,6 +39,7 @@ void InitTFTPState() {
   critical_section_init(&tftp_cs);
   tftp_state.taskid = 0;
   tftp_state.dir = 0;
+  tftp_state.serverWriteEnabled = false;
   tftp_state.server_hostname[0] = '\0';
   tftp_state.filename[0] = '\0';
   tftp_state.unitNum = 0;
@@ -46,6 +48,9 @@ void InitTFTPState() {
   tftp_state.error = TFTPERROR_NOERR;
   tftp_state.status = TFTPSTATUS_IDLE;
   tftp_state.retries = 0;
+  tftp_state.rxRingHighWater = 0;
+  tftp_state.rxRingStalls = 0;
+  tftp_state.dnsCache = DNSCACHE_NOTUSED;
 }
 
 
@@ -121,18 +126,20 @@ static char *PutEmptyString(char* dest) {
 // Input: dest   - point to destination buffer
 //        status - status code
 //        error  - error code
+//        dnsCache - DNS Cache result of server hostname lookup
 //
 // Output: char* - Point to the byte after the null character of
 //                 the generated message
 //
-char* TFTPFormatStatusMessage(char* dest,const uint8_t status,int8_t error){
+char* TFTPFormatStatusMessage(char* dest,const uint8_t status,int8_t error,const uint8_t dnsCache){
   static const char *STATUSMSG[] = { "Idle",
                                      "Starting",
                                      "Connecting to WIFI",
                                      "Requesting Server",
                                      "Transferring",
                                      "Completing",
-                                     "Completed"};
+                                     "Completed",
+                                     "Server waiting for client"};
                           
   //check the range of status
   if (status>=count_of(STATUSMSG)) return PutEmptyString(dest);         
@@ -143,6 +150,11 @@ char* TFTPFormatStatusMessage(char* dest,const uint8_t status,int8_t error){
   if (status ==TFTPSTATUS_COMPLETED){
     return PutString(dest,error==TFTPERROR_NOERR?" Successfully":" with error");
   }    
+  
+  //Add DNS Cache result while the transfer is running
+  //e.g. "Requesting Server (DNS hit)"
+  if (dnsCache==DNSCACHE_HIT)       return PutString(dest," (DNS hit)");
+  else if (dnsCache==DNSCACHE_MISS) return PutString(dest," (DNS miss)");
   else return PutEmptyString(dest);
 }
 
@@ -315,6 +327,9 @@ char* TFTPFormatErrorMessage(char* dest,const int32_t error) {
     case TFTPERROR_RWFAILED:
       dest = PutErrorString(dest,"Storage medium I/O error");
       break;
+    case TFTPERROR_PORTINUSE:
+      dest = PutErrorString(dest,"Unable to listen on TFTP port");
+      break;
     default:
       dest = PutErrorString(dest,"")-1;   //-1 To exclude the null character
       if (error>=0) dest += sprintf(dest,"TFTP Protocol Error=%d",error);
@@ -14,6 +14,7 @@ typedef enum {
   TFTPSTATUS_TRANSFER,        //Data is being transferred   
   TFTPSTATUS_COMPLETING,      //Handling last ACK
   TFTPSTATUS_COMPLETED,       //Complete Successfully
+  TFTPSTATUS_LISTENING,       //Server Mode: Waiting for request from client
 
 }tftp_status_t;
 
@@ -65,7 +66,8 @@ typedef enum {
   TFTPERROR_WIFICONNECTIONLOST = -8, //WIFI Connection lost during File Transfer
   TFTPERROR_DNS = -9,                //Failed to resolve server hostname to IP Address
   TFTPERROR_WATCHDOG = -10,          //WatchDog timer timeout
-  TFTPERROR_RWFAILED = -11           //Read/Write to storage medium failed
+  TFTPERROR_RWFAILED = -11,          //Read/Write to storage medium failed
+  TFTPERROR_PORTINUSE = -12          //Server Mode: Unable to listen on TFTP server port
 }tftp_error_t;
 
 #define TFTPSTATE_INVALIDBLOCKCOUNT (-1)
@@ -73,11 +75,15 @@ typedef enum {
 typedef struct {
   absolute_time_t startTime;
   uint32_t taskid; 
-  uint32_t dir;               //0=Download from server, 1=Upload to server
+  uint32_t dir;               //0=Download from server, 1=Upload to server, 2=Server Mode
+  bool serverWriteEnabled;    //Server Mode: WRQ is accepted
   uint32_t unitNum;           //unitNum of source/destination drive
   uint32_t blockTransferred;  //Number of block sent/received
   uint32_t tsize;             //size of the file being received in bytes
   uint32_t retries;           //Number of Retries
+  uint32_t rxRingHighWater;   //Max number of blocks waiting in RX Ring
+  uint32_t rxRingStalls;      //Number of ACKs withheld because RX Ring is full
+  uint8_t dnsCache;           //DNS Cache result of server hostname lookup (dnscache_result_t)
   int32_t error;
   uint8_t status;  
   char server_hostname[TFTP_HOSTNAME_MAXLEN+1];
@@ -93,7 +99,7 @@ void tftp_critical_section_exit();
 
 //Helper methods for DoTFTPStatus()
 uint8_t TFTPCalcProgressBarValue(uint32_t pbValueMax,const uint32_t blockTransferred,const uint32_t tsize);
-char* TFTPFormatStatusMessage(char* dest,const uint8_t status,int8_t error);
+char* TFTPFormatStatusMessage(char* dest,const uint8_t status,int8_t error,const uint8_t dnsCache);
 char* TFTPFormatBlocksMessage(char *dest,const uint32_t blockTransferred,const uint32_t tsize);
 char* TFTPFormatRetransmit(char *dest,const uint32_t retries);
 char* TFTPFormatElapsedTime(char *dest,const uint32_t elapsedTime);
@@ -5,10 +5,10 @@ extern "C" volatile tftp_state_t tftp_state;
 
 
 CTFTPTask::CTFTPTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,
-                     const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort):CUDPTask() {
-  assert(unitNum!=0);
+                     const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize):CUDPTask() {
   assert(hostname!=NULL);
   assert(filename!=NULL);
+  assert(unitNum!=0 || filename[0]=='\0');  //Server Mode: the unit is selected by each request
   assert(strlen(filename)<=255);
   UpdateTFTPState();
   this->unitNum = unitNum;
@@ -24,6 +24,19 @@ CTFTPTask::CTFTPTask(const uint32_t unitNum,const char* hostname,const char* fil
   else if (tftpMaxAttempt>TFTP_MAXATTEMPT_MAX) this->tftpMaxAttempt = TFTP_MAXATTEMPT_MAX;
   else                                         this->tftpMaxAttempt = tftpMaxAttempt;
   
+  //A whole window may arrive before the event loop runs. Packets beyond
+  //UDP_RXQUEUE_LEN would be dropped, so the window must fit in the queue.
+  //Without the queue, CUDPTask holds one received packet. Only lock-step works then.
+#ifdef UDP_RXQUEUE_LEN
+  const uint32_t windowSizeMax = MIN(TFTP_WINDOWSIZE_MAX,UDP_RXQUEUE_LEN);
+#else
+  const uint32_t windowSizeMax = 1;
+#endif
+  if (tftpWindowSize<TFTP_WINDOWSIZE_MIN)  this->tftpWindowSize = TFTP_WINDOWSIZE_MIN;
+  else if (tftpWindowSize>windowSizeMax)   this->tftpWindowSize = windowSizeMax;
+  else                                     this->tftpWindowSize = tftpWindowSize;
+  this->windowSize = 1;
+  
   this->tftpServerPort = tftpServerPort;
   this->tftpTimeoutLastACK = MAX(tftpTimeout,TFTP_TIMEOUT_LASTACK_MIN);
   this->server_port = 0;
@@ -47,6 +60,9 @@ void CTFTPTask::UpdateTFTPState() {
   tftp_state.tsize = TFTPSTATE_INVALIDTSIZE;
   tftp_state.error = TFTPERROR_NOERR;
   tftp_state.retries = 0;
+  tftp_state.rxRingHighWater = 0;
+  tftp_state.rxRingStalls = 0;
+  tftp_state.dnsCache = DNSCACHE_NOTUSED;
   tftp_critical_section_exit();  
 }
 
@@ -245,6 +261,11 @@ void CTFTPTask::EvtStart() {
   //Start the process by looking up server IP
   DEBUG_PRINTF("DNSLookup: hostname=%s\n",this->hostname);
   DNSLookup(this->hostname); 
+  
+  //Show DNS Cache result in status message
+  tftp_critical_section_enter_blocking();
+  tftp_state.dnsCache = dnsCacheResult;
+  tftp_critical_section_exit();
 }
 
 
@@ -266,6 +287,8 @@ void CTFTPTask::Retry() {
     return;
   } else {
     //Too many retries. Giveup
+    //The cached IP address of server may be outdated
+    ForgetServerAddr();
     this->Complete();
     tftp_critical_section_enter_blocking();
     tftp_state.error = TFTPERROR_TIMEOUT;
@@ -280,6 +303,28 @@ void CTFTPTask::Retry() {
 
 
 
+//////////////////////////////////////////////////////////
+// Handle windowsize option acknowledgement from server
+// This method is common to both CTFTPRXTask and CTFTPTXTask
+//
+// The server may reply a smaller windowsize (RFC 7440).
+// throw E_NEEDRESTART if the value is not 1 to tftpWindowSize
+//
+#define E_NEEDRESTART (0)
+void CTFTPTask::HandleOACK_windowsize(const char* value) {
+  uint32_t size = strtoul(value,NULL,10);
+  
+  if (size>=1 && size<=tftpWindowSize) {
+    INFO_PRINTF("Switching TFTP windowsize to %d\n",size);
+    windowSize = size;
+  } else {
+    //Invalid windowsize. Restart the transfer without windowsize option
+    WARN_PRINTF("Unrecongised windowsize. Restarting transfer without windowsize option\n");
+    tftpWindowSize = 1;   //Turn off windowsize option
+    throw E_NEEDRESTART;
+  }
+}
+
 //////////////////////////////////////////////////////////
 // Process Error Packet
 // Any Errorcode is fatal except TFTPERROR_UNKNOWN_TID
@@ -22,7 +22,7 @@ public:
   const uint32_t OP_OACK  = 6; //Option Acknowledgment
 
   CTFTPTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,
-            const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort);
+            const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize);
   ~CTFTPTask();
   
 protected:
@@ -37,9 +37,11 @@ protected:
   uint32_t tftpMaxAttempt;  //Maximum Number of retries
   uint16_t tftpServerPort;  //TFTP Server Listening Port
   uint32_t tftpTimeoutLastACK; //TFTP Timeout of Last ACK in ms
+  uint32_t tftpWindowSize;  //Requested windowsize (RFC 7440). 1=Don't send windowsize option
 
   //Variables
   uint32_t attempt;       //To track the retry count
+  uint32_t windowSize;    //Negotiated windowsize. 1 until OACK with windowsize is received
 
   //
   // Server and TX Buffer
@@ -82,6 +84,7 @@ protected:
   void EvtStart();
   void Retry();
   void ProcessErrorPacket(const uint8_t* payload,uint16_t payloadlen);
+  void HandleOACK_windowsize(const char* value);
 
 private:  
   void BuildRQPacket(const uint8_t type);
@@ -14,14 +14,11 @@ extern "C" volatile tftp_state_t tftp_state;
 // Constructor
 // 
 CTFTPTXTask::CTFTPTXTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,
-                         const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort):
-                         CTFTPTask(unitNum, hostname, filename,enable1kBlockSize,tftpTimeout,tftpMaxAttempt,tftpServerPort) {
-  
-  
-  nextDataPacketBuf = new uint8_t[TXBUFFERSIZE];
-  nextDataPacketLen = 0;
+                         const uint32_t tftpMaxAttempt,const uint16_t tftpServerPort,const uint32_t tftpWindowSize):
+                         CTFTPTask(unitNum, hostname, filename,enable1kBlockSize,tftpTimeout,tftpMaxAttempt,tftpServerPort,tftpWindowSize) {
   
   OACKReceived = false;
+  dataStarted = false;
   hasCompleted = false; 
   serverTIDAccepted = false;
   blockSent = 0;
@@ -30,13 +27,6 @@ CTFTPTXTask::CTFTPTXTask(const uint32_t unitNum,const char* hostname,const char*
   DEBUG_PRINTF("Total blockCount=%d\n",blockCount);
 }
 
-//Destructor
-//
-CTFTPTXTask::~CTFTPTXTask() {
-  delete []nextDataPacketBuf;
-}
-
-
 //Override Run()
 //
 void CTFTPTXTask::Run(const char* ssid, const char* wpakey){
@@ -79,11 +69,13 @@ void CTFTPTXTask::StartTransfer() {
     AddOption("blksize","1024");    
     AddOption("tsize", blockCount*PRODOS_BLOCKSIZE); //Tell server the file size
   }
+  if (tftpWindowSize>1) AddOption("windowsize",tftpWindowSize);
+  windowSize = 1;   //Until it is acknowledged by OACK
   
   SendPacket();
   SetTimer(tftpTimeout);
   attempt = 1; //First Attempt
-  current_tftpBlock = 0;  //Expecting to receive Ack Block #0 or OACK
+  dataStarted = false;    //Expecting to receive Ack Block #0 or OACK
   
   tftp_critical_section_enter_blocking();
   tftp_state.status = TFTPSTATUS_REQUEST;
@@ -100,8 +92,10 @@ void CTFTPTXTask::StartTransfer() {
 // Discard all invalid packet and let the timeout mechanism
 // to retry.
 //
-void CTFTPTXTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port){
-  CTFTPTask::EvtUDPReceived(payload,payloadlen,remote_addr,remote_port);
+void CTFTPTXTask::EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port){
+  CTFTPTask::EvtUDPReceived(view,remote_addr,remote_port);
+  const uint8_t* payload = Linearize(view);
+  const uint16_t payloadlen = view.len;
   
   //validate the packet format
   if (payloadlen<4) {
@@ -149,7 +143,7 @@ void CTFTPTXTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_a
 #define E_NEEDRESTART (0)
 void CTFTPTXTask::ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port) {
   //Aceept OACKPacket once and before first data packet
-  if (OACKReceived || blockSent!=0) return;
+  if (OACKReceived || dataStarted) return;
   OACKReceived = true;
   DEBUG_PRINTF("OACK Received\n");
   
@@ -167,6 +161,7 @@ void CTFTPTXTask::ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,u
     while(ParseOption(payload,payloadlen,&currentPos,&option,&value)) {
       DEBUG_PRINTF("option: %s=%s\n",option,value);
       if (0==strcmp(option,"blksize")) HandleOACK_blksize(value);
+      else if (0==strcmp(option,"windowsize")) HandleOACK_windowsize(value);
     }
   } catch(int e) {
     if (e==E_NEEDRESTART) {
@@ -195,7 +190,7 @@ void CTFTPTXTask::ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,u
   
   //Everything is ok.
   //Start data transfer by sending Data Packet
-  SendDataPacket();
+  StartData();
 }
 
 //////////////////////////////////////////////////////////
@@ -226,51 +221,54 @@ void CTFTPTXTask::HandleOACK_blksize(const char* value) {
 
 
 //////////////////////////////////////////////////////////
-// Build and send Data packet
+// Start sending Data packets
+// Called when OACK or ACK of block #0 is received
 //
-void CTFTPTXTask::SendDataPacket() {
-  //First Data Packet?
-  if (blockSent==0) {
-    //Prepare first Data packet
-    assert(current_tftpBlock==0);
-    nextDataPacketLen = BuildDataPacket(nextDataPacketBuf,current_tftpBlock+1,blockSent);
-    
-    tftp_critical_section_enter_blocking();
-    tftp_state.status = TFTPSTATUS_TRANSFER;
-    tftp_critical_section_exit();
-    INFO_PRINTF("tftp_state.status = TFTPSTATUS_TRANSFER\n");    
-  }
+void CTFTPTXTask::StartData() {
+  dataStarted = true;
   
-  //Send Data Packet already in nextPacketBuf
-  ++current_tftpBlock; //Advance to next TFTP block
-  TRACE_PRINTF("Sending TFTP Data Packet Block=%d, len=%d\n",current_tftpBlock,nextDataPacketLen);
-  SendPacket(nextDataPacketBuf,nextDataPacketLen);
-  SetTimer(tftpTimeout);
-  attempt = 1; //First Attempt  
+  //Data packet n carries the ProDOS blocks from (n-1)*blocksPerPacket.
+  //The last one is shorter than tftpBlockSize. It can be empty.
+  lastSeq = blockCount/(tftpBlockSize/PRODOS_BLOCKSIZE)+1;
+  sentSeq = 0;
+  ackedSeq = 0;
+  attempt = 1; //First Attempt
   
-  /**** Prepare next Data Packet while waiting Ack from server ****/
+  tftp_critical_section_enter_blocking();
+  tftp_state.status = TFTPSTATUS_TRANSFER;
+  tftp_critical_section_exit();
+  INFO_PRINTF("tftp_state.status = TFTPSTATUS_TRANSFER\n");    
   
-  //Copy nextPacket to txbuffer for Retry()
-  //Also, update blockSent and hasCompleted
-  memcpy(txbuffer,nextDataPacketBuf,nextDataPacketLen);
-  txpacketlen = nextDataPacketLen;  
-  uint32_t payloadlen = txpacketlen - 4; //4 bytes for Data Packet header
-  blockSent += payloadlen/PRODOS_BLOCKSIZE;
+  SendWindow();
+}
+
+//////////////////////////////////////////////////////////
+// Build and send Data packets until windowSize packets 
+// are not acknowledged (RFC 7440)
+//
+// The packets are built again from the unit when they are resent.
+// So, only one packet buffer (txbuffer) is needed.
+//
+void CTFTPTXTask::SendWindow() {
+  const uint32_t blocksPerPacket = tftpBlockSize/PRODOS_BLOCKSIZE;
   
-  //Transfer Completed?
-  if(payloadlen<tftpBlockSize) {
-    hasCompleted = true;  
-  } else {
-    //No, Build Next Data Packet
-    nextDataPacketLen = BuildDataPacket(nextDataPacketBuf,current_tftpBlock+1,blockSent);
+  while(sentSeq<lastSeq && sentSeq-ackedSeq<windowSize) {
+    ++sentSeq;
+    txpacketlen = BuildDataPacket(txbuffer,(uint16_t)sentSeq,(sentSeq-1)*blocksPerPacket);
+    TRACE_PRINTF("Sending TFTP Data Packet Block=%d, len=%d\n",(uint16_t)sentSeq,txpacketlen);
+    SendPacket();
   }
+  SetTimer(tftpTimeout);
   
-  tftp_critical_section_enter_blocking();
-  if (hasCompleted) tftp_state.status = TFTPSTATUS_COMPLETING;
-  tftp_state.error = TFTPERROR_NOERR;
-  tftp_state.blockTransferred = blockSent;
-  tftp_critical_section_exit();
-  if (hasCompleted) INFO_PRINTF("\ntftp_state.status = TFTPSTATUS_COMPLETING\n");
+  //Transfer Completed?
+  if (sentSeq==lastSeq && !hasCompleted) {
+    hasCompleted = true;
+    tftp_critical_section_enter_blocking();
+    tftp_state.status = TFTPSTATUS_COMPLETING;
+    tftp_state.error = TFTPERROR_NOERR;
+    tftp_critical_section_exit();
+    INFO_PRINTF("\ntftp_state.status = TFTPSTATUS_COMPLETING\n");
+  }
 }
 
 //////////////////////////////////////////////////////////
@@ -325,47 +323,67 @@ uint32_t CTFTPTXTask::BuildDataPacket(uint8_t *destBuffer,uint16_t tftpBlockNum,
 // Process ACK
 // Accept remote_port if this is the first ACK Packet
 //
+// The ACK is cumulative. The server acknowledges all Data packets
+// up to the block number. The next window starts after it. If the
+// server has lost a packet, it acks the last good one. So, sending
+// always restarts from the acknowledged block (go-back-N).
+//
 void CTFTPTXTask::ProcessACKPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port){
   uint16_t block = payload[2]*256+payload[3];
   TRACE_PRINTF("ACK Received block=%d\n",block);
   
   //First ACK Packet
-  if (block==0 && blockSent==0) {
+  if (!dataStarted) {
+    if (block!=0) {
+      TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
+      return;
+    }
     //Accept remote_port (TID)
     if (!serverTIDAccepted){
       server_port = remote_port;
       serverTIDAccepted = true;
       DEBUG_PRINTF("Setting server_port to %d\n",remote_port);    
-    }      
+    }
+    StartData();
+    return;
   }
   
-  //Is it the ACK we are waiting for?
-  if (block==current_tftpBlock) {
-    //Proper Ack Received. Send next Data Packet unless hasCompleted is set
-    if (hasCompleted) {
-      this->Complete();
-      tftp_critical_section_enter_blocking();
-      tftp_state.status = TFTPSTATUS_COMPLETED;
-      tftp_critical_section_exit();    
-      INFO_PRINTF("tftp_state.status = TFTPSTATUS_COMPLETED\n");    
-      INFO_PRINTF("TX Transfer Completed! Block Count = %d\n",blockSent);
-    }
-    else {
-      SendDataPacket();
-      return;
-    }
+  //Number of Data packets acknowledged by this ACK
+  //Block numbers wrap around at 65536. So, uint16_t arithmetic is used.
+  const uint16_t newlyAcked = block-(uint16_t)ackedSeq;
+  
+  if (newlyAcked==0) {
+    //If Ack of the packet before the window is received, it means the
+    //Data Block is lost. Retry without any delay
+    if (sentSeq!=ackedSeq) this->Retry();
+    return;
+  }
+  
+  if (newlyAcked > sentSeq-ackedSeq) {
+    //Discard the packet.
+    TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
+    return;
+  }
+  
+  //Proper Ack Received.
+  ackedSeq += newlyAcked;
+  sentSeq = ackedSeq;
+  attempt = 1;  //Reset attempt to 1 since the server has received some data
+  blockSent = MIN(ackedSeq*(tftpBlockSize/PRODOS_BLOCKSIZE),blockCount);
+  tftp_critical_section_enter_blocking();
+  tftp_state.blockTransferred = blockSent;
+  tftp_critical_section_exit();
+  
+  //Send next window unless the last packet is acknowledged
+  if (ackedSeq==lastSeq) {
+    this->Complete();
+    tftp_critical_section_enter_blocking();
+    tftp_state.status = TFTPSTATUS_COMPLETED;
+    tftp_critical_section_exit();    
+    INFO_PRINTF("tftp_state.status = TFTPSTATUS_COMPLETED\n");    
+    INFO_PRINTF("TX Transfer Completed! Block Count = %d\n",blockSent);
   } else {
-    //block number is not expected one.
-    if (block==current_tftpBlock-1) {
-      //If Ack of last Data Packet is received, it means the Data Block
-      //is lost. Retry without any delay
-      //Otherwise, Discard the packet.
-      this->Retry();
-      return;
-    } else {
-      TRACE_PRINTF("Discard Packet: Invalid Block Number\n");
-      return;
-    }
+    SendWindow();
   }
 }
 
@@ -378,7 +396,27 @@ void CTFTPTXTask::EvtTimeout(uint32_t arg){
 
 /////////////////////////////////////////////////////////////
 // Retry Method
+//
+// Before the first Data packet, send the WRQ packet again.
 // See CTFTPTask::Retry()
+// After that, send again from the start of window.
+//
+void CTFTPTXTask::Retry() {
+  //Using base class implementation to resend WRQ or give up
+  if (!dataStarted || attempt>=tftpMaxAttempt) {
+    CTFTPTask::Retry();
+    return;
+  }
+  
+  ++attempt;
+  INFO_PRINTF("#"); 
+  tftp_critical_section_enter_blocking();
+  ++tftp_state.retries;
+  tftp_critical_section_exit();   
+  
+  sentSeq = ackedSeq;
+  SendWindow();
+}
 
 
 //////////////////////////////////////////////////////////
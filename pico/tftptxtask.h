@@ -10,21 +10,19 @@
 class CTFTPTXTask:public CTFTPTask {
 public:
   CTFTPTXTask(const uint32_t unitNum,const char* hostname,const char* filename,const bool enable1kBlockSize,const uint32_t tftpTimeout,const uint32_t tftpMaxAttempt,
-              const uint16_t tftpServerPort);
-  ~CTFTPTXTask();
+              const uint16_t tftpServerPort,const uint32_t tftpWindowSize);
   
   //Override Run()
   virtual void Run(const char* ssid, const char* wpakey);
   
 protected:
-  //Next Data Packet Buffer
-  uint8_t *nextDataPacketBuf;   
-  uint32_t nextDataPacketLen;
-
   bool OACKReceived;           //To indicate OACK Packet has been received
-  uint16_t current_tftpBlock;  //The TFTP block number we have sent and the ACK we expected
+  bool dataStarted;            //To indicate the first Data packet has been sent
+  uint32_t sentSeq;            //Number of Data packets sent. Lower 16 bits is TFTP block number of last one
+  uint32_t ackedSeq;           //Number of Data packets acknowledged by server (start of window - 1)
+  uint32_t lastSeq;            //Sequence number of the last Data packet
   bool hasCompleted;           //To indicate the last Data packet has been sent. Waiting for last Ack
-  uint32_t blockSent;          //Number of ProDOS block sent
+  uint32_t blockSent;          //Number of ProDOS block sent and acknowledged
   uint32_t blockCount;         //Total Number of ProDOS block of the unit
   uint32_t tftpBlockSize;      //TFTP block size (512 or 1024)
   bool serverTIDAccepted;      //Server TID (remote_port) accepted
@@ -32,11 +30,13 @@ protected:
   //Event Handlers
   //void EvtStart();
   void EvtDNSResult(const int dns_error, const ip_addr_t *ipaddr);
-  void EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port);
+  void EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port);
   void EvtTimeout(uint32_t arg);
   
   void StartTransfer();  
-  void SendDataPacket(); 
+  void StartData();
+  void SendWindow(); 
+  void Retry();
   void ProcessOACKPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port);
   void ProcessACKPacket(const uint8_t* payload,uint16_t payloadlen,uint16_t remote_port);
   void HandleOACK_blksize(const char* value);
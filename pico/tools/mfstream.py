@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+#
+# mfstream.py - Upload/Download ProDOS image to/from MegaFlash over USB
+#
+# Host side of the Image Stream Protocol. See imagestream.c for the frame format.
+# Requires pyserial.
+#
+# Usage:
+#   mfstream.py PORT upload IMAGE.po [--unit N]
+#   mfstream.py PORT download IMAGE.po [--unit N]
+#
+# With --unit, the tool selects the menu items of User Terminal. Otherwise, select
+# "Stream" in the Upload/Download menu with a terminal program, close it and run the tool.
+#
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+FRAME_START = ord('S')
+FRAME_READY = ord('R')
+FRAME_DATA  = ord('D')
+FRAME_ACK   = ord('A')
+FRAME_NAK   = ord('N')
+FRAME_END   = ord('E')
+FRAME_ABORT = ord('X')
+
+BLOCKSIZE     = 512
+HEADERSIZE    = 12
+CRCSIZE       = 4
+MAXPAYLOAD    = 8*BLOCKSIZE
+TIMEOUT       = 3.0     # Same as STREAM_TIMEOUT_MS
+MAXERROR      = 10      # Same as STREAM_MAXERROR
+
+
+class StreamError(Exception):
+  pass
+
+
+class FramePort:
+  def __init__(self, port):
+    self.ser = serial.Serial(port, timeout=0.05)
+    self.rx = bytearray()
+
+  def send(self, ftype, seq, payload=b''):
+    header = struct.pack('<2sBBII', b'MF', ftype, 0, seq, len(payload))
+    crc = zlib.crc32(header+payload)
+    self.ser.write(header+payload+struct.pack('<I', crc))
+
+  def send_keys(self, keys):
+    for key in keys:
+      self.ser.write(key.encode())
+      time.sleep(0.3)
+
+  # Output: (type, seq, payload, crcOk) or None if timeout
+  def receive(self, timeout):
+    deadline = time.monotonic()+timeout
+    while True:
+      frame = self._parse()
+      if frame: return frame
+      if time.monotonic()>deadline: return None
+      self.rx += self.ser.read(max(1, self.ser.in_waiting))
+
+  def _parse(self):
+    while True:
+      start = self.rx.find(b'MF')
+      if start<0:
+        del self.rx[:max(0, len(self.rx)-1)]   # Keep 'M' at the end
+        return None
+      del self.rx[:start]
+      if len(self.rx)<HEADERSIZE: return None
+
+      _, ftype, _, seq, length = struct.unpack_from('<2sBBII', self.rx)
+      if length%4 or length>MAXPAYLOAD:
+        del self.rx[:1]   # False sync
+        continue
+      total = HEADERSIZE+length+CRCSIZE
+      if len(self.rx)<total: return None
+
+      (crc,) = struct.unpack_from('<I', self.rx, HEADERSIZE+length)
+      crcOk = crc==zlib.crc32(self.rx[:HEADERSIZE+length])
+      if not crcOk and ftype!=FRAME_DATA:
+        del self.rx[:1]   # Text or broken control frame
+        continue
+      payload = bytes(self.rx[HEADERSIZE:HEADERSIZE+length])
+      del self.rx[:total]
+      return (ftype, seq, payload, crcOk)
+
+
+def start_session(port, blockCount):
+  for _ in range(MAXERROR):
+    port.send(FRAME_START, 0, struct.pack('<I', blockCount))
+    deadline = time.monotonic()+TIMEOUT
+    while time.monotonic()<deadline:
+      frame = port.receive(deadline-time.monotonic())
+      if frame is None: break
+      ftype, _, payload, crcOk = frame
+      if ftype==FRAME_READY and crcOk: return struct.unpack_from('<III', payload)
+      if ftype==FRAME_ABORT: raise StreamError('Rejected by MegaFlash. Is the image larger than the drive?')
+  raise StreamError('No response from MegaFlash')
+
+
+def wait_end(port):
+  for _ in range(MAXERROR):
+    frame = port.receive(TIMEOUT)
+    if frame and frame[0]==FRAME_END: return struct.unpack_from('<I', frame[2])[0]
+    if frame and frame[0]==FRAME_ABORT: raise StreamError('Aborted by MegaFlash')
+  raise StreamError('END frame not received')
+
+
+def upload(port, image):
+  if len(image)%BLOCKSIZE: image += bytes(BLOCKSIZE-len(image)%BLOCKSIZE)
+  blockCount = len(image)//BLOCKSIZE
+  _, frameBlocks, window = start_session(port, blockCount)
+  frameSize = frameBlocks*BLOCKSIZE
+  frameCount = (blockCount+frameBlocks-1)//frameBlocks
+
+  def send_data(seq):
+    port.send(FRAME_DATA, seq, image[seq*frameSize:(seq+1)*frameSize])
+
+  base = nextSend = errors = 0
+  while base<frameCount:
+    while nextSend<frameCount and nextSend<base+window:
+      send_data(nextSend)
+      nextSend += 1
+
+    frame = port.receive(TIMEOUT)
+    if frame is None:
+      errors += 1
+      if errors>MAXERROR: raise StreamError('Timeout')
+      send_data(base)
+      continue
+
+    ftype, seq, _, _ = frame
+    if ftype==FRAME_ACK and seq>base:
+      base = seq
+      errors = 0
+      progress(base*frameBlocks, blockCount)
+    elif ftype==FRAME_NAK and base<=seq<nextSend:
+      send_data(seq)
+    elif ftype==FRAME_ABORT:
+      raise StreamError('Aborted by MegaFlash')
+
+  verificationErrors = wait_end(port)
+  print('\nVerification Error: %d' % verificationErrors)
+  return blockCount
+
+
+def download(port, out):
+  blockCount, frameBlocks, window = start_session(port, 0)
+  frameCount = (blockCount+frameBlocks-1)//frameBlocks
+  pending = {}
+  naked = set()
+  expected = errors = 0
+
+  while expected<frameCount:
+    frame = port.receive(TIMEOUT)
+    if frame is None:
+      errors += 1
+      if errors>MAXERROR: raise StreamError('Timeout')
+      port.send(FRAME_NAK, expected)
+      continue
+
+    ftype, seq, payload, crcOk = frame
+    if ftype==FRAME_ABORT: raise StreamError('Aborted by MegaFlash')
+    if ftype!=FRAME_DATA or not expected<=seq<expected+window: continue
+    if not crcOk:
+      port.send(FRAME_NAK, seq)
+      continue
+
+    pending[seq] = payload
+    for missing in range(expected, seq):
+      if missing not in pending and missing not in naked:
+        naked.add(missing)
+        port.send(FRAME_NAK, missing)
+
+    # Write frames in order
+    while expected in pending:
+      out.write(pending.pop(expected))
+      naked.discard(expected)
+      expected += 1
+      errors = 0
+    port.send(FRAME_ACK, expected)
+    progress(expected*frameBlocks, blockCount)
+
+  wait_end(port)
+  return blockCount
+
+
+def progress(done, total):
+  done = min(done, total)
+  sys.stdout.write('\r%d/%d blocks' % (done, total))
+  sys.stdout.flush()
+
+
+def main():
+  parser = argparse.ArgumentParser(description='Upload/Download ProDOS image to/from MegaFlash')
+  parser.add_argument('port', help='USB serial port of MegaFlash')
+  parser.add_argument('command', choices=['upload', 'download'])
+  parser.add_argument('image', help='ProDOS order image file (.po/.hdv)')
+  parser.add_argument('--unit', type=int, help='Drive number. Select it in User Terminal menu.')
+  args = parser.parse_args()
+
+  port = FramePort(args.port)
+  if args.unit:
+    if args.command=='upload': port.send_keys(['2', str(args.unit), 'CONFIRM\r', '2'])
+    else: port.send_keys(['3', str(args.unit), '3'])
+
+  start = time.monotonic()
+  try:
+    if args.command=='upload':
+      with open(args.image, 'rb') as f: blockCount = upload(port, bytearray(f.read()))
+    else:
+      with open(args.image, 'wb') as f: blockCount = download(port, f)
+  except StreamError as e:
+    port.send(FRAME_ABORT, 0)
+    print('\nError: %s' % e)
+    return 1
+
+  elapsed = time.monotonic()-start
+  print('\n%d blocks in %.1f sec (%.2f MB/s)' % (blockCount, elapsed, blockCount*BLOCKSIZE/elapsed/1e6))
+  if args.unit: port.send_keys(['\r'])   # Press any key to continue
+  return 0
+
+
+if __name__=='__main__':
+  sys.exit(main())
@@ -0,0 +1,324 @@
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/sync.h"
+#include "defines.h"
+#include "debug.h"
+#include "flash.h"
+#include "mediaaccess.h"
+#include "misc.h"
+#include "cmdhandler.h"
+#include "blockstream.h"
+#include "userconfig.h"
+#include "trim.h"
+
+/****************************************************************************************
+Background Pre-erase of Free Sectors (TRIM)
+
+A ProDOS block write to flash which changes any bit from 0 to 1 needs an erase of the
+4kB sector. When a file is deleted, ProDOS only marks its blocks free in the volume bitmap.
+The old data stays in flash. So, a later write to these blocks takes the erase path.
+
+TrimTask() runs on core 0. It reads the volume bitmap of each ProDOS flash unit and finds
+the 4kB sectors whose 8 blocks are all free. These sectors are erased ahead of time. Then,
+later writes to them take the cheap path (tsWriteOneBlockWithoutErase).
+
+TRIM is opt-in. It runs only if it is enabled by CMD_SETTRIM (trim_enable in user config).
+
+The volume bitmap on flash is not always up to date. ProDOS allocates blocks in memory and
+writes the bitmap when the file is closed. So, a block marked free may hold new data.
+To be safe, a sector is erased only if
+- all its blocks were free at the first scan after power-on (mount), and
+- none of its blocks has been written since power-on, and
+- all its blocks are still free.
+untouchedMap has one bit per sector. All bits are set at power-on. TrimNoteWrite() clears
+the bit of the sector when a block is written by any path (Apple, USB, TFTP, terminal).
+Every scan ANDs freeMask into it. Only the sectors whose bit is still set are erased.
+
+Because of the block layout (see GetBlockLoc in flash.c), sector n of a unit (0-8191)
+holds blocks n+k*8192 (k=0-7). The bits of these blocks are in bitmap blocks 2k+n/4096.
+So, a unit is scanned in two halves. For each half, 8 bitmap blocks are ANDed into
+freeMask. A bit of freeMask is set if all 8 blocks of the sector are free.
+
+Priority:
+- The scan runs only if the Apple has not issued any command and no block has been
+  written for TRIM_IDLE_MS, and no multi-block transfer is in progress.
+- At most one sector is erased every TRIM_INTERVAL_MS.
+- If the Apple issues a command or a block is written, the volume bitmap may have changed.
+  The current half is scanned again later. The activity counter (commands + block writes)
+  is also checked while the Device Lock is held, right before the erase. TrimNoteWrite()
+  is called before the block is written. A block write issued after the check has to
+  wait until the erase is completed. So, a block in use is never erased.
+- All flash units are scanned again every TRIM_RESCAN_MS.
+
+Statistics can be read by CMD_GETTRIMSTAT command.
+*****************************************************************************************/
+
+#define TRIM_IDLE_MS          3000
+#define TRIM_INTERVAL_MS      100
+#define TRIM_RESCAN_MS        (10*60*1000)
+#define TRIM_SECTORS_PER_CALL 64    //Max number of free sectors checked per call
+#define TRIM_MAXUNIT          8     //Max number of flash units (medium unit 1-8)
+#define TRIM_SECTORSPERUNIT   8192
+
+//Scan States
+typedef enum {
+  SCAN_START,     //Read Volume Directory Header of the unit
+  SCAN_BITMAP,    //Read 8 bitmap blocks of the current half
+  SCAN_SECTORS    //Check and erase free sectors of the current half
+} scanstate_t;
+
+static critical_section_t trimCS;   //Protect stats
+static trimstats_t stats;
+
+static uint unitNum = 0;            //Unit being scanned. 0 means idle
+static uint mediumUnitNum;          //Flash medium unit number of unitNum
+static scanstate_t state;
+static uint half;                   //0: sectors 0-4095, 1: sectors 4096-8191
+static uint bitmapIndex;            //Bitmap block being read (0-7)
+static uint sectorIndex;            //Next sector to be checked in the current half
+static uint bitmapStart;            //Block number of volume bitmap
+static uint bitmapCount;            //Number of volume bitmap blocks
+static uint32_t scanActivityCount;  //Activity count when the bitmap is read
+static uint8_t __attribute__((aligned(4))) freeMask[BLOCKSIZE];
+static uint8_t __attribute__((aligned(4))) bitmapBuffer[BLOCKSIZE];
+
+//Sectors free at mount and not written since. Indexed by medium unit number - 1.
+//Protected by trimCS because it is updated by both cores.
+static uint8_t __attribute__((aligned(4))) untouchedMap[TRIM_MAXUNIT][TRIM_SECTORSPERUNIT/8];
+static volatile uint32_t writeCount;   //Number of block writes to flash units
+
+static uint32_t lastActivityCount;
+static absolute_time_t lastActivityTime;
+static absolute_time_t nextEraseTime;
+static absolute_time_t nextPassTime;
+
+
+////////////////////////////////////////////////////////////////////
+// Get the activity counter. It is changed if the Apple issues a
+// command or a block of a flash unit is written.
+//
+static inline uint32_t GetActivityCount() {
+  return GetCommandCount()+writeCount;
+}
+
+////////////////////////////////////////////////////////////////////
+// Initialize TRIM data
+//
+void InitTrim() {
+  critical_section_init(&trimCS);
+  memset(&stats,0,sizeof(stats));
+  memset(untouchedMap,0xff,sizeof(untouchedMap));
+  writeCount = 0;
+  lastActivityCount = GetActivityCount();
+  lastActivityTime = get_absolute_time();
+  nextEraseTime = get_absolute_time();
+  nextPassTime = get_absolute_time();
+}
+
+////////////////////////////////////////////////////////////////////
+// Increment a counter in stats
+//
+static void IncStat(uint32_t* counter) {
+  critical_section_enter_blocking(&trimCS);
+  ++*counter;
+  critical_section_exit(&trimCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Called before a block of a flash unit is written. It may be called
+// by core 0 or core 1.
+// The sector of the block is never erased by TRIM until next power-on.
+//
+// Input: mediumUnit - Flash medium unit number (1-8)
+//        blockNum   - Block Number
+//
+void TrimNoteWrite(const uint mediumUnit, const uint blockNum) {
+  if (mediumUnit==0 || mediumUnit>TRIM_MAXUNIT) return;
+  const uint sectorNum = blockNum%TRIM_SECTORSPERUNIT;   //Sector n holds blocks n+k*8192
+  
+  critical_section_enter_blocking(&trimCS);
+  untouchedMap[mediumUnit-1][sectorNum/8] &= ~(0x80>>(sectorNum%8));
+  ++writeCount;
+  critical_section_exit(&trimCS);
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if the Apple has issued a command or a block has been 
+// written since the volume bitmap was read. 
+// Called by tsTrimSectorFlash_Public() with Device Lock held.
+//
+static bool IsActivityDetected() {
+  return GetActivityCount()!=scanActivityCount;
+}
+
+////////////////////////////////////////////////////////////////////
+// Read Volume Directory Header of the unit
+//
+static void StartUnit() {
+  if (unitNum>GetTotalUnitCount()) {
+    //All units are scanned
+    IncStat(&stats.passes);
+    unitNum = 0;
+    nextPassTime = make_timeout_time_ms(TRIM_RESCAN_MS);
+    return;
+  }
+
+  VolumeInfo info;
+  mediumUnitNum = GetMediumUnitNum(unitNum);
+  if (GetMediumType(unitNum)!=TYPE_FLASH || mediumUnitNum==0 || mediumUnitNum>TRIM_MAXUNIT || 
+      !IsUnitWritable(unitNum) ||
+      !GetVolumeInfo(unitNum,&info) || info.type!=TYPE_PRODOS) {
+    ++unitNum;  //Skip this unit
+    return;
+  }
+
+  bitmapStart = info.bitmapBlock;
+  bitmapCount = (info.blockCount+4095)/4096;  //4096 blocks per bitmap block
+  
+  //Don't trust a damaged Volume Directory Header
+  //Block 0-2 are boot blocks and Volume Directory Header
+  if (info.blockCount>GetBlockCount(unitNum) || bitmapStart<3 || 
+      bitmapStart+bitmapCount>info.blockCount) {
+    ++unitNum;  //Skip this unit
+    return;
+  }
+  half = 0;
+  bitmapIndex = 0;
+  state = SCAN_BITMAP;
+}
+
+////////////////////////////////////////////////////////////////////
+// Read one bitmap block and AND it into freeMask
+//
+static void ReadBitmap() {
+  if (bitmapIndex==0) {
+    scanActivityCount = GetActivityCount();
+    memset(freeMask,0xff,BLOCKSIZE);
+  }
+
+  const uint index = bitmapIndex*2+half;
+  if (index<bitmapCount) {
+    if (ReadBlock(unitNum, bitmapStart+index, bitmapBuffer, NULL)!=MFERR_NONE) {
+      ++unitNum;  //Skip this unit
+      state = SCAN_START;
+      return;
+    }
+    uint32_t* dest = (uint32_t*)freeMask;
+    const uint32_t* src = (const uint32_t*)bitmapBuffer;
+    for(uint i=BLOCKSIZE/4;i!=0;--i) {
+      *dest++ &= *src++;
+    }
+  } else {
+    //The blocks are beyond the end of volume
+    memset(freeMask,0,BLOCKSIZE);
+  }
+
+  if (++bitmapIndex==8) {
+    //Only the sectors free at mount and not written since are erased.
+    //A sector once in use is never erased again until next power-on.
+    uint32_t* untouched = (uint32_t*)&untouchedMap[mediumUnitNum-1][half*BLOCKSIZE];
+    uint32_t* mask = (uint32_t*)freeMask;
+    critical_section_enter_blocking(&trimCS);
+    for(uint i=BLOCKSIZE/4;i!=0;--i) {
+      *untouched &= *mask;
+      *mask++ = *untouched++;
+    }
+    critical_section_exit(&trimCS);
+    sectorIndex = 0;
+    state = SCAN_SECTORS;
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Erase the free sectors of the current half
+//
+static void EraseFreeSectors() {
+  for(uint n=TRIM_SECTORS_PER_CALL;n!=0 && sectorIndex<4096;--n) {
+    //Bit 7 of the byte is the first block. 1 means free.
+    if (!(freeMask[sectorIndex/8] & (0x80>>(sectorIndex%8)))) {
+      ++sectorIndex;
+      continue;
+    }
+
+    if (!time_reached(nextEraseTime)) return;   //Rate limit
+
+    trimresult_t result = TrimFlashSector(unitNum, half*4096+sectorIndex, IsActivityDetected);
+    if (result==TRIM_ABORTED) return;   //The half is scanned again at next call
+    ++sectorIndex;
+    if (result==TRIM_ERASED) {
+      IncStat(&stats.reclaimed);
+      nextEraseTime = make_timeout_time_ms(TRIM_INTERVAL_MS);
+      return;
+    }
+    IncStat(&stats.skipped);
+  }
+
+  if (sectorIndex>=4096) {
+    if (half==0) {
+      half = 1;
+      bitmapIndex = 0;
+      state = SCAN_BITMAP;
+    } else {
+      ++unitNum;
+      state = SCAN_START;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Pre-erase free sectors of flash units
+// This function should be called periodically by core 0.
+//
+void TrimTask() {
+  //Opt-in
+  if (!GetTrimEnabled()) return;
+  
+  //Track the activity of the Apple and other block writers
+  const uint32_t count = GetActivityCount();
+  if (count!=lastActivityCount) {
+    lastActivityCount = count;
+    lastActivityTime = get_absolute_time();
+  }
+
+  //Yield to the Apple
+  if (absolute_time_diff_us(lastActivityTime, get_absolute_time()) < TRIM_IDLE_MS*1000ll) return;
+  if (blockStreamMode!=STREAM_NONE) return;
+
+  if (unitNum==0) {
+    if (!time_reached(nextPassTime)) return;
+    unitNum = 1;
+    state = SCAN_START;
+  }
+
+  //The volume bitmap may have been changed. Scan the current half again.
+  if ((state==SCAN_SECTORS || (state==SCAN_BITMAP && bitmapIndex!=0)) && IsActivityDetected()) {
+    IncStat(&stats.aborted);
+    bitmapIndex = 0;
+    state = SCAN_BITMAP;
+  }
+
+  switch(state) {
+    case SCAN_START:
+      StartUnit();
+      break;
+    case SCAN_BITMAP:
+      ReadBitmap();
+      break;
+    case SCAN_SECTORS:
+      EraseFreeSectors();
+      break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Get TRIM statistics
+//
+// Input: statsOut - Pointer to structure to receive the statistics
+//        reset    - Reset the counters to zero
+//
+void GetTrimStats(trimstats_t* statsOut, const bool reset) {
+  critical_section_enter_blocking(&trimCS);
+  *statsOut = stats;
+  if (reset) memset(&stats,0,sizeof(stats));
+  critical_section_exit(&trimCS);
+}
@@ -0,0 +1,27 @@
+#ifndef _TRIM_H
+#define _TRIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Pre-erase statistics
+typedef struct {
+  uint32_t reclaimed;   //Sectors erased because all blocks are free
+  uint32_t skipped;     //Free sectors which are already erased
+  uint32_t aborted;     //Scans aborted because Apple issued a command
+  uint32_t passes;      //Completed scans of all flash units
+} trimstats_t;
+
+void InitTrim();
+void TrimTask();
+void TrimNoteWrite(const uint mediumUnit, const uint blockNum);
+void GetTrimStats(trimstats_t* statsOut, const bool reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
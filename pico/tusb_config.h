@@ -0,0 +1,35 @@
+#ifndef _TUSB_CONFIG_H
+#define _TUSB_CONFIG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// TinyUSB configuration of the composite device
+// CDC: Serial port of User Terminal (stdio_usb)
+// MSC: Flash units and RAM disk (usbmsc.c)
+//
+#define CFG_TUSB_RHPORT0_MODE   (OPT_MODE_DEVICE)
+#define CFG_TUSB_OS             (OPT_OS_PICO)
+
+#define CFG_TUD_ENDPOINT0_SIZE  64
+
+#define CFG_TUD_CDC             1
+#define CFG_TUD_MSC             1
+#define CFG_TUD_HID             0
+#define CFG_TUD_MIDI            0
+#define CFG_TUD_VENDOR          0
+
+//Same as the default configuration of stdio_usb
+#define CFG_TUD_CDC_RX_BUFSIZE  256
+#define CFG_TUD_CDC_TX_BUFSIZE  256
+
+//Multiple of BLOCKSIZE. Number of bytes passed to tud_msc_read10_cb()/tud_msc_write10_cb()
+#define CFG_TUD_MSC_EP_BUFSIZE  4096
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,6 +5,8 @@
 #include "udptask.h"
 #include "debug.h"
 #include "misc.h"
+#include "wifisession.h"
+#include "ipc.h"
 
 
 
@@ -14,11 +16,13 @@ void udp_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pub, const ip_add
 //--------------------------------------------------------------------
 // This function is modified from cyw43_arch_wifi_connect_timeout_ms()
 // The original function fails to report CYW43_LINK_NONET
+// bssid and channel of a known access point can be specified to skip the scan.
+// Use NULL and CYW43_CHANNEL_NONE otherwise.
 //
-static int wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, uint32_t timeout_ms) {
+static int wifi_connect_timeout_ms(const char *ssid, const char *pw, uint32_t auth, const uint8_t *bssid, uint32_t channel, uint32_t timeout_ms) {
   absolute_time_t timeout = make_timeout_time_ms(timeout_ms);
 
-  int err = cyw43_arch_wifi_connect_bssid_async(ssid, NULL, pw, auth);
+  int err = cyw43_wifi_join(&cyw43_state, strlen(ssid), (const uint8_t *)ssid, strlen(pw), (const uint8_t *)pw, auth, bssid, channel);
   if (err) return err;
 
   int status = CYW43_LINK_UP + 1;
@@ -66,15 +70,17 @@ CUDPTask::CUDPTask() {
   wifiConnected = false;
   serverIpResolved = false;
   dnsTimeout   = TIMEOUT_NEVER;
+  dnsHostname  = NULL;
+  dnsCacheResult = DNSCACHE_NOTUSED;
+  dnsCallbackInvoked = false;   //Server Mode never calls DNSLookup()
+  dns_error = DNSERR_NONE;
   timerTimeout = TIMEOUT_NEVER;
   timerArg = 0;
   pcb = NULL;
   completed = false;
-  udpCallbackInvoked=false;
+  rxqueueHead = 0;
+  rxqueueCount = 0;
   rxbuffer = new uint8_t[UDP_BUFFERSIZE];
-  rxdatalen = 0;
-  rxremoteipaddr=IPADDR4_INIT(0);
-  rxremoteport=0;
   watchdogTimeout = TIMEOUT_NEVER;
   hasInitedCyw43 = false;
 
@@ -84,20 +90,15 @@ CUDPTask::CUDPTask() {
 // Destructor
 //
 CUDPTask::~CUDPTask() {
+  FreeRxQueue();
   cyw43_arch_lwip_begin();  
   if (this->pcb) udp_remove(this->pcb);
   if (rxbuffer) delete[] rxbuffer;
   cyw43_arch_lwip_end();   
   
   if (hasInitedCyw43) {
-    //Disconnect WIFI
-    TRACE_PRINTF("Disconnecting WIFI\n");
-    cyw43_arch_disable_sta_mode();
-    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN,0); //Turn off LED
-    
-    //CYW43 Library will go crazy if we try to connect continuously
-    //deinit than init the library seems to fix the problem
-     cyw43_arch_deinit();    
+    //Keep WIFI connected for next task. See wifisession.c
+    WifiSession_Release(wifiConnected);
   }
 }
 
@@ -109,10 +110,7 @@ void CUDPTask::InitCyw43() {
   
   TRACE_PRINTF("InitCyw43()\n");
   hasInitedCyw43 = true;
-  cyw43_arch_init_with_country(WIFI_COUNTRY);
-  cyw43_arch_enable_sta_mode();
-  
-  cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN,1); //Turn on LED
+  WifiSession_Open(WIFI_COUNTRY);  //CYW43 is initialized only if the session is not open
 }
 
 
@@ -147,11 +145,16 @@ void CUDPTask::Run(const char* ssid, const char* wpakey) {
       
       cyw43_arch_poll();
       
+      //A network task may run for minutes. Keep serving Uthernet II,
+      //multi-block transfer, USB and other background tasks.
+      Core0BackgroundTasks();
+      
       //DNS Callback
       if (dnsCallbackInvoked) {
         dnsCallbackInvoked = false;
         dnsTimeout = TIMEOUT_NEVER;
         WatchdogUpdate();
+        if (dns_error==DNSERR_NONE) DNSCache_Add(dnsHostname, &dns_result_ipaddr);
         this->EvtDNSResult(dns_error, &dns_result_ipaddr);
       }
         
@@ -163,10 +166,9 @@ void CUDPTask::Run(const char* ssid, const char* wpakey) {
       }
       
       //UDP Callback
-      if (udpCallbackInvoked) {
-        udpCallbackInvoked = false;
+      while (rxqueueCount!=0 && !completed) {
         WatchdogUpdate();      
-        EvtUDPReceived(rxbuffer,rxdatalen,rxremoteipaddr,rxremoteport);
+        DispatchUDP();
       }
       
       //Timer Timeout
@@ -192,7 +194,14 @@ void CUDPTask::Run(const char* ssid, const char* wpakey) {
       //Abort Request
       if (CUDPTask::abortRequested) CUDPTask::Abort(this);
       
+      //Background work. Don't wait if there is more work to do.
+      bool busy = false;
       if (!completed) {
+        busy = this->EvtIdle();
+        if (busy) WatchdogUpdate();
+      }
+      
+      if (!completed && !busy) {
         cyw43_arch_wait_for_work_until(MIN3(nextRun,dnsTimeout,timerTimeout));
       }
     }while(!completed);
@@ -224,8 +233,8 @@ void CUDPTask::ConnectWifi(const char* ssid, const char* wpakey) {
   uint32_t delay;
   int attempt=0;  
     
-  //Already connected?
-  if (cyw43_tcpip_link_status(&cyw43_state,CYW43_ITF_STA )==CYW43_LINK_UP) return;
+  //Already connected with the same settings?
+  if (WifiSession_Reuse(ssid,wpakey)) return;
 
   //If SSID is empty, don't proceed
   if (ssid[0]=='\0') {
@@ -243,10 +252,19 @@ void CUDPTask::ConnectWifi(const char* ssid, const char* wpakey) {
     authType = CYW43_AUTH_WPA3_WPA2_AES_PSK;
   }  
   
+  //Join the cached access point directly at first attempt
+  uint8_t bssid[6];
+  uint32_t channel;
+  bool useCachedAP = WifiSession_GetCachedAP(ssid,bssid,&channel);
+
   //Try to connect
   do {
     DEBUG_PRINTF("\nConnecting to Wifi Attempt:#%d\n",attempt+1);
-    errorcode = wifi_connect_timeout_ms(ssid, wpakey, authType, 15000);
+    if (useCachedAP) {
+      errorcode = wifi_connect_timeout_ms(ssid, wpakey, authType, bssid, channel, 15000);
+    } else {
+      errorcode = wifi_connect_timeout_ms(ssid, wpakey, authType, NULL, CYW43_CHANNEL_NONE, 15000);
+    }
     
     link_status = cyw43_tcpip_link_status (&cyw43_state, CYW43_ITF_STA);
     DEBUG_PRINTF("link_status=%d\n",link_status);
@@ -257,12 +275,19 @@ void CUDPTask::ConnectWifi(const char* ssid, const char* wpakey) {
       DEBUG_PRINTF("Gateway: %s\n", ip4addr_ntoa(netif_ip4_gw(&cyw43_state.netif[CYW43_ITF_STA])));      
       DEBUG_PRINTF("Netmask: %s\n", ip4addr_ntoa(netif_ip4_netmask(&cyw43_state.netif[CYW43_ITF_STA])));      
       DEBUG_PRINTF("DNS Server: %s\n", ip4addr_ntoa(dns_getserver(0)));
-           
+      
+      WifiSession_SetConnected(ssid,wpakey);
       return;  //success
     } else {
       DEBUG_PRINTF("wifi_connect errorcode = %d\n",errorcode);
     }
     
+    //The access point may have moved. Scan at next attempt.
+    if (useCachedAP) {
+      WifiSession_ForgetAP();
+      useCachedAP = false;
+    }
+    
     //Delay between retries varies. 
     if (attempt ==0) delay = 1000;
     else delay = 15000;
@@ -399,13 +424,27 @@ void CUDPTask::DNSLookup(const char* hostname,const uint32_t timeout) {
   TRACE_PRINTF("CUDPTask::DNSLooup(): hostname = %s\n",hostname);
   this->dnsCallbackInvoked = false;
   this->dns_result_ipaddr = IPADDR4_INIT(0); 
+  this->dnsHostname = hostname;
+  this->dnsCacheResult = DNSCACHE_NOTUSED;
 
+  //Check DNS Cache. An IP address string is not cached.
   ip_addr_t ipaddr;
+  const bool isIpAddr = ipaddr_aton(hostname, &ipaddr);
+  if (!isIpAddr) {
+    if (DNSCache_Lookup(hostname, &ipaddr)) {
+      this->dnsCacheResult = DNSCACHE_HIT;
+      this->EvtDNSResult(DNSERR_NONE,&ipaddr);
+      return;
+    }
+    this->dnsCacheResult = DNSCACHE_MISS;
+  }
+
   cyw43_arch_lwip_begin();
   int err = dns_gethostbyname(hostname, &ipaddr, dns_callback, this);
   cyw43_arch_lwip_end();
   if (err == ERR_OK) {  //dns_gethostbyname() returns IP address immediately
     DEBUG_PRINTF("dns_gethostbyname() returns ERR_OK. resolved IP Address=%s\n",ipaddr_ntoa(&ipaddr));
+    if (!isIpAddr) DNSCache_Add(hostname, &ipaddr);
     this->EvtDNSResult(DNSERR_NONE,&ipaddr);
     return;
   }
@@ -427,6 +466,15 @@ void CUDPTask::DNSLookup(const char* hostname,const uint32_t timeout) {
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+// Remove the server hostname from DNS Cache
+// Called when the server does not respond. The IP address may be outdated.
+//
+void CUDPTask::ForgetServerAddr() {
+  if (dnsHostname && dnsCacheResult!=DNSCACHE_NOTUSED) DNSCache_Remove(dnsHostname);
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Send UDP Packet
 //
@@ -443,9 +491,10 @@ void CUDPTask::SendUDP(const uint8_t *payload,const uint16_t payloadlen, const u
 /////////////////////////////////////////////////////////////////////////////
 // UDP Received callback function
 //
-// UDP Payload is copied to rxbuffer
-// remote IP address and port is copied to rxremoteipaddr and rxremoteport
-// udpCallbackInvoked is set to true
+// The pbuf is added to rxqueue without copying the payload. 
+// It is freed after EvtUDPReceived() returns.
+// Several packets may be received in one cyw43_arch_poll(). If rxqueue 
+// is full, the packet is dropped.
 //
 void udp_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pbuf, const ip_addr_t *remote_addr, u16_t remote_port) {
   TRACE_PRINTF("udp_callback invoked\n");
@@ -454,16 +503,15 @@ void udp_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pbuf, const ip_ad
   //make sure the callback is for this object
   //see note at dns_callback()
   if (CUDPTask::GetRunningObject()==pTask && pTask!=NULL) {
-    if (pbuf->tot_len <= UDP_BUFFERSIZE) {
-      //Copy recevied data to CUDPTask object
-      pTask->udpCallbackInvoked=true;
-      pTask->rxdatalen = pbuf->tot_len;
-      pbuf_copy_partial(pbuf,pTask->rxbuffer,pbuf->tot_len,0);
-      pTask->rxremoteipaddr=*remote_addr;
-      pTask->rxremoteport=remote_port;
-    } else {
-      assert(0);
-    }
+    if (pbuf->tot_len <= UDP_BUFFERSIZE && pTask->rxqueueCount<UDP_RXQUEUE_LEN) {
+      const uint32_t tail = (pTask->rxqueueHead+pTask->rxqueueCount)%UDP_RXQUEUE_LEN;
+      pTask->rxqueue[tail].pbuf = pbuf;
+      pTask->rxqueue[tail].remote_addr = *remote_addr;
+      pTask->rxqueue[tail].remote_port = remote_port;
+      ++pTask->rxqueueCount;
+      return;   //pbuf is owned by rxqueue
+    } 
+    WARN_PRINTF("udp_callback() Packet dropped. len=%d\n",pbuf->tot_len);
   } else {
     WARN_PRINTF("udp_callback() arg NOT POINTING to current UDPTask object. Ignore it!\n");
   }
@@ -471,6 +519,96 @@ void udp_callback(void *arg, struct udp_pcb *pcb, struct pbuf *pbuf, const ip_ad
   if (pbuf) pbuf_free(pbuf);
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// Build a view of the first packet in rxqueue and pass it to 
+// EvtUDPReceived(). Then, free the pbuf even if an exception is thrown.
+//
+void CUDPTask::DispatchUDP() {
+  struct pbuf *pbuf = rxqueue[rxqueueHead].pbuf;
+  const ip_addr_t remote_addr = rxqueue[rxqueueHead].remote_addr;
+  const uint16_t remote_port = rxqueue[rxqueueHead].remote_port;
+  if (++rxqueueHead==UDP_RXQUEUE_LEN) rxqueueHead = 0;
+  --rxqueueCount;
+  
+  udp_view_t view;
+  view.pbuf = pbuf;
+  view.len = pbuf->tot_len;
+  view.payload = (pbuf->len==pbuf->tot_len) ? (const uint8_t*)pbuf->payload : NULL;
+  view.segCount = 0;
+  for(const struct pbuf *p=pbuf; p!=NULL && p->len!=0; p=p->next) {
+    if (view.segCount==UDP_MAX_SEGMENTS) {
+      view.segCount = 0;   //Too many segments. Use Linearize() or CopyFromView()
+      break;
+    }
+    view.seg[view.segCount].data = (const uint8_t*)p->payload;
+    view.seg[view.segCount].len = p->len;
+    ++view.segCount;
+  }
+  
+  try {
+    EvtUDPReceived(view,remote_addr,remote_port);
+  } catch(...) {
+    cyw43_arch_lwip_begin();
+    pbuf_free(pbuf);
+    cyw43_arch_lwip_end();
+    throw;
+  }
+  cyw43_arch_lwip_begin();
+  pbuf_free(pbuf);
+  cyw43_arch_lwip_end();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Free the pbufs which are not dispatched
+//
+void CUDPTask::FreeRxQueue() {
+  cyw43_arch_lwip_begin();
+  while (rxqueueCount!=0) {
+    pbuf_free(rxqueue[rxqueueHead].pbuf);
+    if (++rxqueueHead==UDP_RXQUEUE_LEN) rxqueueHead = 0;
+    --rxqueueCount;
+  }
+  cyw43_arch_lwip_end();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Get the payload of a received packet as a contiguous buffer
+//
+// If the packet is in one segment, the pointer to pbuf is returned. 
+// Otherwise, the payload is copied to rxbuffer.
+//
+// Input: view - View of the packet
+//
+// Output: const uint8_t* - Pointer to the payload. 
+//                          Valid until EvtUDPReceived() returns.
+//
+const uint8_t* CUDPTask::Linearize(const udp_view_t& view) {
+  if (view.payload) return view.payload;
+  pbuf_copy_partial(view.pbuf,rxbuffer,view.len,0);
+  return rxbuffer;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Copy part of the payload of a received packet
+// The segments of the packet are copied directly to dest.
+//
+// Input: view   - View of the packet
+//        dest   - Destination buffer
+//        len    - Number of bytes to be copied
+//        offset - Offset in payload
+//
+// Output: uint16_t - Number of bytes copied
+//
+uint16_t CUDPTask::CopyFromView(const udp_view_t& view,void *dest,const uint16_t len,const uint16_t offset) {
+  if (view.payload) {
+    if (offset>=view.len) return 0;
+    const uint16_t n = MIN(len,view.len-offset);
+    memcpy(dest,view.payload+offset,n);
+    return n;
+  }
+  return pbuf_copy_partial(view.pbuf,dest,len,offset);
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -538,11 +676,15 @@ void CUDPTask::EvtDNSResult(const int dns_error, const ip_addr_t *ipaddr){
 ////////////////////////////////////////////////////////////////////
 // UDP Received Handler
 //
+// The view points to the pbuf of lwIP. It is valid until the handler
+// returns. Use Linearize() or CopyFromView() to access the payload
+// if view.payload is NULL.
+//
 // Default Behaviour:
 //    Nothing (Debug Message Only)
 //
-void CUDPTask::EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port) {
-  TRACE_PRINTF("EvtUDPReceived() Remote IP=%s port=%d len=%d\n",ipaddr_ntoa(&remote_addr),remote_port,payloadlen);
+void CUDPTask::EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port) {
+  TRACE_PRINTF("EvtUDPReceived() Remote IP=%s port=%d len=%d\n",ipaddr_ntoa(&remote_addr),remote_port,view.len);
 }
 
 ////////////////////////////////////////////////////////////////////
@@ -593,3 +735,19 @@ void CUDPTask::EvtWatchdogTimeout() {
   TRACE_PRINTF("EvtWatchdogTimeout()\n");
 }
 
+////////////////////////////////////////////////////////////////////
+// This event handler is called once per pass of the event loop
+// after all other events are handled. Do a small piece of
+// background work only so that the network is polled in time.
+//
+// return true if there is more work to do. The event loop does not
+//        wait for network events in this case.
+//        false to wait for next event
+//
+// Default Behaviour:
+//    Nothing
+//
+bool CUDPTask::EvtIdle() {
+  return false;
+}
+
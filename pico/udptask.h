@@ -4,9 +4,12 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "debug.h"
+#include "dnscache.h"
 
 #define DEFAULT_DNSTIMEOUT 5000       //DNS timeout in msec
 #define UDP_BUFFERSIZE 1500           //UDP Packet Buffer Size
+#define UDP_RXQUEUE_LEN 8             //Max number of received packets waiting for EvtUDPReceived()
+#define UDP_MAX_SEGMENTS 4            //Max number of segments in scatter list of udp_view_t
 #define HEARTBEAT_PERIOD   50         //Execute event loop every HEARTBEAT_PERIOD in msec
 #define WATCHDOG_TIMEOUT   (15*1000)  //Watchdog Timer timeout in msec
 
@@ -22,6 +25,25 @@ enum {
 };
 
 
+//
+//View of a received UDP packet
+//It points to the pbuf of lwIP. No data is copied. The view is valid
+//until EvtUDPReceived() returns. Then, the pbuf is freed.
+//
+typedef struct {
+  const uint8_t* data;
+  uint16_t len;
+} udp_segment_t;
+
+typedef struct {
+  const struct pbuf* pbuf;
+  const uint8_t* payload;   //Whole payload if it is in one segment. Otherwise, NULL
+  uint16_t len;             //Total length of payload
+  uint32_t segCount;        //Number of segments in seg[]. 0 if there are more than UDP_MAX_SEGMENTS
+  udp_segment_t seg[UDP_MAX_SEGMENTS];  //Scatter list
+} udp_view_t;
+
+
 class CUDPTask {
   public:
     //Constant
@@ -47,7 +69,7 @@ class CUDPTask {
 
     //Public Methods
     CUDPTask();
-    ~CUDPTask();
+    virtual ~CUDPTask();
     virtual void Run(const char* ssid, const char* wpakey);
 
     //Getter methods
@@ -75,7 +97,10 @@ class CUDPTask {
     // DNS
     //
     void DNSLookup(const char* hostname,const uint32_t timeout=DEFAULT_DNSTIMEOUT);
+    void ForgetServerAddr();
     absolute_time_t dnsTimeout;
+    const char* dnsHostname;          //Hostname of last DNSLookup()
+    dnscache_result_t dnsCacheResult; //Result of DNS Cache of last DNSLookup()
     ip_addr_t server_addr;  //Sever IP Address
     bool serverIpResolved;  //To indicate Server IP Addr is resolved
     //To recevie result from DNS Callback
@@ -89,12 +114,21 @@ class CUDPTask {
     //
     void SendUDP(const uint8_t *payload,const uint16_t len, const uint16_t port);
     struct udp_pcb *pcb;
-    //To receive result from UDP Callback
-    bool udpCallbackInvoked;    
-    uint8_t *rxbuffer;
-    uint16_t rxdatalen;
-    ip_addr_t rxremoteipaddr;
-    uint16_t  rxremoteport;
+    //Received packets from UDP Callback. The pbufs are owned by the queue
+    struct {
+      struct pbuf *pbuf;
+      ip_addr_t remote_addr;
+      uint16_t remote_port;
+    } rxqueue[UDP_RXQUEUE_LEN];
+    uint32_t rxqueueHead;     //Next packet to be dispatched
+    uint32_t rxqueueCount;
+    void DispatchUDP();
+    void FreeRxQueue();
+    
+    //Helpers for EvtUDPReceived()
+    const uint8_t* Linearize(const udp_view_t& view);
+    static uint16_t CopyFromView(const udp_view_t& view,void *dest,const uint16_t len,const uint16_t offset);
+    uint8_t *rxbuffer;      //Used by Linearize() if the packet is in more than one segment
 
 
     //
@@ -114,12 +148,13 @@ class CUDPTask {
     //Event Handlers
     virtual void EvtStart();
     virtual void EvtDNSResult(const int dnserr, const ip_addr_t *ipaddr);
-    virtual void EvtUDPReceived(const uint8_t* payload,uint16_t payloadlen,ip_addr_t remote_addr,uint16_t remote_port);
+    virtual void EvtUDPReceived(const udp_view_t& view,ip_addr_t remote_addr,uint16_t remote_port);
     virtual void EvtTimeout(uint32_t arg);
     virtual void EvtConnectionLost();
     virtual bool EvtAbortRequested();
     virtual void EvtAborted();
     virtual void EvtWatchdogTimeout();
+    virtual bool EvtIdle();
     
 private:
       //
@@ -0,0 +1,115 @@
+#include <string.h>
+#include "pico/unique_id.h"
+#include "tusb.h"
+#include "defines.h"
+
+//
+// USB Descriptors of the composite device
+// Interface 0,1: CDC (User Terminal)
+// Interface 2  : MSC (Flash units and RAM disk)
+//
+
+#define USBD_VID          0x2E8A  //Raspberry Pi
+#define USBD_PID          0x000A  //Raspberry Pi Pico SDK CDC
+#define USBD_BCD_DEVICE   0x0200  //Changed from stdio_usb so the host does not reuse cached descriptors
+
+enum {
+  ITF_NUM_CDC = 0,
+  ITF_NUM_CDC_DATA,
+  ITF_NUM_MSC,
+  ITF_NUM_TOTAL
+};
+
+#define EPNUM_CDC_NOTIF   0x81
+#define EPNUM_CDC_OUT     0x02
+#define EPNUM_CDC_IN      0x82
+#define EPNUM_MSC_OUT     0x03
+#define EPNUM_MSC_IN      0x83
+
+#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_MSC_DESC_LEN)
+
+enum {
+  STRID_LANGID = 0,
+  STRID_MANUFACTURER,
+  STRID_PRODUCT,
+  STRID_SERIAL,
+  STRID_CDC,
+  STRID_MSC
+};
+
+
+static const tusb_desc_device_t deviceDescriptor = {
+  .bLength            = sizeof(tusb_desc_device_t),
+  .bDescriptorType    = TUSB_DESC_DEVICE,
+  .bcdUSB             = 0x0200,
+
+  //Interface Association Descriptor is used for CDC
+  .bDeviceClass       = TUSB_CLASS_MISC,
+  .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+  .bDeviceProtocol    = MISC_PROTOCOL_IAD,
+  .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+
+  .idVendor           = USBD_VID,
+  .idProduct          = USBD_PID,
+  .bcdDevice          = USBD_BCD_DEVICE,
+
+  .iManufacturer      = STRID_MANUFACTURER,
+  .iProduct           = STRID_PRODUCT,
+  .iSerialNumber      = STRID_SERIAL,
+
+  .bNumConfigurations = 1
+};
+
+static const uint8_t configDescriptor[] = {
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 100),
+  TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRID_CDC, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT, EPNUM_CDC_IN, 64),
+  TUD_MSC_DESCRIPTOR(ITF_NUM_MSC, STRID_MSC, EPNUM_MSC_OUT, EPNUM_MSC_IN, 64)
+};
+
+static const char* strings[] = {
+  NULL,                 //Language ID
+  "MegaFlash",          //Manufacturer
+  "MegaFlash " FIRMWAREVERSTR,
+  NULL,                 //Serial Number: Unique ID of the flash
+  "MegaFlash Terminal",
+  "MegaFlash Drives"
+};
+
+
+const uint8_t* tud_descriptor_device_cb(void) {
+  return (const uint8_t*)&deviceDescriptor;
+}
+
+const uint8_t* tud_descriptor_configuration_cb(uint8_t index) {
+  (void)index;
+  return configDescriptor;
+}
+
+const uint16_t* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
+  static uint16_t descString[32+1];
+  char serial[2*PICO_UNIQUE_BOARD_ID_SIZE_BYTES+1];
+  const char* str;
+  uint len;
+  (void)langid;
+
+  if (index==STRID_LANGID) {
+    descString[1] = 0x0409;   //English
+    len = 1;
+  } else {
+    if (index>=count_of(strings)) return NULL;
+    if (index==STRID_SERIAL) {
+      pico_get_unique_board_id_string(serial,sizeof(serial));
+      str = serial;
+    } else {
+      str = strings[index];
+    }
+
+    //Convert ASCII to UTF-16
+    len = MIN(strlen(str),32);
+    for(uint i=0;i<len;++i) descString[1+i] = str[i];
+  }
+
+  //First word: length in bytes and descriptor type
+  descString[0] = (uint16_t)((TUSB_DESC_STRING<<8) | (2*len+2));
+  return descString;
+}
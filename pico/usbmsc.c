@@ -0,0 +1,212 @@
+#include <string.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "tusb.h"
+#include "defines.h"
+#include "debug.h"
+#include "mediaaccess.h"
+#include "flashunitmapper.h"
+#include "romdisk.h"
+#include "ramdisk.h"
+#include "flash.h"
+#include "usbmsc.h"
+
+/****************************************************************************************
+USB Mass Storage
+
+The Pico enumerates as a composite device: the CDC serial port of the User Terminal and
+a Mass Storage device. Each enabled flash unit and the RAM disk is a LUN. The host sees
+the raw ProDOS image of the unit. 512-byte SCSI blocks are ProDOS blocks.
+
+tud_task() is not called from an interrupt. USBTask() calls it on core 0 from the main
+loops and while waiting for serial input. So, the MSC callbacks below can call
+ReadBlock() and WriteBlock() which may wait for the Device Lock.
+
+Coherency with the Apple:
+- Apple connected: The units are read-only to the host. The Apple owns them. The host
+  may see stale data if the Apple writes to a unit. Eject and mount again to refresh.
+- Apple not connected (User Terminal): The host has exclusive access. The units report
+  not ready while a XMODEM transfer or an erase is running on the terminal.
+
+Write Cache:
+WriteBlock() of a flash block goes through the sector cache in flash.c. The blocks of a
+sector written close together in time are merged in RAM and the sector is erased once.
+Only the blocks written by the host are changed. The dirty sectors are written back when
+the flash is idle, and immediately on SYNCHRONIZE CACHE, STOP UNIT and eject.
+*****************************************************************************************/
+
+static bool writable;             //false if the Apple is connected
+static volatile bool mediaBusy;   //Units are being accessed by User Terminal
+
+
+////////////////////////////////////////////////////////////////////
+// Init USB Mass Storage and TinyUSB device stack
+// Call it before stdio_usb_init()
+//
+// Input: appleConnected - true if MegaFlash is connected to Apple
+//
+void InitUSBMSC(const bool appleConnected) {
+  writable = !appleConnected;
+  mediaBusy = false;
+  tusb_init();
+}
+
+////////////////////////////////////////////////////////////////////
+// Service TinyUSB device stack
+// This function should be called periodically by core 0.
+//
+void USBTask() {
+  if (!tusb_inited()) return;   //USBMSC_WITH_APPLE is 0
+  tud_task();
+}
+
+////////////////////////////////////////////////////////////////////
+// Block access from the host while User Terminal accesses the units
+//
+// Input: busy - true to report the units not ready
+//
+void USBMSC_SetMediaBusy(const bool busy) {
+  if (busy) tsFlushSectorCache();
+  mediaBusy = busy;
+}
+
+////////////////////////////////////////////////////////////////////
+// Map LUN to Smartport unit number
+// LUN 0 to N-1 are enabled flash units. LUN N is RAM disk.
+//
+// Input: lun        - Logical Unit Number
+//        unitNumOut - Pointer to receive Smartport unit number
+//        isFlashOut - Pointer to receive true if it is a flash unit. Can be NULL.
+//
+// Output: false if there is no such LUN
+//
+static bool LunToUnit(const uint8_t lun, uint* unitNumOut, bool* isFlashOut) {
+  const uint flashCount = GetUnitCountFlashEnabled();
+  const uint flashFirst = GetRomdiskFirst()?GetUnitCountRomdisk()+1:1;
+
+  if (lun<flashCount) {
+    *unitNumOut = flashFirst+lun;
+    if (isFlashOut) *isFlashOut = true;
+    return true;
+  }
+  if (lun==flashCount && GetUnitCountRamdisk()!=0) {
+    *unitNumOut = GetRamdiskUnitNum();
+    if (isFlashOut) *isFlashOut = false;
+    return true;
+  }
+  return false;
+}
+
+//--------------------------------------------------------------------
+// TinyUSB MSC Callbacks
+//--------------------------------------------------------------------
+
+uint8_t tud_msc_get_maxlun_cb(void) {
+  uint count = GetUnitCountFlashEnabled()+(GetUnitCountRamdisk()!=0?1:0);
+  if (count==0) count = 1;  //At least one LUN. It is not ready.
+  return MIN(count,USBMSC_MAXLUN);
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
+  char product[17];
+  uint unitNum;
+  bool isFlash;
+  if (!LunToUnit(lun,&unitNum,&isFlash)) strcpy(product,"No Unit");
+  else if (isFlash) snprintf(product,sizeof(product),"Flash Unit %u",(uint)MapFlashUnitNum(lun+1));
+  else strcpy(product,"RAM Disk");
+
+  //Fields are padded with spaces
+  memset(vendor_id,' ',8);
+  memset(product_id,' ',16);
+  memcpy(vendor_id,"MegaFlsh",8);
+  memcpy(product_id,product,strlen(product));
+  memcpy(product_rev,FIRMWAREVERSTR,MIN(4,strlen(FIRMWAREVERSTR)));
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun) {
+  uint unitNum;
+  if (mediaBusy) {
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);  //Becoming ready
+    return false;
+  }
+  if (!LunToUnit(lun,&unitNum,NULL)) {
+    tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3a, 0x00);  //Medium not present
+    return false;
+  }
+  return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size) {
+  uint unitNum;
+  *block_size = BLOCKSIZE;
+  *block_count = LunToUnit(lun,&unitNum,NULL)?GetBlockCount(unitNum):0;
+}
+
+bool tud_msc_is_writable_cb(uint8_t lun) {
+  (void)lun;
+  return writable;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
+  (void)lun;
+  (void)power_condition;
+  (void)load_eject;
+  if (!start) tsFlushSectorCache();  //Stop or Eject
+  return true;
+}
+
+//lba is adjusted by TinyUSB for the bytes already transferred.
+//offset is always 0 because the buffer size is a multiple of BLOCKSIZE.
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
+  uint unitNum;
+  (void)offset;
+  if (!tud_msc_test_unit_ready_cb(lun)) return -1;
+  LunToUnit(lun,&unitNum,NULL);
+
+  uint8_t* dest = (uint8_t*)buffer;
+  for(uint32_t n=bufsize/BLOCKSIZE;n!=0;--n) {
+    if (ReadBlock(unitNum,lba,dest,NULL)!=MFERR_NONE) {
+      tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);  //Unrecovered read error
+      return -1;
+    }
+    ++lba;
+    dest += BLOCKSIZE;
+  }
+  return (int32_t)bufsize;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
+  uint unitNum;
+  (void)offset;
+  if (!writable) {
+    tud_msc_set_sense(lun, SCSI_SENSE_DATA_PROTECT, 0x27, 0x00);  //Write protected
+    return -1;
+  }
+  if (!tud_msc_test_unit_ready_cb(lun)) return -1;
+  LunToUnit(lun,&unitNum,NULL);
+
+  for(uint32_t n=bufsize/BLOCKSIZE;n!=0;--n) {
+    if (WriteBlock(unitNum,lba,buffer,NULL)!=MFERR_NONE) {
+      tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x03, 0x00);  //Write fault
+      return -1;
+    }
+    ++lba;
+    buffer += BLOCKSIZE;
+  }
+  return (int32_t)bufsize;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize) {
+  (void)buffer;
+  (void)bufsize;
+  switch(scsi_cmd[0]) {
+    case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
+      return 0;
+    case 0x35:  //SYNCHRONIZE CACHE (10)
+      tsFlushSectorCache();
+      return 0;
+    default:
+      tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);  //Invalid command
+      return -1;
+  }
+}
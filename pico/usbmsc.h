@@ -0,0 +1,24 @@
+#ifndef _USBMSC_H
+#define _USBMSC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Enumerate USB Mass Storage when the Apple is connected.
+//The units are read-only to the host in this case.
+#define USBMSC_WITH_APPLE     1
+
+#define USBMSC_MAXLUN         9     //8 flash units + RAM disk
+
+void InitUSBMSC(const bool appleConnected);
+void USBTask();
+void USBMSC_SetMediaBusy(const bool busy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,12 +2,24 @@
 #include "pico/stdio/driver.h"
 #include "hardware/timer.h"
 #include "usbserial.h"
+#include "usbmsc.h"
+#include "flash.h"
 
 //
 // Routines to access USB serial port for file transfer and
 // basic user interface
 //
 
+/////////////////////////////////////////////////////////////////
+//Read bytes from USB serial port
+//TinyUSB is not serviced by interrupt. So, run USBTask() before
+//reading the port.
+//
+static inline int usb_in_chars(char* buf,const int len) {
+  USBTask();
+  return stdio_usb.in_chars(buf,len);
+}
+
 /////////////////////////////////////////////////////////////////
 //Send single byte to host
 //
@@ -41,7 +53,7 @@ int usb_getchar_timeout_us(const uint32_t timeout_us){
   
   start = time_us_32();
   do {
-    int count=stdio_usb.in_chars(&ch,1);
+    int count=usb_in_chars(&ch,1);
     if (count>0) return ch;
     
     elapsed = time_us_32() - start;
@@ -82,8 +94,11 @@ again:
 int usb_getkey() {
   int key;
   
+  //Blocks written by USB Mass Storage are cached while
+  //User Terminal waits for a key
   do {
     key = usb_getkey_timeout_us(1000);
+    FlushSectorCacheIfIdle();
   }while(key==-1);
   
   return key;
@@ -107,7 +122,7 @@ uint32_t usb_getraw_timeout(char *buf,const uint32_t len,const uint32_t timeout_
   start = time_us_32();
   
   do {
-    int count = stdio_usb.in_chars(buf+receivedCount, len-receivedCount);
+    int count = usb_in_chars(buf+receivedCount, len-receivedCount);
     if (count>0) receivedCount += count;
     
     elapsed = time_us_32() - start;
@@ -185,7 +200,7 @@ void usb_discard() {
   char buf[256];
   int count;
   do {
-    count = stdio_usb.in_chars(buf,256);
+    count = usb_in_chars(buf,256);
   }while (count>0);
 }
 
@@ -200,7 +215,7 @@ void usb_discard_duration_us(const uint32_t duration_us){
   
   start = time_us_32();
   do {
-    stdio_usb.in_chars(buf,256);
+    usb_in_chars(buf,256);
     elapsed = time_us_32() - start;
   }while (elapsed<duration_us);
 }
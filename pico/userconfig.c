@@ -104,6 +104,8 @@ static void InitAdvancedSettings() {
   pConfig->tftp_serverport = TFTP_SERVERPORT_DEFAULT;
   pConfig->tftp_timeout = TFTP_TIMEOUT_DEFAULT;
   pConfig->tftp_enable1kblock = TFTP_ENABLE1KBLOCK_DEFAULT;
+  pConfig->tftp_windowsize = TFTP_WINDOWSIZE_DEFAULT;
+  pConfig->trim_enable = false;
   pConfig->tftp_lastserver[0]='\0';
   pConfig->ntpserver_override[0] ='\0';
 }
@@ -160,6 +162,10 @@ void LoadAllConfigs() {
     InitAdvancedSettings();    
   } else {
     settingsNotInFlash = false;
+    
+    //tftp_windowsize is added after V1.1.5. It is 0 in old config.
+    //Upgrade it in memory only.
+    if (pConfig->tftp_windowsize==0) pConfig->tftp_windowsize = TFTP_WINDOWSIZE_DEFAULT;
   }  
 }
 
@@ -452,6 +458,44 @@ void SaveTFTPEnable1kBlockSize(const bool enable) {
   EncryptWriteConfigToFlash();
 }
 
+/////////////////////////////////////////////////////
+// Get TFTP Window Size
+//
+// Output: uint8_t - TFTP windowsize
+// 
+uint8_t GetTFTPWindowSize() {
+  return pConfig->tftp_windowsize;
+}
+ 
+/////////////////////////////////////////////////////
+// Save TFTP Window Size
+//
+// Input: windowsize - TFTP windowsize
+//
+void SaveTFTPWindowSize(const uint8_t windowsize) {
+  pConfig->tftp_windowsize = windowsize;
+  EncryptWriteConfigToFlash();
+}
+
+/////////////////////////////////////////////////////
+// Get Background TRIM setting
+//
+// Output: bool - TRIM is enabled
+// 
+bool GetTrimEnabled() {
+  return pConfig->trim_enable!=0;
+}
+ 
+/////////////////////////////////////////////////////
+// Save Background TRIM setting
+//
+// Input: enable - Enable TRIM
+//
+void SaveTrimEnabled(const bool enable) {
+  pConfig->trim_enable = enable;
+  EncryptWriteConfigToFlash();
+}
+
 /////////////////////////////////////////////////////
 // Get TFTP Last Server Hostname/IPAddr
 //
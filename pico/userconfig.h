@@ -62,6 +62,9 @@ typedef struct {
   //User Settings (V2) (UserSettings_t version=2)
   uint8_t user2_fd_enableflags;     //Enable Flags of each individual flash drive
   
+  //Advanced Settings (V2)
+  uint8_t tftp_windowsize;    //TFTP windowsize. 0 in old config, set to default when loaded
+  uint8_t trim_enable;        //Background TRIM of flash units. 0 (disabled) in old config
   
 } Config_t;
 
@@ -91,6 +94,10 @@ uint8_t GetTFTPMaxAttempt();
 void SaveTFTPMaxAttempt(const uint8_t maxattempt);
 bool GetTFTPEnable1kBlockSize();
 void SaveTFTPEnable1kBlockSize(const bool enable);
+uint8_t GetTFTPWindowSize();
+void SaveTFTPWindowSize(const uint8_t windowsize);
+bool GetTrimEnabled();
+void SaveTrimEnabled(const bool enable);
 const char* GetTFTPLastServer();
 void SaveTFTPLastServer(const char* hostname);
 const char* GetNTPServerOverride();
@@ -1,14 +1,35 @@
 /**
  * Uthernet II (W5100) emulation at C0x4–C0x7 (slot 4: $C0C4–$C0C7).
  * W5100 register and memory state; C0x interface; network stack and RX path.
+ *
+ * The emulation is split between the two cores:
+ * - Core 1 (BusLoop) runs U2_HandleBusAccess(). It only reads and writes
+ *   u2_memory. A write to Sn_CR posts the command to a single-producer/
+ *   single-consumer queue and wakes up core 0. Sn_CR reads back non-zero
+ *   until core 0 has executed the command, like a real W5100. If the queue
+ *   is full, the command is deferred and posted again at the next bus access.
+ * - Core 0 runs U2_Poll(). It executes the queued commands and owns lwIP
+ *   and uthernet2_net.c. Received data is copied into the RX ring and
+ *   published by updating sn_rx_wr after the data.
+ * The free space of the RX ring is computed from Sn_RX_RD captured at the
+ * last RECV command, so core 0 never sees a half-written Sn_RX_RD.
+ * A software reset is split as well. Core 1 resets the registers and posts
+ * the reset to core 0. Core 0 closes the sockets and then resets the buffers
+ * and the socket state used by the RX path. MR reads back RST until then.
  */
 #include "uthernet2.h"
 #include "uthernet2_net.h"
 #include "w5100_regs.h"
+#include "hardware/sync.h"
+#include "pico/multicore.h"
+#include "ipc.h"
 #include <string.h>
 
 #define READFLAG  (1u << 4)
 
+#define U2_TX_MAX_PACKET  2048  /* max bytes sent by one SEND command */
+#define U2_TX_MAX_FRAME   1518  /* max MACRAW frame */
+
 static uint8_t  u2_memory[W5100_MEM_SIZE];
 static uint8_t  u2_mode_register;
 static uint16_t u2_data_address;
@@ -19,11 +40,53 @@ typedef struct {
   uint16_t receive_base;
   uint16_t receive_size;
   uint16_t register_address;
-  uint16_t sn_rx_wr;  /* next write offset in RX buffer (0..receive_size-1) */
+  volatile uint16_t sn_rx_wr;  /* next write offset in RX buffer (0..receive_size-1), written by core 0 */
+  uint16_t rx_rd;              /* Sn_RX_RD at the last RECV command, core 0 only */
+  uint16_t rx_pending_wr;      /* write offset of the packet being received, core 0 only */
 } u2_socket_t;
 
 static u2_socket_t u2_sockets[W5100_NUM_SOCKETS];
 
+/* Socket command queue: core 1 (producer) -> core 0 (consumer) */
+#define U2_CMDQ_SIZE   8          /* power of 2 */
+#define U2_CMD_RESET   0xFF       /* socket number of W5100 software reset */
+
+typedef struct {
+  uint8_t socket;
+  uint8_t command;
+} u2_cmd_t;
+
+static u2_cmd_t u2_cmdq[U2_CMDQ_SIZE];
+static volatile uint32_t u2_cmdq_head;  /* written by core 1 only */
+static volatile uint32_t u2_cmdq_tail;  /* written by core 0 only */
+
+/* Size of the common register block and of a socket register block */
+#define U2_REG_BLOCK_SIZE 0x30
+
+/* Software reset posted by core 1 and not yet executed by core 0 */
+static volatile bool u2_reset_pending;
+
+/* Commands not posted because the queue was full, core 1 only.
+ * Bit n: Sn_CR of socket n. The command is the value in Sn_CR. */
+#define U2_DEFER_RESET 0x80       /* software reset */
+static uint8_t u2_cmd_deferred;
+
+/* Message to wake up core 0 */
+static struct IpcMsg u2_wakeup_msg = {IPCCMD_U2, 0};
+
+/* Post a command to core 0. Returns false if the queue is full. */
+static bool u2_post_command(uint8_t socket, uint8_t command) {
+  uint32_t head = u2_cmdq_head;
+  if (head - u2_cmdq_tail >= U2_CMDQ_SIZE) return false;
+  u2_cmdq[head & (U2_CMDQ_SIZE - 1)].socket = socket;
+  u2_cmdq[head & (U2_CMDQ_SIZE - 1)].command = command;
+  __dmb();  /* entry and socket registers before head */
+  u2_cmdq_head = head + 1;
+  /* If fifo is full, core 0 finds the command at next poll */
+  if (multicore_fifo_wready()) multicore_fifo_push_blocking((uint32_t)(uintptr_t)&u2_wakeup_msg);
+  return true;
+}
+
 static inline uint8_t get_byte(uint16_t val, unsigned shift) {
   return (uint8_t)((val >> shift) & 0xFF);
 }
@@ -32,26 +95,53 @@ static uint16_t read_net16(const uint8_t *p) {
   return (uint16_t)p[0] << 8 | p[1];
 }
 
-static void u2_reset(void) {
-  memset(u2_memory, 0, sizeof(u2_memory));
-  u2_mode_register = 0;
-  for (int i = 0; i < W5100_NUM_SOCKETS; i++)
-    U2_Net_Close(i);
-  /* data_address is NOT reset on soft reset (Uthernet II doc) */
+/* Socket buffer bases and sizes from TMSR */
+static void apply_tx_sizes(uint8_t value) {
+  uint16_t base = W5100_TX_BASE;
+  const uint16_t end = W5100_RX_BASE;
+  uint8_t val = value;
   for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
-    u2_sockets[i].transmit_base = 0;
-    u2_sockets[i].transmit_size = 0;
-    u2_sockets[i].receive_base = 0;
-    u2_sockets[i].receive_size = 0;
-    u2_sockets[i].register_address = (uint16_t)(W5100_S0_BASE + (i << 8));
-    u2_sockets[i].sn_rx_wr = 0;
+    u2_sockets[i].transmit_base = base;
+    uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
+    val >>= 2;
+    base += size;
+    if (base > end) base = end;
+    u2_sockets[i].transmit_size = base - u2_sockets[i].transmit_base;
   }
+}
+
+/* Socket buffer bases and sizes from RMSR */
+static void apply_rx_sizes(uint8_t value) {
+  uint16_t base = W5100_RX_BASE;
+  const uint16_t end = W5100_MEM_SIZE;
+  uint8_t val = value;
+  for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
+    u2_sockets[i].receive_base = base;
+    uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
+    val >>= 2;
+    base += size;
+    if (base > end) base = end;
+    u2_sockets[i].receive_size = base - u2_sockets[i].receive_base;
+  }
+}
+
+/* Reset the registers seen by the 6502. Only the register blocks are
+ * cleared, so it is short enough for core 1. The buffers are reset by
+ * exec_reset() on core 0. */
+static void u2_reset_registers(void) {
+  u2_mode_register = 0;
+  /* data_address is NOT reset on soft reset (Uthernet II doc) */
+  memset(u2_memory, 0, U2_REG_BLOCK_SIZE);
   u2_memory[W5100_RTR0] = 0x07;
   u2_memory[W5100_RTR1] = 0xD0;
   u2_memory[W5100_RCR]  = 0x08;
   u2_memory[W5100_PTIMER] = 0x28;
+  /* default buffer sizes (same as AppleWin: 0x55 = 2K per socket) */
+  u2_memory[W5100_RMSR] = 0x55;
+  u2_memory[W5100_TMSR] = 0x55;
   for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
     uint16_t ra = u2_sockets[i].register_address;
+    memset(&u2_memory[ra], 0, U2_REG_BLOCK_SIZE);
     u2_memory[ra + W5100_SN_DHAR0] = 0xFF;
     u2_memory[ra + W5100_SN_DHAR1] = 0xFF;
     u2_memory[ra + W5100_SN_DHAR2] = 0xFF;
@@ -60,66 +150,51 @@ static void u2_reset(void) {
     u2_memory[ra + W5100_SN_DHAR5] = 0xFF;
     u2_memory[ra + W5100_SN_TTL]   = 0x80;
   }
-  /* set default buffer sizes (same as AppleWin: 0x55 = 2K per socket) */
-  u2_memory[W5100_RMSR] = 0x55;
-  u2_memory[W5100_TMSR] = 0x55;
-  /* apply sizes to socket base/size */
-  {
-    uint16_t base = W5100_TX_BASE;
-    const uint16_t end = W5100_RX_BASE;
-    uint8_t val = 0x55;
-    for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
-      u2_sockets[i].transmit_base = base;
-      uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
-      val >>= 2;
-      base += size;
-      if (base > end) base = end;
-      u2_sockets[i].transmit_size = base - u2_sockets[i].transmit_base;
-    }
+}
+
+/* Software reset by the 6502. Core 1 does not touch the buffers and the
+ * socket state, because core 0 may be writing received data. They are reset
+ * by exec_reset() after core 0 has closed the sockets. */
+static void u2_soft_reset(void) {
+  u2_reset_registers();
+  u2_reset_pending = true;
+  /* Commands of the sockets are discarded with the registers */
+  u2_cmd_deferred = 0;
+  if (!u2_post_command(U2_CMD_RESET, 0)) u2_cmd_deferred = U2_DEFER_RESET;
+}
+
+/* MR as seen by the 6502. RST reads back 1 until core 0 has done the reset. */
+static uint8_t get_mode_register(void) {
+  return u2_reset_pending ? (uint8_t)(u2_mode_register | W5100_MR_RST) : u2_mode_register;
+}
+
+/* Post the deferred commands in order: reset first, then the sockets.
+ * A command stays deferred until the queue has room. */
+static void u2_post_deferred(void) {
+  if (u2_cmd_deferred & U2_DEFER_RESET) {
+    if (!u2_post_command(U2_CMD_RESET, 0)) return;
+    u2_cmd_deferred &= ~U2_DEFER_RESET;
   }
-  {
-    uint16_t base = W5100_RX_BASE;
-    const uint16_t end = W5100_MEM_SIZE;
-    uint8_t val = 0x55;
-    for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
-      u2_sockets[i].receive_base = base;
-      uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
-      val >>= 2;
-      base += size;
-      if (base > end) base = end;
-      u2_sockets[i].receive_size = base - u2_sockets[i].receive_base;
-    }
+  for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
+    if (!(u2_cmd_deferred & (1u << i))) continue;
+    uint8_t command = u2_memory[u2_sockets[i].register_address + W5100_SN_CR];
+    if (command != 0 && !u2_post_command((uint8_t)i, command)) return;
+    u2_cmd_deferred &= ~(1u << i);
   }
 }
 
+/* A write to TMSR or RMSR. While a reset is pending, core 0 may still be
+ * writing received data. The sizes are applied by exec_reset() then. */
 static void set_tx_sizes(uint16_t address, uint8_t value) {
   u2_memory[address] = value;
-  uint16_t base = W5100_TX_BASE;
-  const uint16_t end = W5100_RX_BASE;
-  uint8_t val = value;
-  for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
-    u2_sockets[i].transmit_base = base;
-    uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
-    val >>= 2;
-    base += size;
-    if (base > end) base = end;
-    u2_sockets[i].transmit_size = base - u2_sockets[i].transmit_base;
-  }
+  __dmb();  /* TMSR before u2_reset_pending, see exec_reset() */
+  if (!u2_reset_pending) apply_tx_sizes(value);
 }
 
 static void set_rx_sizes(uint16_t address, uint8_t value) {
   u2_memory[address] = value;
-  uint16_t base = W5100_RX_BASE;
-  const uint16_t end = W5100_MEM_SIZE;
-  uint8_t val = value;
-  for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
-    u2_sockets[i].receive_base = base;
-    uint16_t size = (uint16_t)(1 << (10 + (val & 3)));
-    val >>= 2;
-    base += size;
-    if (base > end) base = end;
-    u2_sockets[i].receive_size = base - u2_sockets[i].receive_base;
-  }
+  __dmb();  /* RMSR before u2_reset_pending, see exec_reset() */
+  if (!u2_reset_pending) apply_rx_sizes(value);
 }
 
 static uint16_t get_tx_data_size(int i) {
@@ -156,6 +231,17 @@ static uint8_t get_rx_rsr_byte(int i, unsigned shift) {
   return get_byte(get_rx_rsr(i), shift);
 }
 
+/* Free space of RX buffer for core 0. One byte is kept unused so that a full
+ * buffer is not seen as empty. */
+static uint16_t get_rx_free(int i) {
+  const u2_socket_t *s = &u2_sockets[i];
+  uint16_t size = s->receive_size;
+  if (size == 0) return 0;
+  uint16_t mask = size - 1;
+  uint16_t used = (uint16_t)((s->sn_rx_wr - s->rx_rd) & mask);
+  return (uint16_t)(size - 1 - used);
+}
+
 static uint8_t read_socket_register(uint16_t address) {
   int i = (address >> 8) - 0x04;
   uint16_t loc = address & 0xFF;
@@ -173,6 +259,7 @@ static uint8_t read_socket_register(uint16_t address) {
   case W5100_SN_TX_RD1:
   case W5100_SN_TX_WR0:
   case W5100_SN_TX_WR1:
+    return u2_memory[address];
   case W5100_SN_RX_RSR0:
     return get_rx_rsr_byte(i, 8);
   case W5100_SN_RX_RSR1:
@@ -187,7 +274,7 @@ static uint8_t read_socket_register(uint16_t address) {
 
 static uint8_t read_value_at(uint16_t address) {
   if (address == W5100_MR)
-    return u2_mode_register;
+    return get_mode_register();
   if (address >= W5100_GAR0 && address <= W5100_UPORT1)
     return u2_memory[address];
   if (address >= W5100_S0_BASE && address <= W5100_S3_MAX)
@@ -214,7 +301,7 @@ static uint8_t read_value(void) {
 static void write_common_register(uint16_t address, uint8_t value) {
   if (address == W5100_MR) {
     if (value & W5100_MR_RST)
-      u2_reset();
+      u2_soft_reset();
     else
       u2_mode_register = value;
     return;
@@ -230,62 +317,67 @@ static void write_common_register(uint16_t address, uint8_t value) {
     set_tx_sizes(address, value);
 }
 
-/* Push received data into socket i's RX buffer. UDP: write 4B IP + 2B port + 2B len (big-endian) then payload. TCP: payload only. */
-static void u2_push_rx(int socket_i, const uint8_t *data, uint16_t len, int is_udp, uint32_t src_ip, uint16_t src_port) {
-  if (socket_i < 0 || socket_i >= W5100_NUM_SOCKETS || !data) return;
+/* Copy data into the RX buffer of s at offset wr, in at most two pieces. Returns the new offset. */
+static uint16_t rx_ring_write(const u2_socket_t *s, uint16_t wr, const uint8_t *data, uint16_t len) {
+  uint16_t first = s->receive_size - wr;
+  if (first > len) first = len;
+  memcpy(&u2_memory[s->receive_base + wr], data, first);
+  memcpy(&u2_memory[s->receive_base], data + first, len - first);
+  return (uint16_t)((wr + len) & (s->receive_size - 1));
+}
+
+/* Free space of RX buffer of socket i */
+static uint16_t u2_rx_room(int socket_i) {
+  if (socket_i < 0 || socket_i >= W5100_NUM_SOCKETS) return 0;
+  return get_rx_free(socket_i);
+}
+
+/* Start a received packet of len bytes for socket i and write its header.
+ * UDP: 4B IP + 2B port + 2B len (big-endian). MACRAW: 2B len (big-endian). TCP: no header.
+ * Returns 0 if there is no room for header and data; the packet is dropped. */
+static int u2_rx_begin(int socket_i, uint16_t len, u2_rx_type_t type, uint32_t src_ip, uint16_t src_port) {
+  if (socket_i < 0 || socket_i >= W5100_NUM_SOCKETS) return 0;
   u2_socket_t *s = &u2_sockets[socket_i];
-  uint16_t size = s->receive_size;
-  if (size == 0) return;
-  uint16_t mask = size - 1;
-  uint16_t base = s->receive_base;
-  uint16_t total = len;
-  if (is_udp) total += 8;  /* 4 + 2 + 2 */
-  if (get_rx_rsr(socket_i) + total > size) return;  /* no room, drop */
-  if (is_udp) {
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(src_ip >> 24);
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(src_ip >> 16);
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(src_ip >> 8);
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)src_ip;
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(src_port >> 8);
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)src_port;
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(len >> 8);
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-    u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)len;
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-  }
-  for (uint16_t k = 0; k < len; k++) {
-    u2_memory[base + (s->sn_rx_wr & mask)] = data[k];
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
+  if (s->receive_size == 0) return 0;
+  uint8_t hdr[8];
+  uint16_t hdr_len = 0;
+  if (type == U2_RX_UDP) {
+    hdr[0] = (uint8_t)(src_ip >> 24);
+    hdr[1] = (uint8_t)(src_ip >> 16);
+    hdr[2] = (uint8_t)(src_ip >> 8);
+    hdr[3] = (uint8_t)src_ip;
+    hdr[4] = (uint8_t)(src_port >> 8);
+    hdr[5] = (uint8_t)src_port;
+    hdr[6] = (uint8_t)(len >> 8);
+    hdr[7] = (uint8_t)len;
+    hdr_len = 8;
+  } else if (type == U2_RX_MACRAW) {
+    hdr[0] = (uint8_t)(len >> 8);
+    hdr[1] = (uint8_t)len;
+    hdr_len = 2;
   }
+  if (get_rx_free(socket_i) < (uint32_t)hdr_len + len) return 0;  /* no room, drop */
+  s->rx_pending_wr = rx_ring_write(s, s->sn_rx_wr, hdr, hdr_len);
+  return 1;
 }
 
-/* Push MACRAW frame: 2-byte length (big-endian) then frame data. */
-static void u2_push_rx_macraw(int socket_i, const uint8_t *data, uint16_t len) {
-  if (socket_i < 0 || socket_i >= W5100_NUM_SOCKETS || !data) return;
+/* Append data of the packet started by u2_rx_begin() */
+static void u2_rx_write(int socket_i, const uint8_t *data, uint16_t len) {
   u2_socket_t *s = &u2_sockets[socket_i];
-  uint16_t size = s->receive_size;
-  if (size == 0) return;
-  uint16_t mask = size - 1;
-  uint16_t base = s->receive_base;
-  uint16_t total = (uint16_t)(2 + len);
-  if (get_rx_rsr(socket_i) + total > size) return;
-  u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)(len >> 8);
-  s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-  u2_memory[base + (s->sn_rx_wr & mask)] = (uint8_t)len;
-  s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-  for (uint16_t k = 0; k < len; k++) {
-    u2_memory[base + (s->sn_rx_wr & mask)] = data[k];
-    s->sn_rx_wr = (s->sn_rx_wr + 1) & mask;
-  }
+  s->rx_pending_wr = rx_ring_write(s, s->rx_pending_wr, data, len);
+}
+
+/* Make the packet visible to the 6502 */
+static void u2_rx_commit(int socket_i) {
+  u2_socket_t *s = &u2_sockets[socket_i];
+  __dmb();  /* data before sn_rx_wr */
+  s->sn_rx_wr = s->rx_pending_wr;
 }
 
-/* Read TX buffer data between rd and wr and send via network */
+static const u2_rx_ops_t u2_rx_ops = { u2_rx_room, u2_rx_begin, u2_rx_write, u2_rx_commit };
+
+/* Read TX buffer data between rd and wr and send via network.
+ * The data is passed as up to two pieces of u2_memory (the TX ring may wrap), no copy is made here. */
 static void send_data(int i) {
   const u2_socket_t *s = &u2_sockets[i];
   uint16_t buf_size = s->transmit_size;
@@ -295,10 +387,19 @@ static void send_data(int i) {
   uint16_t rd = read_net16(r + W5100_SN_TX_RD0) & mask;
   uint16_t wr = read_net16(r + W5100_SN_TX_WR0) & mask;
   int data_len = (int)wr - (int)rd;
-  if (data_len <= 0) data_len += buf_size;
-  if (data_len == 0) return;
-  uint16_t base = s->transmit_base;
+  if (data_len < 0) data_len += buf_size;
+  if (data_len == 0) return;  /* Nothing written since the last SEND, same as get_tx_data_size() */
   uint8_t status = U2_Net_GetStatus(i);
+  int n = data_len;
+  if (n > U2_TX_MAX_PACKET) n = U2_TX_MAX_PACKET;
+  if (status == W5100_SN_SR_SOCK_MACRAW && n > U2_TX_MAX_FRAME) n = U2_TX_MAX_FRAME;
+  u2_span_t seg[2];
+  uint16_t first = buf_size - rd;
+  if (first > n) first = (uint16_t)n;
+  seg[0].data = &u2_memory[s->transmit_base + rd];
+  seg[0].len = first;
+  seg[1].data = &u2_memory[s->transmit_base];
+  seg[1].len = (uint16_t)(n - first);
   if (status == W5100_SN_SR_SOCK_UDP) {
     uint32_t dip = (uint32_t)u2_memory[s->register_address + W5100_SN_DIPR0] << 24
                   | (uint32_t)u2_memory[s->register_address + W5100_SN_DIPR1] << 16
@@ -306,94 +407,128 @@ static void send_data(int i) {
                   | (uint32_t)u2_memory[s->register_address + W5100_SN_DIPR3];
     uint16_t dport = (uint16_t)u2_memory[s->register_address + W5100_SN_DPORT0] << 8
                   | (uint16_t)u2_memory[s->register_address + W5100_SN_DPORT1];
-    /* Copy payload out (may wrap) */
-    uint8_t buf[2048];
-    int n = data_len;
-    if (n > (int)sizeof(buf)) n = (int)sizeof(buf);
-    for (int j = 0; j < n; j++)
-      buf[j] = u2_memory[base + ((rd + j) & mask)];
-    U2_Net_SendUdp(i, buf, (uint16_t)n, dip, dport);
+    U2_Net_SendUdp(i, seg, dip, dport);
   } else if (status == W5100_SN_SR_ESTABLISHED) {
-    uint8_t buf[2048];
-    int n = data_len;
-    if (n > (int)sizeof(buf)) n = (int)sizeof(buf);
-    for (int j = 0; j < n; j++)
-      buf[j] = u2_memory[base + ((rd + j) & mask)];
-    U2_Net_SendTcp(i, buf, (uint16_t)n);
+    U2_Net_SendTcp(i, seg);
   } else if (status == W5100_SN_SR_SOCK_MACRAW) {
-    uint8_t buf[1518];
-    int n = data_len;
-    if (n > (int)sizeof(buf)) n = (int)sizeof(buf);
-    for (int j = 0; j < n; j++)
-      buf[j] = u2_memory[base + ((rd + j) & mask)];
-    U2_Net_SendMacraw(i, buf, (uint16_t)n);
+    U2_Net_SendMacraw(i, seg);
   }
   /* Advance TX_RD to TX_WR */
   u2_memory[s->register_address + W5100_SN_TX_RD0] = (uint8_t)(wr >> 8);
   u2_memory[s->register_address + W5100_SN_TX_RD1] = (uint8_t)wr;
 }
 
-static void write_socket_register(uint16_t address, uint8_t value) {
-  u2_memory[address] = value;
-  uint16_t loc = address & 0xFF;
-  if (loc == W5100_SN_CR) {
-    int i = (address >> 8) - 0x04;
-    switch (value) {
-    case W5100_SN_CR_OPEN: {
-      uint8_t mr = u2_memory[(address & 0xFF00) + W5100_SN_MR];
-      uint16_t port = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT0] << 8
-                    | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT1];
-      switch (mr & W5100_SN_MR_PROTO_MASK) {
-      case W5100_SN_MR_UDP:
-        if (U2_Net_OpenUdp(i, port) == 0) { /* ok */ }
-        else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-        break;
-      case W5100_SN_MR_TCP:
-        if (U2_Net_OpenTcp(i) == 0) u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_SOCK_INIT;
-        else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-        break;
-      case W5100_SN_MR_MACRAW:
-        if (U2_Net_OpenMacraw(i) == 0) u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_SOCK_MACRAW;
-        else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-        break;
-      default:
-        u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-        break;
-      }
+/* Execute a socket command on core 0. Sn_CR is cleared when it is done. */
+static void exec_socket_command(int i, uint8_t value) {
+  uint16_t address = u2_sockets[i].register_address + W5100_SN_CR;
+  switch (value) {
+  case W5100_SN_CR_OPEN: {
+    uint8_t mr = u2_memory[(address & 0xFF00) + W5100_SN_MR];
+    uint16_t port = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT0] << 8
+                  | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT1];
+    switch (mr & W5100_SN_MR_PROTO_MASK) {
+    case W5100_SN_MR_UDP:
+      if (U2_Net_OpenUdp(i, port) == 0) { /* ok */ }
+      else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
       break;
-    }
-    case W5100_SN_CR_CONNECT: {
-      uint32_t dip = (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR0] << 24
-                   | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR1] << 16
-                   | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR2] << 8
-                   | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR3];
-      uint16_t dport = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_DPORT0] << 8
-                     | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_DPORT1];
-      if (U2_Net_ConnectTcpEx(i, dip, dport) != 0)
-        u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
+    case W5100_SN_MR_TCP:
+      if (U2_Net_OpenTcp(i) == 0) u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_SOCK_INIT;
+      else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
       break;
-    }
-    case W5100_SN_CR_LISTEN: {
-      uint16_t port = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT0] << 8
-                    | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT1];
-      if (U2_Net_ListenTcp(i, port) != 0)
-        u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-      break;
-    }
-    case W5100_SN_CR_CLOSE:
-    case W5100_SN_CR_DISCON:
-      U2_Net_Close(i);
-      u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
-      break;
-    case W5100_SN_CR_SEND:
-      send_data(i);
-      break;
-    case W5100_SN_CR_RECV:
-      U2_Net_RecvConfirm(i);
+    case W5100_SN_MR_MACRAW:
+      if (U2_Net_OpenMacraw(i) == 0) u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_SOCK_MACRAW;
+      else u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
       break;
     default:
+      u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
       break;
     }
+    break;
+  }
+  case W5100_SN_CR_CONNECT: {
+    uint32_t dip = (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR0] << 24
+                 | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR1] << 16
+                 | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR2] << 8
+                 | (uint32_t)u2_memory[(address & 0xFF00) + W5100_SN_DIPR3];
+    uint16_t dport = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_DPORT0] << 8
+                   | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_DPORT1];
+    if (U2_Net_ConnectTcpEx(i, dip, dport) != 0)
+      u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
+    break;
+  }
+  case W5100_SN_CR_LISTEN: {
+    uint16_t port = (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT0] << 8
+                  | (uint16_t)u2_memory[(address & 0xFF00) + W5100_SN_PORT1];
+    if (U2_Net_ListenTcp(i, port) != 0)
+      u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
+    break;
+  }
+  case W5100_SN_CR_CLOSE:
+  case W5100_SN_CR_DISCON:
+    U2_Net_Close(i);
+    u2_memory[(address & 0xFF00) + W5100_SN_SR] = W5100_SN_SR_CLOSED;
+    break;
+  case W5100_SN_CR_SEND:
+    send_data(i);
+    break;
+  case W5100_SN_CR_RECV: {
+    /* Bytes consumed by the 6502 since the last RECV. It opens the TCP window. */
+    u2_socket_t *s = &u2_sockets[i];
+    uint16_t consumed = 0;
+    if (s->receive_size) {
+      uint16_t mask = s->receive_size - 1;
+      uint16_t rd = read_net16(&u2_memory[s->register_address + W5100_SN_RX_RD0]) & mask;
+      uint16_t used = (uint16_t)((s->sn_rx_wr - s->rx_rd) & mask);
+      consumed = (uint16_t)((rd - s->rx_rd) & mask);
+      if (consumed > used) consumed = used;  /* Sn_RX_RD beyond the data */
+      s->rx_rd = rd;
+    }
+    U2_Net_RecvConfirm(i, consumed);
+    break;
+  }
+  default:
+    break;
+  }
+  __dmb();  /* registers updated by the command before Sn_CR */
+  u2_memory[address] = 0;
+}
+
+/* W5100 software reset on core 0. The sockets are closed first, so the RX
+ * path does not write the buffers any more. The registers have been reset by
+ * core 1. The ones written by the 6502 since then are kept. */
+static void exec_reset(void) {
+  for (int i = 0; i < W5100_NUM_SOCKETS; i++) U2_Net_Close(i);
+  memset(&u2_memory[W5100_TX_BASE], 0, W5100_MEM_SIZE - W5100_TX_BASE);
+  for (int i = 0; i < W5100_NUM_SOCKETS; i++) {
+    u2_socket_t *s = &u2_sockets[i];
+    s->sn_rx_wr = 0;
+    s->rx_rd = 0;
+    s->rx_pending_wr = 0;
+    u2_memory[s->register_address + W5100_SN_TX_RD0] = 0;  /* written by send_data() */
+    u2_memory[s->register_address + W5100_SN_TX_RD1] = 0;
+  }
+  uint8_t tmsr = u2_memory[W5100_TMSR];
+  uint8_t rmsr = u2_memory[W5100_RMSR];
+  apply_tx_sizes(tmsr);
+  apply_rx_sizes(rmsr);
+  __dmb();  /* buffers and sizes before u2_reset_pending */
+  u2_reset_pending = false;
+  __dmb();
+  /* TMSR/RMSR written by core 1 while the reset was pending. Core 1 applies
+   * the sizes itself if it has seen u2_reset_pending cleared. */
+  if (u2_memory[W5100_TMSR] != tmsr) apply_tx_sizes(u2_memory[W5100_TMSR]);
+  if (u2_memory[W5100_RMSR] != rmsr) apply_rx_sizes(u2_memory[W5100_RMSR]);
+}
+
+static void write_socket_register(uint16_t address, uint8_t value) {
+  u2_memory[address] = value;
+  uint16_t loc = address & 0xFF;
+  if (loc == W5100_SN_CR && value != 0) {
+    int i = (address >> 8) - 0x04;
+    /* Queue full: Sn_CR stays non-zero and the command is posted at a later
+     * bus access. Commands deferred before go first to keep the order. */
+    if (u2_cmd_deferred || !u2_post_command((uint8_t)i, value))
+      u2_cmd_deferred |= (uint8_t)(1u << i);
   }
 }
 
@@ -417,11 +552,27 @@ static void write_value(uint8_t value) {
 
 void U2_Init(void) {
   u2_data_address = 0;
-  U2_Net_Init(u2_push_rx, u2_push_rx_macraw);
-  u2_reset();
+  u2_cmdq_head = 0;
+  u2_cmdq_tail = 0;
+  u2_cmd_deferred = 0;
+  for (int i = 0; i < W5100_NUM_SOCKETS; i++)
+    u2_sockets[i].register_address = (uint16_t)(W5100_S0_BASE + (i << 8));
+  U2_Net_Init(&u2_rx_ops);
+  u2_reset_registers();
+  u2_reset_pending = true;
+  exec_reset();
 }
 
 void U2_Poll(void) {
+  /* Execute the commands posted by core 1 */
+  while (u2_cmdq_tail != u2_cmdq_head) {
+    __dmb();  /* head before entry */
+    u2_cmd_t cmd = u2_cmdq[u2_cmdq_tail & (U2_CMDQ_SIZE - 1)];
+    if (cmd.socket == U2_CMD_RESET) exec_reset();
+    else exec_socket_command(cmd.socket, cmd.command);
+    __dmb();
+    u2_cmdq_tail = u2_cmdq_tail + 1;
+  }
   U2_Net_Poll();
 }
 
@@ -430,12 +581,14 @@ void U2_HandleBusAccess(uint32_t busdata, uint8_t *read_byte_out) {
   uint8_t data = (uint8_t)((busdata >> 5) & 0xFF);
   int is_read = (busdata & READFLAG) != 0;
 
+  if (u2_cmd_deferred) u2_post_deferred();
+
   *read_byte_out = 0;
   if (is_read) {
     uint8_t res;
     switch (loc) {
     case U2_C0X_MODE_REGISTER:
-      res = u2_mode_register;
+      res = get_mode_register();
       break;
     case U2_C0X_ADDRESS_HIGH:
       res = get_byte(u2_data_address, 8);
@@ -455,7 +608,7 @@ void U2_HandleBusAccess(uint32_t busdata, uint8_t *read_byte_out) {
     switch (loc) {
     case U2_C0X_MODE_REGISTER:
       if (data & W5100_MR_RST)
-        u2_reset();
+        u2_soft_reset();
       else
         u2_mode_register = data;
       break;
@@ -7,7 +7,7 @@
 /** Call once at startup before the bus loop. */
 void U2_Init(void);
 
-/** Advance network and drain RX; call periodically from the bus loop. */
+/** Execute socket commands posted by the bus loop, advance network and drain RX; call periodically from core 0. */
 void U2_Poll(void);
 
 /**
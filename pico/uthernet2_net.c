@@ -1,6 +1,12 @@
 /**
  * Uthernet II network layer: lwIP TCP/UDP for W5100 socket emulation.
  * Only built when CYW43/lwIP is available (Pico W).
+ *
+ * TCP flow control: received pbufs are queued per socket and moved into the
+ * W5100 RX buffer as room allows. tcp_recved() is called only when the 6502
+ * has consumed the data (RECV command), so the TCP window follows how fast
+ * the 6502 reads. When the queue is over U2_NET_RX_QUEUE_MAX, the recv callback
+ * refuses the pbuf and lwIP delivers it again later. No data is dropped.
  */
 #include "uthernet2_net.h"
 #include "w5100_regs.h"
@@ -15,12 +21,17 @@
 #include "lwip/err.h"
 #include "lwip/netif.h"
 #include <string.h>
+#include <stdbool.h>
 
 #define U2_NET_MAX_SOCKETS  W5100_NUM_SOCKETS
 #define U2_MACRAW_MAX_FRAME 1518
 
-static u2_push_rx_fn push_rx_cb;
-static u2_push_rx_macraw_fn push_rx_macraw_cb;
+/* Max bytes of TCP data queued per socket while W5100 RX buffer is full (<65536) */
+#ifndef U2_NET_RX_QUEUE_MAX
+#define U2_NET_RX_QUEUE_MAX 8192
+#endif
+
+static const u2_rx_ops_t *rx_ops;
 
 typedef enum { PCB_NONE = 0, PCB_UDP, PCB_TCP, PCB_MACRAW } pcb_type_t;
 
@@ -32,6 +43,9 @@ typedef struct {
   struct tcp_pcb *tcp_connected; /* TCP: accepted connection (when listening) */
   pcb_type_t type;
   uint8_t    status;  /* W5100_SN_SR_* */
+  struct pbuf *rx_queue;  /* TCP: data not yet moved into RX buffer */
+  uint16_t   rx_unacked;  /* TCP: bytes in RX buffer not yet passed to tcp_recved */
+  bool       rx_fin;      /* TCP: remote closed; set CLOSED when rx_queue is empty */
 } u2_net_socket_t;
 
 static u2_net_socket_t sockets[U2_NET_MAX_SOCKETS];
@@ -46,6 +60,71 @@ static uint8_t get_status(int i) {
   return sockets[i].status;
 }
 
+/* Copy a pbuf chain into RX buffer of socket i. Each pbuf is copied directly; no staging buffer.
+ * Returns 0 if there is no room. */
+static int push_rx_pbuf(int i, const struct pbuf *p, u2_rx_type_t type, uint32_t src_ip, uint16_t src_port) {
+  if (!rx_ops || !rx_ops->begin(i, (uint16_t)p->tot_len, type, src_ip, src_port)) return 0;
+  for (const struct pbuf *q = p; q; q = q->next)
+    rx_ops->write(i, (const uint8_t *)q->payload, q->len);
+  rx_ops->commit(i);
+  return 1;
+}
+
+/* TCP pcb carrying the data of socket i */
+static struct tcp_pcb *active_tcp(int i) {
+  return sockets[i].tcp_connected ? sockets[i].tcp_connected : sockets[i].pcb.tcp;
+}
+
+/* Move queued TCP data into RX buffer of socket i as far as room allows */
+static void drain_tcp_rx(int i) {
+  u2_net_socket_t *s = &sockets[i];
+  while (s->rx_queue && rx_ops) {
+    struct pbuf *q = s->rx_queue;
+    uint16_t n = rx_ops->room(i);
+    if (n > q->tot_len) n = q->tot_len;
+    if (n == 0 || !rx_ops->begin(i, n, U2_RX_TCP, 0, 0)) break;
+    uint16_t left = n;
+    for (const struct pbuf *r = q; left; r = r->next) {
+      uint16_t k = (r->len < left) ? r->len : left;
+      rx_ops->write(i, (const uint8_t *)r->payload, k);
+      left -= k;
+    }
+    rx_ops->commit(i);
+    s->rx_unacked += n;
+    s->rx_queue = pbuf_free_header(q, n);
+  }
+  if (!s->rx_queue && s->rx_fin) {
+    s->rx_fin = false;
+    set_status(i, W5100_SN_SR_CLOSED);
+  }
+}
+
+/* Free the TCP receive queue of socket i */
+static void clear_tcp_rx(int i) {
+  u2_net_socket_t *s = &sockets[i];
+  if (s->rx_queue) pbuf_free(s->rx_queue);
+  s->rx_queue = NULL;
+  s->rx_unacked = 0;
+  s->rx_fin = false;
+}
+
+/* Build a PBUF_REF chain referring to the TX pieces (no copy). Returns NULL on error or no data. */
+static struct pbuf *ref_pbuf(const u2_span_t seg[2]) {
+  struct pbuf *p = NULL;
+  for (int k = 0; k < 2; k++) {
+    if (seg[k].len == 0) continue;
+    struct pbuf *q = pbuf_alloc(PBUF_RAW, seg[k].len, PBUF_REF);
+    if (!q) {
+      if (p) pbuf_free(p);
+      return NULL;
+    }
+    q->payload = (void *)seg[k].data;
+    if (p) pbuf_cat(p, q);
+    else p = q;
+  }
+  return p;
+}
+
 /* TCP connected callback */
 static err_t tcp_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
   int i = (int)(intptr_t)arg;
@@ -57,22 +136,27 @@ static err_t tcp_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err) {
   return ERR_OK;
 }
 
-/* TCP recv callback: push payload to W5100 RX buffer */
+/* TCP recv callback: queue payload and move it to W5100 RX buffer.
+ * The window is opened later by U2_Net_RecvConfirm(). */
 static err_t tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
   int i = (int)(intptr_t)arg;
   if (i < 0 || i >= U2_NET_MAX_SOCKETS) { if (p) pbuf_free(p); return ERR_ARG; }
   if (err != ERR_OK) { if (p) pbuf_free(p); return err; }
+  u2_net_socket_t *s = &sockets[i];
   if (!p) {
-    set_status(i, W5100_SN_SR_CLOSED);
+    /* Let the 6502 read the queued data first */
+    s->rx_fin = true;
+    drain_tcp_rx(i);
     return ERR_OK;
   }
-  if (push_rx_cb && p->tot_len > 0) {
-    uint8_t *buf = (uint8_t *)p->payload;
-    uint16_t len = (uint16_t)p->tot_len;
-    push_rx_cb(i, buf, len, 0, 0, 0);
+  if (s->rx_queue) {
+    /* Queue full: refuse the pbuf. lwIP keeps it and calls again later. */
+    if ((uint32_t)s->rx_queue->tot_len + p->tot_len > U2_NET_RX_QUEUE_MAX) return ERR_MEM;
+    pbuf_cat(s->rx_queue, p);
+  } else {
+    s->rx_queue = p;
   }
-  tcp_recved(tpcb, p->tot_len);
-  pbuf_free(p);
+  drain_tcp_rx(i);
   return ERR_OK;
 }
 
@@ -82,6 +166,7 @@ static err_t tcp_accept_cb(void *arg, struct tcp_pcb *newpcb, err_t err) {
   if (i < 0 || i >= U2_NET_MAX_SOCKETS || err != ERR_OK) return ERR_VAL;
   /* Keep listen pcb in .tcp; use .tcp_connected for the connection */
   if (sockets[i].tcp_connected) tcp_close(sockets[i].tcp_connected);
+  clear_tcp_rx(i);
   sockets[i].tcp_connected = newpcb;
   set_status(i, W5100_SN_SR_ESTABLISHED);
   tcp_arg(newpcb, (void *)(intptr_t)i);
@@ -95,16 +180,15 @@ static void udp_recv_cb(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                         const ip_addr_t *addr, u16_t port) {
   int i = (int)(intptr_t)arg;
   if (i < 0 || i >= U2_NET_MAX_SOCKETS || !p) { if (p) pbuf_free(p); return; }
-  if (push_rx_cb && p->tot_len > 0) {
+  if (p->tot_len > 0) {
     uint32_t ip = ip_addr_get_ip4_u32(addr); /* already in network order on some ports */
-    push_rx_cb(i, (const uint8_t *)p->payload, (uint16_t)p->tot_len, 1, ip, port);
+    push_rx_pbuf(i, p, U2_RX_UDP, ip, port);
   }
   pbuf_free(p);
 }
 
-void U2_Net_Init(u2_push_rx_fn push_rx, u2_push_rx_macraw_fn push_rx_macraw) {
-  push_rx_cb = push_rx;
-  push_rx_macraw_cb = push_rx_macraw;
+void U2_Net_Init(const u2_rx_ops_t *ops) {
+  rx_ops = ops;
   memset(sockets, 0, sizeof(sockets));
   for (int i = 0; i < U2_NET_MAX_SOCKETS; i++)
     sockets[i].status = W5100_SN_SR_CLOSED;
@@ -118,16 +202,17 @@ int U2_Net_OpenMacraw(int i) {
   return 0;
 }
 
-/* Send raw Ethernet frame via netif linkoutput (full frame including MAC headers). */
-void U2_Net_SendMacraw(int i, const uint8_t *data, uint16_t len) {
-  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_MACRAW || !data || len == 0 || len > U2_MACRAW_MAX_FRAME)
+/* Send raw Ethernet frame via netif linkoutput (full frame including MAC headers).
+ * The frame is passed by reference; the driver copies it before linkoutput returns. */
+void U2_Net_SendMacraw(int i, const u2_span_t seg[2]) {
+  uint32_t len = (uint32_t)seg[0].len + seg[1].len;
+  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_MACRAW || len == 0 || len > U2_MACRAW_MAX_FRAME)
     return;
   cyw43_arch_lwip_begin();
   struct netif *netif = netif_list;
   if (netif && netif->linkoutput) {
-    struct pbuf *p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+    struct pbuf *p = ref_pbuf(seg);
     if (p) {
-      memcpy(p->payload, data, len);
       netif->linkoutput(netif, p);
       pbuf_free(p);
     }
@@ -136,8 +221,10 @@ void U2_Net_SendMacraw(int i, const uint8_t *data, uint16_t len) {
 }
 
 void U2_Net_FeedMacrawRx(int i, const uint8_t *data, uint16_t len) {
-  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_MACRAW || !push_rx_macraw_cb || !data) return;
-  push_rx_macraw_cb(i, data, len);
+  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_MACRAW || !rx_ops || !data) return;
+  if (!rx_ops->begin(i, len, U2_RX_MACRAW, 0, 0)) return;
+  rx_ops->write(i, data, len);
+  rx_ops->commit(i);
 }
 
 void U2_Net_Close(int i) {
@@ -147,6 +234,7 @@ void U2_Net_Close(int i) {
     udp_remove(s->pcb.udp);
     s->pcb.udp = NULL;
   } else if (s->type == PCB_TCP) {
+    clear_tcp_rx(i);
     if (s->tcp_connected) {
       tcp_arg(s->tcp_connected, NULL);
       tcp_recv(s->tcp_connected, NULL);
@@ -231,14 +319,14 @@ int U2_Net_ListenTcp(int i, uint16_t local_port) {
   return 0;
 }
 
-/* Send UDP: dest_ip_net (network order), dest_port (host order) */
-void U2_Net_SendUdp(int i, const uint8_t *data, uint16_t len, uint32_t dest_ip_net, uint16_t dest_port) {
-  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_UDP || !sockets[i].pcb.udp || !data)
+/* Send UDP: dest_ip_net (network order), dest_port (host order)
+ * The payload is passed by reference. lwIP copies a PBUF_REF before queuing it (e.g. ARP pending). */
+void U2_Net_SendUdp(int i, const u2_span_t seg[2], uint32_t dest_ip_net, uint16_t dest_port) {
+  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_UDP || !sockets[i].pcb.udp)
     return;
   cyw43_arch_lwip_begin();
-  struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  struct pbuf *p = ref_pbuf(seg);
   if (p) {
-    memcpy(p->payload, data, len);
     ip_addr_t addr;
     IP4_ADDR(&addr, (dest_ip_net >> 24) & 0xFF, (dest_ip_net >> 16) & 0xFF,
              (dest_ip_net >> 8) & 0xFF, dest_ip_net & 0xFF);
@@ -248,22 +336,35 @@ void U2_Net_SendUdp(int i, const uint8_t *data, uint16_t len, uint32_t dest_ip_n
   cyw43_arch_lwip_end();
 }
 
-/* Send TCP: use connected pcb if from accept, else client pcb */
-void U2_Net_SendTcp(int i, const uint8_t *data, uint16_t len) {
-  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_TCP || !data || len == 0)
+/* Send TCP: use connected pcb if from accept, else client pcb
+ * tcp_write copies each piece straight into its segments. The data cannot be referenced
+ * because the 6502 may overwrite the TX buffer before it is acknowledged. */
+void U2_Net_SendTcp(int i, const u2_span_t seg[2]) {
+  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_TCP || seg[0].len == 0)
     return;
-  struct tcp_pcb *pcb = sockets[i].tcp_connected ? sockets[i].tcp_connected : sockets[i].pcb.tcp;
+  struct tcp_pcb *pcb = active_tcp(i);
   if (!pcb) return;
   cyw43_arch_lwip_begin();
-  err_t err = tcp_write(pcb, data, len, TCP_WRITE_FLAG_COPY);
+  err_t err = tcp_write(pcb, seg[0].data, seg[0].len, TCP_WRITE_FLAG_COPY | (seg[1].len ? TCP_WRITE_FLAG_MORE : 0));
+  if (err == ERR_OK && seg[1].len)
+    err = tcp_write(pcb, seg[1].data, seg[1].len, TCP_WRITE_FLAG_COPY);
   if (err == ERR_OK)
     tcp_output(pcb);
   cyw43_arch_lwip_end();
 }
 
-void U2_Net_RecvConfirm(int i) {
-  (void)i;
-  /* No-op for raw lwIP; RSR is computed from pointers in uthernet2 */
+/* The 6502 has consumed len bytes: open the TCP window by the same amount
+ * and move queued data into the room. UDP/MACRAW: nothing to do. */
+void U2_Net_RecvConfirm(int i, uint16_t len) {
+  if (i < 0 || i >= U2_NET_MAX_SOCKETS || sockets[i].type != PCB_TCP) return;
+  u2_net_socket_t *s = &sockets[i];
+  if (len > s->rx_unacked) len = s->rx_unacked;
+  cyw43_arch_lwip_begin();
+  struct tcp_pcb *pcb = active_tcp(i);
+  if (pcb && len) tcp_recved(pcb, len);
+  s->rx_unacked -= len;
+  drain_tcp_rx(i);
+  cyw43_arch_lwip_end();
 }
 
 uint8_t U2_Net_GetStatus(int i) {
@@ -278,20 +379,18 @@ void U2_Net_Poll(void) {
 
 #else /* !PICO_CYW43_ARCH_POLL */
 
-static u2_push_rx_fn push_rx_cb;
-
-void U2_Net_Init(u2_push_rx_fn push_rx, u2_push_rx_macraw_fn push_rx_macraw) { (void)push_rx; (void)push_rx_macraw; push_rx_cb = NULL; }
+void U2_Net_Init(const u2_rx_ops_t *rx_ops) { (void)rx_ops; }
 void U2_Net_Close(int i) { (void)i; }
 int  U2_Net_OpenUdp(int i, uint16_t local_port) { (void)i; (void)local_port; return -1; }
 int  U2_Net_OpenTcp(int i) { (void)i; return -1; }
 int  U2_Net_OpenMacraw(int i) { (void)i; return -1; }
-void U2_Net_SendMacraw(int i, const uint8_t *data, uint16_t len) { (void)i; (void)data; (void)len; }
+void U2_Net_SendMacraw(int i, const u2_span_t seg[2]) { (void)i; (void)seg; }
 void U2_Net_FeedMacrawRx(int i, const uint8_t *data, uint16_t len) { (void)i; (void)data; (void)len; }
 int  U2_Net_ConnectTcpEx(int i, uint32_t dest_ip_net, uint16_t dest_port) { (void)i; (void)dest_ip_net; (void)dest_port; return -1; }
 int  U2_Net_ListenTcp(int i, uint16_t local_port) { (void)i; (void)local_port; return -1; }
-void U2_Net_SendUdp(int i, const uint8_t *data, uint16_t len, uint32_t dest_ip_net, uint16_t dest_port) { (void)i; (void)data; (void)len; (void)dest_ip_net; (void)dest_port; }
-void U2_Net_SendTcp(int i, const uint8_t *data, uint16_t len) { (void)i; (void)data; (void)len; }
-void U2_Net_RecvConfirm(int i) { (void)i; }
+void U2_Net_SendUdp(int i, const u2_span_t seg[2], uint32_t dest_ip_net, uint16_t dest_port) { (void)i; (void)seg; (void)dest_ip_net; (void)dest_port; }
+void U2_Net_SendTcp(int i, const u2_span_t seg[2]) { (void)i; (void)seg; }
+void U2_Net_RecvConfirm(int i, uint16_t len) { (void)i; (void)len; }
 uint8_t U2_Net_GetStatus(int i) { (void)i; return W5100_SN_SR_CLOSED; }
 void U2_Net_Poll(void) { }
 
@@ -1,38 +1,58 @@
 /**
  * Uthernet II network layer (lwIP TCP/UDP).
- * Call U2_Net_Init() with a push_rx callback; then use U2_Net_* from uthernet2.
+ * Call U2_Net_Init() with the RX buffer callbacks; then use U2_Net_* from uthernet2.
  */
 #ifndef _UTHERNET2_NET_H
 #define _UTHERNET2_NET_H
 
 #include <stdint.h>
 
-/* Callback: push received data into W5100 RX buffer for socket i.
- * is_udp: 1 = UDP (callback will write 4B IP + 2B port + 2B len then payload); 0 = TCP (payload only).
- * src_ip: IPv4 in host order (for UDP header); src_port host order. */
-typedef void (*u2_push_rx_fn)(int socket_i, const uint8_t *data, uint16_t len,
-                              int is_udp, uint32_t src_ip, uint16_t src_port);
-/* Callback: push MACRAW frame into socket i's RX buffer (2-byte length big-endian then frame). */
-typedef void (*u2_push_rx_macraw_fn)(int socket_i, const uint8_t *data, uint16_t len);
+/* Type of received packet; selects the header written in front of the data */
+typedef enum {
+  U2_RX_TCP = 0,  /* payload only */
+  U2_RX_UDP,      /* 4B IP + 2B port + 2B len then payload */
+  U2_RX_MACRAW    /* 2B len (big-endian) then frame */
+} u2_rx_type_t;
 
-void U2_Net_Init(u2_push_rx_fn push_rx, u2_push_rx_macraw_fn push_rx_macraw);
+/* Callbacks to write a received packet into W5100 RX buffer of socket i.
+ * room:   free space of RX buffer in bytes (header included).
+ * begin:  reserve room for len bytes of data and write the header. Returns 0 if there is no room.
+ *         src_ip: IPv4 in host order (for UDP header); src_port host order.
+ * write:  append data; called for each piece (e.g. each pbuf of a chain) until len bytes are written.
+ * commit: make the packet visible to the 6502. */
+typedef struct {
+  uint16_t (*room)(int socket_i);
+  int  (*begin)(int socket_i, uint16_t len, u2_rx_type_t type, uint32_t src_ip, uint16_t src_port);
+  void (*write)(int socket_i, const uint8_t *data, uint16_t len);
+  void (*commit)(int socket_i);
+} u2_rx_ops_t;
+
+/* A piece of TX data. The TX buffer may wrap, so data is passed as two pieces (the second may be empty).
+ * The data stays valid only during the call. */
+typedef struct {
+  const uint8_t *data;
+  uint16_t len;
+} u2_span_t;
+
+void U2_Net_Init(const u2_rx_ops_t *rx_ops);
 
 void U2_Net_Close(int i);
 int  U2_Net_OpenUdp(int i, uint16_t local_port);
 int  U2_Net_OpenTcp(int i);
 int  U2_Net_OpenMacraw(int i);
-void U2_Net_SendMacraw(int i, const uint8_t *data, uint16_t len);
+void U2_Net_SendMacraw(int i, const u2_span_t seg[2]);
 /** Feed a received raw Ethernet frame into socket i (MACRAW RX). Call from driver hook if available. */
 void U2_Net_FeedMacrawRx(int i, const uint8_t *data, uint16_t len);
 int  U2_Net_ConnectTcpEx(int i, uint32_t dest_ip_net, uint16_t dest_port);
 int  U2_Net_ListenTcp(int i, uint16_t local_port);
-void U2_Net_SendUdp(int i, const uint8_t *data, uint16_t len, uint32_t dest_ip_net, uint16_t dest_port);
-void U2_Net_SendTcp(int i, const uint8_t *data, uint16_t len);
-void U2_Net_RecvConfirm(int i);
+void U2_Net_SendUdp(int i, const u2_span_t seg[2], uint32_t dest_ip_net, uint16_t dest_port);
+void U2_Net_SendTcp(int i, const u2_span_t seg[2]);
+/** RECV command: the 6502 has consumed len bytes of RX buffer. Opens the TCP window and moves queued data in. */
+void U2_Net_RecvConfirm(int i, uint16_t len);
 
 uint8_t U2_Net_GetStatus(int i);
 
-/** Advance lwIP and drain recv into RX buffers. Call periodically from bus loop. */
+/** Advance lwIP and drain recv into RX buffers. Call periodically from core 0. */
 void U2_Net_Poll(void);
 
 #endif /* _UTHERNET2_NET_H */
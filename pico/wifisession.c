@@ -0,0 +1,208 @@
+#include <string.h>
+#include "pico/cyw43_arch.h"
+#include "pico/stdlib.h"
+#include "defines.h"
+#include "debug.h"
+#include "wifisession.h"
+
+/****************************************************************************************
+Persistent WIFI Session
+
+Every CUDPTask (NTP, WIFI Test and TFTP) needs WIFI. Association and DHCP take seconds.
+So, the connection is not torn down when a task is completed. It is kept for
+WIFI_SESSION_IDLE_MS and the next task reuses it. Back-to-back TFTP transfers start
+without any delay.
+
+- CUDPTask::InitCyw43() opens the session. The CYW43 library is initialized only if the
+  session is not open.
+- CUDPTask::ConnectWifi() reuses the connection if it is up and the SSID and WPA Key are
+  unchanged. Otherwise, the library is restarted and WIFI is connected again.
+- The destructor of CUDPTask releases the session. It is closed immediately if the task
+  failed to connect or the connection is lost.
+- WifiSessionTask() runs on core 0 while no task is running. It polls the library to
+  keep DHCP lease and ARP alive. The session is closed when the idle time expires or
+  the connection is lost.
+
+The BSSID and channel of the access point are cached when WIFI is connected. The next
+connection to the same SSID joins that access point directly without a full scan.
+The DHCP lease is kept while the session is open. If the link drops and WIFI is
+reconnected without restarting the library, lwIP requests the same IP address again.
+*****************************************************************************************/
+
+#ifndef CYW43_IOCTL_GET_CHANNEL
+#define CYW43_IOCTL_GET_CHANNEL (0x3a)
+#endif
+
+static bool isOpen = false;       //CYW43 library is initialized
+static bool inUse = false;        //A CUDPTask is using the session
+static bool isConnected = false;  //WIFI is connected with sessionSSID and sessionWPAKey
+static uint32_t sessionCountry;
+static char sessionSSID[SSIDLEN+1];
+static char sessionWPAKey[WPAKEYLEN+1];
+static absolute_time_t idleTimeout;
+
+//Cached Access Point
+static bool apCached = false;
+static char apSSID[SSIDLEN+1];
+static uint8_t apBSSID[6];
+static uint32_t apChannel;
+
+
+////////////////////////////////////////////////////////////////////
+// Check if WIFI link is up
+//
+static bool IsLinkUp() {
+  return cyw43_tcpip_link_status(&cyw43_state,CYW43_ITF_STA)==CYW43_LINK_UP;
+}
+
+////////////////////////////////////////////////////////////////////
+// Open the session. Init CYW43 library if it is not initialized.
+//
+// Input: country - WIFI country code
+//
+void WifiSession_Open(const uint32_t country) {
+  inUse = true;
+  if (isOpen) return;
+
+  TRACE_PRINTF("WifiSession_Open()\n");
+  cyw43_arch_init_with_country(country);
+  cyw43_arch_enable_sta_mode();
+  cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN,1); //Turn on LED
+
+  sessionCountry = country;
+  isOpen = true;
+  isConnected = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Release the session when a CUDPTask is completed
+//
+// Input: keepConnected - true to keep WIFI connected for next task
+//
+void WifiSession_Release(const bool keepConnected) {
+  inUse = false;
+  if (!isOpen) return;
+
+  if (keepConnected && WIFI_SESSION_IDLE_MS!=0 && isConnected && IsLinkUp()) {
+    idleTimeout = make_timeout_time_ms(WIFI_SESSION_IDLE_MS);
+    return;
+  }
+  WifiSession_Close();
+}
+
+////////////////////////////////////////////////////////////////////
+// Disconnect WIFI and deinit CYW43 library
+//
+void WifiSession_Close() {
+  if (!isOpen) return;
+
+  TRACE_PRINTF("Disconnecting WIFI\n");
+  cyw43_arch_disable_sta_mode();
+  cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN,0); //Turn off LED
+
+  //CYW43 Library will go crazy if we try to connect continuously
+  //deinit than init the library seems to fix the problem
+  cyw43_arch_deinit();
+
+  isOpen = false;
+  isConnected = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Is CYW43 library initialized
+//
+bool WifiSession_IsOpen() {
+  return isOpen;
+}
+
+////////////////////////////////////////////////////////////////////
+// Check if the connection can be reused
+// If WIFI is connected to another network or the link is not up,
+// the library is restarted so that a new connection can be made.
+//
+// Input: ssid, wpakey - WIFI settings of the task
+//
+// Output: true if WIFI is connected with the same settings
+//
+bool WifiSession_Reuse(const char* ssid, const char* wpakey) {
+  if (!isOpen) return false;
+
+  if (isConnected && IsLinkUp() &&
+      strcmp(ssid,sessionSSID)==0 && strcmp(wpakey,sessionWPAKey)==0) {
+    DEBUG_PRINTF("Reusing WIFI connection\n");
+    return true;
+  }
+
+  if (isConnected || cyw43_tcpip_link_status(&cyw43_state,CYW43_ITF_STA)!=CYW43_LINK_DOWN) {
+    TRACE_PRINTF("Restarting WIFI session\n");
+    WifiSession_Close();
+    WifiSession_Open(sessionCountry);
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Record the settings of the connection and cache the access point
+// Called by CUDPTask::ConnectWifi() when WIFI is connected
+//
+// Input: ssid, wpakey - WIFI settings
+//
+void WifiSession_SetConnected(const char* ssid, const char* wpakey) {
+  strncpy(sessionSSID,ssid,SSIDLEN);
+  sessionSSID[SSIDLEN] = '\0';
+  strncpy(sessionWPAKey,wpakey,WPAKEYLEN);
+  sessionWPAKey[WPAKEYLEN] = '\0';
+  isConnected = true;
+
+  //channel_info_t: hw_channel, target_channel, scan_channel
+  uint32_t channelInfo[3];
+  apCached = false;
+  if (cyw43_wifi_get_bssid(&cyw43_state,apBSSID)==0 &&
+      cyw43_ioctl(&cyw43_state,CYW43_IOCTL_GET_CHANNEL,sizeof(channelInfo),(uint8_t*)channelInfo,CYW43_ITF_STA)==0) {
+    strcpy(apSSID,sessionSSID);
+    apChannel = channelInfo[0];
+    apCached = true;
+    DEBUG_PRINTF("AP %02x:%02x:%02x:%02x:%02x:%02x Channel %d\n",
+      apBSSID[0],apBSSID[1],apBSSID[2],apBSSID[3],apBSSID[4],apBSSID[5],apChannel);
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Get the cached access point of ssid
+//
+// Input: ssid       - SSID to be connected
+//        bssidOut   - 6 bytes buffer to receive BSSID
+//        channelOut - Pointer to receive channel number
+//
+// Output: true if the access point is cached
+//
+bool WifiSession_GetCachedAP(const char* ssid, uint8_t* bssidOut, uint32_t* channelOut) {
+  if (!apCached || strcmp(ssid,apSSID)!=0) return false;
+  memcpy(bssidOut,apBSSID,sizeof(apBSSID));
+  *channelOut = apChannel;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Forget the cached access point
+// Called if the access point cannot be joined
+//
+void WifiSession_ForgetAP() {
+  apCached = false;
+}
+
+////////////////////////////////////////////////////////////////////
+// Keep the idle connection alive and close it after WIFI_SESSION_IDLE_MS
+// This function should be called periodically by core 0.
+//
+void WifiSessionTask() {
+  if (!isOpen || inUse) return;
+
+  cyw43_arch_lwip_begin();
+  cyw43_arch_poll();
+  cyw43_arch_lwip_end();
+
+  if (time_reached(idleTimeout) || !IsLinkUp()) {
+    WifiSession_Close();
+  }
+}
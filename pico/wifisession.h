@@ -0,0 +1,28 @@
+#ifndef _WIFISESSION_H
+#define _WIFISESSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+//Keep WIFI connected for WIFI_SESSION_IDLE_MS after the last UDP task is completed.
+//Set it to 0 to disconnect WIFI as soon as the task is completed.
+#define WIFI_SESSION_IDLE_MS  (2*60*1000)
+
+void WifiSession_Open(const uint32_t country);
+void WifiSession_Release(const bool keepConnected);
+void WifiSession_Close();
+bool WifiSession_IsOpen();
+bool WifiSession_Reuse(const char* ssid, const char* wpakey);
+void WifiSession_SetConnected(const char* ssid, const char* wpakey);
+bool WifiSession_GetCachedAP(const char* ssid, uint8_t* bssidOut, uint32_t* channelOut);
+void WifiSession_ForgetAP();
+void WifiSessionTask();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,999 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "usbserial.h"
+#include "dmamemops.h"
+#include "zmodem.h"
+#include "defines.h"
+#include "debug.h"
+#include "misc.h"
+#include "mediaaccess.h"
+
+/****************************************************************************************
+ZMODEM
+
+Only one file is transferred in a session. The behaviour follows sz/rz of lrzsz.
+
+Upload (PC to MegaFlash, "sz image.po"):
+- ZRINIT advertises full duplex, overlapped I/O and CRC32. Receive buffer size is 0.
+  So, the sender streams data subpackets without waiting.
+- Data is written by WriteBlockForImageTransfer() once 512 bytes are received.
+- A bad subpacket is answered by ZRPOS with the number of bytes accepted. The sender
+  restarts from that offset.
+- Crash recovery: The last upload which did not complete is remembered. If the same
+  file size is sent to the same drive with ZCRESUM ("sz -r"), the transfer resumes at
+  the last 8kB boundary written. The boundary matches the 64kB erase of
+  WriteBlockForImageTransfer() which happens every 16 blocks.
+
+Download (MegaFlash to PC, "rz"):
+- Data subpackets of ZMODEM_SUBPACKETSIZE bytes are streamed with ZCRCG. If the
+  receiver has a limited buffer, ZCRCW is used to wait for ZACK.
+- ZRPOS from the receiver moves the file position. A receiver with a partial file
+  ("rz -r") can resume the download.
+*****************************************************************************************/
+
+//--------------------------------------------------------------
+//The definitions below must be the same as the ones in busloop.c
+
+extern uint8_t* dataBuffer;
+//--------------------------------------------------------------
+
+#define ZPAD    '*'
+#define ZDLE    030
+#define ZBIN    'A'
+#define ZHEX    'B'
+#define ZBIN32  'C'
+#define CAN     030
+#define XON     021
+#define XOFF    023
+#define CTRLC   03
+
+//Frame Types
+enum {
+  ZRQINIT = 0,
+  ZRINIT,
+  ZSINIT,
+  ZACK,
+  ZFILE,
+  ZSKIP,
+  ZNAK,
+  ZABORT,
+  ZFIN,
+  ZRPOS,
+  ZDATA,
+  ZEOF,
+  ZFERR,
+  ZCRC,
+  ZCHALLENGE,
+  ZCOMPL,
+  ZCAN,
+  ZFREECNT,
+  ZCOMMAND,
+  ZSTDERR
+};
+
+//Data subpacket terminators
+#define ZCRCE   'h'   //End of frame. Header follows.
+#define ZCRCG   'i'   //Frame continues nonstop
+#define ZCRCQ   'j'   //Frame continues. ZACK expected.
+#define ZCRCW   'k'   //End of frame. ZACK expected.
+#define ZRUB0   'l'   //Translate to 0x7f
+#define ZRUB1   'm'   //Translate to 0xff
+
+//Header byte positions
+#define ZP0     0
+#define ZP1     1
+#define ZF0     3
+
+//ZRINIT flags
+#define CANFDX  0x01
+#define CANOVIO 0x02
+#define CANFC32 0x20
+
+//ZFILE conversion options
+#define ZCBIN   1
+#define ZCRESUM 3
+
+//Results of receive functions
+#define ZTIMEOUT  (-2)
+#define ZCANCEL   (-3)      //5 CAN received or Ctrl-C
+#define ZERROR    (-4)      //Bad CRC or garbage
+#define GOTTERM   0x100     //OR'ed with terminator by ReadEscaped()
+
+#define onesecond 1000000
+
+//Input buffer
+static uint8_t inBuffer[256];
+static uint inCount, inPos;
+static bool userCancelAllowed;  //Ctrl-C aborts while waiting for the first header
+
+//Output buffer
+static uint8_t outBuffer[256];
+static uint outCount;
+static uint8_t lastSent;
+
+//Data subpacket buffer. Allocated from heap during transfer.
+static uint8_t* subpacket;
+
+//Last upload which did not complete
+static struct {
+  bool valid;
+  uint32_t unitNum;
+  uint32_t fileSize;
+  uint32_t pos;
+} resume;
+
+
+//--------------------------------------------------------------
+// Low level I/O
+//--------------------------------------------------------------
+
+////////////////////////////////////////////////////////////////////
+// Read a byte from host
+// Bytes available are read into inBuffer at once.
+//
+// Input: timeout_us - timeout period in us
+//
+// Output: byte received or ZTIMEOUT
+//
+static int ReadByte(const uint32_t timeout_us) {
+  if (inPos==inCount) {
+    inPos = 0;
+    inCount = usb_getraw_timeout((char*)inBuffer,sizeof(inBuffer),0);
+    if (inCount==0) inCount = usb_getraw_timeout((char*)inBuffer,1,timeout_us);
+    if (inCount==0) return ZTIMEOUT;
+  }
+  return inBuffer[inPos++];
+}
+
+static void Flush() {
+  if (outCount) usb_putraw((const char*)outBuffer,outCount);
+  outCount = 0;
+}
+
+static inline void PutByte(const uint8_t c) {
+  outBuffer[outCount++] = c;
+  if (outCount==sizeof(outBuffer)) Flush();
+}
+
+////////////////////////////////////////////////////////////////////
+// Send a byte with ZDLE encoding
+// ZDLE, DLE, XON, XOFF and CR after '@' are escaped like lrzsz does.
+//
+static void PutEscaped(uint8_t c) {
+  switch(c) {
+    case ZDLE:
+    case 0x10: case 0x11: case 0x13:
+    case 0x90: case 0x91: case 0x93:
+      PutByte(ZDLE);
+      c ^= 0x40;
+      break;
+    case '\r': case 0x8d:
+      if ((lastSent&0x7f)=='@') {
+        PutByte(ZDLE);
+        c ^= 0x40;
+      }
+      break;
+  }
+  lastSent = c;
+  PutByte(c);
+}
+
+static void PutHex(const uint8_t c) {
+  static const char digits[] = "0123456789abcdef";
+  PutByte(digits[c>>4]);
+  PutByte(digits[c&0x0f]);
+}
+
+////////////////////////////////////////////////////////////////////
+// Send a hex header. The output buffer is flushed.
+//
+// Input: type - Frame type
+//        hdr  - ZP0-ZP3 or ZF3-ZF0
+//
+static void SendHexHeader(const uint8_t type, const uint8_t hdr[4]) {
+  uint8_t buf[5] = {type, hdr[0], hdr[1], hdr[2], hdr[3]};
+  const uint32_t crc = CRC16(buf,5);
+
+  PutByte(ZPAD);
+  PutByte(ZPAD);
+  PutByte(ZDLE);
+  PutByte(ZHEX);
+  for(uint i=0;i<5;++i) PutHex(buf[i]);
+  PutHex(crc>>8);
+  PutHex(crc);
+  PutByte('\r');
+  PutByte(0x8a);
+  if (type!=ZFIN && type!=ZACK) PutByte(XON);
+  Flush();
+}
+
+////////////////////////////////////////////////////////////////////
+// Send a binary header. Data subpackets usually follow. So, it is not flushed.
+//
+// Input: type  - Frame type
+//        hdr   - ZP0-ZP3 or ZF3-ZF0
+//        crc32 - true to use CRC32
+//
+static void SendBinHeader(const uint8_t type, const uint8_t hdr[4], const bool crc32) {
+  uint8_t buf[5] = {type, hdr[0], hdr[1], hdr[2], hdr[3]};
+
+  PutByte(ZPAD);
+  PutByte(ZDLE);
+  PutByte(crc32?ZBIN32:ZBIN);
+  for(uint i=0;i<5;++i) PutEscaped(buf[i]);
+  if (crc32) {
+    uint32_t crc = CRC32(buf,5);
+    for(uint i=0;i<4;++i,crc>>=8) PutEscaped(crc);   //LSB first
+  } else {
+    const uint32_t crc = CRC16(buf,5);
+    PutEscaped(crc>>8);
+    PutEscaped(crc);
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Send a data subpacket
+//
+// Input: data  - Data with one spare byte at the end for the terminator
+//        len   - Number of bytes
+//        term  - ZCRCE, ZCRCG, ZCRCQ or ZCRCW
+//        crc32 - true to use CRC32
+//
+static void SendData(uint8_t* data, const uint32_t len, const uint8_t term, const bool crc32) {
+  for(uint32_t i=0;i<len;++i) PutEscaped(data[i]);
+  PutByte(ZDLE);
+  PutByte(term);
+
+  //CRC covers the terminator
+  data[len] = term;
+  if (crc32) {
+    uint32_t crc = CRC32(data,len+1);
+    for(uint i=0;i<4;++i,crc>>=8) PutEscaped(crc);
+  } else {
+    const uint32_t crc = CRC16(data,len+1);
+    PutEscaped(crc>>8);
+    PutEscaped(crc);
+  }
+  if (term==ZCRCW) {
+    PutByte(XON);
+    Flush();
+  }
+}
+
+static inline void SetPos(uint8_t hdr[4], const uint32_t pos) {
+  hdr[0] = pos;
+  hdr[1] = pos>>8;
+  hdr[2] = pos>>16;
+  hdr[3] = pos>>24;
+}
+
+static inline uint32_t GetPos(const uint8_t hdr[4]) {
+  return hdr[0] | (hdr[1]<<8) | (hdr[2]<<16) | ((uint32_t)hdr[3]<<24);
+}
+
+static void SendPosHeader(const uint8_t type, const uint32_t pos) {
+  uint8_t hdr[4];
+  SetPos(hdr,pos);
+  SendHexHeader(type,hdr);
+}
+
+////////////////////////////////////////////////////////////////////
+// Abort the session
+// Send CAN and BS like lrzsz does. Then, discard all input.
+//
+static void CancelSession() {
+  Flush();
+  for(uint i=0;i<10;++i) PutByte(CAN);
+  for(uint i=0;i<10;++i) PutByte('\b');
+  Flush();
+  sleep_ms(100);
+  usb_discard();
+}
+
+////////////////////////////////////////////////////////////////////
+// Read a ZDLE encoded byte
+//
+// Input: timeout_us - timeout period in us
+//
+// Output: byte, GOTTERM|terminator, ZTIMEOUT, ZCANCEL or ZERROR
+//
+static int ReadEscaped(const uint32_t timeout_us) {
+  int c;
+  do {
+    c = ReadByte(timeout_us);
+    if (c<0) return c;
+    if (c!=ZDLE && (c&0x7f)!=XON && (c&0x7f)!=XOFF) return c;
+  } while (c!=ZDLE);
+
+  //ZDLE received
+  uint canCount = 1;
+  while(1) {
+    c = ReadByte(timeout_us);
+    if (c<0) return c;
+    switch(c) {
+      case CAN:
+        if (++canCount>=5) return ZCANCEL;
+        continue;
+      case ZCRCE: case ZCRCG: case ZCRCQ: case ZCRCW:
+        return GOTTERM|c;
+      case ZRUB0:
+        return 0x7f;
+      case ZRUB1:
+        return 0xff;
+      case XON: case XOFF: case XON|0x80: case XOFF|0x80:
+        continue;
+      default:
+        if ((c&0x60)==0x40) return c^0x40;
+        return ZERROR;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Read a hex byte of hex header
+//
+static int ReadHex(const uint32_t timeout_us) {
+  int value = 0;
+  for(uint i=0;i<2;++i) {
+    int c = ReadByte(timeout_us);
+    if (c<0) return c;
+    c &= 0x7f;
+    if (c>='0' && c<='9') c -= '0';
+    else if (c>='a' && c<='f') c -= 'a'-10;
+    else if (c>='A' && c<='F') c -= 'A'-10;
+    else return ZERROR;
+    value = (value<<4)|c;
+  }
+  return value;
+}
+
+////////////////////////////////////////////////////////////////////
+// Read a header
+// Garbage before the header is skipped.
+//
+// Input: hdr        - Buffer to receive ZP0-ZP3
+//        crc32Out   - Pointer to receive true if the header uses CRC32. Can be NULL.
+//        timeout_us - Timeout for the first byte. 1 second for the rest.
+//
+// Output: Frame type, ZTIMEOUT, ZCANCEL or ZERROR
+//
+static int ReadHeader(uint8_t hdr[4], bool* crc32Out, uint32_t timeout_us) {
+  const uint MAXGARBAGE = 65536;  //Data in flight is skipped after ZRPOS
+  uint garbageCount = 0;
+  uint canCount = 0;
+  uint8_t buf[5];
+  int c;
+
+again:
+  //Looking for ZPAD
+  c = ReadByte(timeout_us);
+  timeout_us = onesecond;
+  if (c<0) return c;
+  if (userCancelAllowed && c==CTRLC) return ZCANCEL;
+  if (c==CAN) {
+    if (++canCount>=5) return ZCANCEL;
+    goto again;
+  }
+  canCount = 0;
+  if (c!=ZPAD) {
+    if (++garbageCount>MAXGARBAGE) return ZERROR;
+    goto again;
+  }
+
+  //More ZPAD then ZDLE
+  do {
+    c = ReadByte(timeout_us);
+    if (c<0) return c;
+  } while (c==ZPAD);
+  if (c!=ZDLE) goto again;
+
+  c = ReadByte(timeout_us);
+  if (c<0) return c;
+  if (c==ZHEX) {
+    for(uint i=0;i<5;++i) {
+      c = ReadHex(timeout_us);
+      if (c<0) goto bad;
+      buf[i] = c;
+    }
+    int crcHi = ReadHex(timeout_us);
+    int crcLo = ReadHex(timeout_us);
+    if (crcHi<0 || crcLo<0) return ZERROR;
+    if (CRC16(buf,5)!=(uint32_t)((crcHi<<8)|crcLo)) return ZERROR;
+    if (crc32Out) *crc32Out = false;
+  } else if (c==ZBIN || c==ZBIN32) {
+    const bool crc32 = (c==ZBIN32);
+    uint8_t crcBytes[4];
+    for(uint i=0;i<5+(crc32?4:2);++i) {
+      c = ReadEscaped(timeout_us);
+      if (c<0 || (c&GOTTERM)) goto bad;
+      if (i<5) buf[i] = c;
+      else crcBytes[i-5] = c;
+    }
+    if (crc32) {
+      const uint32_t crc = crcBytes[0] | (crcBytes[1]<<8) | (crcBytes[2]<<16) | ((uint32_t)crcBytes[3]<<24);
+      if (CRC32(buf,5)!=crc) return ZERROR;
+    } else {
+      if (CRC16(buf,5)!=(uint32_t)((crcBytes[0]<<8)|crcBytes[1])) return ZERROR;
+    }
+    if (crc32Out) *crc32Out = crc32;
+  } else {
+    goto again;
+  }
+
+  memcpy(hdr,buf+1,4);
+  return buf[0];
+
+bad:
+  return (c==ZCANCEL)?ZCANCEL:ZERROR;
+}
+
+////////////////////////////////////////////////////////////////////
+// Read a data subpacket into subpacket buffer
+//
+// Input: maxLen     - Size of the buffer. One more byte is used for the terminator.
+//        crc32      - true if CRC32 is used
+//        lenOut     - Pointer to receive number of bytes received
+//
+// Output: Terminator, ZTIMEOUT, ZCANCEL or ZERROR
+//
+static int ReadData(const uint32_t maxLen, const bool crc32, uint32_t* lenOut) {
+  uint32_t len = 0;
+  int c;
+
+  //Data
+  while(1) {
+    c = ReadEscaped(onesecond);
+    if (c<0) return c;
+    if (c&GOTTERM) break;
+    if (len>=maxLen) return ZERROR;
+    subpacket[len++] = c;
+  }
+  const uint8_t term = c&0xff;
+  subpacket[len] = term;   //CRC covers the terminator
+
+  //CRC
+  uint8_t crcBytes[4];
+  for(uint i=0;i<(crc32?4:2);++i) {
+    c = ReadEscaped(onesecond);
+    if (c<0) return c;
+    if (c&GOTTERM) return ZERROR;
+    crcBytes[i] = c;
+  }
+  if (crc32) {
+    const uint32_t crc = crcBytes[0] | (crcBytes[1]<<8) | (crcBytes[2]<<16) | ((uint32_t)crcBytes[3]<<24);
+    if (CRC32(subpacket,len+1)!=crc) return ZERROR;
+  } else {
+    if (CRC16(subpacket,len+1)!=(uint32_t)((crcBytes[0]<<8)|crcBytes[1])) return ZERROR;
+  }
+
+  *lenOut = len;
+  return term;
+}
+
+static void InitIO() {
+  inCount = inPos = 0;
+  outCount = 0;
+  lastSent = 0;
+}
+
+
+//--------------------------------------------------------------
+// Receive (PC to MegaFlash)
+//--------------------------------------------------------------
+
+static uint32_t rxUnitNum;
+static uint32_t rxPos;            //Number of bytes accepted
+static uint32_t rxBlockLimit;     //Number of blocks of the drive
+static uint32_t verificationErrorCount;
+
+////////////////////////////////////////////////////////////////////
+// Append received data to the image
+// Data is collected in dataBuffer and written when a block is full.
+//
+// Input: src - Data
+//        len - Number of bytes
+//
+static void AppendData(const uint8_t* src, uint32_t len) {
+  while (len) {
+    const uint32_t offset = rxPos%BLOCKSIZE;
+    const uint32_t count = MIN(len,BLOCKSIZE-offset);
+    memcpy(dataBuffer+offset,src,count);
+    src += count;
+    len -= count;
+    rxPos += count;
+
+    //Block is full
+    if (rxPos%BLOCKSIZE==0) {
+      const uint32_t blockNum = rxPos/BLOCKSIZE-1;
+      if (blockNum<rxBlockLimit) {
+        TurnOnActLed();
+        TurnOnPicoLed();
+        if (!WriteBlockForImageTransfer(rxUnitNum,blockNum,dataBuffer)) ++verificationErrorCount;
+        TurnOffActLed();
+        TurnOffPicoLed();
+      }
+
+      //Crash recovery point. 16 blocks = 8kB
+      if (rxPos%(16*BLOCKSIZE)==0) resume.pos = rxPos;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Write the last partial block
+//
+static void FlushData() {
+  const uint32_t offset = rxPos%BLOCKSIZE;
+  if (offset==0) return;
+
+  memset(dataBuffer+offset,0,BLOCKSIZE-offset);
+  const uint32_t blockNum = rxPos/BLOCKSIZE;
+  if (blockNum<rxBlockLimit) {
+    if (!WriteBlockForImageTransfer(rxUnitNum,blockNum,dataBuffer)) ++verificationErrorCount;
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// Handle ZFILE. File info subpacket follows the header.
+//
+// Input: hdr   - Header of ZFILE
+//        crc32 - true if CRC32 is used
+//
+// Output: true if the file is accepted. ZRPOS has been sent.
+//         false if the subpacket is bad or the file is too large.
+//
+static bool ReceiveFileInfo(const uint8_t hdr[4], const bool crc32) {
+  uint32_t len;
+  const int term = ReadData(ZMODEM_MAXSUBPACKET,crc32,&len);
+  if (term<0) {
+    SendPosHeader(ZNAK,0);
+    return false;
+  }
+
+  //File name, NUL, size in decimal, ...
+  subpacket[len] = '\0';
+  const uint32_t nameLen = strlen((char*)subpacket);
+  const uint32_t fileSize = (nameLen<len)?strtoul((char*)subpacket+nameLen+1,NULL,10):0;
+  DEBUG_PRINTF("ZFILE %s size=%u\n",subpacket,fileSize);
+
+  if (fileSize>rxBlockLimit*BLOCKSIZE) {
+    SendPosHeader(ZSKIP,0);
+    return false;
+  }
+
+  //Resume the last upload if possible
+  rxPos = 0;
+  if (hdr[ZF0]==ZCRESUM && fileSize!=0 && resume.valid &&
+      resume.unitNum==rxUnitNum && resume.fileSize==fileSize) {
+    rxPos = resume.pos;
+  }
+  resume.valid = true;
+  resume.unitNum = rxUnitNum;
+  resume.fileSize = fileSize;
+  resume.pos = rxPos;
+
+  SendPosHeader(ZRPOS,rxPos);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////
+// Receive data subpackets of ZDATA frame
+//
+// Input: crc32 - true if CRC32 is used
+//
+// Output: true if the frame ends normally. false if ZRPOS has been sent.
+//
+static bool ReceiveDataFrame(const bool crc32) {
+  uint32_t len;
+  while(1) {
+    const int term = ReadData(ZMODEM_MAXSUBPACKET,crc32,&len);
+    if (term<0) {
+      if (term==ZCANCEL) return false;
+      SendPosHeader(ZRPOS,rxPos);
+      return false;
+    }
+
+    AppendData(subpacket,len);
+
+    switch(term) {
+      case ZCRCW:
+        SendPosHeader(ZACK,rxPos);
+        return true;
+      case ZCRCQ:
+        SendPosHeader(ZACK,rxPos);
+        break;
+      case ZCRCG:
+        break;
+      case ZCRCE:
+        return true;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////
+// ZModem Receive (PC to MegaFlash)
+//
+// Input: unitNum - ProDOS Drive to be written.
+//
+// Output: int - Number of bytes received
+//               -1 if aborted
+//
+int zmodemrx(const uint32_t unitNum) {
+  const uint MAXSTARTRETRY = 30;  //Retry every 3 seconds. 90 seconds for user to start transfer
+  uint8_t hdr[4];
+  uint8_t rinit[4] = {0, 0, 0, CANFDX|CANOVIO|CANFC32};  //Buffer size = 0: Nonstop streaming
+  bool crc32;
+  uint errorCount = 0;
+  uint32_t len;
+
+  enum {
+    STATE_BEGIN,      //Waiting for ZFILE
+    STATE_RECEIVING,  //Waiting for ZDATA or ZEOF
+    STATE_FINISHING,  //File received. Waiting for ZFIN.
+    STATE_COMPLETE,
+    STATE_ABORT
+  } state = STATE_BEGIN;
+
+  rxUnitNum = unitNum;
+  rxBlockLimit = GetBlockCountForImageTransfer(unitNum);
+  verificationErrorCount = 0;
+  userCancelAllowed = true;
+  InitIO();
+
+  SendHexHeader(ZRINIT,rinit);
+  do {
+    int type = ReadHeader(hdr,&crc32,3*onesecond);
+    if (type==ZCANCEL) {
+      state = STATE_ABORT;
+      break;
+    }
+
+    if (type<0) {
+      //Timeout or bad header
+      const uint maxError = (state==STATE_BEGIN)?MAXSTARTRETRY:ZMODEM_MAXERROR;
+      if (++errorCount>maxError) {
+        state = (state==STATE_FINISHING)?STATE_COMPLETE:STATE_ABORT;
+      }
+      else if (state==STATE_RECEIVING) SendPosHeader(ZRPOS,rxPos);
+      else SendHexHeader(ZRINIT,rinit);
+      continue;
+    }
+
+    userCancelAllowed = false;
+    switch(type) {
+      case ZRQINIT:
+        if (state!=STATE_RECEIVING) SendHexHeader(ZRINIT,rinit);
+        break;
+
+      case ZSINIT:
+        //Attention string is not used
+        if (ReadData(ZMODEM_MAXSUBPACKET,crc32,&len)>=0) SendPosHeader(ZACK,0);
+        else SendPosHeader(ZNAK,0);
+        break;
+
+      case ZFILE:
+        if (state==STATE_BEGIN) {
+          if (ReceiveFileInfo(hdr,crc32)) {
+            state = STATE_RECEIVING;
+            errorCount = 0;
+          }
+        } else if (state==STATE_RECEIVING) {
+          //Our ZRPOS was lost
+          ReadData(ZMODEM_MAXSUBPACKET,crc32,&len);
+          SendPosHeader(ZRPOS,rxPos);
+        } else {
+          //Only one file is accepted
+          ReadData(ZMODEM_MAXSUBPACKET,crc32,&len);
+          SendPosHeader(ZSKIP,0);
+        }
+        break;
+
+      case ZDATA:
+        if (state!=STATE_RECEIVING) break;
+        if (GetPos(hdr)!=rxPos) {
+          //Not the position we want. Data is skipped by ReadHeader().
+          if (++errorCount>ZMODEM_MAXERROR) state = STATE_ABORT;
+          else SendPosHeader(ZRPOS,rxPos);
+          break;
+        }
+        //Errors are counted until there is progress
+        const uint32_t framePos = rxPos;
+        if (ReceiveDataFrame(crc32) || rxPos!=framePos) errorCount = 0;
+        else if (++errorCount>ZMODEM_MAXERROR) state = STATE_ABORT;
+        break;
+
+      case ZEOF:
+        if (state==STATE_RECEIVING && GetPos(hdr)==rxPos) {
+          FlushData();
+          resume.valid = false;
+          state = STATE_FINISHING;
+          errorCount = 0;
+        }
+        //Ready for next file
+        if (state==STATE_FINISHING) SendHexHeader(ZRINIT,rinit);
+        break;
+
+      case ZFIN:
+        SendPosHeader(ZFIN,0);
+        //Wait for "OO" from sender
+        ReadByte(onesecond);
+        ReadByte(onesecond);
+        state = (state==STATE_FINISHING)?STATE_COMPLETE:STATE_ABORT;
+        break;
+
+      case ZABORT:
+      case ZFERR:
+      case ZCAN:
+        state = STATE_ABORT;
+        break;
+    }
+  } while (state!=STATE_COMPLETE && state!=STATE_ABORT);
+
+  if (state==STATE_ABORT) CancelSession();
+  return (state==STATE_COMPLETE)?(int)rxPos:-1;
+}
+
+//PC -> MegaFlash
+void UploadZModem(const uint32_t unitNum) {
+  subpacket = malloc(ZMODEM_MAXSUBPACKET+1);
+  if (!subpacket) {
+    printf("\nError: Not enough memory.\n");
+    return;
+  }
+
+  printf("\nYou are ready to upload ProDOS image file to drive %d.\n",unitNum);
+  printf("Please start upload using ZModem protocol within 90 seconds.\n");
+  printf("Use \"sz -r\" to resume an interrupted upload.\n");
+  printf("Type Ctrl-C to abort.\n");
+
+  int byteCount = zmodemrx(unitNum);
+  free(subpacket);
+  subpacket = NULL;
+
+  if (byteCount<0) printf("\nAborted.\n");
+  else {
+    printf("\n\n");
+    if (byteCount%BLOCKSIZE!=0) printf("Warning:Last block is incomplete.\n");
+    if (byteCount>0x2000000) printf("Warning:The file is larger than 32MB\n");
+    printf("%d blocks received.\n",byteCount/BLOCKSIZE);
+    printf("Verification Error:%d\n",verificationErrorCount);
+  }
+}
+
+
+//--------------------------------------------------------------
+// Transmit (MegaFlash to PC)
+//--------------------------------------------------------------
+
+////////////////////////////////////////////////////////////////////
+// Read file data from the drive
+//
+// Input: dest    - Destination buffer
+//        unitNum - ProDOS Drive
+//        pos     - File position in bytes
+//        len     - Number of bytes
+//
+// Output: false if a block cannot be read
+//
+static bool ReadFileData(uint8_t* dest, const uint32_t unitNum, uint32_t pos, uint32_t len) {
+  uint error = MFERR_NONE;
+  TurnOnActLed();
+  TurnOnPicoLed();
+  while (len && error==MFERR_NONE) {
+    const uint32_t offset = pos%BLOCKSIZE;
+    const uint32_t count = MIN(len,BLOCKSIZE-offset);
+    error = ReadBlock(unitNum,pos/BLOCKSIZE,dataBuffer,NULL);
+    memcpy(dest,dataBuffer+offset,count);
+    dest += count;
+    pos += count;
+    len -= count;
+  }
+  TurnOffActLed();
+  TurnOffPicoLed();
+  return error==MFERR_NONE;
+}
+
+////////////////////////////////////////////////////////////////////
+// ZModem Transmit (MegaFlash to PC)
+//
+// Input: unitNum    - ProDOS Drive to be read.
+//        blockCount - Number of blocks to be sent
+//
+// Output: int - Number of bytes sent
+//               -1 if aborted
+//
+int zmodemtx(const uint32_t unitNum, const uint32_t blockCount) {
+  const uint MAXSTARTRETRY = 30;  //Retry every 3 seconds. 90 seconds for user to start transfer
+  const uint32_t fileSize = blockCount*BLOCKSIZE;
+  uint8_t hdr[4];
+  const uint8_t zero[4] = {0,0,0,0};
+  bool crc32 = false;
+  uint32_t rxBufLen = 0;   //Receive buffer size of receiver. 0 = nonstop.
+  uint32_t pos = 0;
+  uint errorCount = 0;
+  bool readError = false;
+  int type;
+
+  enum {
+    STATE_BEGIN,      //Sending ZRQINIT
+    STATE_FILEINFO,   //Sending ZFILE
+    STATE_SENDING,    //Sending ZDATA from pos
+    STATE_EOF,        //Sending ZEOF
+    STATE_FINISHING,  //Sending ZFIN
+    STATE_COMPLETE,
+    STATE_ABORT
+  } state = STATE_BEGIN;
+
+  userCancelAllowed = true;
+  InitIO();
+
+  //Start receiver automatically
+  usb_putraw("rz\r",3);
+
+  do {
+    switch(state) {
+      case STATE_BEGIN:
+        SendHexHeader(ZRQINIT,zero);
+        type = ReadHeader(hdr,NULL,3*onesecond);
+        if (type==ZRINIT) {
+          crc32 = (hdr[ZF0]&CANFC32)!=0;
+          rxBufLen = hdr[ZP0] | (hdr[ZP1]<<8);
+          userCancelAllowed = false;
+          errorCount = 0;
+          state = STATE_FILEINFO;
+        }
+        else if (type==ZCHALLENGE) SendHexHeader(ZACK,hdr);
+        else if (type==ZCANCEL) state = STATE_ABORT;
+        else if (++errorCount>MAXSTARTRETRY) state = STATE_ABORT;
+        break;
+
+      case STATE_FILEINFO: {
+        //File name, NUL, size, mtime, mode
+        uint8_t fhdr[4] = {0,0,0,ZCBIN};
+        const int nameLen = sprintf((char*)subpacket,"drive%u.po",(uint)unitNum);
+        const int infoLen = sprintf((char*)subpacket+nameLen+1,"%u 0 100644",(uint)fileSize);
+        SendBinHeader(ZFILE,fhdr,crc32);
+        SendData(subpacket,nameLen+1+infoLen+1,ZCRCW,crc32);
+
+        type = ReadHeader(hdr,NULL,3*onesecond);
+        if (type==ZRPOS) {
+          pos = MIN(GetPos(hdr),fileSize);
+          errorCount = 0;
+          state = STATE_SENDING;
+        }
+        else if (type==ZSKIP) state = STATE_FINISHING;    //File exists on PC
+        else if (type==ZCANCEL || type==ZABORT || type==ZFERR) state = STATE_ABORT;
+        else if (++errorCount>ZMODEM_MAXERROR) state = STATE_ABORT;
+        break;
+      }
+
+      case STATE_SENDING: {
+        const uint32_t framePos = pos;
+        uint32_t bytesSinceAck = 0;
+        uint8_t term = ZCRCG;
+        SetPos(hdr,pos);
+        SendBinHeader(ZDATA,hdr,crc32);
+
+        while (pos<fileSize) {
+          const uint32_t len = MIN(ZMODEM_SUBPACKETSIZE,fileSize-pos);
+          //The CAN sequence of CancelSession() ends the data frame
+          if (!ReadFileData(subpacket,unitNum,pos,len)) {
+            readError = true;
+            break;
+          }
+
+          if (pos+len>=fileSize) term = ZCRCE;
+          else if (rxBufLen!=0 && bytesSinceAck+2*len>rxBufLen) term = ZCRCW;
+          else term = ZCRCG;
+          SendData(subpacket,len,term,crc32);
+          pos += len;
+          bytesSinceAck += len;
+          if (term!=ZCRCG) break;
+
+          //Check for ZRPOS without waiting.
+          //Skip CR, LF and XON after hex headers.
+          if (inPos==inCount) {
+            inCount = usb_getraw_timeout((char*)inBuffer,sizeof(inBuffer),0);
+            inPos = 0;
+          }
+          while (inPos!=inCount && inBuffer[inPos]!=ZPAD && inBuffer[inPos]!=CAN) ++inPos;
+          if (inPos!=inCount) {
+            Flush();
+            type = ReadHeader(hdr,NULL,0);
+            if (type==ZRPOS) break;
+            if (type==ZCANCEL || type==ZABORT) break;
+          }
+          type = ZTIMEOUT;
+        }
+        Flush();
+
+        if (readError) {
+          state = STATE_ABORT;
+          break;
+        }
+
+        if (term==ZCRCG) {
+          //Interrupted by receiver
+          //Errors are counted until there is progress
+          if (type==ZRPOS) {
+            pos = MIN(GetPos(hdr),fileSize);
+            if (pos>framePos) errorCount = 0;
+            if (++errorCount>ZMODEM_MAXERROR) state = STATE_ABORT;
+          }
+          else state = STATE_ABORT;
+        }
+        else if (term==ZCRCW) {
+          //Wait for ZACK
+          type = ReadHeader(hdr,NULL,10*onesecond);
+          if (type==ZRPOS) pos = MIN(GetPos(hdr),fileSize);
+          else if (type==ZACK) errorCount = 0;
+          else if (++errorCount>ZMODEM_MAXERROR || type==ZCANCEL) state = STATE_ABORT;
+          else pos = framePos;   //Timeout. Send the frame again.
+        }
+        else state = STATE_EOF;   //ZCRCE: End of file
+        break;
+      }
+
+      case STATE_EOF:
+        SetPos(hdr,fileSize);
+        SendBinHeader(ZEOF,hdr,crc32);
+        Flush();
+        do {
+          type = ReadHeader(hdr,NULL,3*onesecond);
+        } while (type==ZACK);
+        if (type==ZRINIT) {
+          errorCount = 0;
+          state = STATE_FINISHING;
+        }
+        else if (type==ZRPOS) {
+          pos = MIN(GetPos(hdr),fileSize);
+          state = STATE_SENDING;
+        }
+        else if (type==ZCANCEL || ++errorCount>ZMODEM_MAXERROR) state = STATE_ABORT;
+        break;
+
+      case STATE_FINISHING:
+        SendHexHeader(ZFIN,zero);
+        type = ReadHeader(hdr,NULL,3*onesecond);
+        if (type==ZFIN) {
+          usb_putraw("OO",2);
+          state = STATE_COMPLETE;
+        }
+        else if (++errorCount>ZMODEM_MAXERROR) state = STATE_COMPLETE;  //File has been sent
+        break;
+
+      default:
+        break;
+    }
+  } while (state!=STATE_COMPLETE && state!=STATE_ABORT);
+
+  if (state==STATE_ABORT) CancelSession();
+  if (readError) printf("\nRead Error.\n");
+  return (state==STATE_COMPLETE)?(int)pos:-1;
+}
+
+//MegaFlash -> PC
+void DownloadZModem(const uint32_t unitNum) {
+  subpacket = malloc(ZMODEM_SUBPACKETSIZE+1);
+  if (!subpacket) {
+    printf("\nError: Not enough memory.\n");
+    return;
+  }
+
+  printf("\nYou are ready to download ProDOS image file (.po) from drive %d.\n",unitNum);
+  printf("Please start download using ZModem protocol within 90 seconds.\n");
+  printf("Type Ctrl-C to abort.\n");
+
+  uint32_t blockCount = GetBlockCountForImageTransfer(unitNum);
+  int byteCount = zmodemtx(unitNum,blockCount);
+  free(subpacket);
+  subpacket = NULL;
+
+  if (byteCount<0) printf("\nAborted.\n");
+  else {
+    printf("\n\nDownload Completed.\n");
+    printf("%d blocks sent.\n",byteCount/BLOCKSIZE);
+  }
+}
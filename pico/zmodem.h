@@ -0,0 +1,21 @@
+#ifndef _ZMODEM_H
+#define _ZMODEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "defines.h"
+
+#define ZMODEM_SUBPACKETSIZE  1024    //Data subpacket size when sending
+#define ZMODEM_MAXSUBPACKET   8192    //Max data subpacket size when receiving (sz -8)
+#define ZMODEM_MAXERROR       10
+
+void UploadZModem(const uint32_t unitNum);
+void DownloadZModem(const uint32_t unitNum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif